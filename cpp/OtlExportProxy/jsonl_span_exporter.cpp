@@ -0,0 +1,128 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "jsonl_span_exporter.h"
+#include "nlohmann/json.hpp"
+
+namespace nostd     = opentelemetry::nostd;
+namespace trace_sdk = opentelemetry::sdk::trace;
+namespace sdk_cmn   = opentelemetry::sdk::common;
+
+namespace {
+
+    // nlohmann::json can take every alternative of OwnedAttributeValue directly
+    struct AttrToJson {
+        template <typename T>
+        nlohmann::json operator()(const T& value) const {
+            return nlohmann::json(value);
+        }
+    };
+
+    nlohmann::json AttrsToJson(const std::unordered_map<std::string, sdk_cmn::OwnedAttributeValue>& attrs) {
+        nlohmann::json j = nlohmann::json::object();
+        for (auto& attr : attrs) {
+            j[attr.first] = nostd::visit(AttrToJson(), attr.second);
+        }
+        return j;
+    }
+
+    template <size_t N, typename Id>
+    std::string IdToHex(const Id& id) {
+        char buf[N];
+        id.ToLowerBase16(nostd::span<char, N>{buf, N});
+        return std::string(buf, N);
+    }
+
+}
+
+// ------------------------------------ JsonLinesSink ----------------------------------------
+
+JsonLinesSink::~JsonLinesSink() {
+    if (file_) {
+        fclose(file_);
+    }
+}
+
+int JsonLinesSink::Open(const std::string& path) {
+    file_ = fopen(path.c_str(), "a");
+    if (!file_) {
+        printf(FRED("Can not open span output file %s\n"), path.c_str());
+        return -1;
+    }
+    return 1;
+}
+
+void JsonLinesSink::Write(const std::string& lines) {
+    std::lock_guard<std::mutex> lock(mux_);
+    fwrite(lines.data(), 1, lines.size(), file_);
+}
+
+void JsonLinesSink::Flush() {
+    std::lock_guard<std::mutex> lock(mux_);
+    fflush(file_);
+}
+
+// -------------------------------- JsonLinesSpanExporter ------------------------------------
+
+JsonLinesSpanExporter::JsonLinesSpanExporter(std::shared_ptr<JsonLinesSink> sink) : sink_(std::move(sink)) {}
+
+std::unique_ptr<trace_sdk::Recordable> JsonLinesSpanExporter::MakeRecordable() noexcept {
+    return std::unique_ptr<trace_sdk::Recordable>(new trace_sdk::SpanData);
+}
+
+sdk_cmn::ExportResult JsonLinesSpanExporter::Export(
+        const nostd::span<std::unique_ptr<trace_sdk::Recordable>>& spans) noexcept {
+    if (is_shutdown_) {
+        return sdk_cmn::ExportResult::kFailure;
+    }
+
+    std::string lines;
+    for (auto& recordable : spans) {
+        auto span = std::unique_ptr<trace_sdk::SpanData>(static_cast<trace_sdk::SpanData*>(recordable.release()));
+        if (!span) continue;
+
+        nlohmann::json j;
+        j["trace_id"] = IdToHex<32>(span->GetTraceId());
+        j["span_id"] = IdToHex<16>(span->GetSpanId());
+        j["parent_span_id"] = IdToHex<16>(span->GetParentSpanId());
+        j["name"] = std::string(span->GetName());
+        j["start_ns"] = span->GetStartTime().time_since_epoch().count();
+        j["duration_ns"] = span->GetDuration().count();
+        j["attributes"] = AttrsToJson(span->GetAttributes());
+
+        nlohmann::json events = nlohmann::json::array();
+        for (auto& event : span->GetEvents()) {
+            nlohmann::json je;
+            je["name"] = std::string(event.GetName());
+            je["ts_ns"] = event.GetTimestamp().time_since_epoch().count();
+            je["attributes"] = AttrsToJson(event.GetAttributes());
+            events.push_back(je);
+        }
+        j["events"] = events;
+
+        lines += j.dump();
+        lines += '\n';
+    }
+    sink_->Write(lines);
+
+    return sdk_cmn::ExportResult::kSuccess;
+}
+
+bool JsonLinesSpanExporter::Shutdown(std::chrono::microseconds timeout) noexcept {
+    if (!is_shutdown_) {
+        sink_->Flush();
+        is_shutdown_ = true;
+    }
+    return true;
+}
@@ -0,0 +1,72 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_JSONL_SPAN_EXPORTER_H
+#define MTMC_JSONL_SPAN_EXPORTER_H
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "opentelemetry/sdk/trace/exporter.h"
+#include "opentelemetry/sdk/trace/span_data.h"
+#include "../util.h"
+
+/**
+ * Output file shared by the exporters of all the daemon workers. Each line is a self-contained json span, so the file
+ * can be uploaded to a collector later or inspected without one.
+ */
+class JsonLinesSink {
+public:
+    JsonLinesSink() = default;
+    ~JsonLinesSink();
+
+    /**
+     * Open the output file in append mode
+     * @param path: Path to the file
+     * @return 1 for success, -1 for failed
+     */
+    int Open(const std::string& path);
+
+    /**
+     * Append a block of lines. Lines of one block are never interleaved with another block
+     */
+    void Write(const std::string& lines);
+
+    void Flush();
+
+private:
+    FILE* file_ = nullptr;
+    std::mutex mux_;
+};
+
+class JsonLinesSpanExporter : public opentelemetry::sdk::trace::SpanExporter {
+public:
+    explicit JsonLinesSpanExporter(std::shared_ptr<JsonLinesSink> sink);
+
+    std::unique_ptr<opentelemetry::sdk::trace::Recordable> MakeRecordable() noexcept override;
+
+    opentelemetry::sdk::common::ExportResult Export(
+            const opentelemetry::nostd::span<std::unique_ptr<opentelemetry::sdk::trace::Recordable>>& spans) noexcept override;
+
+    bool Shutdown(std::chrono::microseconds timeout = (std::chrono::microseconds::max)()) noexcept override;
+
+private:
+    std::shared_ptr<JsonLinesSink> sink_;
+    bool is_shutdown_ = false;
+};
+
+#endif //MTMC_JSONL_SPAN_EXPORTER_H
@@ -14,6 +14,9 @@
 
 #include "opentele_exporter.h"
 
+#include <cmath>
+#include <cstring>
+
 namespace trace     = opentelemetry::trace;
 namespace nostd     = opentelemetry::nostd;
 namespace trace_sdk = opentelemetry::sdk::trace;
@@ -26,7 +29,32 @@ namespace util = mtmc::util;
 OpenteleDaemon::OpenteleDaemon() {};
 OpenteleDaemon::~OpenteleDaemon() {};
 
-[[noreturn]] __attribute__((optimize("O3"))) void OpenteleDaemon::Run() {
+std::atomic<bool> OpenteleDaemon::stop_flag_{false};
+
+void OpenteleDaemon::RequestStop(int signum) {
+    stop_flag_.store(true);
+}
+
+// Sub metrics packed in PERF_METRICS, indexed by their byte offset
+static const char* kPerfMetricsKeys[NUM_PERF_METRICS] = {
+        "PERF_METRICS.RETIRING", "PERF_METRICS.BAD_SPECULATION", "PERF_METRICS.FRONTEND_BOUND",
+        "PERF_METRICS.BACKEND_BOUND", "PERF_METRICS.HEAVY_OPERATIONS", "PERF_METRICS.BRANCH_MISPREDICTS",
+        "PERF_METRICS.FETCH_LATENCY", "PERF_METRICS.MEMORY_BOUND"};
+
+static std::chrono::system_clock::time_point time_cast(uint64_t ns) {
+    auto d = std::chrono::nanoseconds{ns};
+    std::chrono::system_clock::time_point tp{std::chrono::duration_cast<std::chrono::system_clock::duration>(d)};
+    return tp;
+}
+
+// Wake up the profiler waiting on this payload
+static void post_done(const char* shm_name, mtmc::ShmIpcStatus* shm_status) {
+    shm_status->done = 1;
+    ipc::sync::semaphore done_sem(mtmc::ShmDoneSemName(shm_name).c_str(), 0);
+    done_sem.post(1);
+}
+
+__attribute__((optimize("O3"))) void OpenteleDaemon::Run() {
     // Sanctity checks
     CheckEnv();
     if (setting_.channel_name.empty()) {
@@ -40,227 +68,505 @@ OpenteleDaemon::~OpenteleDaemon() {};
         printf("Daemon Exit due to channel is not valid\n");
         return;
     }
-    std::unordered_map<std::string, ipc::shm::handle> shm_map;
 
     auto jaeger_ip_env = getenv("JAEGER_IP");
     auto jaeger_ip = std::string("localhost");
     if (jaeger_ip_env) {
         jaeger_ip = std::string(jaeger_ip_env);
     }
+    bool remote = !(jaeger_ip == "localhost" || jaeger_ip == "127.0.0.1");
+    if (setting_.throttle_us >= 0) {
+        throttle_us_ = setting_.throttle_us;
+    }
+    else {
+        throttle_us_ = (setting_.sink == SpanSink::JAEGER && remote) ? DEFAULT_REMOTE_THROTTLE_US : 0;
+    }
 
-    opts.endpoint = jaeger_ip;
-    auto exporter  = jaeger::JaegerExporterFactory::Create(opts);
-//    opentelemetry::sdk::trace::BatchSpanProcessorOptions opt;
-//    auto processor = trace_sdk::BatchSpanProcessorFactory::Create(std::move(exporter), opt);
-    auto processor = trace_sdk::SimpleSpanProcessorFactory::Create(std::move(exporter));
-    auto inst_scope = opentelemetry::sdk::instrumentationscope::InstrumentationScope::Create("MTMC-OTLE-Exporter", "v0.2", "");
-
-    auto time_cast = [](uint64_t ns) -> std::chrono::system_clock::time_point{
-        auto d = std::chrono::nanoseconds{ns};
-        std::chrono::system_clock::time_point tp{std::chrono::duration_cast<std::chrono::system_clock::duration>(d)};
-        return tp;
-    };
-
-    // Shared between worker and host
-    std::queue<ipc::shm::handle> hdlr_queue;
-    std::queue<mtmc::ShmIpcLoad> pld_queue;
-    std::mutex queue_mux;
-
-    auto export_worker = [&](int idx){
-        while (true) {
-
-            // Queue Mutex
-            queue_mux.lock();
-            if (hdlr_queue.empty()) {
-                queue_mux.unlock();
-                // Queue Mutex Done
-                sleep(1);
-                continue;
-            }
-            ipc::shm::handle shm_hdlr = std::move(hdlr_queue.front());
-            mtmc::ShmIpcLoad pld = pld_queue.front();
-            hdlr_queue.pop();
-            pld_queue.pop();
-            queue_mux.unlock();
-            // Queue Mutex Done
-
-            // Locate starting of the data
-            auto shm_status = (mtmc::ShmIpcStatus *) ((char *) shm_hdlr.get() + pld.data_offset);
-            auto mtmc_data = (mtmc::SingleProfile *) ((char *) shm_hdlr.get() + pld.data_offset +
-                                                      sizeof(mtmc::ShmIpcStatus));
+    std::shared_ptr<JsonLinesSink> file_sink;
+    if (setting_.sink == SpanSink::JSON_FILE) {
+        file_sink = std::make_shared<JsonLinesSink>();
+        if (file_sink->Open(setting_.file_path) != 1) {
+            printf("Daemon Exit due to span output file can not be opened\n");
+            return;
+        }
+        printf("Write spans to %s\n", setting_.file_path.c_str());
+    }
 
-            std::unordered_map<int64_t, opentelemetry::trace::TraceId> traceid_map;
+    for (int i = 0; i < setting_.num_workers; ++i) {
+        processors_.push_back(CreateProcessor(jaeger_ip, file_sink));
+    }
+    num_queued_.assign(setting_.num_workers, 0);
+    inst_scope_ = opentelemetry::sdk::instrumentationscope::InstrumentationScope::Create("MTMC-OTLE-Exporter", "v0.2", "");
 
-            int count = 0;
-            for (int i = 0; i < pld.num_data; ++i) {
-                auto &sig_data = mtmc_data[i];
-                auto prefix = std::string(sig_data.prefix);
+    signal(SIGINT, OpenteleDaemon::RequestStop);
+    signal(SIGTERM, OpenteleDaemon::RequestStop);
 
-                // [0] INTEROP or "" [1] Op Name [2] Op Type [3] INTEROP Hash id if [0] == INTEROP else Parent HashID [4] INTEROP inputs
-                auto prefix_segs = mtmc::util::StringSplit(prefix, ':');
-                auto &hash_id = prefix_segs[3];
+    WorkStealingPool<SpanRange> pool;
+    pool.Start(setting_.num_workers, [this](int idx, SpanRange& range) {
+        ConvertRange(idx, range);
+    });
 
-                // Create span id.
-                std::vector<uint8_t> span_id_hash;
-                if (sig_data.hash_id == 0) {
-                    span_id_hash = util::GenerateUniqueSpanId();
-                } else {
-                    span_id_hash = util::GenerateUniqueSpanId(sig_data.hash_id);
-                }
+    printf("Launch %d workers for exporting.\n", setting_.num_workers);
+    printf("Waiting for requests...\n");
+    while (!stop_flag_.load()) {
+        auto buffer = cc.recv(RECV_TIMEOUT_MS);
+        if (buffer.empty()) continue;
 
-                // Create parent span id
-                std::vector<uint8_t> parent_span_id_hash;
-                parent_span_id_hash = util::GenerateUniqueSpanId(sig_data.parent_info.parent_ctx_hash_id);
-
-                // Create per iteration traceid
-                opentelemetry::trace::TraceId trace_id;
-                if (pld.trace_hash == 0) { // Unique trace_id for every int_prefix value
-                    auto trace_id_find = traceid_map.find(sig_data.int_prefix);
-                    if (trace_id_find == traceid_map.end()) {
-                        trace_id = opentelemetry::trace::TraceId(util::GenerateUniqueTraceId(sig_data.int_prefix, 0));
-                        traceid_map.insert({sig_data.int_prefix, trace_id});
-                    } else {
-                        trace_id = trace_id_find->second;
-                    }
-                } else { // This branch will make sure every run uses the same trace_id
-                    trace_id = opentelemetry::trace::TraceId(
-                            util::GenerateUniqueTraceId(pld.trace_hash, pld.trace_hash));
-                }
+        auto pld = (mtmc::ShmIpcLoad*)buffer.data();
 
-                // Program Info
-                trace_api::SpanContext child_ctx(
-                        trace_id,
-                        trace_api::SpanId(span_id_hash),
-                        trace_api::TraceFlags{trace_api::TraceFlags::kIsSampled},
-                        false,
-                        trace_api::TraceState::GetDefault());
-
-                auto recordable = processor->MakeRecordable();
-                recordable->SetName(sig_data.prefix);
-                recordable->SetInstrumentationScope(*inst_scope);
-                recordable->SetIdentity(child_ctx, trace_api::SpanId(parent_span_id_hash));
-                recordable->SetSpanKind(opentelemetry::trace::SpanKind());
-
-                uint64_t start_ns = sig_data.start_ts;
-                auto start_tp = time_cast(start_ns);
-
-                uint64_t end_ns = sig_data.end_ts;
-                auto end_tp = time_cast(end_ns);
-
-                recordable->SetStartTime(opentelemetry::common::SystemTimestamp(start_tp));
-                recordable->SetDuration(end_tp - start_tp);
-
-                std::vector<std::pair<nostd::string_view, opentelemetry::common::AttributeValue>> vec;
-                vec.emplace_back("tid", (int64_t) sig_data.tid);
-                vec.emplace_back("pthreadid", (int64_t) sig_data.pthread_id);
-                vec.emplace_back("int_prefix", sig_data.int_prefix);
-
-                // Parent info
-                std::string parent_info = std::to_string(sig_data.parent_info.parent_tid) + "-*-" +
-                                          std::to_string(sig_data.parent_info.parent_pthread_id) + "-*-" +
-                                          std::to_string(sig_data.parent_info.task_sched_time);
-                vec.emplace_back("parent_tid_pthreadid_sched_time",
-                                 parent_info);
-
-                // Begin event info
-                std::string start_event_info = std::to_string(sig_data.rd_ret_start.core_id) + "-" +
-                                               std::to_string(sig_data.rd_ret_start.prefix) + "-" +
-                                               std::to_string(sig_data.rd_ret_start.num_event);
-                vec.emplace_back("b_coreid_prefix_num_event",
-                                 start_event_info);
-
-                // End event info
-                std::string end_event_info = std::to_string(sig_data.rd_ret_end.core_id) + "-" +
-                                             std::to_string(sig_data.rd_ret_end.prefix) + "-" +
-                                             std::to_string(sig_data.rd_ret_end.num_event);
-                vec.emplace_back("e_coreid_prefix_num_event",
-                                 end_event_info);
-
-                // Begin events
-                std::string begin_events;
-                for (int j = 0; j < sig_data.rd_ret_start.num_event; ++j) {
-                    begin_events += std::to_string(sig_data.ret_start[j]);
-                    if (j < sig_data.rd_ret_start.num_event - 1) begin_events += "-";
-                }
-                vec.emplace_back("b_events", begin_events);
+        // Get data shm
+        ipc::shm::handle shm_hdlr = ipc::shm::handle(pld->shm_name, pld->shm_size, ipc::shm::open);
+        if (!shm_hdlr.valid()) {
+            printf(FRED("Shm hdlr from name %s is not valid"), pld->shm_name);
+            continue;
+        }
 
-                // End events
-                std::string end_events;
-                for (int j = 0; j < sig_data.rd_ret_end.num_event; ++j) {
-                    end_events += std::to_string(sig_data.ret_end[j]);
-                    if (j < sig_data.rd_ret_end.num_event - 1) end_events += "-";
-                }
-                vec.emplace_back("e_events", end_events);
-
-                // Config id
-                vec.emplace_back("mux_id", sig_data.multiplex_idx);
-                vec.emplace_back("cfg_id", pld.configs_id);
-
-                // Constant var
-                std::string cnsts;
-                for (int j = 0; j < pld.cnsts_length; ++j) {
-                    cnsts += std::to_string(pld.cnsts[j]);
-                    if (j != pld.cnsts_length - 1)
-                        cnsts += "-*-";
-                }
-                vec.emplace_back("cnsts", cnsts);
+        if (pld->num_migrated || pld->num_mismatched || pld->num_dropped) {
+            printf(FYEL("Payload %s: %lu spans, %lu migrated, %lu mismatched, %lu dropped\n"), pld->shm_name,
+                   pld->num_spans, pld->num_migrated, pld->num_mismatched, pld->num_dropped);
+        }
 
-                recordable->AddEvent("PeriodInfo", std::chrono::system_clock::now(),
-                                     opentelemetry::common::KeyValueIterableView<std::vector<std::pair<nostd::string_view,
-                                             opentelemetry::common::AttributeValue>>>(vec));
+        auto payload = std::make_shared<ExportPayload>();
+        payload->pld = *pld;
+        payload->recv_tp = std::chrono::steady_clock::now();
+
+        // Chunk descriptors then event names follow the load
+        size_t desc_bytes = pld->num_chunks * sizeof(mtmc::ShmChunkDesc);
+        size_t name_bytes = pld->num_names * sizeof(mtmc::ShmEventName);
+        if (buffer.size() < sizeof(mtmc::ShmIpcLoad) + desc_bytes + name_bytes +
+                            pld->num_metrics * sizeof(mtmc::ShmMetricFormula)) {
+            printf(FRED("Payload from %s is truncated. Expect %d chunk descriptors, %d names and %d metrics\n"),
+                   pld->shm_name, pld->num_chunks, pld->num_names, pld->num_metrics);
+            continue;
+        }
+        auto names_head = (mtmc::ShmEventName *) ((char *) buffer.data() + sizeof(mtmc::ShmIpcLoad) + desc_bytes);
+        if (ParseNames(names_head, pld->num_names, payload.get()) != 1) {
+            printf(FRED("Invalid event names from %s. Fall back to string attributes\n"), pld->shm_name);
+        }
+        auto metrics_head = (mtmc::ShmMetricFormula *) ((char *) names_head + name_bytes);
+        if (ParseMetrics(metrics_head, pld->num_metrics, payload.get()) != pld->num_metrics) {
+            printf(FYEL("Some metrics from %s are not emitted. Compute them in the post-processing\n"), pld->shm_name);
+        }
 
-                processor->OnEnd(std::move(recordable));
-                if (i % 10240 == 0) {
-                    processor->ForceFlush();
-                    Dprintf("Worker %d: %d/%d\n", idx, count++, int(pld.num_data)/10240);
+        if (pld->num_chunks > 0) {
+            // Arena mode. Data is read in place from the chunks, and invalid spans are not filtered by the profiler
+            auto desc_head = (mtmc::ShmChunkDesc *) ((char *) buffer.data() + sizeof(mtmc::ShmIpcLoad));
+            for (int c = 0; c < pld->num_chunks; ++c) {
+                auto chunk = (mtmc::SingleProfile *) ((char *) shm_hdlr.get() + desc_head[c].offset);
+                for (int i = 0; i < desc_head[c].num_data; ++i) {
+                    if (chunk[i].flag_bits.group_switched ||
+                        chunk[i].rd_ret_start.num_event != chunk[i].rd_ret_end.num_event) continue;
+                    payload->spans.push_back(chunk + i);
                 }
-                if (!(jaeger_ip == "localhost" || jaeger_ip == "127.0.0.1"))  {
-                    usleep(100);
+            }
+        }
+        else {
+            auto mtmc_data = (mtmc::SingleProfile *) ((char *) shm_hdlr.get() + pld->data_offset +
+                                                      sizeof(mtmc::ShmIpcStatus));
+            for (int i = 0; i < pld->num_data; ++i) {
+                payload->spans.push_back(mtmc_data + i);
+            }
+            // Send receive shm signal
+            auto shm_status = (mtmc::ShmIpcStatus *) ((char *) shm_hdlr.get() + pld->data_offset);
+            post_done(pld->shm_name, shm_status);
+        }
+        payload->shm_hdlr = std::move(shm_hdlr);
+
+        if (payload->spans.empty()) {
+            FinishPayload(*payload);
+            continue;
+        }
 
+        // Workers only read the trace ids, so spans of one iteration keep one id across ranges and workers
+        if (pld->trace_hash == 0) {
+            for (auto span : payload->spans) {
+                if (payload->traceid_map.find(span->int_prefix) == payload->traceid_map.end()) {
+                    payload->traceid_map.insert({span->int_prefix, opentelemetry::trace::TraceId(
+                            util::GenerateUniqueTraceId(span->int_prefix, 0))});
                 }
             }
+        }
+
+        // Split into ranges for the worker pool
+        std::vector<SpanRange> ranges;
+        for (size_t begin = 0; begin < payload->spans.size(); begin += SPAN_RANGE_SIZE) {
+            size_t end = std::min(begin + SPAN_RANGE_SIZE, payload->spans.size());
+            ranges.push_back(SpanRange{payload, begin, end});
+        }
+        payload->remaining_ranges.store(ranges.size());
+        pool.Submit(std::move(ranges));
+    }
 
+    // Drain the submitted ranges then flush every processor
+    printf("Stop requested. Flushing pending spans...\n");
+    pool.Stop();
+    for (auto& processor : processors_) {
+        processor->ForceFlush();
+        processor->Shutdown();
+    }
+    printf("Daemon exit. %lu spans converted in total.\n", num_converted_.load());
+}
+
+int OpenteleDaemon::ParseNames(const mtmc::ShmEventName* names, int num_names, ExportPayload* payload) {
+    for (int i = 0; i < num_names; ++i) {
+        std::string name(names[i].name, strnlen(names[i].name, SHM_EVENT_NAME_LEN));
+        int group = names[i].group;
+        if (group == -1) {
+            payload->cnst_keys.push_back("cnst." + name);
+            continue;
+        }
+        if (group < 0 || group >= MAX_CONFIG_GROUPS) {
+            payload->evt_keys.clear();
+            payload->cnst_keys.clear();
+            return -1;
+        }
+        if (group >= payload->evt_keys.size()) {
+            payload->evt_keys.resize(group + 1);
+            payload->slots_idx.resize(group + 1, -1);
+            payload->perf_metrics_idx.resize(group + 1, -1);
+        }
+        // Json configs and the txt topdown config use different names for the same counters
+        if (name == "TOPDOWN.SLOTS:perf_metrics" || name == "Perf_Slots") {
+            payload->slots_idx[group] = payload->evt_keys[group].size();
+        }
+        else if (name == "PERF_METRICS" || name == "Perf_Metrics") {
+            payload->perf_metrics_idx[group] = payload->evt_keys[group].size();
+        }
+        payload->evt_keys[group].push_back("evt." + name);
+    }
+    return 1;
+}
+
+int OpenteleDaemon::ParseMetrics(const mtmc::ShmMetricFormula* metrics, int num_metrics, ExportPayload* payload) {
+    int num_compiled = 0;
+    for (int i = 0; i < num_metrics; ++i) {
+        int group = metrics[i].group;
+        if (group < 0 || group >= payload->evt_keys.size()) continue;
+
+        // Values of a span are the deltas of the group's events, then the constants
+        std::vector<std::string> names;
+        for (auto& key : payload->evt_keys[group]) {
+            names.push_back(key.substr(strlen("evt.")));
+        }
+        for (auto& key : payload->cnst_keys) {
+            names.push_back(key.substr(strlen("cnst.")));
+        }
+        std::string name(metrics[i].name, strnlen(metrics[i].name, SHM_EVENT_NAME_LEN));
+        std::string formula(metrics[i].formula, strnlen(metrics[i].formula, SHM_FORMULA_LEN));
+        mtmc::util::MetricFormula compiled;
+        if (compiled.Compile(formula, names) != 1) continue;
+
+        if (group >= payload->metrics.size()) {
+            payload->metrics.resize(group + 1);
+        }
+        payload->metrics[group].emplace_back("metric." + name, compiled);
+        ++num_compiled;
+    }
+    return num_compiled;
+}
+
+void OpenteleDaemon::ConvertRange(int worker_idx, SpanRange& range) {
+    auto processor = processors_[worker_idx].get();
+    auto& payload = *range.payload;
+
+    for (size_t i = range.begin; i < range.end; ++i) {
+        ConvertSpan(processor, payload, *payload.spans[i]);
+        // The batch processor drops spans once its queue is full. Only this worker fills it, so waiting for the
+        // export before it has queued a full queue since the last flush never loses a span
+        if (setting_.processor == SpanProcessorType::BATCH && ++num_queued_[worker_idx] >= setting_.queue_size) {
             processor->ForceFlush();
-            std::cout << "Worker " << idx << " Process " << pld.num_data << " logs." << std::endl;
-            shm_hdlr.release();
+            num_queued_[worker_idx] = 0;
         }
-    };
-    std::vector<std::thread> export_workers;
-    for (int i = 0; i < NUM_EXPORT_WORKER; ++i) {
-        export_workers.push_back(std::thread(export_worker, i));
     }
+    // Batch processor flushes by itself. Forcing it here would turn every range into a small batch
+    if (setting_.processor == SpanProcessorType::SIMPLE) {
+        processor->ForceFlush();
+    }
+    num_converted_.fetch_add(range.end - range.begin);
+    Dprintf("Worker %d: converted [%lu, %lu) of %s\n", worker_idx, range.begin, range.end, payload.pld.shm_name);
 
-    printf("Launch %d workers for exporting.\n", NUM_EXPORT_WORKER);
-    printf("Waiting for requests...\n");
-    while(true) {
-        auto buffer = cc.recv();
+    if (payload.remaining_ranges.fetch_sub(1) == 1) {
+        FinishPayload(payload);
+    }
+}
 
-        auto pld = (mtmc::ShmIpcLoad*)buffer.data();
+void OpenteleDaemon::FinishPayload(ExportPayload& payload) {
+    if (payload.pld.num_chunks > 0) {
+        // Profiler can reuse the arena only after all the spans have been converted
+        auto shm_status = (mtmc::ShmIpcStatus *) ((char *) payload.shm_hdlr.get() + payload.pld.data_offset);
+        post_done(payload.pld.shm_name, shm_status);
+    }
+    payload.shm_hdlr.release();
 
-        // Get data shm
-        ipc::shm::handle shm_hdlr = ipc::shm::handle(pld->shm_name, pld->shm_size, ipc::shm::open);
-        if (!shm_hdlr.valid()) {
-            printf(FRED("Shm hdlr from name %s is not valid"), pld->shm_name);
-            continue;
+    // Conversion throughput of this payload
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - payload.recv_tp).count();
+    printf("Process %lu logs from %s in %.3f s. %.0f spans/s with %d workers\n", payload.spans.size(),
+           payload.pld.shm_name, secs, secs > 0 ? payload.spans.size() / secs : 0., setting_.num_workers);
+}
+
+__attribute__((optimize("O3"))) void OpenteleDaemon::ConvertSpan(trace_sdk::SpanProcessor* processor,
+                                                                 const ExportPayload& payload,
+                                                                 const mtmc::SingleProfile& sig_data) {
+    auto& pld = payload.pld;
+    auto prefix = std::string(sig_data.prefix);
+
+    // [0] INTEROP or "" [1] Op Name [2] Op Type [3] INTEROP Hash id if [0] == INTEROP else Parent HashID [4] INTEROP inputs
+    auto prefix_segs = mtmc::util::StringSplit(prefix, ':');
+    auto &hash_id = prefix_segs[3];
+
+    // Create span id.
+    std::vector<uint8_t> span_id_hash;
+    if (sig_data.hash_id == 0) {
+        span_id_hash = util::GenerateUniqueSpanId();
+    } else {
+        span_id_hash = util::GenerateUniqueSpanId(sig_data.hash_id);
+    }
+
+    // Create parent span id
+    std::vector<uint8_t> parent_span_id_hash;
+    parent_span_id_hash = util::GenerateUniqueSpanId(sig_data.parent_info.parent_ctx_hash_id);
+
+    // Create per iteration traceid
+    opentelemetry::trace::TraceId trace_id;
+    if (pld.trace_hash == 0) { // Unique trace_id for every int_prefix value. Filled before the payload is split
+        trace_id = payload.traceid_map.at(sig_data.int_prefix);
+    } else { // This branch will make sure every run uses the same trace_id
+        trace_id = opentelemetry::trace::TraceId(
+                util::GenerateUniqueTraceId(pld.trace_hash, pld.trace_hash));
+    }
+
+    // Program Info
+    trace_api::SpanContext child_ctx(
+            trace_id,
+            trace_api::SpanId(span_id_hash),
+            trace_api::TraceFlags{trace_api::TraceFlags::kIsSampled},
+            false,
+            trace_api::TraceState::GetDefault());
+
+    auto recordable = processor->MakeRecordable();
+    recordable->SetName(sig_data.prefix);
+    recordable->SetInstrumentationScope(*inst_scope_);
+    recordable->SetIdentity(child_ctx, trace_api::SpanId(parent_span_id_hash));
+    recordable->SetSpanKind(opentelemetry::trace::SpanKind());
+
+    uint64_t start_ns = sig_data.start_ts;
+    auto start_tp = time_cast(start_ns);
+
+    uint64_t end_ns = sig_data.end_ts;
+    auto end_tp = time_cast(end_ns);
+
+    recordable->SetStartTime(opentelemetry::common::SystemTimestamp(start_tp));
+    recordable->SetDuration(end_tp - start_tp);
+
+    std::vector<std::pair<nostd::string_view, opentelemetry::common::AttributeValue>> vec;
+    vec.emplace_back("tid", (int64_t) sig_data.tid);
+    vec.emplace_back("pthreadid", (int64_t) sig_data.pthread_id);
+    vec.emplace_back("int_prefix", sig_data.int_prefix);
+    vec.emplace_back("migrated", (bool) sig_data.flag_bits.migrated);
+    vec.emplace_back("pmc_valid", !sig_data.flag_bits.pmc_invalid);
+
+    // Group of the counters of this span. With per process mux every process only has its own config
+    int group = pld.configs_id == -1 ? sig_data.multiplex_idx : 0;
+    bool typed = group >= 0 && group < payload.evt_keys.size() &&
+                 payload.evt_keys[group].size() == sig_data.rd_ret_start.num_event &&
+                 sig_data.rd_ret_start.num_event == sig_data.rd_ret_end.num_event && !sig_data.flag_bits.group_switched;
+
+    if (typed) {
+        // Parent info
+        vec.emplace_back("parent_tid", (int64_t) sig_data.parent_info.parent_tid);
+        vec.emplace_back("parent_pthreadid", (int64_t) sig_data.parent_info.parent_pthread_id);
+        vec.emplace_back("parent_sched_time", (int64_t) sig_data.parent_info.task_sched_time);
+
+        // Begin and end event info
+        vec.emplace_back("b_coreid", (int64_t) sig_data.rd_ret_start.core_id);
+        vec.emplace_back("b_prefix", (int64_t) sig_data.rd_ret_start.prefix);
+        vec.emplace_back("e_coreid", (int64_t) sig_data.rd_ret_end.core_id);
+        vec.emplace_back("e_prefix", (int64_t) sig_data.rd_ret_end.prefix);
+        vec.emplace_back("num_event", (int64_t) sig_data.rd_ret_start.num_event);
+
+        // Delta of every counter. PERF_METRICS is a packed register, so its delta is meaningless
+        auto& keys = payload.evt_keys[group];
+        int slots_idx = payload.slots_idx[group];
+        int perf_metrics_idx = payload.perf_metrics_idx[group];
+        for (int j = 0; j < sig_data.rd_ret_start.num_event; ++j) {
+            if (j == perf_metrics_idx) continue;
+            vec.emplace_back(keys[j], (int64_t) (sig_data.ret_end[j] - sig_data.ret_start[j]));
+        }
+
+        // Topdown level 1 and 2 of this span, same as tma_cal.PerfMetricEquLookup
+        if (slots_idx >= 0 && perf_metrics_idx >= 0) {
+            double slots_a = sig_data.ret_start[slots_idx];
+            double slots_b = sig_data.ret_end[slots_idx];
+            uint64_t metric_a = sig_data.ret_start[perf_metrics_idx];
+            uint64_t metric_b = sig_data.ret_end[perf_metrics_idx];
+            for (int m = 0; m < NUM_PERF_METRICS; ++m) {
+                double prec_a = (metric_a >> (m * 8)) & 0xff;
+                double prec_b = (metric_b >> (m * 8)) & 0xff;
+                vec.emplace_back(kPerfMetricsKeys[m], (prec_b * slots_b - prec_a * slots_a) / (slots_b - slots_a + 0.00001));
+            }
+        }
+
+        // Metrics of the config from the same deltas, so the post-processing does not evaluate them again
+        if (group < payload.metrics.size() && !payload.metrics[group].empty()) {
+            int num_event = sig_data.rd_ret_start.num_event;
+            std::vector<double> values(num_event + payload.cnst_keys.size(), 0.);
+            for (int j = 0; j < num_event; ++j) {
+                values[j] = (double) (int64_t) (sig_data.ret_end[j] - sig_data.ret_start[j]);
+            }
+            for (int j = 0; j < payload.cnst_keys.size() && j < pld.cnsts_length; ++j) {
+                values[num_event + j] = (double) pld.cnsts[j];
+            }
+            for (auto& metric : payload.metrics[group]) {
+                double value = metric.second.Eval(values.data());
+                if (std::isfinite(value)) vec.emplace_back(metric.first, value);
+            }
+        }
+    }
+    else {
+        // No event names. Keep the string encoded attributes
+        std::string parent_info = std::to_string(sig_data.parent_info.parent_tid) + "-*-" +
+                                  std::to_string(sig_data.parent_info.parent_pthread_id) + "-*-" +
+                                  std::to_string(sig_data.parent_info.task_sched_time);
+        vec.emplace_back("parent_tid_pthreadid_sched_time", parent_info);
+
+        std::string start_event_info = std::to_string(sig_data.rd_ret_start.core_id) + "-" +
+                                       std::to_string(sig_data.rd_ret_start.prefix) + "-" +
+                                       std::to_string(sig_data.rd_ret_start.num_event);
+        vec.emplace_back("b_coreid_prefix_num_event", start_event_info);
+
+        std::string end_event_info = std::to_string(sig_data.rd_ret_end.core_id) + "-" +
+                                     std::to_string(sig_data.rd_ret_end.prefix) + "-" +
+                                     std::to_string(sig_data.rd_ret_end.num_event);
+        vec.emplace_back("e_coreid_prefix_num_event", end_event_info);
+
+        std::string begin_events;
+        for (int j = 0; j < sig_data.rd_ret_start.num_event; ++j) {
+            begin_events += std::to_string(sig_data.ret_start[j]);
+            if (j < sig_data.rd_ret_start.num_event - 1) begin_events += "-";
         }
+        vec.emplace_back("b_events", begin_events);
 
-        // Send receive shm signal
-        auto shm_status = (mtmc::ShmIpcStatus *) ((char *) shm_hdlr.get() + pld->data_offset);
-        shm_status->done = 1;
+        std::string end_events;
+        for (int j = 0; j < sig_data.rd_ret_end.num_event; ++j) {
+            end_events += std::to_string(sig_data.ret_end[j]);
+            if (j < sig_data.rd_ret_end.num_event - 1) end_events += "-";
+        }
+        vec.emplace_back("e_events", end_events);
+    }
 
-        // Push to worker queue
-        {
-            std::lock_guard<std::mutex> guard(queue_mux);
-            hdlr_queue.push(std::move(shm_hdlr));
-            pld_queue.push(*pld);
+    // Config id
+    vec.emplace_back("mux_id", sig_data.multiplex_idx);
+    vec.emplace_back("cfg_id", pld.configs_id);
+
+    // Constant var
+    if (payload.cnst_keys.size() == pld.cnsts_length) {
+        for (int j = 0; j < pld.cnsts_length; ++j) {
+            vec.emplace_back(payload.cnst_keys[j], (int64_t) pld.cnsts[j]);
+        }
+    }
+    else {
+        std::string cnsts;
+        for (int j = 0; j < pld.cnsts_length; ++j) {
+            cnsts += std::to_string(pld.cnsts[j]);
+            if (j != pld.cnsts_length - 1)
+                cnsts += "-*-";
         }
+        vec.emplace_back("cnsts", cnsts);
+    }
+
+    recordable->AddEvent("PeriodInfo", std::chrono::system_clock::now(),
+                         opentelemetry::common::KeyValueIterableView<std::vector<std::pair<nostd::string_view,
+                                 opentelemetry::common::AttributeValue>>>(vec));
+
+    processor->OnEnd(std::move(recordable));
+    if (throttle_us_) {
+        usleep(throttle_us_);
+    }
+}
 
+std::unique_ptr<trace_sdk::SpanProcessor> OpenteleDaemon::CreateProcessor(const std::string& jaeger_ip,
+                                                                          std::shared_ptr<JsonLinesSink> file_sink) {
+    std::unique_ptr<trace_sdk::SpanExporter> exporter;
+    if (setting_.sink == SpanSink::JSON_FILE) {
+        exporter = std::unique_ptr<trace_sdk::SpanExporter>(new JsonLinesSpanExporter(file_sink));
+    }
+    else {
+        opts.endpoint = jaeger_ip;
+        exporter = jaeger::JaegerExporterFactory::Create(opts);
     }
 
+    if (setting_.processor == SpanProcessorType::BATCH) {
+        trace_sdk::BatchSpanProcessorOptions batch_opts;
+        batch_opts.max_export_batch_size = setting_.batch_size;
+        batch_opts.max_queue_size = setting_.queue_size;
+        batch_opts.schedule_delay_millis = std::chrono::milliseconds(setting_.batch_delay_ms);
+        return trace_sdk::BatchSpanProcessorFactory::Create(std::move(exporter), batch_opts);
+    }
+    return trace_sdk::SimpleSpanProcessorFactory::Create(std::move(exporter));
 }
 
 void OpenteleDaemon::CheckEnv() {
     setting_.channel_name = DEFAULT_CHANNEL_NAME; // TODO: Here let's hardcode it. Later may get from environ
+
+    auto workers_env = getenv("MTMC_EXPORT_WORKERS");
+    if (workers_env) {
+        int num_workers = atoi(workers_env);
+        if (num_workers > 0) {
+            setting_.num_workers = num_workers;
+        }
+        else {
+            printf(FRED("Invalid MTMC_EXPORT_WORKERS %s. Use %d workers\n"), workers_env, setting_.num_workers);
+        }
+    }
+
+    // Where spans go. "jaeger" (default) or "file"
+    auto sink_env = getenv("MTMC_OTLE_SINK");
+    if (sink_env) {
+        std::string sink(sink_env);
+        if (sink == "file") {
+            setting_.sink = SpanSink::JSON_FILE;
+        }
+        else if (sink != "jaeger") {
+            printf(FRED("Unknown MTMC_OTLE_SINK %s. Use jaeger\n"), sink_env);
+        }
+    }
+    auto file_env = getenv("MTMC_OTLE_FILE_PATH");
+    if (file_env) {
+        setting_.file_path = std::string(file_env);
+    }
+
+    // Span processor. "simple" (default) or "batch"
+    auto processor_env = getenv("MTMC_OTLE_PROCESSOR");
+    if (processor_env) {
+        std::string processor(processor_env);
+        if (processor == "batch") {
+            setting_.processor = SpanProcessorType::BATCH;
+        }
+        else if (processor != "simple") {
+            printf(FRED("Unknown MTMC_OTLE_PROCESSOR %s. Use simple\n"), processor_env);
+        }
+    }
+    auto batch_size_env = getenv("MTMC_OTLE_BATCH_SIZE");
+    if (batch_size_env && atoi(batch_size_env) > 0) {
+        setting_.batch_size = atoi(batch_size_env);
+    }
+    auto batch_delay_env = getenv("MTMC_OTLE_BATCH_DELAY_MS");
+    if (batch_delay_env && atoi(batch_delay_env) > 0) {
+        setting_.batch_delay_ms = atoi(batch_delay_env);
+    }
+    auto queue_size_env = getenv("MTMC_OTLE_QUEUE_SIZE");
+    if (queue_size_env && atoi(queue_size_env) > 0) {
+        setting_.queue_size = atoi(queue_size_env);
+    }
+    // A queue smaller than a batch would never fill a batch
+    if (setting_.queue_size < setting_.batch_size) {
+        setting_.queue_size = setting_.batch_size * DEFAULT_QUEUE_BATCHES;
+    }
+
+    auto throttle_env = getenv("MTMC_OTLE_THROTTLE_US");
+    if (throttle_env && atoi(throttle_env) >= 0) {
+        setting_.throttle_us = atoi(throttle_env);
+    }
 }
 
 int main() {
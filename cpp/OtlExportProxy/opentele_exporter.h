@@ -20,17 +20,77 @@
 #include "libipc/ipc.h"
 #include "../exporter.h"
 #include <queue>
+#include <condition_variable>
+#include <atomic>
+#include <csignal>
+#include <memory>
+#include "work_stealing_pool.h"
+#include "jsonl_span_exporter.h"
 
 #include "opentelemetry/context/runtime_context.h"
 #include "opentelemetry/sdk/instrumentationscope/instrumentation_scope.h"
 #include "opentelemetry/exporters/jaeger/jaeger_exporter_factory.h"
 #include "opentelemetry/sdk/trace/simple_processor_factory.h"
+#include "opentelemetry/sdk/trace/batch_span_processor_factory.h"
+#include "opentelemetry/sdk/trace/batch_span_processor_options.h"
 #include "opentelemetry/sdk/trace/tracer_provider_factory.h"
 #include "opentelemetry/trace/provider.h"
-#define NUM_EXPORT_WORKER 1
+#define NUM_EXPORT_WORKER 4
+#define SPAN_RANGE_SIZE 4096     // Number of spans in a task of the worker pool
+#define RECV_TIMEOUT_MS 500      // Interval to check the stop flag while waiting for requests
+#define NUM_PERF_METRICS 8
+#define MAX_CONFIG_GROUPS 256
+#define DEFAULT_BATCH_SIZE 512
+#define DEFAULT_BATCH_DELAY_MS 1000
+#define DEFAULT_QUEUE_BATCHES 8
+#define DEFAULT_REMOTE_THROTTLE_US 100
+
+enum class SpanSink {
+    JAEGER,      // Send to the Jaeger agent at JAEGER_IP
+    JSON_FILE,   // Append json lines to a local file. No collector needed
+};
+
+enum class SpanProcessorType {
+    SIMPLE,      // Export every span synchronously
+    BATCH,       // Queue spans and export them in batches from a background thread
+};
 
 struct DaemonSetting {
     std::string channel_name = DEFAULT_CHANNEL_NAME;
+    int num_workers = NUM_EXPORT_WORKER;
+
+    SpanSink sink = SpanSink::JAEGER;
+    std::string file_path = "mtmc_spans.jsonl";
+    SpanProcessorType processor = SpanProcessorType::SIMPLE;
+    size_t batch_size = DEFAULT_BATCH_SIZE;
+    uint64_t batch_delay_ms = DEFAULT_BATCH_DELAY_MS;
+    size_t queue_size = 0;      // Spans the batch processor queues. 0 means DEFAULT_QUEUE_BATCHES batches
+    int64_t throttle_us = -1;   // Sleep after every span. -1 means 100us for a remote Jaeger, otherwise 0
+};
+
+// A request from the profiler. Shared by all the ranges split from it
+struct ExportPayload {
+    mtmc::ShmIpcLoad pld;
+    ipc::shm::handle shm_hdlr;
+    std::vector<mtmc::SingleProfile*> spans;
+    std::atomic<size_t> remaining_ranges{0};
+    std::chrono::steady_clock::time_point recv_tp;
+
+    // Attribute keys built once from the event names sent with the load. Empty if the profiler sent no names
+    std::vector<std::vector<std::string>> evt_keys;  // "evt.<name>" of every config group
+    std::vector<int> slots_idx;                      // Index of TOPDOWN.SLOTS in every config group. -1 if absent
+    std::vector<int> perf_metrics_idx;               // Index of PERF_METRICS in every config group. -1 if absent
+    std::vector<std::string> cnst_keys;              // "cnst.<name>" in the order of pld.cnsts
+    std::vector<std::vector<std::pair<std::string, mtmc::util::MetricFormula>>> metrics;  // "metric.<name>" of every config group
+
+    // Trace id of every int_prefix, built before the spans are split so all the ranges share one id per iteration
+    std::unordered_map<int64_t, opentelemetry::trace::TraceId> traceid_map;
+};
+
+struct SpanRange {
+    std::shared_ptr<ExportPayload> payload;
+    size_t begin = 0;
+    size_t end = 0;
 };
 
 class Daemon {
@@ -51,12 +111,50 @@ public:
 
     void CheckEnv() override;
 
-    [[noreturn]] void Run() override;
+    /**
+     * Receive requests and convert them until SIGINT/SIGTERM. Pending payloads are converted and flushed before return
+     */
+    void Run() override;
+
+    static void RequestStop(int signum);
 
 private:
+    void ConvertRange(int worker_idx, SpanRange& range);
+
+    void ConvertSpan(opentelemetry::sdk::trace::SpanProcessor* processor, const ExportPayload& payload,
+                     const mtmc::SingleProfile& sig_data);
+
+    void FinishPayload(ExportPayload& payload);
+
+    /**
+     * Read the event and constant names following the load
+     * @return 1 for success, -1 for malformed names
+     */
+    int ParseNames(const mtmc::ShmEventName* names, int num_names, ExportPayload* payload);
+
+    /**
+     * Compile the metric formulas following the names. A formula that does not compile is skipped
+     * @return number of compiled metrics
+     */
+    int ParseMetrics(const mtmc::ShmMetricFormula* metrics, int num_metrics, ExportPayload* payload);
+
+    std::unique_ptr<opentelemetry::sdk::trace::SpanProcessor> CreateProcessor(const std::string& jaeger_ip,
+                                                                              std::shared_ptr<JsonLinesSink> file_sink);
 
     DaemonSetting setting_;
 
+    // One processor per worker, so that workers never share the exporter
+    std::vector<std::unique_ptr<opentelemetry::sdk::trace::SpanProcessor>> processors_;
+    std::unique_ptr<opentelemetry::sdk::instrumentationscope::InstrumentationScope> inst_scope_;
+    uint64_t throttle_us_ = 0;
+
+    // Spans a worker queued to its batch processor since its last flush. Only touched by the worker
+    std::vector<size_t> num_queued_;
+
+    std::atomic<uint64_t> num_converted_{0};
+
+    static std::atomic<bool> stop_flag_;
+
 };
 
 
@@ -0,0 +1,167 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_WORK_STEALING_POOL_H
+#define MTMC_WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed size thread pool where every worker owns a deque of tasks. A worker pops from the back of its own deque and
+ * steals from the front of the others when it runs dry, so a large payload split into ranges is spread over all
+ * workers without a single shared queue.
+ */
+template <typename Task>
+class WorkStealingPool {
+public:
+    using Handler = std::function<void(int, Task&)>;
+
+    WorkStealingPool() = default;
+
+    ~WorkStealingPool() {
+        Stop();
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    /**
+     * Launch the workers
+     * @param num_workers: Number of worker threads
+     * @param handler: Called as handler(worker_idx, task) for every task
+     * @return 1 for success, -1 for failed
+     */
+    int Start(int num_workers, Handler handler) {
+        if (num_workers <= 0 || !workers_.empty()) return -1;
+        handler_ = std::move(handler);
+        stop_.store(false);
+        for (int i = 0; i < num_workers; ++i) {
+            queues_.emplace_back(new WorkerQueue());
+        }
+        for (int i = 0; i < num_workers; ++i) {
+            workers_.emplace_back(&WorkStealingPool::WorkerLoop, this, i);
+        }
+        return 1;
+    }
+
+    /**
+     * Distribute the tasks round robin over the worker deques
+     */
+    void Submit(std::vector<Task>&& tasks) {
+        if (tasks.empty() || queues_.empty()) return;
+        num_pending_.fetch_add(tasks.size());
+        for (auto& task : tasks) {
+            auto& queue = *queues_[next_queue_];
+            next_queue_ = next_queue_ + 1 == queues_.size() ? 0 : next_queue_ + 1;
+            std::lock_guard<std::mutex> lock(queue.mux);
+            queue.tasks.push_back(std::move(task));
+        }
+        std::lock_guard<std::mutex> lock(idle_mux_);
+        idle_cv_.notify_all();
+    }
+
+    /**
+     * Finish all submitted tasks then join the workers
+     */
+    void Stop() {
+        if (workers_.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(idle_mux_);
+            stop_.store(true);
+            idle_cv_.notify_all();
+        }
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+        queues_.clear();
+    }
+
+    int NumWorkers() const {
+        return workers_.size();
+    }
+
+private:
+    struct WorkerQueue {
+        std::mutex mux;
+        std::deque<Task> tasks;
+    };
+
+    bool PopLocal(int idx, Task* task) {
+        auto& queue = *queues_[idx];
+        std::lock_guard<std::mutex> lock(queue.mux);
+        if (queue.tasks.empty()) return false;
+        *task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool Steal(int idx, Task* task) {
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            auto& queue = *queues_[(idx + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mux);
+            if (queue.tasks.empty()) continue;
+            *task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void WorkerLoop(int idx) {
+        while (true) {
+            Task task;
+            if (PopLocal(idx, &task) || Steal(idx, &task)) {
+                handler_(idx, task);
+                if (num_pending_.fetch_sub(1) == 1) {
+                    // Last task done. Workers waiting for stop can exit now
+                    std::lock_guard<std::mutex> lock(idle_mux_);
+                    idle_cv_.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_mux_);
+            idle_cv_.wait(lock, [&]{ return NumQueued() > 0 || (stop_.load() && num_pending_.load() == 0); });
+            if (stop_.load() && num_pending_.load() == 0) break;
+        }
+    }
+
+    size_t NumQueued() {
+        size_t queued = 0;
+        for (auto& queue : queues_) {
+            std::lock_guard<std::mutex> lock(queue->mux);
+            queued += queue->tasks.size();
+        }
+        return queued;
+    }
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::vector<std::thread> workers_;
+    size_t next_queue_ = 0;
+    Handler handler_;
+
+    std::mutex idle_mux_;
+    std::condition_variable idle_cv_;
+    std::atomic<int64_t> num_pending_{0};
+    std::atomic<bool> stop_{false};
+};
+
+#endif //MTMC_WORK_STEALING_POOL_H
@@ -0,0 +1,368 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "critical_path.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <thread>
+#include <unordered_map>
+
+namespace mtmc {
+namespace analyzer {
+
+    namespace {
+        inline bool StartsBefore(const std::vector<TraceSpan>& spans, uint32_t a, uint32_t b) {
+            return spans[a].start_ts < spans[b].start_ts || (spans[a].start_ts == spans[b].start_ts && a < b);
+        }
+
+        void MergeOps(std::vector<OpResult>* dst, const std::vector<OpResult>& src) {
+            for (size_t i = 0; i < src.size(); ++i) {
+                auto& d = (*dst)[i];
+                auto& s = src[i];
+                d.count += s.count;
+                d.total_ns += s.total_ns;
+                d.cp_count += s.cp_count;
+                d.cp_self_ns += s.cp_self_ns;
+                d.cp_sched_delay_ns += s.cp_sched_delay_ns;
+                d.sched_count += s.sched_count;
+                d.sched_delay_ns += s.sched_delay_ns;
+                d.sched_delay_max_ns = std::max(d.sched_delay_max_ns, s.sched_delay_max_ns);
+            }
+        }
+    }
+
+    CriticalPathAnalyzer::CriticalPathAnalyzer(int num_threads) {
+        num_threads_ = num_threads > 0 ? num_threads : 1;
+    }
+
+    template <typename Func>
+    void CriticalPathAnalyzer::ParallelFor(size_t num_items, Func func) {
+        // Items are handed out in small batches, so a few large threads or iterations do not serialize the pass
+        std::atomic<size_t> next{0};
+        size_t batch = std::max<size_t>(1, std::min<size_t>(4096, num_items / (num_threads_ * 16)));
+        auto worker = [&](int worker_idx) {
+            while (true) {
+                size_t begin = next.fetch_add(batch);
+                if (begin >= num_items) break;
+                func(begin, std::min(num_items, begin + batch), worker_idx);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int i = 1; i < num_threads_; ++i) {
+            workers.emplace_back(worker, i);
+        }
+        worker(0);
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+    AnalysisResult CriticalPathAnalyzer::Analyze(Trace* trace) {
+        AnalysisResult result;
+        auto& spans = trace->spans;
+        result.ops.assign(trace->names.size(), OpResult{});
+        if (spans.empty()) return result;
+
+        SortByThread(trace);
+
+        // Enclosing span on the same thread. Spans of a thread nest like a stack
+        enclosing_.assign(spans.size(), NO_PARENT);
+        ParallelFor(thread_ranges_.size(), [&](size_t begin, size_t end, int) {
+            std::vector<uint32_t> stack;
+            for (size_t t = begin; t < end; ++t) {
+                stack.clear();
+                for (size_t i = thread_ranges_[t].second.first; i < thread_ranges_[t].second.second; ++i) {
+                    while (!stack.empty() && spans[stack.back()].end_ts < spans[i].end_ts) stack.pop_back();
+                    enclosing_[i] = stack.empty() ? NO_PARENT : stack.back();
+                    stack.push_back(i);
+                }
+            }
+        });
+
+        parent_.assign(spans.size(), NO_PARENT);
+        std::atomic<uint64_t> num_orphans{0};
+        ParallelFor(spans.size(), [&](size_t begin, size_t end, int) {
+            num_orphans.fetch_add(LinkParents(*trace, begin, end), std::memory_order_relaxed);
+        });
+        result.num_orphans = num_orphans.load();
+
+        BuildChildren(*trace);
+
+        // Per op totals and scheduling delay of all spans
+        std::vector<std::vector<OpResult>> local_ops(num_threads_, std::vector<OpResult>(trace->names.size()));
+        ParallelFor(spans.size(), [&](size_t begin, size_t end, int worker_idx) {
+            auto& ops = local_ops[worker_idx];
+            for (size_t i = begin; i < end; ++i) {
+                auto& op = ops[spans[i].name_id];
+                ++op.count;
+                op.total_ns += spans[i].end_ts - spans[i].start_ts;
+                if (parent_[i] != NO_PARENT && spans[i].task_sched_time != 0 && spans[i].parent_tid != 0) {
+                    uint64_t delay = spans[i].start_ts - ForkTime(spans[i], parent_[i], *trace);
+                    ++op.sched_count;
+                    op.sched_delay_ns += delay;
+                    op.sched_delay_max_ns = std::max(op.sched_delay_max_ns, delay);
+                }
+            }
+        });
+
+        // Group the spans into iterations. Roots are spans whose parent is in no or another iteration
+        std::unordered_map<int64_t, size_t> iter_idx;
+        std::vector<std::vector<uint32_t>> iter_roots;
+        std::vector<uint64_t> iter_end;
+        for (uint32_t i = 0; i < spans.size(); ++i) {
+            auto itr = iter_idx.insert({spans[i].int_prefix, result.iterations.size()});
+            if (itr.second) {
+                result.iterations.push_back(IterationResult{spans[i].int_prefix, 0, spans[i].start_ts});
+                iter_roots.emplace_back();
+                iter_end.push_back(0);
+            }
+            size_t idx = itr.first->second;
+            auto& iter = result.iterations[idx];
+            ++iter.num_spans;
+            iter.start_ts = std::min(iter.start_ts, spans[i].start_ts);
+            iter_end[idx] = std::max(iter_end[idx], spans[i].end_ts);
+            if (parent_[i] == NO_PARENT || spans[parent_[i]].int_prefix != spans[i].int_prefix) {
+                iter_roots[idx].push_back(i);
+            }
+        }
+        for (size_t i = 0; i < result.iterations.size(); ++i) {
+            result.iterations[i].makespan_ns = iter_end[i] - result.iterations[i].start_ts;
+        }
+
+        ParallelFor(result.iterations.size(), [&](size_t begin, size_t end, int worker_idx) {
+            for (size_t i = begin; i < end; ++i) {
+                WalkIteration(*trace, iter_roots[i], &result.iterations[i], &local_ops[worker_idx]);
+            }
+        });
+        for (auto& ops : local_ops) {
+            MergeOps(&result.ops, ops);
+        }
+
+        std::sort(result.iterations.begin(), result.iterations.end(),
+                  [](const IterationResult& a, const IterationResult& b) { return a.int_prefix < b.int_prefix; });
+        for (auto& iter : result.iterations) {
+            result.total_makespan_ns += iter.makespan_ns;
+        }
+        return result;
+    }
+
+    // ----------------------------------- Private ----------------------------------------
+
+    void CriticalPathAnalyzer::SortByThread(Trace* trace) {
+        auto& spans = trace->spans;
+
+        // Bucket by tid, then sort each thread in parallel
+        std::unordered_map<int32_t, size_t> tid_idx;
+        thread_ranges_.clear();
+        for (auto& span : spans) {
+            auto itr = tid_idx.insert({span.tid, thread_ranges_.size()});
+            if (itr.second) thread_ranges_.push_back({span.tid, {0, 0}});
+            ++thread_ranges_[itr.first->second].second.second;
+        }
+        size_t offset = 0;
+        for (auto& range : thread_ranges_) {
+            size_t cnt = range.second.second;
+            range.second = {offset, offset};
+            offset += cnt;
+        }
+        std::vector<TraceSpan> sorted(spans.size());
+        for (auto& span : spans) {
+            sorted[thread_ranges_[tid_idx[span.tid]].second.second++] = span;
+        }
+        spans.swap(sorted);
+        std::vector<TraceSpan>().swap(sorted);
+
+        ParallelFor(thread_ranges_.size(), [&](size_t begin, size_t end, int) {
+            for (size_t t = begin; t < end; ++t) {
+                // Outer span first when two spans start at the same time
+                std::sort(spans.begin() + thread_ranges_[t].second.first, spans.begin() + thread_ranges_[t].second.second,
+                          [](const TraceSpan& a, const TraceSpan& b) {
+                              return a.start_ts < b.start_ts || (a.start_ts == b.start_ts && a.end_ts > b.end_ts);
+                          });
+            }
+        });
+        std::sort(thread_ranges_.begin(), thread_ranges_.end());
+    }
+
+    uint64_t CriticalPathAnalyzer::LinkParents(const Trace& trace, size_t begin, size_t end) {
+        auto& spans = trace.spans;
+        uint64_t num_orphans = 0;
+        for (size_t i = begin; i < end; ++i) {
+            const TraceSpan& span = spans[i];
+            parent_[i] = enclosing_[i];
+            if (span.parent_tid == 0 || span.task_sched_time == 0) continue;
+
+            auto range_itr = std::lower_bound(thread_ranges_.begin(), thread_ranges_.end(), span.parent_tid,
+                                              [](const std::pair<int32_t, std::pair<size_t, size_t>>& r, int32_t tid) {
+                                                  return r.first < tid;
+                                              });
+            if (range_itr == thread_ranges_.end() || range_itr->first != span.parent_tid) {
+                ++num_orphans;
+                continue;
+            }
+
+            // Last span of the parent thread started by task_sched_time, then walk out to the one still running
+            size_t r_begin = range_itr->second.first, r_end = range_itr->second.second;
+            auto itr = std::upper_bound(spans.begin() + r_begin, spans.begin() + r_end, span.task_sched_time,
+                                        [](uint64_t t, const TraceSpan& s) { return t < s.start_ts; });
+            if (itr == spans.begin() + r_begin) {
+                ++num_orphans;
+                continue;
+            }
+            uint32_t cand = (itr - spans.begin()) - 1;
+            if (cand == i) cand = enclosing_[i];
+            while (cand != NO_PARENT && spans[cand].end_ts < span.task_sched_time) {
+                cand = enclosing_[cand];
+            }
+            // Parent must start before the child, which keeps the graph acyclic
+            if (cand != NO_PARENT && StartsBefore(spans, cand, i)) {
+                parent_[i] = cand;
+            }
+            else {
+                ++num_orphans;
+            }
+        }
+        return num_orphans;
+    }
+
+    void CriticalPathAnalyzer::BuildChildren(const Trace& trace) {
+        auto& spans = trace.spans;
+        child_offset_.assign(spans.size() + 1, 0);
+        for (auto parent : parent_) {
+            if (parent != NO_PARENT) ++child_offset_[parent + 1];
+        }
+        for (size_t i = 0; i < spans.size(); ++i) {
+            child_offset_[i + 1] += child_offset_[i];
+        }
+        children_.assign(child_offset_.back(), 0);
+        std::vector<uint32_t> fill(child_offset_.begin(), child_offset_.end() - 1);
+        for (uint32_t i = 0; i < spans.size(); ++i) {
+            if (parent_[i] != NO_PARENT) children_[fill[parent_[i]]++] = i;
+        }
+        ParallelFor(spans.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                if (child_offset_[i + 1] - child_offset_[i] < 2) continue;
+                std::sort(children_.begin() + child_offset_[i], children_.begin() + child_offset_[i + 1],
+                          [&spans](uint32_t a, uint32_t b) { return spans[a].end_ts > spans[b].end_ts; });
+            }
+        });
+    }
+
+    uint64_t CriticalPathAnalyzer::ForkTime(const TraceSpan& span, uint32_t parent, const Trace& trace) const {
+        if (parent == NO_PARENT || span.task_sched_time == 0 || span.parent_tid == 0) return span.start_ts;
+        uint64_t fork = std::max(span.task_sched_time, trace.spans[parent].start_ts);
+        return std::min(fork, span.start_ts);
+    }
+
+    void CriticalPathAnalyzer::WalkIteration(const Trace& trace, const std::vector<uint32_t>& roots,
+                                             IterationResult* iter, std::vector<OpResult>* ops) {
+        auto& spans = trace.spans;
+        std::vector<uint32_t> sorted_roots(roots);
+        std::sort(sorted_roots.begin(), sorted_roots.end(),
+                  [&spans](uint32_t a, uint32_t b) { return spans[a].end_ts > spans[b].end_ts; });
+
+        // Iterative walk, a deep fork chain must not overflow the stack. NO_PARENT is the virtual iteration root
+        struct Frame {
+            uint32_t span;
+            uint64_t cursor;
+            const uint32_t* next;
+            const uint32_t* end;
+        };
+        std::vector<Frame> stack;
+        stack.push_back(Frame{NO_PARENT, iter->start_ts + iter->makespan_ns, sorted_roots.data(),
+                              sorted_roots.data() + sorted_roots.size()});
+
+        while (!stack.empty()) {
+            size_t top = stack.size() - 1;
+            bool descended = false;
+            while (stack[top].next != stack[top].end) {
+                uint32_t c = *stack[top].next++;
+                const TraceSpan& child = spans[c];
+                uint64_t cursor = stack[top].cursor;
+                if (child.int_prefix != iter->int_prefix || child.start_ts >= cursor) continue;
+
+                uint32_t self = stack[top].span;
+                uint64_t fork = self == NO_PARENT ? child.start_ts : ForkTime(child, self, trace);
+                uint64_t child_end = std::min(child.end_ts, cursor);
+                if (self == NO_PARENT) iter->cp_untracked_ns += cursor - child_end;
+                else (*ops)[spans[self].name_id].cp_self_ns += cursor - child_end;
+
+                auto& op = (*ops)[child.name_id];
+                ++op.cp_count;
+                op.cp_sched_delay_ns += child.start_ts - fork;
+                ++iter->cp_num_spans;
+                iter->cp_sched_delay_ns += child.start_ts - fork;
+
+                // Before the child was forked, the parent itself is on the path
+                stack[top].cursor = fork;
+                stack.push_back(Frame{c, child_end, children_.data() + child_offset_[c],
+                                      children_.data() + child_offset_[c + 1]});
+                descended = true;
+                break;
+            }
+            if (descended) continue;
+
+            const Frame& f = stack[top];
+            uint64_t start = f.span == NO_PARENT ? iter->start_ts : spans[f.span].start_ts;
+            if (f.cursor > start) {
+                if (f.span == NO_PARENT) iter->cp_untracked_ns += f.cursor - start;
+                else (*ops)[spans[f.span].name_id].cp_self_ns += f.cursor - start;
+            }
+            stack.pop_back();
+        }
+    }
+
+    int WriteAnalysisCsv(const AnalysisResult& result, const Trace& trace, const std::string& prefix) {
+        std::ofstream iter_fs(prefix + "_iterations.csv", std::ios::out);
+        std::ofstream ops_fs(prefix + "_ops.csv", std::ios::out);
+        if (!iter_fs.good() || !ops_fs.good()) {
+            printf("Open output failed: %s_*.csv\n", prefix.c_str());
+            return -1;
+        }
+
+        iter_fs << "int_prefix,num_spans,start_ts,makespan_ns,cp_num_spans,cp_sched_delay_ns,cp_untracked_ns\n";
+        for (auto& iter : result.iterations) {
+            iter_fs << iter.int_prefix << "," << iter.num_spans << "," << iter.start_ts << "," << iter.makespan_ns << ","
+                    << iter.cp_num_spans << "," << iter.cp_sched_delay_ns << "," << iter.cp_untracked_ns << "\n";
+        }
+
+        // Most critical op first
+        std::vector<uint32_t> order(result.ops.size());
+        for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&result](uint32_t a, uint32_t b) {
+            return result.ops[a].cp_self_ns + result.ops[a].cp_sched_delay_ns >
+                   result.ops[b].cp_self_ns + result.ops[b].cp_sched_delay_ns;
+        });
+
+        ops_fs << "op,count,total_ns,cp_count,cp_self_ns,cp_sched_delay_ns,cp_share,sched_count,sched_delay_mean_ns,"
+                  "sched_delay_max_ns\n";
+        for (auto i : order) {
+            auto& op = result.ops[i];
+            if (op.count == 0) continue;
+            double cp_share = result.total_makespan_ns ?
+                    double(op.cp_self_ns + op.cp_sched_delay_ns) / result.total_makespan_ns : 0;
+            double sched_mean = op.sched_count ? double(op.sched_delay_ns) / op.sched_count : 0;
+            // Quote the name, a prefix can hold ','
+            std::string name = trace.names[i];
+            for (size_t p = name.find('"'); p != std::string::npos; p = name.find('"', p + 2)) name.insert(p, "\"");
+            ops_fs << "\"" << name << "\"," << op.count << "," << op.total_ns << "," << op.cp_count << ","
+                   << op.cp_self_ns << "," << op.cp_sched_delay_ns << "," << cp_share << "," << op.sched_count << ","
+                   << sched_mean << "," << op.sched_delay_max_ns << "\n";
+        }
+        return 1;
+    }
+}
+}
@@ -0,0 +1,110 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_CRITICAL_PATH_H
+#define MTMC_CRITICAL_PATH_H
+
+#include <string>
+#include <vector>
+
+#include "trace_reader.h"
+
+namespace mtmc {
+namespace analyzer {
+
+#define NO_PARENT UINT32_MAX
+
+    struct IterationResult {
+        int64_t int_prefix;
+        uint64_t num_spans;
+        uint64_t start_ts;
+        uint64_t makespan_ns;         // First start to last end of the iteration, which is the critical path length
+        uint64_t cp_num_spans;        // Number of spans on the critical path
+        uint64_t cp_sched_delay_ns;   // Time on the critical path spent waiting for a forked task to be scheduled
+        uint64_t cp_untracked_ns;     // Time on the critical path not covered by any span
+    };
+
+    struct OpResult {
+        uint64_t count;
+        uint64_t total_ns;
+        uint64_t cp_count;            // Number of spans of this op on the critical path
+        uint64_t cp_self_ns;          // Time of this op on the critical path, excluding children on it
+        uint64_t cp_sched_delay_ns;   // Scheduling delay of this op on the critical path
+        uint64_t sched_count;         // Number of spans of this op forked by a parent
+        uint64_t sched_delay_ns;      // Sum of start_ts - task_sched_time
+        uint64_t sched_delay_max_ns;
+    };
+
+    struct AnalysisResult {
+        std::vector<IterationResult> iterations;  // Sorted by int_prefix
+        std::vector<OpResult> ops;                // Indexed by name_id
+        uint64_t total_makespan_ns = 0;
+        uint64_t num_orphans = 0;                 // Spans with a parent tid but no parent span found
+    };
+
+    /**
+     * Rebuild the fork/join DAG of a trace and compute the critical path of every iteration (int_prefix).
+     *
+     * The parent of a span is the innermost span on parent_tid running at task_sched_time, or the enclosing span on the
+     * same thread if the span was not forked. The critical path is walked backward from the end of a span: the child
+     * that ends last is on the path, then the walk continues from the moment that child was forked. The gap between
+     * fork and start of a child on the path is its scheduling delay.
+     */
+    class CriticalPathAnalyzer {
+    public:
+        explicit CriticalPathAnalyzer(int num_threads);
+
+        /**
+         * Sorts trace->spans in place (by tid then start)
+         */
+        AnalysisResult Analyze(Trace* trace);
+
+        const std::vector<uint32_t>& Parents() const {
+            return parent_;
+        }
+
+    private:
+        void SortByThread(Trace* trace);
+
+        // Returns the number of forked spans whose parent is not found. They fall back to the enclosing span
+        uint64_t LinkParents(const Trace& trace, size_t begin, size_t end);
+
+        void BuildChildren(const Trace& trace);
+
+        void WalkIteration(const Trace& trace, const std::vector<uint32_t>& roots, IterationResult* iter,
+                           std::vector<OpResult>* ops);
+
+        uint64_t ForkTime(const TraceSpan& span, uint32_t parent, const Trace& trace) const;
+
+        template <typename Func>
+        void ParallelFor(size_t num_items, Func func);
+
+        int num_threads_;
+
+        std::vector<std::pair<int32_t, std::pair<size_t, size_t>>> thread_ranges_;  // tid -> [begin, end) of spans
+        std::vector<uint32_t> enclosing_;       // Enclosing span on the same thread
+        std::vector<uint32_t> parent_;
+        std::vector<uint32_t> child_offset_;    // CSR of children, each sorted by end_ts descending
+        std::vector<uint32_t> children_;
+    };
+
+    /**
+     * Write <prefix>_iterations.csv and <prefix>_ops.csv
+     * @return 1 for success, -1 for failed
+     */
+    int WriteAnalysisCsv(const AnalysisResult& result, const Trace& trace, const std::string& prefix);
+}
+}
+
+#endif //MTMC_CRITICAL_PATH_H
@@ -0,0 +1,82 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <thread>
+
+#include "critical_path.h"
+
+namespace {
+    void Usage(const char* prog) {
+        printf("Usage: %s [-t threads] [-f name_field] [-o output_prefix] log_file [log_file ...]\n"
+               "  Critical path and scheduling delay of the text logs exported by MTMC (ExportMode 1)\n"
+               "  -t  Number of worker threads. Default is the number of cores\n"
+               "  -f  Use the n-th '~' separated field of the prefix as the op name. Default is the full prefix\n"
+               "  -o  Output prefix of <prefix>_iterations.csv and <prefix>_ops.csv. Default is mtmc_cp\n", prog);
+    }
+
+    double SecondsSince(std::chrono::steady_clock::time_point tp) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - tp).count();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int num_threads = std::thread::hardware_concurrency();
+    int name_field = -1;
+    std::string output_prefix = "mtmc_cp";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f:o:h")) != -1) {
+        switch (opt) {
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'f':
+                name_field = atoi(optarg);
+                break;
+            case 'o':
+                output_prefix = optarg;
+                break;
+            default:
+                Usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    auto tp = std::chrono::steady_clock::now();
+    mtmc::analyzer::Trace trace;
+    mtmc::analyzer::TraceReader reader(num_threads, name_field);
+    for (int i = optind; i < argc; ++i) {
+        if (reader.ReadFile(argv[i], &trace) < 0) return 1;
+    }
+    printf("Read %lu spans, %lu ops, %lu bad lines in %.2fs\n", trace.spans.size(), trace.names.size(),
+           trace.num_bad_lines, SecondsSince(tp));
+
+    tp = std::chrono::steady_clock::now();
+    mtmc::analyzer::CriticalPathAnalyzer analyzer(num_threads);
+    auto result = analyzer.Analyze(&trace);
+    printf("Analyzed %lu iterations in %.2fs. %lu forked spans have no parent span in the trace\n",
+           result.iterations.size(), SecondsSince(tp), result.num_orphans);
+
+    if (mtmc::analyzer::WriteAnalysisCsv(result, trace, output_prefix) != 1) return 1;
+    printf("Results written to %s_iterations.csv and %s_ops.csv\n", output_prefix.c_str(), output_prefix.c_str());
+    return 0;
+}
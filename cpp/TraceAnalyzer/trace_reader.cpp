@@ -0,0 +1,200 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "trace_reader.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace mtmc {
+namespace analyzer {
+
+    namespace {
+        // Fields before the prefix: tid, pthread_id, start, end, parent_tid, parent_pthread_id, sched_time, topdown,
+        // begin header, begin events, end header, end events, int_prefix. After it: cfg idx, constants
+        const int kNumHeadFields = 13;
+        const int kNumTailFields = 2;
+
+        inline bool ParseInt(const char* begin, const char* end, int64_t* value) {
+            if (begin == end) return false;
+            bool neg = *begin == '-';
+            if (neg) ++begin;
+            if (begin == end) return false;
+            uint64_t v = 0;
+            for (const char* p = begin; p < end; ++p) {
+                if (*p < '0' || *p > '9') return false;
+                v = v * 10 + (*p - '0');
+            }
+            *value = neg ? -int64_t(v) : int64_t(v);
+            return true;
+        }
+    }
+
+    TraceReader::TraceReader(int num_threads, int name_field) {
+        num_threads_ = num_threads > 0 ? num_threads : 1;
+        name_field_ = name_field;
+    }
+
+    bool TraceReader::ParseLine(const char* begin, const char* end, TraceSpan* span, const char** name,
+                                size_t* name_len) {
+        // The prefix may hold ',', so fields are split from both sides
+        const char* head[kNumHeadFields + 1];
+        const char* p = begin;
+        head[0] = begin;
+        for (int i = 1; i <= kNumHeadFields; ++i) {
+            p = static_cast<const char*>(memchr(p, ',', end - p));
+            if (p == nullptr) return false;
+            head[i] = ++p;
+        }
+        const char* prefix_end = end;
+        for (int i = 0; i < kNumTailFields; ++i) {
+            while (prefix_end > head[kNumHeadFields] && *(prefix_end - 1) != ',') --prefix_end;
+            if (prefix_end == head[kNumHeadFields]) return false;
+            --prefix_end;
+        }
+
+        int64_t tid, start, end_ts, parent_tid, sched, int_prefix;
+        if (!ParseInt(head[0], head[1] - 1, &tid) || !ParseInt(head[2], head[3] - 1, &start) ||
+            !ParseInt(head[3], head[4] - 1, &end_ts) || !ParseInt(head[4], head[5] - 1, &parent_tid) ||
+            !ParseInt(head[6], head[7] - 1, &sched) || !ParseInt(head[12], head[13] - 1, &int_prefix)) {
+            return false;
+        }
+        if (end_ts < start) return false;
+
+        span->tid = tid;
+        span->start_ts = start;
+        span->end_ts = end_ts;
+        span->parent_tid = parent_tid;
+        span->task_sched_time = sched;
+        span->int_prefix = int_prefix;
+        *name = head[kNumHeadFields];
+        *name_len = prefix_end - head[kNumHeadFields];
+        return true;
+    }
+
+    int64_t TraceReader::ReadFile(const std::string& path, Trace* trace) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            printf("Open trace failed: %s\n", path.c_str());
+            return -1;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+        auto* data = static_cast<const char*>(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+        close(fd);
+        if (data == MAP_FAILED) {
+            printf("Mmap trace failed: %s\n", path.c_str());
+            return -1;
+        }
+        madvise(const_cast<char*>(data), st.st_size, MADV_SEQUENTIAL);
+
+        // Split on line boundaries
+        const char* file_end = data + st.st_size;
+        std::vector<const char*> bounds{data};
+        for (int i = 1; i < num_threads_; ++i) {
+            const char* p = data + st.st_size / num_threads_ * i;
+            if (p < bounds.back()) p = bounds.back();
+            const char* nl = static_cast<const char*>(memchr(p, '\n', file_end - p));
+            bounds.push_back(nl ? nl + 1 : file_end);
+        }
+        bounds.push_back(file_end);
+
+        size_t num_ranges = bounds.size() - 1;
+        std::vector<std::vector<TraceSpan>> spans(num_ranges);
+        std::vector<std::vector<std::string>> names(num_ranges);
+        std::vector<size_t> num_bad_lines(num_ranges, 0);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < num_ranges; ++i) {
+            workers.emplace_back(&TraceReader::ParseRange, this, bounds[i], bounds[i+1], &spans[i], &names[i],
+                                 &num_bad_lines[i]);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        munmap(const_cast<char*>(data), st.st_size);
+
+        // Merge the local name tables into the trace
+        std::unordered_map<std::string, uint32_t> name_ids;
+        for (uint32_t i = 0; i < trace->names.size(); ++i) {
+            name_ids.insert({trace->names[i], i});
+        }
+        int64_t num_read = 0;
+        for (size_t i = 0; i < num_ranges; ++i) {
+            std::vector<uint32_t> remap(names[i].size());
+            for (size_t j = 0; j < names[i].size(); ++j) {
+                auto itr = name_ids.insert({names[i][j], (uint32_t)trace->names.size()});
+                if (itr.second) trace->names.push_back(names[i][j]);
+                remap[j] = itr.first->second;
+            }
+            for (auto& span : spans[i]) {
+                span.name_id = remap[span.name_id];
+            }
+            trace->spans.insert(trace->spans.end(), spans[i].begin(), spans[i].end());
+            trace->num_bad_lines += num_bad_lines[i];
+            num_read += spans[i].size();
+            std::vector<TraceSpan>().swap(spans[i]);
+        }
+        return num_read;
+    }
+
+    void TraceReader::ParseRange(const char* begin, const char* end, std::vector<TraceSpan>* spans,
+                                 std::vector<std::string>* names, size_t* num_bad_lines) {
+        std::unordered_map<std::string, uint32_t> name_ids;
+        std::string name;
+        const char* line = begin;
+        while (line < end) {
+            const char* nl = static_cast<const char*>(memchr(line, '\n', end - line));
+            const char* line_end = nl ? nl : end;
+            TraceSpan span{};
+            const char* name_ptr;
+            size_t name_len;
+            if (line_end > line && ParseLine(line, line_end, &span, &name_ptr, &name_len)) {
+                if (name_field_ >= 0) {
+                    // Keep only the requested '~' separated field, eg. the op type of an INTRAOP~name~op~... prefix
+                    const char* f = name_ptr;
+                    const char* name_end = name_ptr + name_len;
+                    for (int i = 0; i < name_field_ && f < name_end; ++i) {
+                        const char* sep = static_cast<const char*>(memchr(f, '~', name_end - f));
+                        f = sep ? sep + 1 : name_end;
+                    }
+                    const char* sep = static_cast<const char*>(memchr(f, '~', name_end - f));
+                    name.assign(f, sep ? sep : name_end);
+                }
+                else {
+                    name.assign(name_ptr, name_len);
+                }
+                auto itr = name_ids.insert({name, (uint32_t)names->size()});
+                if (itr.second) names->push_back(name);
+                span.name_id = itr.first->second;
+                spans->push_back(span);
+            }
+            else if (line_end > line && *line != '#') {
+                ++*num_bad_lines;
+            }
+            line = line_end + 1;
+        }
+    }
+}
+}
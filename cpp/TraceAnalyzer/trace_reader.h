@@ -0,0 +1,80 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_TRACE_READER_H
+#define MTMC_TRACE_READER_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mtmc {
+namespace analyzer {
+
+    // The fields of an exported span that the analysis needs. Kept small since a trace can hold 1e8+ spans
+    struct TraceSpan {
+        uint64_t start_ts;
+        uint64_t end_ts;
+        uint64_t task_sched_time;  // 0 if the span was not forked by GetParamsInfo()
+        int64_t int_prefix;
+        int32_t tid;
+        int32_t parent_tid;
+        uint32_t name_id;
+    };
+
+    struct Trace {
+        std::vector<TraceSpan> spans;
+        std::vector<std::string> names;  // Indexed by TraceSpan::name_id
+        size_t num_bad_lines = 0;
+    };
+
+    /**
+     * Reader of the text logs written by MTMCProfiler::Finish() (ExportMode 1). A file is memory mapped and split into
+     * one byte range per thread, every thread parses its range and interns names locally, then the name tables are
+     * merged.
+     */
+    class TraceReader {
+    public:
+        /**
+         * @param num_threads: Number of parser threads
+         * @param name_field: Use only the name_field-th '~' separated field of the prefix as the op name. -1 uses the
+         *                    full prefix
+         */
+        explicit TraceReader(int num_threads, int name_field = -1);
+
+        /**
+         * Parse a log file and append its spans to the trace
+         * @return Number of spans read. -1 for failed to open the file
+         */
+        int64_t ReadFile(const std::string& path, Trace* trace);
+
+        /**
+         * Parse one log line
+         * @return true if the line is a valid span
+         */
+        static bool ParseLine(const char* begin, const char* end, TraceSpan* span, const char** name,
+                              size_t* name_len);
+
+    private:
+        void ParseRange(const char* begin, const char* end, std::vector<TraceSpan>* spans,
+                        std::vector<std::string>* names, size_t* num_bad_lines);
+
+        int num_threads_;
+        int name_field_;
+    };
+}
+}
+
+#endif //MTMC_TRACE_READER_H
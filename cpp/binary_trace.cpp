@@ -0,0 +1,211 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "binary_trace.h"
+#include "util.h"
+
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+
+namespace mtmc {
+
+    namespace {
+        // Records are staged in a buffer of this many records before each pwrite
+#define BIN_WRITE_BATCH 4096
+
+        bool PwriteAll(int fd, const char* buf, size_t len, uint64_t offset) {
+            while (len > 0) {
+                ssize_t n = pwrite(fd, buf, len, offset);
+                if (n <= 0) return false;
+                buf += n;
+                len -= n;
+                offset += n;
+            }
+            return true;
+        }
+
+        // A block of records and where it starts in the file. gather copies n records from begin on to dst
+        struct BlockPlan {
+            int cpu;
+            uint64_t num_records;
+            uint64_t offset;
+            std::function<void(uint64_t begin, uint64_t n, char* dst)> gather;
+        };
+
+        bool WriteBlock(int fd, const BlockPlan& plan, uint32_t record_size) {
+            BinBlockHeader hdr{};
+            hdr.cpu = plan.cpu;
+            hdr.num_records = plan.num_records;
+            if (!PwriteAll(fd, (const char*)&hdr, sizeof(hdr), plan.offset)) return false;
+
+            uint64_t batch = std::min(plan.num_records, (uint64_t)BIN_WRITE_BATCH);
+            std::vector<char> buf(batch * record_size);
+            uint64_t offset = plan.offset + sizeof(hdr);
+            for (uint64_t i = 0; i < plan.num_records; i += batch) {
+                uint64_t n = std::min(batch, plan.num_records - i);
+                plan.gather(i, n, buf.data());
+                if (!PwriteAll(fd, buf.data(), n * record_size, offset)) return false;
+                offset += n * record_size;
+            }
+            return true;
+        }
+
+        /**
+         * Lay out and write the file. Blocks are written in parallel, every writer knows its offset up front
+         * @param plans: Blocks without their offset, which is filled here
+         */
+        int WriteBlocks(const std::string& path, uint32_t record_type, uint32_t record_size,
+                        const std::vector<std::string>& event_names, int64_t realtime_offset_ns,
+                        std::vector<BlockPlan>& plans, int num_workers) {
+            BinFileHeader file_hdr{};
+            memcpy(file_hdr.magic, MTMC_BIN_MAGIC, sizeof(MTMC_BIN_MAGIC));
+            file_hdr.version = MTMC_BIN_VERSION;
+            file_hdr.record_type = record_type;
+            file_hdr.record_size = record_size;
+            file_hdr.num_events = event_names.size();
+            file_hdr.realtime_offset_ns = realtime_offset_ns;
+            file_hdr.num_blocks = plans.size();
+
+            std::string names;
+            for (auto& name : event_names) {
+                names.append(name);
+                names.push_back('\0');
+            }
+            names.resize(BinPad8(names.size()), '\0');
+            file_hdr.names_bytes = names.size();
+
+            uint64_t offset = sizeof(file_hdr) + names.size();
+            for (auto& plan : plans) {
+                plan.offset = offset;
+                offset += sizeof(BinBlockHeader) + plan.num_records * record_size;
+            }
+
+            int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                Dprintf(FRED("Open file failed: %s\n"), path.c_str());
+                return -1;
+            }
+            bool ok = ftruncate(fd, offset) == 0 &&
+                      PwriteAll(fd, (const char*)&file_hdr, sizeof(file_hdr), 0) &&
+                      PwriteAll(fd, names.data(), names.size(), sizeof(file_hdr));
+
+            if (num_workers <= 0) num_workers = std::max(1u, std::thread::hardware_concurrency());
+            num_workers = std::min(num_workers, (int)plans.size());
+            std::atomic<size_t> next{0};
+            std::atomic<bool> failed{false};
+            std::vector<std::thread> workers;
+            for (int w = 0; ok && w < num_workers; ++w) {
+                workers.emplace_back([&]() {
+                    size_t i;
+                    while ((i = next.fetch_add(1)) < plans.size()) {
+                        if (!WriteBlock(fd, plans[i], record_size)) failed.store(true);
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            close(fd);
+
+            if (!ok || failed.load()) {
+                Dprintf(FRED("Write binary trace failed: %s\n"), path.c_str());
+                return -1;
+            }
+            Dprintf(FGRN("Export %lu cpu blocks, %lu bytes to %s\n"), plans.size(), offset, path.c_str());
+            return 1;
+        }
+
+        template <class Record>
+        int ReadBlocks(const std::string& path, uint32_t record_type, std::map<int, std::vector<Record>>* per_cpu_data,
+                       std::vector<std::string>* event_names, int64_t* realtime_offset_ns) {
+            std::ifstream ifs(path, std::ios::in | std::ios::binary);
+            BinFileHeader file_hdr{};
+            if (!ifs.read((char*)&file_hdr, sizeof(file_hdr)) || memcmp(file_hdr.magic, MTMC_BIN_MAGIC, 8) != 0 ||
+                file_hdr.version != MTMC_BIN_VERSION || file_hdr.record_type != record_type ||
+                file_hdr.record_size != sizeof(Record)) {
+                Dprintf(FRED("Not a binary trace of record type %u: %s\n"), record_type, path.c_str());
+                return -1;
+            }
+
+            std::string names(file_hdr.names_bytes, '\0');
+            if (!ifs.read(&names[0], names.size())) return -1;
+            if (event_names) {
+                event_names->clear();
+                for (size_t pos = 0; event_names->size() < file_hdr.num_events && pos < names.size();) {
+                    event_names->emplace_back(names.c_str() + pos);
+                    pos += event_names->back().size() + 1;
+                }
+            }
+            *realtime_offset_ns = file_hdr.realtime_offset_ns;
+
+            per_cpu_data->clear();
+            for (uint64_t b = 0; b < file_hdr.num_blocks; ++b) {
+                BinBlockHeader hdr{};
+                if (!ifs.read((char*)&hdr, sizeof(hdr))) return -1;
+                auto& records = (*per_cpu_data)[hdr.cpu];
+                size_t old_size = records.size();
+                records.resize(old_size + hdr.num_records);
+                if (!ifs.read((char*)(records.data() + old_size), hdr.num_records * sizeof(Record))) return -1;
+            }
+            return 1;
+        }
+    }
+
+    int WriteCtxSwitchBinary(const std::string& path, const std::vector<EbpfCpuStorage>& cpu_storage,
+                             const std::vector<std::string>& event_names, int64_t realtime_offset_ns,
+                             int num_workers) {
+        std::vector<BlockPlan> plans;
+        for (int cpu = 0; cpu < (int)cpu_storage.size(); ++cpu) {
+            auto& storage = cpu_storage[cpu];
+            if (!storage.data || storage.Size() == 0) continue;
+            plans.push_back(BlockPlan{cpu, storage.Size(), 0, [&storage](uint64_t begin, uint64_t n, char* dst) {
+                auto records = (PmcData*)dst;
+                for (uint64_t j = 0; j < n; ++j) {
+                    records[j] = storage.At(begin + j).pmc_data;
+                }
+            }});
+        }
+        return WriteBlocks(path, BIN_RECORD_EBPF_CTX_SWITCH, sizeof(PmcData), event_names, realtime_offset_ns, plans,
+                           num_workers);
+    }
+
+    int ReadCtxSwitchBinary(const std::string& path, std::map<int, std::vector<PmcData>>* per_cpu_data,
+                            std::vector<std::string>* event_names, int64_t* realtime_offset_ns) {
+        return ReadBlocks(path, BIN_RECORD_EBPF_CTX_SWITCH, per_cpu_data, event_names, realtime_offset_ns);
+    }
+
+    int WriteSchedSwitchBinary(const std::string& path, const std::map<int, std::vector<SchedSwitchRecord>>& per_cpu_data,
+                               int64_t realtime_offset_ns, int num_workers) {
+        std::vector<BlockPlan> plans;
+        for (auto& cpu_data : per_cpu_data) {
+            auto& records = cpu_data.second;
+            if (records.empty()) continue;
+            plans.push_back(BlockPlan{cpu_data.first, records.size(), 0, [&records](uint64_t begin, uint64_t n, char* dst) {
+                memcpy(dst, records.data() + begin, n * sizeof(SchedSwitchRecord));
+            }});
+        }
+        return WriteBlocks(path, BIN_RECORD_SCHED_SWITCH, sizeof(SchedSwitchRecord), {}, realtime_offset_ns, plans,
+                           num_workers);
+    }
+
+    int ReadSchedSwitchBinary(const std::string& path, std::map<int, std::vector<SchedSwitchRecord>>* per_cpu_data,
+                              int64_t* realtime_offset_ns) {
+        return ReadBlocks(path, BIN_RECORD_SCHED_SWITCH, per_cpu_data, nullptr, realtime_offset_ns);
+    }
+}
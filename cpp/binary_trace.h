@@ -0,0 +1,111 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_BINARY_TRACE_H
+#define MTMC_BINARY_TRACE_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ebpf_common.h"
+
+namespace mtmc {
+
+    /*
+     * Self describing binary trace file. All fields are little endian.
+     *
+     *   BinFileHeader
+     *   num_events NUL terminated event names, names_bytes in total, padded to 8 bytes
+     *   num_blocks x (BinBlockHeader, num_records x record_size bytes)
+     *
+     * Timestamps in the records are raw. Add realtime_offset_ns to get CLOCK_REALTIME, the clock of the span logs.
+     */
+#define MTMC_BIN_MAGIC "MTMCBIN"
+#define MTMC_BIN_VERSION 1
+
+    enum BinRecordType : uint32_t {
+        BIN_RECORD_EBPF_CTX_SWITCH = 1,  // PmcData, one block per cpu
+        BIN_RECORD_SCHED_SWITCH = 2,     // SchedSwitchRecord, one block per cpu
+    };
+
+    struct BinFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_type;
+        uint32_t record_size;
+        uint32_t num_events;
+        int64_t realtime_offset_ns;
+        uint64_t num_blocks;
+        uint64_t names_bytes;
+    };
+
+    struct BinBlockHeader {
+        int32_t cpu;
+        uint32_t reserved;
+        uint64_t num_records;
+    };
+
+    // sched:sched_switch tracepoint sample
+    struct SchedSwitchRecord {
+        uint64_t ts;
+        int32_t cpu;
+        int32_t prev_tid;
+        int32_t next_tid;
+        int32_t reserved;
+        int64_t prev_state;
+        char prev_comm[16];
+        char next_comm[16];
+    };
+
+    inline uint64_t BinPad8(uint64_t bytes) {
+        return (bytes + 7) & ~uint64_t(7);
+    }
+
+    /**
+     * Write the kept context switch records of every cpu as BIN_RECORD_EBPF_CTX_SWITCH blocks. Block offsets are known
+     * up front, so the blocks are written in parallel with pwrite
+     * @param realtime_offset_ns: CLOCK_REALTIME - CLOCK_MONOTONIC, the clock of bpf_ktime_get_ns()
+     * @param num_workers: Number of writer threads. 0 for one per hardware thread
+     * @return 1 for success, -1 for failed
+     */
+    int WriteCtxSwitchBinary(const std::string& path, const std::vector<EbpfCpuStorage>& cpu_storage,
+                             const std::vector<std::string>& event_names, int64_t realtime_offset_ns,
+                             int num_workers = 0);
+
+    /**
+     * Read a file written by WriteCtxSwitchBinary
+     * @return 1 for success, -1 if the file can not be read or is not a context switch trace
+     */
+    int ReadCtxSwitchBinary(const std::string& path, std::map<int, std::vector<PmcData>>* per_cpu_data,
+                            std::vector<std::string>* event_names, int64_t* realtime_offset_ns);
+
+    /**
+     * Write the sched_switch records of every cpu as BIN_RECORD_SCHED_SWITCH blocks, in parallel as above
+     * @param realtime_offset_ns: Offset from the record timestamps to CLOCK_REALTIME
+     * @return 1 for success, -1 for failed
+     */
+    int WriteSchedSwitchBinary(const std::string& path, const std::map<int, std::vector<SchedSwitchRecord>>& per_cpu_data,
+                               int64_t realtime_offset_ns, int num_workers = 0);
+
+    /**
+     * Read a file written by WriteSchedSwitchBinary
+     * @return 1 for success, -1 if the file can not be read or is not a sched_switch trace
+     */
+    int ReadSchedSwitchBinary(const std::string& path, std::map<int, std::vector<SchedSwitchRecord>>* per_cpu_data,
+                              int64_t* realtime_offset_ns);
+}
+
+#endif //MTMC_BINARY_TRACE_H
@@ -0,0 +1,221 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "ctx_switch_join.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+namespace mtmc {
+
+    namespace {
+        // One side of a switch, seen from the thread
+        struct SwitchEvent {
+            uint64_t ts;
+            bool is_out;
+            bool preempted;
+            int cpu;
+            int group_id;
+            const uint64_t* pmc;
+        };
+
+        bool EventEarlier(const SwitchEvent& a, const SwitchEvent& b) {
+            return a.ts < b.ts;
+        }
+
+        bool RunEarlier(const RunqueueWait& a, const RunqueueWait& b) {
+            return a.run_ts < b.run_ts;
+        }
+    }
+
+    CtxSwitchJoin::CtxSwitchJoin(int64_t mono_to_real_ns, bool per_core_counters, int group_base) {
+        mono_to_real_ns_ = mono_to_real_ns;
+        per_core_counters_ = per_core_counters;
+        group_base_ = group_base;
+    }
+
+    void CtxSwitchJoin::AddSwitches(const std::map<int, std::vector<StoreData>>& per_cpu_data) {
+        std::unordered_map<int32_t, std::vector<SwitchEvent>> events;
+        for (auto& cpu_data : per_cpu_data) {
+            for (auto& data : cpu_data.second) {
+                auto& pmc_data = data.pmc_data;
+                uint64_t ts = pmc_data.time_stamp + mono_to_real_ns_;
+                // Pid 0 is the idle task
+                if (pmc_data.prev_pid != 0) {
+                    events[pmc_data.prev_pid].push_back(SwitchEvent{ts, true, pmc_data.prev_task_state == 0,
+                                                                    cpu_data.first, pmc_data.group_id,
+                                                                    pmc_data.pmc_reading});
+                }
+                if (pmc_data.curr_pid != 0) {
+                    events[pmc_data.curr_pid].push_back(SwitchEvent{ts, false, false, cpu_data.first,
+                                                                    pmc_data.group_id, pmc_data.pmc_reading});
+                }
+            }
+        }
+
+        for (auto& elem : events) {
+            auto& thread_events = elem.second;
+            std::sort(thread_events.begin(), thread_events.end(), EventEarlier);
+            auto& intervals = intervals_[elem.first];
+            bool open = false;
+            for (auto& evt : thread_events) {
+                if (evt.is_out) {
+                    // A second switch out means the switch in was lost. The earlier interval can not be trusted
+                    if (open) intervals.pop_back();
+                    intervals.emplace_back();
+                    auto& interval = intervals.back();
+                    interval.out_ts = evt.ts;
+                    interval.in_ts = UINT64_MAX;
+                    interval.out_cpu = evt.cpu;
+                    interval.in_cpu = -1;
+                    interval.preempted = evt.preempted;
+                    interval.group_id = evt.group_id;
+                    memcpy(interval.pmc_out, evt.pmc, sizeof(interval.pmc_out));
+                    open = true;
+                }
+                else if (open) {
+                    auto& interval = intervals.back();
+                    interval.in_ts = evt.ts;
+                    interval.in_cpu = evt.cpu;
+                    memcpy(interval.pmc_in, evt.pmc, sizeof(interval.pmc_in));
+                    open = false;
+                }
+            }
+        }
+    }
+
+    void CtxSwitchJoin::AddWakeups(const std::vector<EbpfWakeupData>& wakeups) {
+        for (auto& wakeup : wakeups) {
+            if (wakeup.run_ts < wakeup.waking_ts) continue;
+            wakeups_[wakeup.tid].push_back(RunqueueWait{wakeup.waking_ts + mono_to_real_ns_,
+                                                        wakeup.run_ts + mono_to_real_ns_, wakeup.waker_tid});
+        }
+        for (auto& elem : wakeups_) {
+            std::sort(elem.second.begin(), elem.second.end(), RunEarlier);
+        }
+    }
+
+    SpanCtxInfo CtxSwitchJoin::Join(const SingleProfile& span) const {
+        SpanCtxInfo info{};
+        int num_event = std::min(span.rd_ret_start.num_event, (int)(sizeof(info.pmc_delta) / sizeof(uint64_t)));
+        for (int j = 0; j < num_event; ++j) {
+            info.pmc_delta[j] = span.ret_end[j] - span.ret_start[j];
+        }
+        info.pmc_exclusive = !span.flag_bits.pmc_invalid;
+
+        // The thread pool thread picking the task up may have been waiting for a cpu since the fork
+        info.runqueue_ns = RunqueueNs((int32_t)span.tid, span.start_ts, span.end_ts, &info.num_wakeups);
+        uint64_t sched_ts = span.parent_info.task_sched_time;
+        if (sched_ts != 0 && sched_ts < span.start_ts) {
+            uint32_t num_sched_wakeups = 0;
+            info.sched_delay_ns = span.start_ts - sched_ts;
+            info.sched_runqueue_ns = RunqueueNs((int32_t)span.tid, sched_ts, span.start_ts, &num_sched_wakeups);
+        }
+
+        auto itr = intervals_.find((int32_t)span.tid);
+        if (itr == intervals_.end()) return info;
+        auto& intervals = itr->second;
+
+        // Intervals of a thread do not overlap, so in_ts is sorted as well
+        auto first = std::lower_bound(intervals.begin(), intervals.end(), span.start_ts,
+                                      [](const OffCpuInterval& interval, uint64_t ts) { return interval.in_ts <= ts; });
+        for (auto it = first; it != intervals.end() && it->out_ts < span.end_ts; ++it) {
+            uint64_t lo = std::max(it->out_ts, span.start_ts);
+            uint64_t hi = std::min(it->in_ts, span.end_ts);
+            if (hi > lo) info.off_cpu_ns += hi - lo;
+            if (it->out_ts < span.start_ts) continue;
+
+            if (it->preempted) ++info.num_preempted;
+            else ++info.num_blocked;
+
+            if (!per_core_counters_) continue;
+            // The core counted other tasks between the switch out and in. Only removable if it came back on that core,
+            // and the records counted the span's group
+            if (it->in_ts > span.end_ts || it->in_cpu != it->out_cpu || it->group_id + group_base_ != span.multiplex_idx) {
+                info.pmc_exclusive = false;
+                continue;
+            }
+            for (int j = 0; j < std::min(num_event, EBPF_NUM_PMC); ++j) {
+                uint64_t others = it->pmc_in[j] - it->pmc_out[j];
+                info.pmc_delta[j] = info.pmc_delta[j] > others ? info.pmc_delta[j] - others : 0;
+            }
+        }
+        return info;
+    }
+
+    int CtxSwitchJoin::Export(std::list<util::IndexVector<SingleProfile>>& profile_storage,
+                              const std::string& file) const {
+        std::ofstream resultfs(file, std::ios::out);
+        if (!resultfs.good()) {
+            Dprintf(FRED("Open file failed: %s\n"), file.c_str());
+            return -1;
+        }
+        for (auto& vec : profile_storage) {
+            for (size_t i = 0; i < vec.Size(); ++i) {
+                auto& span = vec[i];
+                if (!span.flag_bits.has_end_info) continue;
+                auto info = Join(span);
+                uint64_t dur = span.end_ts - span.start_ts;
+                resultfs << span.tid << "," << span.start_ts << "," << span.end_ts << "," << span.prefix << ","
+                         << (dur > info.off_cpu_ns ? dur - info.off_cpu_ns : 0) << "," << info.off_cpu_ns << ","
+                         << info.num_preempted << "," << info.num_blocked << "," << info.pmc_exclusive << ","
+                         << info.runqueue_ns << "," << info.num_wakeups << "," << info.sched_delay_ns << ","
+                         << info.sched_runqueue_ns << ",";
+                int num_event = std::min(span.rd_ret_start.num_event, (int)(sizeof(info.pmc_delta) / sizeof(uint64_t)));
+                for (int j = 0; j < num_event; ++j) {
+                    if (j) resultfs << "_";
+                    resultfs << info.pmc_delta[j];
+                }
+                resultfs << "\n";
+            }
+        }
+        return 1;
+    }
+
+    const std::vector<OffCpuInterval>* CtxSwitchJoin::Intervals(int32_t tid) const {
+        auto itr = intervals_.find(tid);
+        return itr == intervals_.end() ? nullptr : &itr->second;
+    }
+
+    const std::vector<RunqueueWait>* CtxSwitchJoin::Wakeups(int32_t tid) const {
+        auto itr = wakeups_.find(tid);
+        return itr == wakeups_.end() ? nullptr : &itr->second;
+    }
+
+    int64_t CtxSwitchJoin::MonoToRealOffsetNs() {
+        timespec mono{};
+        timespec real{};
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        clock_gettime(CLOCK_REALTIME, &real);
+        return ((int64_t)real.tv_sec - mono.tv_sec) * 1000 * 1000 * 1000 + ((int64_t)real.tv_nsec - mono.tv_nsec);
+    }
+
+    // ----------------------------------- Private ----------------------------------------
+
+    uint64_t CtxSwitchJoin::RunqueueNs(int32_t tid, uint64_t begin, uint64_t end, uint32_t* num_wakeups) const {
+        auto itr = wakeups_.find(tid);
+        if (itr == wakeups_.end()) return 0;
+        auto& waits = itr->second;
+        uint64_t ns = 0;
+        auto first = std::upper_bound(waits.begin(), waits.end(), begin,
+                                      [](uint64_t ts, const RunqueueWait& wait) { return ts < wait.run_ts; });
+        for (auto it = first; it != waits.end() && it->run_ts <= end; ++it) {
+            ns += it->run_ts - std::max(it->waking_ts, begin);
+            ++*num_wakeups;
+        }
+        return ns;
+    }
+}
@@ -0,0 +1,120 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_CTX_SWITCH_JOIN_H
+#define MTMC_CTX_SWITCH_JOIN_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mtmc_profiler.h"
+#include "ebpf_common.h"
+
+namespace mtmc {
+
+    // A thread switched out at out_ts and back in at in_ts. Timestamps are already in span time
+    struct OffCpuInterval {
+        uint64_t out_ts;
+        uint64_t in_ts;      // UINT64_MAX if the thread was not seen switching back in
+        int out_cpu;
+        int in_cpu;
+        bool preempted;      // Switched out while runnable. Otherwise it blocked
+        int group_id;        // Event group of the counters at the switch out
+        uint64_t pmc_out[EBPF_NUM_PMC];
+        uint64_t pmc_in[EBPF_NUM_PMC];
+    };
+
+    // A thread was runnable from waking_ts and switched in at run_ts. Timestamps are already in span time
+    struct RunqueueWait {
+        uint64_t waking_ts;
+        uint64_t run_ts;
+        int32_t waker_tid;
+    };
+
+    // Context switch information of one span
+    struct SpanCtxInfo {
+        uint64_t off_cpu_ns;
+        uint32_t num_preempted;
+        uint32_t num_blocked;
+        bool pmc_exclusive;            // pmc_delta only counts this thread. Other tasks' increments were removed
+        uint64_t runqueue_ns;          // Part of off_cpu_ns the thread was runnable after a wakeup, waiting for a cpu
+        uint32_t num_wakeups;
+        uint64_t sched_delay_ns;       // start_ts - task_sched_time. 0 if the span was not forked by GetParamsInfo()
+        uint64_t sched_runqueue_ns;    // Part of sched_delay_ns in the runqueue. The rest is queueing in the thread pool
+        uint64_t pmc_delta[16];        // Same order as SingleProfile::ret_start
+    };
+
+    /**
+     * Join the eBPF context switch records to the spans of the same thread. Off cpu intervals overlapping a span give
+     * its true on cpu time. With per core counters, the increments made by other tasks on the core while the thread
+     * was switched out are removed from the span's counter deltas. With the wakeup to run latencies, the time a thread
+     * waited in the runqueue is told apart from the rest of its off cpu time and of its scheduling delay.
+     *
+     * The eBPF counters are expected in the order of the span's events, ie. the sampler was attached to the per core
+     * fds of the same event group.
+     */
+    class CtxSwitchJoin {
+    public:
+        /**
+         * @param mono_to_real_ns: Offset from bpf_ktime_get_ns() to the span clock. See MonoToRealOffsetNs()
+         * @param per_core_counters: Span counters are per core, so other tasks' increments have to be removed
+         * @param group_base: multiplex_idx of the span for the records' group 0. The records count the groups of Init,
+         * which start at the stripe group
+         */
+        CtxSwitchJoin(int64_t mono_to_real_ns, bool per_core_counters, int group_base = 0);
+
+        /**
+         * Build the off cpu intervals of every thread from the per cpu switch records
+         */
+        void AddSwitches(const std::map<int, std::vector<StoreData>>& per_cpu_data);
+
+        /**
+         * Add the wakeup to run latencies of EbpfSampler::GetEbpfWakeupData, collected over the same period
+         */
+        void AddWakeups(const std::vector<EbpfWakeupData>& wakeups);
+
+        SpanCtxInfo Join(const SingleProfile& span) const;
+
+        /**
+         * Join every valid span and write one csv line per span:
+         * tid,start,end,prefix,on_cpu_ns,off_cpu_ns,preempted,blocked,exclusive,runqueue_ns,wakeups,sched_delay_ns,
+         * sched_runqueue_ns,delta_0_..._delta_n
+         * @return 1 for success, -1 for failed
+         */
+        int Export(std::list<util::IndexVector<SingleProfile>>& profile_storage, const std::string& file) const;
+
+        const std::vector<OffCpuInterval>* Intervals(int32_t tid) const;
+
+        const std::vector<RunqueueWait>* Wakeups(int32_t tid) const;
+
+        // CLOCK_REALTIME - CLOCK_MONOTONIC at the time of the call
+        static int64_t MonoToRealOffsetNs();
+
+    private:
+        int64_t mono_to_real_ns_;
+        bool per_core_counters_;
+        int group_base_;
+        std::unordered_map<int32_t, std::vector<OffCpuInterval>> intervals_;  // Sorted by out_ts
+        std::unordered_map<int32_t, std::vector<RunqueueWait>> wakeups_;      // Sorted by run_ts
+
+        // Sum of the runqueue waits of tid that ended in (begin, end]. Waits are clipped to begin
+        uint64_t RunqueueNs(int32_t tid, uint64_t begin, uint64_t end, uint32_t* num_wakeups) const;
+    };
+}
+
+#endif //MTMC_CTX_SWITCH_JOIN_H
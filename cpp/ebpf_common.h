@@ -15,12 +15,99 @@
 #ifndef MTMC_EBPF_COMMON_H
 #define MTMC_EBPF_COMMON_H
 
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
 namespace mtmc {
 
+// Size of the header the kernel puts before every ring buffer record
+#define EBPF_RINGBUF_HDR_BYTES 8
+// Max number of counters a record can carry. Kernel records only have the ones of EbpfPmcLayout
+#define EBPF_NUM_PMC 13
+// Bytes of a kernel record before its counters, the PmcData and EbpfSpanData fields up to pmc_reading / pmc_delta
+#define EBPF_RECORD_HDR_BYTES 32
+#define EBPF_SPAN_HDR_BYTES 64
+// Capacity of the in kernel filter maps
+#define EBPF_MAX_TARGET_TGIDS 64
+#define EBPF_MAX_TARGET_THREADS 65536
+// Capacity of the in kernel map of spans started but not ended yet
+#define EBPF_MAX_OPEN_SPANS 65536
+// Capacity of the in kernel map of threads woken up but not switched in yet. Least recently used ones are evicted
+#define EBPF_MAX_PENDING_WAKEUPS 65536
+// Capacity of the in kernel off cpu aggregation
+#define EBPF_MAX_OFFCPU_KEYS 65536
+
+    enum EbpfTransport : int {
+        EBPF_TRANSPORT_ARRAY = 0,   // Per cpu array polled every WeakUpIntvMs. Overflow is only detected afterwards
+        EBPF_TRANSPORT_RINGBUF = 1, // BPF ring buffer streamed with epoll wakeups. Requires Linux 5.8
+    };
+
+    enum EbpfOverflowPolicy : int {
+        EBPF_OVERFLOW_ROTATE = 0,   // Overwrite the oldest records of the cpu
+        EBPF_OVERFLOW_DROP = 1,     // Keep the oldest records and drop the new ones
+    };
+
     struct EbpfCtxScConfig {
         uint64_t PerCoreStorageLength = 1000; // Size of per core ring buffer
         uint64_t StorageMaxByte = 1e9; // Default maximum storage for all cpus in the main memory
-        uint64_t WeakUpIntvMs = 1000;
+        uint64_t WeakUpIntvMs = 1000;  // Poll interval of the array transport. Max wait of the ring buffer transport
+        int Transport = EBPF_TRANSPORT_ARRAY;
+        uint64_t RingBufBytes = 1 << 24; // Shared by all cpus. Rounded up to a power of 2 pages
+        uint64_t WakeupWatermark = 64;   // Pending records before the kernel wakes the collector up
+        pid_t TargetTgid = 0;            // Only keep switches in or out of this process. 0 for the calling process, -1 for all
+        bool FilterThreads = false;      // Only keep switches of the threads added by EbpfCtxScAddThread
+        int OverflowPolicy = EBPF_OVERFLOW_ROTATE;  // What to do once StorageMaxByte is used. Lost records are counted
+        std::string SpanUsdtBinary;      // Capture spans from the mtmc USDT probes of this binary (eg. libpfc.so). Empty for off
+        uint64_t SpanStorageMaxByte = 1e8;  // Spans past it are dropped and counted
+        bool WakeupLatency = false;      // Record the wakeup to run latency of the filtered threads. Ring buffer transport only
+        uint64_t WakeupStorageMaxByte = 1e8;  // Wakeups past it are dropped and counted
+        bool OffCpuStacks = false;       // Aggregate the blocked time of the filtered threads by stack and active span
+        uint64_t OffCpuMaxStacks = 16384;   // Distinct user and kernel stacks kept. Stacks past it are lost, not their time
+    };
+
+    // Blocked time aggregated in kernel by thread, active span and the stacks it blocked at, see OffCpuStacks. The active
+    // span is only known if the span USDT probes are attached, ie. SpanUsdtBinary is set
+    struct EbpfOffCpuStack {
+        uint64_t span_start_ts;     // bpf_ktime_get_ns() at span_start of the active span. 0 if none
+        uint64_t span_hash_id;
+        uint32_t tid;
+        uint32_t tgid;
+        int32_t user_stack_id;      // Negative if the stack could not be stored
+        int32_t kernel_stack_id;
+        uint64_t blocked_ns;
+        uint64_t count;
+    };
+
+    // A thread woken up by sched_waking / sched_wakeup and its next switch in. run_ts - waking_ts is the time it was
+    // runnable but waited for a cpu
+    struct EbpfWakeupData {
+        uint64_t waking_ts;         // The waker started the wakeup. bpf_ktime_get_ns(), CLOCK_MONOTONIC
+        uint64_t wakeup_ts;         // The thread was put on the runqueue. 0 if not seen
+        uint64_t run_ts;            // The thread switched in
+        int32_t tid;
+        int32_t waker_tid;          // Current task at sched_waking. For irq wakeups the interrupted one
+        int32_t target_cpu;         // Runqueue it was put on
+        int32_t run_cpu;
+    };
+
+    // A span captured in kernel from the span_start and span_end USDT probes, see mtmc_probes.h
+    struct EbpfSpanData {
+        uint64_t start_ts;          // bpf_ktime_get_ns(), CLOCK_MONOTONIC
+        uint64_t end_ts;
+        uint64_t hash_id;
+        uint64_t parent_hash_id;
+        int64_t int_prefix;
+        int32_t tid;
+        int32_t parent_tid;
+        int32_t depth;
+        int32_t start_cpu;
+        int32_t end_cpu;            // Per core counter deltas are only valid if it is start_cpu
+        int32_t group_id;           // Event group at the start. -1 if the group switched within the span
+        uint64_t pmc_delta[EBPF_NUM_PMC];
     };
 
     struct PmcData {
@@ -28,8 +115,28 @@ namespace mtmc {
         pid_t prev_pid;
         pid_t curr_pid;
         int core_id;
+        int group_id;               // Event group the counters belong to
         uint64_t prev_task_state;
-        uint64_t pmc_reading[13];
+        uint64_t pmc_reading[EBPF_NUM_PMC];
+    };
+
+    // Counters read by the eBPF program. Generated from the profiler's event groups, see PerfmonCollector
+    struct EbpfPmcLayout {
+        std::vector<int> group_events;  // Number of events of every group
+        bool multiplexed = false;       // One group at a time, switched by the perfmon agents. Otherwise all are read
+
+        // Counters in a kernel record
+        int RecordPmcs() const {
+            int num = 0;
+            for (int n : group_events) {
+                num = multiplexed ? std::max(num, n) : num + n;
+            }
+            return std::min(num, EBPF_NUM_PMC);
+        }
+
+        uint64_t RecordBytes() const {
+            return EBPF_RECORD_HDR_BYTES + RecordPmcs() * sizeof(uint64_t);
+        }
     };
 
     struct StoreData {
@@ -38,6 +145,28 @@ namespace mtmc {
         PmcData pmc_data;
     };
 
+    // Preallocated records of one cpu. Only the collector thread writes it
+    struct EbpfCpuStorage {
+        std::unique_ptr<StoreData[]> data;
+        uint64_t capacity = 0;
+        uint64_t num_written = 0;       // Records ever written. The newest min(num_written, capacity) are kept
+        uint64_t last_idx = 0;          // Array transport: perfmon_data index after the last copied record
+        uint64_t last_warp_around = 0;
+
+        uint64_t Size() const {
+            return std::min(num_written, capacity);
+        }
+
+        // Slot of the oldest kept record
+        uint64_t Begin() const {
+            return num_written > capacity ? num_written % capacity : 0;
+        }
+
+        // i-th kept record, oldest first
+        const StoreData& At(uint64_t i) const {
+            return data[(Begin() + i) % capacity];
+        }
+    };
 }
 
 #endif //MTMC_EBPF_COMMON_H
@@ -13,15 +13,53 @@
 //        limitations under the License.
 
 #include "ebpf_sampler.h"
+#include "binary_trace.h"
+#include "ctx_switch_join.h"
+
+#include <cerrno>
+#include <unistd.h>
 
 namespace mtmc {
 
     EbpfSampler* EbpfSampler::ebpf_instance_ = nullptr;
 
+    namespace {
+        // Paired with the next switch in, see WAKEUP_LATENCY in the program
+        const char* const WAKEUP_TRACEPOINTS[] = {"sched_waking", "sched_wakeup", "sched_wakeup_new"};
+
+        // Key and value of the offcpu_time map
+        struct OffCpuKey {
+            uint64_t span_start_ts;
+            uint64_t span_hash_id;
+            uint32_t tid;
+            uint32_t tgid;
+            int32_t user_stack_id;
+            int32_t kernel_stack_id;
+        };
+
+        struct OffCpuVal {
+            uint64_t blocked_ns;
+            uint64_t count;
+        };
+    }
+
     EbpfSampler::EbpfSampler() : ebpf_collector_(nullptr) {}
 
     int EbpfSampler::EbpfCtxScInit(EbpfCtxScConfig ebpf_cfg, const std::vector<int> &perf_cpus,
                                    std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> cpu_fd_pairs) {
+        // Every group of the fd pairs is counted together
+        EbpfPmcLayout layout;
+        for (auto& elem : cpu_fd_pairs) {
+            int group = elem.first.first;
+            if ((int)layout.group_events.size() <= group) layout.group_events.resize(group + 1, 0);
+            layout.group_events[group] = std::max(layout.group_events[group], elem.first.second + 1);
+        }
+        return EbpfCtxScInit(ebpf_cfg, perf_cpus, std::move(cpu_fd_pairs), layout);
+    }
+
+    int EbpfSampler::EbpfCtxScInit(EbpfCtxScConfig ebpf_cfg, const std::vector<int> &perf_cpus,
+                                   std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> cpu_fd_pairs,
+                                   const EbpfPmcLayout& layout) {
 
         // Make sure Init and Close only called by one thread at a time
         if (running_state_.load() > EBPF_STATE::UNINITIALIZED) {
@@ -35,53 +73,336 @@ namespace mtmc {
         Dprintf(FGRN("[EBPF COLLECTOR] Start Init EBPF Ctx\n"));
 
         cpu_fd_pairs_ = std::move(cpu_fd_pairs);
+        layout_ = layout;
+        record_bytes_ = layout_.RecordBytes();
         auto& cpu_onlines = perf_cpus;
 
-        // defines for number of event
-        std::string env_df = "-DNUM_EVTS=" + std::to_string(cpu_fd_pairs_.size());
+        // Counters in a record. The struct and the reads are generated for exactly these
+        std::string env_df = "-DRECORD_PMCS=" + std::to_string(layout_.RecordPmcs());
 
         // define length of percpu array perfmon_data
         const uint64_t EBPF_MAX_PERCORE_LENGTH = ebpf_cfg.PerCoreStorageLength;
         std::string datalen_df = "-DPERCPU_ARRAY_LENGTH=" +std::to_string(EBPF_MAX_PERCORE_LENGTH);
 
         // Initialize and register BPF
-        const std::string BPF_PROGRAM = R"(
+        const std::string BPF_PROGRAM = std::string(R"(
 #include <linux/sched.h>
 #include <uapi/linux/ptrace.h>
 
-// -- New
-struct pmc_data {
-    u64 time_stamp;
-    pid_t prev_pid;
-    pid_t curr_pid;
-    int core_id;
-    u64 prev_task_state;
-    u64 pmc_reading[13];
-};
-
-BPF_PERF_ARRAY(inst, MAX_CPUS);
-
-BPF_PERF_ARRAY(PMC0, MAX_CPUS);
-BPF_PERF_ARRAY(PMC1, MAX_CPUS);
-BPF_PERF_ARRAY(PMC2, MAX_CPUS);
-BPF_PERF_ARRAY(PMC3, MAX_CPUS);
-BPF_PERF_ARRAY(PMC4, MAX_CPUS);
-BPF_PERF_ARRAY(PMC5, MAX_CPUS);
-BPF_PERF_ARRAY(PMC6, MAX_CPUS);
-BPF_PERF_ARRAY(PMC7, MAX_CPUS);
-BPF_PERF_ARRAY(PMC8, MAX_CPUS);
-BPF_PERF_ARRAY(PMC9, MAX_CPUS);
-BPF_PERF_ARRAY(PMC10, MAX_CPUS);
-BPF_PERF_ARRAY(PMC11, MAX_CPUS);
-BPF_PERF_ARRAY(PMC12, MAX_CPUS);
-BPF_PERF_ARRAY(PMC13, MAX_CPUS);
-BPF_PERF_ARRAY(PMC14, MAX_CPUS);
-BPF_PERF_ARRAY(PMC15, MAX_CPUS);
+)") + GeneratePmcSource(layout_) + R"(
+#ifdef FILTER_TGID
+BPF_HASH(target_tgids, u32, u8, MAX_TARGET_TGIDS);
+#endif
+#ifdef FILTER_THREADS
+BPF_HASH(target_threads, u32, u8, MAX_TARGET_THREADS);
+#endif
 
+#ifdef USE_RINGBUF
+BPF_RINGBUF_OUTPUT(events, RINGBUF_PAGES);
+BPF_PERCPU_ARRAY(rb_stats, u64, 4); // [[SUBMITTED],[DROPPED],[SPAN_DROPPED],[WAKEUP_DROPPED]]
+#else
 BPF_PERCPU_ARRAY(counter, u64, 2); // [[CNTR_IDX],[WRAP_AROUND]]
 BPF_PERCPU_ARRAY(perfmon_data, struct pmc_data, PERCPU_ARRAY_LENGTH);
+#endif
 // -- New
 
+static __always_inline void fill_pmc_data(struct pmc_data* pmc_data_ptr, int cur_cpu, pid_t prev_pid, pid_t cur_pid,
+                                          long state) {
+    pmc_data_ptr->group_id = read_pmcs(pmc_data_ptr->pmc_reading, cur_cpu);
+    pmc_data_ptr->time_stamp = bpf_ktime_get_ns();
+    pmc_data_ptr->curr_pid = cur_pid;
+    pmc_data_ptr->prev_pid = prev_pid;
+    pmc_data_ptr->core_id = cur_cpu;
+    pmc_data_ptr->prev_task_state = state;
+}
+
+#ifdef SPAN_USDT
+// Spans from the mtmc USDT probes. Counters are read at both ends, so no user space buffer is needed
+struct span_open {
+    u64 start_ts;
+    u64 hash_id;
+    u64 parent_hash_id;
+    s64 int_prefix;
+    s32 parent_tid;
+    s32 start_cpu;
+    s32 group_id;
+    u64 pmc_start[RECORD_PMCS];
+};
+
+struct span_data {
+    u64 start_ts;
+    u64 end_ts;
+    u64 hash_id;
+    u64 parent_hash_id;
+    s64 int_prefix;
+    s32 tid;
+    s32 parent_tid;
+    s32 depth;
+    s32 start_cpu;
+    s32 end_cpu;
+    s32 group_id;
+    u64 pmc_delta[RECORD_PMCS];
+};
+
+BPF_HASH(open_spans, u64, struct span_open, MAX_OPEN_SPANS);
+BPF_RINGBUF_OUTPUT(span_events, RINGBUF_PAGES);
+
+#ifdef OFFCPU_STACKS
+// Innermost open span of every thread. Blocked time is attributed to it
+struct active_span_id {
+    u64 start_ts;
+    u64 hash_id;
+};
+
+// Threads that exit within a span leave their entry behind, so the least recently used ones are evicted
+BPF_TABLE("lru_hash", u32, struct active_span_id, active_span, MAX_OPEN_SPANS);
+#endif
+
+// (tid, depth) identifies an open span
+static __always_inline u64 span_key(u64 tid, u64 depth) {
+    return (tid << 16) | (depth & 0xffff);
+}
+
+int on_span_start(struct pt_regs *ctx) {
+    u64 tid = 0, depth = 0, parent_tid = 0;
+    struct span_open span = {};
+    bpf_usdt_readarg(1, ctx, &tid);
+    bpf_usdt_readarg(2, ctx, &depth);
+    bpf_usdt_readarg(3, ctx, &span.hash_id);
+    bpf_usdt_readarg(4, ctx, &parent_tid);
+    bpf_usdt_readarg(5, ctx, &span.parent_hash_id);
+    bpf_usdt_readarg(6, ctx, &span.int_prefix);
+    span.parent_tid = parent_tid;
+    span.start_cpu = bpf_get_smp_processor_id();
+    span.group_id = read_pmcs(span.pmc_start, span.start_cpu);
+    span.start_ts = bpf_ktime_get_ns();
+    u64 key = span_key(tid, depth);
+    open_spans.update(&key, &span);
+#ifdef OFFCPU_STACKS
+    u32 active_tid = tid;
+    struct active_span_id active = {span.start_ts, span.hash_id};
+    active_span.update(&active_tid, &active);
+#endif
+    return 0;
+}
+
+int on_span_end(struct pt_regs *ctx) {
+    int SPAN_DROPPED = 2;
+    u64 pmc_end[RECORD_PMCS] = {};
+    int end_cpu = bpf_get_smp_processor_id();
+    int end_group = read_pmcs(pmc_end, end_cpu);
+    u64 end_ts = bpf_ktime_get_ns();
+
+    u64 tid = 0;
+    s64 depth = -1;
+    bpf_usdt_readarg(1, ctx, &tid);
+    bpf_usdt_readarg(2, ctx, &depth);
+    if (depth < 0)
+        return 0;
+#ifdef OFFCPU_STACKS
+    // The enclosing span is active again
+    u32 active_tid = tid;
+    u64 parent_key = span_key(tid, depth - 1);
+    struct span_open* parent = depth > 0 ? open_spans.lookup(&parent_key) : NULL;
+    if (parent) {
+        struct active_span_id active = {parent->start_ts, parent->hash_id};
+        active_span.update(&active_tid, &active);
+    }
+    else {
+        active_span.delete(&active_tid);
+    }
+#endif
+    u64 key = span_key(tid, depth);
+    struct span_open* span = open_spans.lookup(&key);
+    if (!span)
+        return 0;
+
+    struct span_data* out = span_events.ringbuf_reserve(sizeof(struct span_data));
+    if (!out) {
+        rb_stats.increment(SPAN_DROPPED);
+        open_spans.delete(&key);
+        return 0;
+    }
+    out->start_ts = span->start_ts;
+    out->end_ts = end_ts;
+    out->hash_id = span->hash_id;
+    out->parent_hash_id = span->parent_hash_id;
+    out->int_prefix = span->int_prefix;
+    out->tid = tid;
+    out->parent_tid = span->parent_tid;
+    out->depth = depth;
+    out->start_cpu = span->start_cpu;
+    out->end_cpu = end_cpu;
+    out->group_id = end_group == span->group_id ? end_group : -1;
+#pragma unroll
+    for (int j = 0; j < RECORD_PMCS; ++j) {
+        out->pmc_delta[j] = pmc_end[j] - span->pmc_start[j];
+    }
+    span_events.ringbuf_submit(out, 0);
+    open_spans.delete(&key);
+    return 0;
+}
+#endif
+
+#ifdef WAKEUP_LATENCY
+// Wakeups are paired with the next switch in of the thread, so the runqueue wait is measured in kernel
+struct wakeup_pending {
+    u64 waking_ts;
+    u64 wakeup_ts;
+    s32 waker_tid;
+    s32 target_cpu;
+};
+
+struct wakeup_data {
+    u64 waking_ts;
+    u64 wakeup_ts;
+    u64 run_ts;
+    s32 tid;
+    s32 waker_tid;
+    s32 target_cpu;
+    s32 run_cpu;
+};
+
+BPF_TABLE("lru_hash", u32, struct wakeup_pending, pending_wakeups, MAX_PENDING_WAKEUPS);
+BPF_RINGBUF_OUTPUT(wakeup_events, RINGBUF_PAGES);
+
+static __always_inline int wakeup_start(u32 tid, int target_cpu, bool is_new) {
+#ifdef FILTER_THREADS
+    if (!target_threads.lookup(&tid))
+        return 0;
+#endif
+    struct wakeup_pending pending = {};
+    pending.waking_ts = bpf_ktime_get_ns();
+    pending.wakeup_ts = is_new ? pending.waking_ts : 0;
+    pending.waker_tid = bpf_get_current_pid_tgid();
+    pending.target_cpu = target_cpu;
+    pending_wakeups.update(&tid, &pending);
+    return 0;
+}
+
+TRACEPOINT_PROBE(sched, sched_waking) {
+    return wakeup_start(args->pid, args->target_cpu, false);
+}
+
+// New threads are not woken up, they are put on the runqueue at once
+TRACEPOINT_PROBE(sched, sched_wakeup_new) {
+    return wakeup_start(args->pid, args->target_cpu, true);
+}
+
+TRACEPOINT_PROBE(sched, sched_wakeup) {
+    u32 tid = args->pid;
+    struct wakeup_pending* pending = pending_wakeups.lookup(&tid);
+    if (pending) {
+        pending->wakeup_ts = bpf_ktime_get_ns();
+        pending->target_cpu = args->target_cpu;
+    }
+    return 0;
+}
+
+static __always_inline void wakeup_end(u32 prev_tid, long prev_state, u32 cur_tid, int cur_cpu, u64 cur_ts) {
+    int WAKEUP_DROPPED = 3;
+    // A preempted thread was runnable all along, a wakeup seen before is stale
+    if (prev_state == 0)
+        pending_wakeups.delete(&prev_tid);
+
+    struct wakeup_pending* pending = pending_wakeups.lookup(&cur_tid);
+    if (!pending)
+        return;
+#ifdef FILTER_TGID
+    u32 cur_tgid = bpf_get_current_pid_tgid() >> 32;
+    if (!target_tgids.lookup(&cur_tgid)) {
+        pending_wakeups.delete(&cur_tid);
+        return;
+    }
+#endif
+    struct wakeup_data* out = wakeup_events.ringbuf_reserve(sizeof(struct wakeup_data));
+    if (out) {
+        out->waking_ts = pending->waking_ts;
+        out->wakeup_ts = pending->wakeup_ts;
+        out->run_ts = cur_ts;
+        out->tid = cur_tid;
+        out->waker_tid = pending->waker_tid;
+        out->target_cpu = pending->target_cpu;
+        out->run_cpu = cur_cpu;
+        wakeup_events.ringbuf_submit(out, 0);
+    }
+    else {
+        rb_stats.increment(WAKEUP_DROPPED);
+    }
+    pending_wakeups.delete(&cur_tid);
+}
+#endif
+
+#ifdef OFFCPU_STACKS
+struct offcpu_key {
+    u64 span_start_ts;
+    u64 span_hash_id;
+    u32 tid;
+    u32 tgid;
+    s32 user_stack_id;
+    s32 kernel_stack_id;
+};
+
+struct offcpu_val {
+    u64 blocked_ns;
+    u64 count;
+};
+
+BPF_TABLE("lru_hash", u32, u64, offcpu_start, MAX_OFFCPU_KEYS);
+BPF_HASH(offcpu_time, struct offcpu_key, struct offcpu_val, MAX_OFFCPU_KEYS);
+BPF_STACK_TRACE(offcpu_stacks, MAX_OFFCPU_STACKS);
+BPF_PERCPU_ARRAY(offcpu_stats, u64, 1); // [[DROPPED]]
+
+static __always_inline bool offcpu_target(u32 tid, u32 tgid) {
+#ifdef FILTER_TGID
+    if (!target_tgids.lookup(&tgid))
+        return false;
+#endif
+#ifdef FILTER_THREADS
+    if (!target_threads.lookup(&tid))
+        return false;
+#endif
+    return tid != 0;
+}
+
+static __always_inline void offcpu_switch(struct pt_regs *ctx, u32 prev_tid, u32 prev_tgid, long prev_state,
+                                          u64 cur_pid_tgid, u64 cur_ts) {
+    int DROPPED = 0;
+    // Only blocked time is attributed. A preempted thread did not wait for anything
+    if (prev_state != 0 && offcpu_target(prev_tid, prev_tgid))
+        offcpu_start.update(&prev_tid, &cur_ts);
+
+    u32 cur_tid = cur_pid_tgid;
+    u64* start_ts = offcpu_start.lookup(&cur_tid);
+    if (!start_ts)
+        return;
+    u64 blocked_ns = cur_ts - *start_ts;
+    offcpu_start.delete(&cur_tid);
+
+    // The thread is still in schedule(), so its stacks are where it blocked
+    struct offcpu_key key = {};
+    key.tid = cur_tid;
+    key.tgid = cur_pid_tgid >> 32;
+    key.user_stack_id = offcpu_stacks.get_stackid(ctx, BPF_F_USER_STACK);
+    key.kernel_stack_id = offcpu_stacks.get_stackid(ctx, 0);
+#ifdef SPAN_USDT
+    struct active_span_id* span = active_span.lookup(&cur_tid);
+    if (span) {
+        key.span_start_ts = span->start_ts;
+        key.span_hash_id = span->hash_id;
+    }
+#endif
+    struct offcpu_val zero = {};
+    struct offcpu_val* val = offcpu_time.lookup_or_try_init(&key, &zero);
+    if (!val) {
+        offcpu_stats.increment(DROPPED);
+        return;
+    }
+    __sync_fetch_and_add(&val->blocked_ns, blocked_ns);
+    __sync_fetch_and_add(&val->count, 1);
+}
+#endif
+
 int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
   pid_t prev_pid = prev->pid;
   pid_t cur_pid = bpf_get_current_pid_tgid();
@@ -94,6 +415,43 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
 //    if (state == 0x0001)
 //        return 0;
 
+#ifdef WAKEUP_LATENCY
+    // Before the filters below, the thread filter was already applied at the wakeup
+    wakeup_end(prev_pid, state, cur_pid, cur_cpu, cur_ts);
+#endif
+#ifdef OFFCPU_STACKS
+    offcpu_switch(ctx, prev_pid, prev->tgid, state, bpf_get_current_pid_tgid(), cur_ts);
+#endif
+
+    // Only switches involving the profiled process or threads take space and collector time
+#ifdef FILTER_TGID
+    u32 prev_tgid = prev->tgid;
+    u32 cur_tgid = bpf_get_current_pid_tgid() >> 32;
+    if (!target_tgids.lookup(&prev_tgid) && !target_tgids.lookup(&cur_tgid))
+        return 0;
+#endif
+#ifdef FILTER_THREADS
+    u32 prev_tid = prev_pid;
+    u32 cur_tid = cur_pid;
+    if (!target_threads.lookup(&prev_tid) && !target_threads.lookup(&cur_tid))
+        return 0;
+#endif
+
+#ifdef USE_RINGBUF
+    // Reserve in place and submit. A full ring buffer is counted instead of overwriting older records
+    int SUBMITTED = 0;
+    int DROPPED = 1;
+    struct pmc_data* pmc_data_ptr = events.ringbuf_reserve(sizeof(struct pmc_data));
+    if (!pmc_data_ptr) {
+        rb_stats.increment(DROPPED);
+        return 0;
+    }
+    fill_pmc_data(pmc_data_ptr, cur_cpu, prev_pid, cur_pid, state);
+    rb_stats.increment(SUBMITTED);
+    // Only wake the collector up once enough records are pending
+    u64 pending = events.ringbuf_query(BPF_RB_AVAIL_DATA);
+    events.ringbuf_submit(pmc_data_ptr, pending >= WAKEUP_WATERMARK_BYTES ? BPF_RB_FORCE_WAKEUP : BPF_RB_NO_WAKEUP);
+#else
     // -- New
     int CNTR_IDX = 0; // Current index in the perfmon_data. When reading, the available data should be [0, CNTR_IDX) [CNTR_IDX', PERCPU_ARRAY_LENGTH)
     int WRAP_AROUND = 1; // How many times the PERCPU_ARRAY has wrapped around
@@ -104,24 +462,7 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
         int store_idx_int = (int)(*store_idx_ptr); // Cast int here since it needs 64bit alignment
         pmc_data_ptr = perfmon_data.lookup(&store_idx_int);
         if (pmc_data_ptr) {
-            if (NUM_EVTS > 0) pmc_data_ptr->pmc_reading[0] = PMC0.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 1) pmc_data_ptr->pmc_reading[1] = PMC1.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 2) pmc_data_ptr->pmc_reading[2] = PMC2.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 3) pmc_data_ptr->pmc_reading[3] = PMC3.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 4) pmc_data_ptr->pmc_reading[4] = PMC4.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 5) pmc_data_ptr->pmc_reading[5] = PMC5.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 6) pmc_data_ptr->pmc_reading[6] = PMC6.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 7) pmc_data_ptr->pmc_reading[7] = PMC7.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 8) pmc_data_ptr->pmc_reading[8] = PMC8.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 9) pmc_data_ptr->pmc_reading[9] = PMC9.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 10) pmc_data_ptr->pmc_reading[10] = PMC10.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 11) pmc_data_ptr->pmc_reading[11] = PMC11.perf_read(cur_cpu); // PMC read
-            if (NUM_EVTS > 12) pmc_data_ptr->pmc_reading[12] = PMC12.perf_read(cur_cpu); // PMC read
-            pmc_data_ptr->time_stamp = bpf_ktime_get_ns();
-            pmc_data_ptr->curr_pid = cur_pid;
-            pmc_data_ptr->prev_pid = prev_pid;
-            pmc_data_ptr->core_id = cur_cpu;
-            pmc_data_ptr->prev_task_state = state;
+            fill_pmc_data(pmc_data_ptr, cur_cpu, prev_pid, cur_pid, state);
         }
         if (*store_idx_ptr == PERCPU_ARRAY_LENGTH - 1) {
             u64 val_to_update = 0;
@@ -134,28 +475,103 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
     }
 
     // -- New -- End
+#endif
 
   return 0;
 }
 )";
         std::vector<std::string> cflags = {"-DMAX_CPUS="+std::to_string(cpu_onlines.size()), env_df, datalen_df};
-        auto init_res = bpf_.init(BPF_PROGRAM, cflags);
+        if (ebpf_cfg.TargetTgid != -1) {
+            cflags.emplace_back("-DFILTER_TGID");
+            cflags.emplace_back("-DMAX_TARGET_TGIDS=" + std::to_string(EBPF_MAX_TARGET_TGIDS));
+        }
+        if (ebpf_cfg.FilterThreads) {
+            cflags.emplace_back("-DFILTER_THREADS");
+            cflags.emplace_back("-DMAX_TARGET_THREADS=" + std::to_string(EBPF_MAX_TARGET_THREADS));
+        }
+        if (ebpf_cfg.Transport == EBPF_TRANSPORT_RINGBUF) {
+            // Ring buffer size must be a power of 2 number of pages
+            uint64_t pages = 1;
+            while (pages * getpagesize() < ebpf_cfg.RingBufBytes) pages <<= 1;
+            cflags.emplace_back("-DUSE_RINGBUF");
+            cflags.emplace_back("-DRINGBUF_PAGES=" + std::to_string(pages));
+            cflags.emplace_back("-DWAKEUP_WATERMARK_BYTES=" +
+                                std::to_string(ebpf_cfg.WakeupWatermark * (record_bytes_ + EBPF_RINGBUF_HDR_BYTES)));
+        }
+        // The span probes share the ring buffer poller of the collector thread
+        span_usdt_ = !ebpf_cfg.SpanUsdtBinary.empty();
+        std::vector<ebpf::USDT> usdts;
+        if (span_usdt_) {
+            if (ebpf_cfg.Transport != EBPF_TRANSPORT_RINGBUF) {
+                Dprintf(FRED("[EBPF COLLECTOR] Span USDT probes require the ring buffer transport\n"));
+                return -1;
+            }
+            pid_t span_pid = ebpf_cfg.TargetTgid == 0 ? getpid() : ebpf_cfg.TargetTgid;
+            cflags.emplace_back("-DSPAN_USDT");
+            cflags.emplace_back("-DMAX_OPEN_SPANS=" + std::to_string(EBPF_MAX_OPEN_SPANS));
+            usdts.emplace_back(ebpf_cfg.SpanUsdtBinary, span_pid, "mtmc", "span_start", "on_span_start");
+            usdts.emplace_back(ebpf_cfg.SpanUsdtBinary, span_pid, "mtmc", "span_end", "on_span_end");
+        }
+        wakeup_latency_ = ebpf_cfg.WakeupLatency;
+        if (wakeup_latency_) {
+            if (ebpf_cfg.Transport != EBPF_TRANSPORT_RINGBUF) {
+                Dprintf(FRED("[EBPF COLLECTOR] Wakeup latency requires the ring buffer transport\n"));
+                return -1;
+            }
+            cflags.emplace_back("-DWAKEUP_LATENCY");
+            cflags.emplace_back("-DMAX_PENDING_WAKEUPS=" + std::to_string(EBPF_MAX_PENDING_WAKEUPS));
+        }
+        // Aggregated in kernel, so it works with either transport. Spans are only known with the span probes
+        offcpu_stacks_ = ebpf_cfg.OffCpuStacks;
+        if (offcpu_stacks_) {
+            cflags.emplace_back("-DOFFCPU_STACKS");
+            cflags.emplace_back("-DMAX_OFFCPU_KEYS=" + std::to_string(EBPF_MAX_OFFCPU_KEYS));
+            cflags.emplace_back("-DMAX_OFFCPU_STACKS=" + std::to_string(ebpf_cfg.OffCpuMaxStacks));
+            if (!span_usdt_) {
+                Dprintf(FYEL("[EBPF COLLECTOR] Off cpu stacks without SpanUsdtBinary are only keyed by thread\n"));
+            }
+        }
+        auto init_res = bpf_.init(BPF_PROGRAM, cflags, usdts);
         if (!init_res.ok()) {
             Dprintf(FRED("%s\n"), init_res.msg().c_str());
             return -1;
         }
 
+        // Fill the filter maps before the probe is attached. Threads registered earlier are pushed now
+        {
+            std::lock_guard<std::mutex> filter_lck(filter_mux_);
+            filter_tgid_ = ebpf_cfg.TargetTgid != -1;
+            filter_threads_ = ebpf_cfg.FilterThreads;
+            filter_ready_ = true;
+            if (filter_tgid_) {
+                uint32_t tgid = ebpf_cfg.TargetTgid == 0 ? getpid() : ebpf_cfg.TargetTgid;
+                uint8_t one = 1;
+                auto tgids = bpf_.get_hash_table<uint32_t, uint8_t>("target_tgids");
+                if (!tgids.update_value(tgid, one).ok()) {
+                    Dprintf(FRED("[EBPF COLLECTOR] Failed to set target tgid %u\n"), tgid);
+                    return -1;
+                }
+            }
+            if (filter_threads_) {
+                for (auto tid : target_threads_) {
+                    UpdateThreadFilter(tid, true);
+                }
+            }
+        }
+
         int cntr = 0;
         for (auto & single_event_cpu_fd_pair : cpu_fd_pairs_) {
-            std::cout << single_event_cpu_fd_pair.second.size() << std::endl;
-            auto status = bpf_.attach_curr_perffd("PMC"+std::to_string(cntr),single_event_cpu_fd_pair.second);
+            // Events past EBPF_NUM_PMC have no array in the program
+            auto name = PmcArrayName(single_event_cpu_fd_pair.first.first, single_event_cpu_fd_pair.first.second);
+            if (name.empty()) continue;
+            auto status = bpf_.attach_curr_perffd(name, single_event_cpu_fd_pair.second);
             if (!status.ok()) {
                 Dprintf("%s\n", status.msg().c_str());
                 return -1;
             }
             cntr += 1;
         }
-        std::cout << cntr << std::endl;
+        Dprintf(FCYN("[EBPF COLLECTOR] %d counters attached, %lu bytes per record\n"), cntr, record_bytes_);
 
         auto attach_res = bpf_.attach_kprobe("finish_task_switch", "task_switch_event");
         if (!attach_res.ok()) {
@@ -170,57 +586,90 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
         const uint64_t kfull_data_bytes = sizeof(StoreData);
         const uint64_t kper_core_length = ebpf_cfg.StorageMaxByte/((kfull_data_bytes)*cpu_onlines.size());
 
-        Dprintf(FCYN("Kper_core_length: %lu, kper_data_pmc_bytes: %lu, kmeta_data_bytes: %lu\n"), kper_core_length,
-                kper_data_pmc_bytes);
+        Dprintf(FCYN("Kper_core_length: %lu, kper_data_pmc_bytes: %lu\n"), kper_core_length, kper_data_pmc_bytes);
 
-        // Init perfmon_collector eBPF data storage. With maximum
-        ebpf_data_map_ = std::make_shared<std::map<int, std::vector<StoreData>>>();
+        // Preallocate the per cpu storage. Pages are only touched once records are written
+        overflow_policy_ = ebpf_cfg.OverflowPolicy;
+        stored_records_.store(0);
+        lost_records_.store(0);
+        cpu_storage_.clear();
+        cpu_storage_.resize(max_cpu);
         for (auto& olcpu : cpu_onlines) {
-            ebpf_data_map_->insert({olcpu, std::vector<StoreData>()});
-            ebpf_data_map_->find(olcpu)->second.reserve(kper_core_length);
+            if (olcpu >= max_cpu) continue;
+            cpu_storage_[olcpu].data.reset(new StoreData[kper_core_length]);
+            cpu_storage_[olcpu].capacity = kper_core_length;
+        }
+
+        // Records are streamed from the ring buffer by the collector thread
+        if (ebpf_cfg.Transport == EBPF_TRANSPORT_RINGBUF) {
+            auto rb_res = bpf_.open_ring_buffer("events", &EbpfSampler::OnRingBufSample, this);
+            if (!rb_res.ok()) {
+                Dprintf(FRED("[EBPF COLLECTOR] Open ring buffer failed: %s\n"), rb_res.msg().c_str());
+                return -1;
+            }
+            if (span_usdt_) {
+                {
+                    std::lock_guard<std::mutex> span_lck(span_mux_);
+                    span_data_.clear();
+                }
+                max_spans_ = ebpf_cfg.SpanStorageMaxByte / sizeof(EbpfSpanData);
+                lost_spans_.store(0);
+                auto span_res = bpf_.open_ring_buffer("span_events", &EbpfSampler::OnSpanSample, this);
+                if (!span_res.ok()) {
+                    Dprintf(FRED("[EBPF COLLECTOR] Open span ring buffer failed: %s\n"), span_res.msg().c_str());
+                    return -1;
+                }
+                auto usdt_res = bpf_.attach_usdt_all();
+                if (!usdt_res.ok()) {
+                    Dprintf(FRED("[EBPF COLLECTOR] Attach USDT probes of %s failed: %s. Is it built with USDT_PROBES?\n"),
+                            ebpf_cfg.SpanUsdtBinary.c_str(), usdt_res.msg().c_str());
+                    return -1;
+                }
+            }
+            if (wakeup_latency_) {
+                {
+                    std::lock_guard<std::mutex> wakeup_lck(wakeup_mux_);
+                    wakeup_data_.clear();
+                }
+                max_wakeups_ = ebpf_cfg.WakeupStorageMaxByte / sizeof(EbpfWakeupData);
+                lost_wakeups_.store(0);
+                auto wakeup_res = bpf_.open_ring_buffer("wakeup_events", &EbpfSampler::OnWakeupSample, this);
+                if (!wakeup_res.ok()) {
+                    Dprintf(FRED("[EBPF COLLECTOR] Open wakeup ring buffer failed: %s\n"), wakeup_res.msg().c_str());
+                    return -1;
+                }
+                for (auto& tp : WAKEUP_TRACEPOINTS) {
+                    auto tp_res = bpf_.attach_tracepoint(std::string("sched:") + tp, std::string("tracepoint__sched__") + tp);
+                    if (!tp_res.ok()) {
+                        Dprintf(FRED("[EBPF COLLECTOR] Attach tracepoint sched:%s failed: %s\n"), tp, tp_res.msg().c_str());
+                        return -1;
+                    }
+                }
+            }
+            running_state_.store(EBPF_STATE::WAITING);
+            ebpf_collector_.reset();
+            ebpf_collector_ = std::make_shared<std::thread>(&EbpfSampler::RingBufCollect, this, ebpf_cfg);
+            return 1;
         }
 
         // Thread for constantly acquiring data
         running_state_.store(EBPF_STATE::WAITING);
         auto fn = [=]{
-            std::cout << FYEL("FLAG3") << std::endl;
             auto percpu_perfmon_cntr = this->bpf_.get_percpu_array_table<uint64_t>("counter");
-            auto percpu_perfmon_data = this->bpf_.get_percpu_array_table<PmcData>("perfmon_data");
-            std::vector<PmcData> keys(max_cpu * ebpf_cfg.PerCoreStorageLength);
-            std::vector<PmcData> values(max_cpu * ebpf_cfg.PerCoreStorageLength);
+            // Values are generated records of record_bytes_, a multiple of 8, so they are not padded per cpu
+            auto percpu_perfmon_data = this->bpf_.get_percpu_array_table<uint64_t>("perfmon_data");
+            std::vector<uint32_t> keys(ebpf_cfg.PerCoreStorageLength);
+            std::vector<char> values(max_cpu * ebpf_cfg.PerCoreStorageLength * record_bytes_);
             // Outer loop -- Check between each start / Stop
             while(this->running_state_.load() != EBPF_STATE::EXITING) {
                 // Wait for start
-                {
-                    ebpf_cv_.notify_all();
-                    std::unique_lock<std::mutex> lck(this->ebpf_mux_);
-                    while (this->running_state_.load() != EBPF_STATE::RUNNING) {
-                        // Exiting conditions
-                        if (this->running_state_.load() == EBPF_STATE::EXITING) goto EXIT;
-                        ebpf_cv_.wait(lck);
-                        if (this->running_state_.load() == EBPF_STATE::EXITING) goto EXIT;
-                    }
-                }
+                if (!WaitRunning()) break;
 
                 // Per iteration time
                 auto startts = Env::GetClockTimeNs();
 
-                // Check storage size
-                uint64_t storage_usage = 0;
-                for (auto& store_data : *ebpf_data_map_) {
-                    storage_usage += store_data.second.size() * kfull_data_bytes;
-                }
-                if (storage_usage > ebpf_cfg.StorageMaxByte) {
-                    Dprintf(FRED("[EBPF COLLECTOR] Collector storage exceeds limits. Current %lu. Max %lu."),
-                            storage_usage, ebpf_cfg.StorageMaxByte);
-                    std::lock_guard<std::mutex> lck(ebpf_mux_);
-                    running_state_.store(EBPF_STATE::EXITING);
-                    continue;
-                }
-
                 // Loop through per cpu data
                 std::vector<std::vector<uint64_t>> per_cpu_pmc_cntr = percpu_perfmon_cntr.get_table_offline();
-//                std::vector<std::vector<PmcData>> per_cpu_pmc_data = percpu_perfmon_data.get_table_offline();
                 int fd_pmc = percpu_perfmon_data.get_fd();
                 __u32 out_batch = 0;
                 __u32 count = 0;
@@ -240,83 +689,43 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
                 }
 
                 for (auto& cpu_id : cpu_onlines) {
-                    // Get per core storage
-                    auto itr = this->ebpf_data_map_->find(cpu_id);
-                    if (itr == this->ebpf_data_map_->end())
-                        continue;
-                    auto& storage = itr->second;
+                    if (cpu_id >= max_cpu || !cpu_storage_[cpu_id].data) continue;
+                    auto& storage = cpu_storage_[cpu_id];
 
                     // Get per cpu ebpf data header
-                    uint64_t& curr_id = per_cpu_pmc_cntr[0][cpu_id];
-                    uint64_t& warp_around = per_cpu_pmc_cntr[1][cpu_id];
-
-                    // Check the difference between this sample and the last one.
-                    bool valid = true;
-                    bool warp_error = false;
-                    uint64_t last_id = 0;
-                    uint64_t last_warp_around = 0;
-                    if (!storage.empty()) {
-                        last_id = storage.back().curr_idx;
-                        last_warp_around = storage.back().warp_around;
-                    }
-                    if (warp_around - last_warp_around > 1) { // Invalid if warp_around more than once
-                        warp_error = true;
+                    uint64_t curr_id = per_cpu_pmc_cntr[0][cpu_id];
+                    uint64_t warp_around = per_cpu_pmc_cntr[1][cpu_id];
+                    uint64_t last_id = storage.last_idx;
+
+                    // More than one lap since the last read, or a lap that passed the last read index, overwrote
+                    // records we had not read. Only [0, curr) is known to be intact: |xxxxxxC________|
+                    if (warp_around - storage.last_warp_around > 1 ||
+                        (warp_around - storage.last_warp_around == 1 && curr_id > last_id)) {
                         Dprintf(FRED("[EBPF COLLECTOR] Core %d data invalid due to storage overlap. Last warp around: %lu,"
-                                     "current warp around: %lu\n"), cpu_id, last_warp_around, warp_around);
+                                     "current warp around: %lu\n"), cpu_id, storage.last_warp_around, warp_around);
+                        lost_records_.fetch_add((warp_around - storage.last_warp_around) * EBPF_MAX_PERCORE_LENGTH - last_id);
+                        CopyRecords(storage, values.data(), record_bytes_, max_cpu, cpu_id, 0, curr_id, curr_id, warp_around);
                     }
-                    if (storage.size() > kper_core_length) { // Invalid if storage is full
-                        valid = false;
-                        Dprintf(FRED("[EBPF COLLECTOR] Core %d data invalid due to storage is full\n"), cpu_id);
+                    // |xxxxxC_____Lxxxxx|
+                    else if (warp_around != storage.last_warp_around) {
+                        CopyRecords(storage, values.data(), record_bytes_, max_cpu, cpu_id, last_id, EBPF_MAX_PERCORE_LENGTH, curr_id,
+                                    warp_around);
+                        CopyRecords(storage, values.data(), record_bytes_, max_cpu, cpu_id, 0, curr_id, curr_id, warp_around);
                     }
-
-                    // Collect data
-                    if (valid) {
-                        // If warp around more than once, the data is regarded as invalid, and only store |xxxxxxC________|
-                        if (warp_error) {
-                            // Begin -> Curr
-                            for (uint64_t i = 0; i < curr_id; ++i) {
-                                storage.push_back(StoreData{.curr_idx = curr_id, .warp_around = warp_around,
-//                                        .pmc_data = per_cpu_pmc_data[i][cpu_id]});
-                                        .pmc_data = values[i*max_cpu+cpu_id]});
-                            }
-                        }
-                            // Store the data
-                        else {
-                            // |xxxxxC_____Lxxxxx|
-                            if (last_id > curr_id) {
-                                // Last -> End
-                                for (uint64_t i = last_id; i < EBPF_MAX_PERCORE_LENGTH; ++i) {
-                                    storage.push_back(StoreData{.curr_idx = curr_id, .warp_around = warp_around,
-//                                            .pmc_data = per_cpu_pmc_data[i][cpu_id]});
-                                            .pmc_data = values[i*max_cpu+cpu_id]});
-                                }
-
-                                // Begin -> Curr
-                                for (uint64_t i = 0; i < curr_id; ++i) {
-                                    storage.push_back(StoreData{.curr_idx = curr_id, .warp_around = warp_around,
-//                                            .pmc_data = per_cpu_pmc_data[i][cpu_id]});
-                                            .pmc_data = values[i*max_cpu+cpu_id]});
-                                }
-                            }
-                            // |____LxxxC_______|
-                            if (curr_id > last_id) {
-                                // Last -> Curr
-                                for (uint64_t i = last_id; i < curr_id; ++i) {
-                                    storage.push_back(StoreData{.curr_idx = curr_id, .warp_around = warp_around,
-//                                            .pmc_data = per_cpu_pmc_data[i][cpu_id]});
-                                            .pmc_data = values[i*max_cpu+cpu_id]});
-                                }
-                            }
-                        }
+                    // |____LxxxC_______|
+                    else {
+                        CopyRecords(storage, values.data(), record_bytes_, max_cpu, cpu_id, last_id, curr_id, curr_id, warp_around);
                     }
+                    storage.last_idx = curr_id;
+                    storage.last_warp_around = warp_around;
                 }
 
                 // Per iteration time
                 auto endts = Env::GetClockTimeNs();
-                Dprintf(FMAG("[EBPF COLLECTOR] Time per ebpf collector iteration: %lu\n"), endts - startts);
+                Dprintf(FMAG("[EBPF COLLECTOR] Time per ebpf collector iteration: %lu. Storage usage: %lu bytes\n"),
+                        endts - startts, stored_records_.load() * kfull_data_bytes);
                 usleep(ebpf_cfg.WeakUpIntvMs * 1000);
             }
-            EXIT:
             Dprintf(FYEL("[EBPF COLLECTOR] collector Exit flag\n"));
             return;
         };
@@ -368,6 +777,11 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
 
         Dprintf(FGRN("[EBPF COLLECTOR] Close eBPF context\n"));
 
+        {
+            std::lock_guard<std::mutex> filter_lck(filter_mux_);
+            filter_ready_ = false;
+        }
+
         int success = EbpfCtxStateChange(EBPF_STATE::EXITING);
 
         if (success == -1) {
@@ -381,14 +795,32 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
         }
 
         // Detach perffd
-        int cntr = 0;
         for (auto& single_event_cpu_fd_pair : cpu_fd_pairs_) {
-            auto status = bpf_.detach_curr_perffd("PMC"+std::to_string(cntr),single_event_cpu_fd_pair.second);
+            auto name = PmcArrayName(single_event_cpu_fd_pair.first.first, single_event_cpu_fd_pair.first.second);
+            if (name.empty()) continue;
+            auto status = bpf_.detach_curr_perffd(name, single_event_cpu_fd_pair.second);
             if (!status.ok()) {
                 Dprintf(FRED("[EBPF COLLECTOR] Error closing Ebpf. Msg: %s\n"), status.msg().c_str());
                 return -1;
             }
-            cntr++;
+        }
+
+        if (span_usdt_) {
+            auto usdt_res = bpf_.detach_usdt_all();
+            if (!usdt_res.ok()) {
+                Dprintf(FRED("[EBPF COLLECTOR] Detach USDT probes error: %s\n"), usdt_res.msg().c_str());
+            }
+            span_usdt_ = false;
+        }
+
+        if (wakeup_latency_) {
+            for (auto& tp : WAKEUP_TRACEPOINTS) {
+                auto tp_res = bpf_.detach_tracepoint(std::string("sched:") + tp);
+                if (!tp_res.ok()) {
+                    Dprintf(FRED("[EBPF COLLECTOR] Detach tracepoint sched:%s error: %s\n"), tp, tp_res.msg().c_str());
+                }
+            }
+            wakeup_latency_ = false;
         }
 
         // Detach kprobe
@@ -401,13 +833,158 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
         return 1;
     }
 
+    int EbpfSampler::EbpfCtxScAddThread(pid_t tid) {
+        std::lock_guard<std::mutex> lck(filter_mux_);
+        target_threads_.insert(tid);
+        if (filter_ready_ && filter_threads_) {
+            return UpdateThreadFilter(tid, true);
+        }
+        return 1;
+    }
+
+    int EbpfSampler::EbpfCtxScRemoveThread(pid_t tid) {
+        std::lock_guard<std::mutex> lck(filter_mux_);
+        target_threads_.erase(tid);
+        if (filter_ready_ && filter_threads_) {
+            return UpdateThreadFilter(tid, false);
+        }
+        return 1;
+    }
+
+    int EbpfSampler::EbpfCtxScSwitchGroup(int cpu, int group, const std::vector<int>& fds) {
+        if (running_state_.load() <= EBPF_STATE::UNINITIALIZED || !layout_.multiplexed ||
+            group >= (int)layout_.group_events.size()) return -1;
+        std::lock_guard<std::mutex> lck(group_mux_);
+        for (int e = 0; e < (int)fds.size(); ++e) {
+            auto name = PmcArrayName(group, e);
+            if (name.empty()) break;
+            auto status = bpf_.attach_curr_perffd(name, {{cpu, fds[e]}});
+            if (!status.ok()) {
+                Dprintf(FRED("[EBPF COLLECTOR] Switch cpu %d to group %d failed: %s\n"), cpu, group, status.msg().c_str());
+                return -1;
+            }
+        }
+        // Publish the group after its fds, so the program never reads the new group from the old fds
+        auto active_group = bpf_.get_array_table<int>("active_group");
+        if (!active_group.update_value(cpu, group).ok()) return -1;
+        return 1;
+    }
+
+    uint64_t EbpfSampler::EbpfCtxScLost() {
+        return lost_records_.load();
+    }
+
+    uint64_t EbpfSampler::EbpfCtxScStorageBytes() {
+        return stored_records_.load(std::memory_order_relaxed) * sizeof(StoreData);
+    }
+
+    std::vector<EbpfSpanData> EbpfSampler::GetEbpfSpanData() {
+        std::lock_guard<std::mutex> lck(span_mux_);
+        return span_data_;
+    }
+
+    uint64_t EbpfSampler::EbpfSpanLost() {
+        return lost_spans_.load();
+    }
+
+    std::vector<EbpfWakeupData> EbpfSampler::GetEbpfWakeupData() {
+        std::lock_guard<std::mutex> lck(wakeup_mux_);
+        return wakeup_data_;
+    }
+
+    uint64_t EbpfSampler::EbpfWakeupLost() {
+        return lost_wakeups_.load();
+    }
+
+    std::vector<EbpfOffCpuStack> EbpfSampler::GetEbpfOffCpuStacks() {
+        std::vector<EbpfOffCpuStack> ret;
+        if (!offcpu_stacks_) return ret;
+        auto offcpu_time = bpf_.get_hash_table<OffCpuKey, OffCpuVal>("offcpu_time");
+        for (auto& elem : offcpu_time.get_table_offline()) {
+            auto& key = elem.first;
+            ret.push_back(EbpfOffCpuStack{key.span_start_ts, key.span_hash_id, key.tid, key.tgid, key.user_stack_id,
+                                          key.kernel_stack_id, elem.second.blocked_ns, elem.second.count});
+        }
+        return ret;
+    }
+
+    uint64_t EbpfSampler::EbpfOffCpuLost() {
+        if (!offcpu_stacks_) return 0;
+        uint64_t lost = 0;
+        auto offcpu_stats = bpf_.get_percpu_array_table<uint64_t>("offcpu_stats");
+        for (auto cpu_lost : offcpu_stats.get_table_offline()[0]) {
+            lost += cpu_lost;
+        }
+        return lost;
+    }
+
+    int EbpfSampler::EbpfOffCpuExport(const std::string& path) {
+        if (!offcpu_stacks_) {
+            Dprintf(FRED("[EBPF COLLECTOR] Off cpu stacks are off. Nothing to export\n"));
+            return -1;
+        }
+        std::ofstream resultfs(path, std::ios::out);
+        if (!resultfs.good()) {
+            Dprintf(FRED("Open file failed: %s\n"), path.c_str());
+            return -1;
+        }
+
+        auto stack_table = bpf_.get_stack_table("offcpu_stacks");
+        // Many keys share a stack, symbolize each once. Symbols come innermost first
+        std::map<std::pair<int, int>, std::string> folded;
+        auto fold = [&](int stack_id, int pid) -> const std::string& {
+            auto itr = folded.find({stack_id, pid});
+            if (itr != folded.end()) return itr->second;
+            std::string frames;
+            if (stack_id < 0) {
+                frames = "[lost]";
+            }
+            else {
+                auto symbols = stack_table.get_stack_symbol(stack_id, pid);
+                for (auto sym = symbols.rbegin(); sym != symbols.rend(); ++sym) {
+                    if (!frames.empty()) frames.push_back(';');
+                    frames.append(*sym);
+                }
+            }
+            return folded[{stack_id, pid}] = frames;
+        };
+
+        int64_t mono_to_real_ns = CtxSwitchJoin::MonoToRealOffsetNs();
+        auto stacks = GetEbpfOffCpuStacks();
+        for (auto& stack : stacks) {
+            resultfs << stack.tid << "," << (stack.span_start_ts ? stack.span_start_ts + mono_to_real_ns : 0) << ","
+                     << stack.span_hash_id << "," << stack.blocked_ns << "," << stack.count << ","
+                     << fold(stack.user_stack_id, stack.tgid) << ";" << fold(stack.kernel_stack_id, -1) << "\n";
+        }
+        Dprintf(FGRN("[EBPF COLLECTOR] Export %lu off cpu stacks to %s. %lu lost\n"), stacks.size(), path.c_str(),
+                EbpfOffCpuLost());
+        return 1;
+    }
+
+    std::shared_ptr<std::map<int, std::vector<StoreData>>> EbpfSampler::GetEbpfCtxData() {
+        auto ret = std::make_shared<std::map<int, std::vector<StoreData>>>();
+        for (int cpu = 0; cpu < (int)cpu_storage_.size(); ++cpu) {
+            auto& storage = cpu_storage_[cpu];
+            if (!storage.data) continue;
+            auto& vec = (*ret)[cpu];
+            vec.resize(storage.Size());
+            // Oldest first. A rotated storage is split into two contiguous ranges
+            uint64_t begin = storage.Begin();
+            uint64_t first_len = std::min(storage.Size(), storage.capacity - begin);
+            memcpy(vec.data(), storage.data.get() + begin, first_len * sizeof(StoreData));
+            memcpy(vec.data() + first_len, storage.data.get(), (storage.Size() - first_len) * sizeof(StoreData));
+        }
+        return ret;
+    }
+
     void EbpfSampler::DebugPrintEbpfCtxData() {
-        if (!ebpf_data_map_)
-            return;
-        for (auto& cpu_data : *ebpf_data_map_) {
-            printf("CPU [%d]: Data [%lu]. ", cpu_data.first, cpu_data.second.size());
-            for (int i = 0; i < (cpu_data.second.size() > 5 ? 5 : cpu_data.second.size()); ++i) {
-                auto& data = cpu_data.second[i];
+        printf("Records lost: %lu. Storage usage: %lu bytes\n", lost_records_.load(), EbpfCtxScStorageBytes());
+        for (int cpu = 0; cpu < (int)cpu_storage_.size(); ++cpu) {
+            auto& storage = cpu_storage_[cpu];
+            if (!storage.data) continue;
+            printf("CPU [%d]: Data [%lu]. ", cpu, storage.Size());
+            for (uint64_t i = 0; i < std::min(storage.Size(), (uint64_t)5); ++i) {
+                auto& data = storage.At(i);
                 printf("[(%lu, %lu)-(%d-0x%.4lX->%d)],", data.warp_around, data.curr_idx,
                        data.pmc_data.prev_pid, data.pmc_data.prev_task_state, data.pmc_data.curr_pid);
             }
@@ -417,7 +994,7 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
 
     void EbpfSampler::DebugExportEbpfCtxData(const char* path_cstr) {
         auto path = std::string(path_cstr);
-        if (!ebpf_data_map_)
+        if (cpu_storage_.empty())
             return;
 
         std::ofstream resultfs;
@@ -439,16 +1016,17 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
         resultfs << mono_ns << ",";
         resultfs << real_ns << "\n";
 
-        for (auto& cpu_data : *ebpf_data_map_) {
-            for (int i = 0; i < cpu_data.second.size(); ++i) {
-                auto& data = cpu_data.second[i];
-                resultfs << cpu_data.first << ","; // cpu
+        for (int cpu = 0; cpu < (int)cpu_storage_.size(); ++cpu) {
+            auto& storage = cpu_storage_[cpu];
+            for (uint64_t i = 0; i < storage.Size(); ++i) {
+                auto& data = storage.At(i);
+                resultfs << cpu << ","; // cpu
                 resultfs << data.pmc_data.time_stamp + diff << "," << data.warp_around << "," << data.curr_idx << ","; // time mono ns, warp around, idx
                 resultfs << data.pmc_data.prev_task_state << "," << data.pmc_data.prev_pid << "," << data.pmc_data.curr_pid;
 
                 // PMC readings
                 resultfs << "," << data.pmc_data.pmc_reading[0];
-                for (int j = 1; j < 13; ++j) {
+                for (int j = 1; j < EBPF_NUM_PMC; ++j) {
                     resultfs << "-" << data.pmc_data.pmc_reading[j];
                 }
                 resultfs << "\n";
@@ -456,6 +1034,222 @@ int task_switch_event(struct pt_regs *ctx, struct task_struct *prev) {
         }
     }
 
+    int EbpfSampler::EbpfCtxScExport(const std::string& path, const std::vector<std::string>& event_names) {
+        if (running_state_.load() == EBPF_STATE::RUNNING) {
+            Dprintf(FYEL("[EBPF COLLECTOR] Export while collecting. Call EbpfCtxScStop() first for a consistent view\n"));
+        }
+        return WriteCtxSwitchBinary(path, cpu_storage_, event_names, CtxSwitchJoin::MonoToRealOffsetNs());
+    }
+
+    // ----------------------------------- Private ----------------------------------------
+
+    int EbpfSampler::UpdateThreadFilter(pid_t tid, bool add) {
+        auto threads = bpf_.get_hash_table<uint32_t, uint8_t>("target_threads");
+        uint32_t key = tid;
+        uint8_t one = 1;
+        auto status = add ? threads.update_value(key, one) : threads.remove_value(key);
+        if (!status.ok()) {
+            Dprintf(FRED("[EBPF COLLECTOR] Failed to update thread filter of %d: %s\n"), tid, status.msg().c_str());
+            return -1;
+        }
+        return 1;
+    }
+
+    bool EbpfSampler::WaitRunning() {
+        ebpf_cv_.notify_all();
+        std::unique_lock<std::mutex> lck(ebpf_mux_);
+        while (running_state_.load() != EBPF_STATE::RUNNING) {
+            if (running_state_.load() == EBPF_STATE::EXITING) return false;
+            ebpf_cv_.wait(lck);
+        }
+        return true;
+    }
+
+    void EbpfSampler::RingBufCollect(EbpfCtxScConfig ebpf_cfg) {
+        auto rb_stats = bpf_.get_percpu_array_table<uint64_t>("rb_stats");
+        uint64_t kernel_dropped = 0;
+        uint64_t kernel_spans_dropped = 0;
+        uint64_t kernel_wakeups_dropped = 0;
+        while (running_state_.load() != EBPF_STATE::EXITING) {
+            if (running_state_.load() != EBPF_STATE::RUNNING) {
+                // Drain the records of the last run before sleeping
+                bpf_.consume_ring_buffer();
+                if (!WaitRunning()) break;
+            }
+
+            // Sleeps in epoll until the kernel wakes us up at the watermark, or the interval passed
+            int ret = bpf_.poll_ring_buffer(ebpf_cfg.WeakUpIntvMs);
+            if (ret < 0 && ret != -EINTR) {
+                Dprintf(FRED("[EBPF COLLECTOR] Poll ring buffer failed: %d\n"), ret);
+                break;
+            }
+
+            // Records the kernel could not reserve are counted there, never overwritten
+            uint64_t dropped = 0;
+            auto stats = rb_stats.get_table_offline();
+            for (auto cpu_dropped : stats[1]) {
+                dropped += cpu_dropped;
+            }
+            if (dropped > kernel_dropped) {
+                Dprintf(FRED("[EBPF COLLECTOR] Ring buffer is full. %lu records dropped\n"), dropped - kernel_dropped);
+                lost_records_.fetch_add(dropped - kernel_dropped);
+                kernel_dropped = dropped;
+            }
+            if (span_usdt_) {
+                uint64_t spans_dropped = 0;
+                for (auto cpu_dropped : stats[2]) {
+                    spans_dropped += cpu_dropped;
+                }
+                if (spans_dropped > kernel_spans_dropped) {
+                    lost_spans_.fetch_add(spans_dropped - kernel_spans_dropped);
+                    kernel_spans_dropped = spans_dropped;
+                }
+            }
+            if (wakeup_latency_) {
+                uint64_t wakeups_dropped = 0;
+                for (auto cpu_dropped : stats[3]) {
+                    wakeups_dropped += cpu_dropped;
+                }
+                if (wakeups_dropped > kernel_wakeups_dropped) {
+                    lost_wakeups_.fetch_add(wakeups_dropped - kernel_wakeups_dropped);
+                    kernel_wakeups_dropped = wakeups_dropped;
+                }
+            }
+        }
+        Dprintf(FYEL("[EBPF COLLECTOR] collector Exit flag\n"));
+    }
+
+    int EbpfSampler::OnRingBufSample(void* ctx, void* data, size_t size) {
+        auto sampler = static_cast<EbpfSampler*>(ctx);
+        if (size < sampler->record_bytes_) return 0;
+        auto pmc_data = static_cast<const PmcData*>(data);
+        if (pmc_data->core_id < 0 || pmc_data->core_id >= (int)sampler->cpu_storage_.size()) return 0;
+
+        auto& storage = sampler->cpu_storage_[pmc_data->core_id];
+        // No wrap around in the ring buffer. curr_idx is the sequence number on this core
+        uint64_t seq = storage.num_written;
+        StoreData* dst = sampler->ReserveRecord(storage);
+        if (dst == nullptr) return 0;
+        dst->curr_idx = seq;
+        dst->warp_around = 0;
+        DecodeRecord(data, sampler->record_bytes_, &dst->pmc_data);
+        return 0;
+    }
+
+    int EbpfSampler::OnSpanSample(void* ctx, void* data, size_t size) {
+        auto sampler = static_cast<EbpfSampler*>(ctx);
+        uint64_t span_bytes = EBPF_SPAN_HDR_BYTES + sampler->layout_.RecordPmcs() * sizeof(uint64_t);
+        if (size < span_bytes) return 0;
+        std::lock_guard<std::mutex> lck(sampler->span_mux_);
+        if (sampler->span_data_.size() >= sampler->max_spans_) {
+            sampler->lost_spans_.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+        // Kernel spans only carry the configured counters
+        sampler->span_data_.emplace_back();
+        auto& span = sampler->span_data_.back();
+        memset(&span, 0, sizeof(span));
+        memcpy(&span, data, span_bytes);
+        return 0;
+    }
+
+    int EbpfSampler::OnWakeupSample(void* ctx, void* data, size_t size) {
+        auto sampler = static_cast<EbpfSampler*>(ctx);
+        if (size < sizeof(EbpfWakeupData)) return 0;
+        std::lock_guard<std::mutex> lck(sampler->wakeup_mux_);
+        if (sampler->wakeup_data_.size() >= sampler->max_wakeups_) {
+            sampler->lost_wakeups_.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+        sampler->wakeup_data_.push_back(*static_cast<const EbpfWakeupData*>(data));
+        return 0;
+    }
+
+    StoreData* EbpfSampler::ReserveRecord(EbpfCpuStorage& storage) {
+        if (storage.capacity == 0) return nullptr;
+        if (storage.num_written >= storage.capacity) {
+            // Full. Either overwrite the oldest record or keep the old ones and drop the new one
+            lost_records_.fetch_add(1, std::memory_order_relaxed);
+            if (overflow_policy_ == EBPF_OVERFLOW_DROP) return nullptr;
+        }
+        else {
+            stored_records_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return &storage.data[storage.num_written++ % storage.capacity];
+    }
+
+    void EbpfSampler::CopyRecords(EbpfCpuStorage& storage, const char* values, uint64_t record_bytes, int max_cpu, int cpu_id,
+                                  uint64_t begin, uint64_t end, uint64_t curr_idx, uint64_t warp_around) {
+        // Values of the percpu array are interleaved by cpu, so this is a strided gather into the contiguous storage
+        for (uint64_t i = begin; i < end; ++i) {
+            StoreData* dst = ReserveRecord(storage);
+            if (dst == nullptr) return;
+            dst->curr_idx = curr_idx;
+            dst->warp_around = warp_around;
+            DecodeRecord(values + (i * max_cpu + cpu_id) * record_bytes, record_bytes, &dst->pmc_data);
+        }
+    }
+
+    void EbpfSampler::DecodeRecord(const void* record, uint64_t record_bytes, PmcData* dst) {
+        memcpy(dst, record, record_bytes);
+        memset((char*)dst + record_bytes, 0, sizeof(PmcData) - record_bytes);
+    }
+
+    std::string EbpfSampler::PmcArrayName(int group, int event) const {
+        // Counted together, the counters of all groups are concatenated
+        int idx = 0;
+        for (int g = 0; g < group && !layout_.multiplexed; ++g) {
+            idx += layout_.group_events[g];
+        }
+        if (group >= (int)layout_.group_events.size() || event >= layout_.group_events[group] ||
+            idx + event >= EBPF_NUM_PMC) return "";
+        return "PMC_" + std::to_string(group) + "_" + std::to_string(event);
+    }
+
+    std::string EbpfSampler::GeneratePmcSource(const EbpfPmcLayout& layout) {
+        std::string src = "struct pmc_data {\n"
+                          "    u64 time_stamp;\n"
+                          "    pid_t prev_pid;\n"
+                          "    pid_t curr_pid;\n"
+                          "    int core_id;\n"
+                          "    int group_id;\n"
+                          "    u64 prev_task_state;\n"
+                          "    u64 pmc_reading[RECORD_PMCS];\n"
+                          "};\n\n";
+        std::string reads;
+        int idx = 0;
+        for (int g = 0; g < (int)layout.group_events.size(); ++g) {
+            std::string indent = "    ";
+            if (layout.multiplexed) {
+                idx = 0;
+                indent = "        ";
+                reads += "    if (group == " + std::to_string(g) + ") {\n";
+            }
+            for (int e = 0; e < layout.group_events[g] && idx < EBPF_NUM_PMC; ++e, ++idx) {
+                std::string name = "PMC_" + std::to_string(g) + "_" + std::to_string(e);
+                src += "BPF_PERF_ARRAY(" + name + ", MAX_CPUS);\n";
+                reads += indent + "pmc_reading[" + std::to_string(idx) + "] = " + name + ".perf_read(cur_cpu);\n";
+            }
+            if (layout.multiplexed) {
+                reads += "        return " + std::to_string(g) + ";\n    }\n";
+            }
+        }
+
+        // The perfmon agents publish the group they switched to
+        std::string body;
+        if (layout.multiplexed) {
+            src += "BPF_ARRAY(active_group, int, MAX_CPUS);\n";
+            body = "    int* group_ptr = active_group.lookup(&cur_cpu);\n"
+                   "    int group = group_ptr ? *group_ptr : 0;\n" + reads + "    return -1;\n";
+        }
+        else {
+            body = reads + "    return 0;\n";
+        }
+        src += "\n// Read the counters of the active group. Returns the group\n"
+               "static __always_inline int read_pmcs(u64* pmc_reading, int cur_cpu) {\n" + body + "}\n";
+        return src;
+    }
+
     EbpfSampler::~EbpfSampler() {
         EbpfCtxScClose();
     }
@@ -17,17 +17,20 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <BPF.h>
 #include <condition_variable>
 #include <thread>
 #include <atomic>
 #include <utility>
+#include <memory>
 
 #include "util.h"
 #include "env.h"
 #include "ebpf_common.h"
 
 namespace mtmc {
+
     class EbpfSampler {
     public:
         // Non-thread safe
@@ -38,19 +41,107 @@ namespace mtmc {
             return *ebpf_instance_;
         }
 
+        /**
+         * Init with every group of cpu_fd_pairs counted together
+         * @param cpu_fd_pairs: {group, event} -> {cpu, fd}, see PerfmonCollector::DebugAcquireEbpfCpuFdPairs
+         */
         int EbpfCtxScInit(EbpfCtxScConfig ebpf_cfg, const std::vector<int> &perf_cpus,
                           std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> cpu_fd_pairs);
 
+        /**
+         * Init with the program, its records and the decoder generated for layout. Records only carry its counters
+         * @param layout: From PerfmonCollector::GetGroupEventNums and IsMultiplexed
+         * @return 1 for success, -1 for failed
+         */
+        int EbpfCtxScInit(EbpfCtxScConfig ebpf_cfg, const std::vector<int> &perf_cpus,
+                          std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> cpu_fd_pairs,
+                          const EbpfPmcLayout& layout);
+
         int EbpfCtxScStart();
 
         int EbpfCtxScStop();
 
         int EbpfCtxScClose();
 
+        /**
+         * Add a thread to the in kernel thread filter. Can be called before init, the thread is kept until then.
+         * No effect on the data if FilterThreads is off
+         * @return 1 for success, -1 for failed
+         */
+        int EbpfCtxScAddThread(pid_t tid);
+
+        int EbpfCtxScRemoveThread(pid_t tid);
+
+        /**
+         * Point the counters of group on cpu to its new fds and make it the active group. For multiplexed layouts,
+         * called from the PerfmonCollector group switch hook
+         * @return 1 for success, -1 for failed
+         */
+        int EbpfCtxScSwitchGroup(int cpu, int group, const std::vector<int>& fds);
+
+        // True from init till close. Its perf arrays hold the fds of the per core agents in the meantime
+        bool EbpfCtxScInited() const {
+            return running_state_.load() > EBPF_STATE::UNINITIALIZED;
+        }
+
+        /**
+         * Number of records lost, because the kernel side buffer was overrun or the storage was full
+         */
+        uint64_t EbpfCtxScLost();
+
+        /**
+         * Copy of the per cpu context switch records collected so far, oldest first. Call it after EbpfCtxScStop()
+         */
+        std::shared_ptr<std::map<int, std::vector<StoreData>>> GetEbpfCtxData();
+
+        // Bytes used by the stored records. O(1)
+        uint64_t EbpfCtxScStorageBytes();
+
         void DebugPrintEbpfCtxData();
 
         void DebugExportEbpfCtxData(const char* path_cstr);
 
+        /**
+         * Write the records to a binary trace (see binary_trace.h), one block per cpu written in parallel
+         * @param event_names: Names of the counters in pmc_reading, stored in the file header
+         * @return 1 for success, -1 for failed
+         */
+        int EbpfCtxScExport(const std::string& path, const std::vector<std::string>& event_names);
+
+        /**
+         * Copy of the spans captured from the USDT probes so far. Empty unless EbpfCtxScConfig::SpanUsdtBinary is set
+         */
+        std::vector<EbpfSpanData> GetEbpfSpanData();
+
+        // Number of spans lost, because the ring buffer or SpanStorageMaxByte was full
+        uint64_t EbpfSpanLost();
+
+        /**
+         * Copy of the wakeup to run latencies recorded so far, in the order the threads switched in. Empty unless
+         * EbpfCtxScConfig::WakeupLatency is set. Join them to the spans with CtxSwitchJoin::AddWakeups
+         */
+        std::vector<EbpfWakeupData> GetEbpfWakeupData();
+
+        // Number of wakeups lost, because the ring buffer or WakeupStorageMaxByte was full
+        uint64_t EbpfWakeupLost();
+
+        /**
+         * Blocked time aggregated in kernel so far. Empty unless EbpfCtxScConfig::OffCpuStacks is set
+         */
+        std::vector<EbpfOffCpuStack> GetEbpfOffCpuStacks();
+
+        // Number of blocked intervals lost, because the in kernel aggregation was full
+        uint64_t EbpfOffCpuLost();
+
+        /**
+         * Write the aggregated blocked time with symbolized stacks, one csv line per key:
+         * tid,span_start_ts,span_hash_id,blocked_ns,count,frames
+         * span_start_ts is in span time (CLOCK_REALTIME), so with tid it finds the span in the trace. frames are the user
+         * then the kernel frames, outermost first and separated by ';'. They are last since symbols may contain ','
+         * @return 1 for success, -1 for failed
+         */
+        int EbpfOffCpuExport(const std::string& path);
+
         EbpfSampler& operator=(const EbpfSampler&) = delete;
 //        EbpfSampler& operator=(const EbpfSampler&&) = delete;
         EbpfSampler(const EbpfSampler&) = delete;
@@ -69,11 +160,48 @@ namespace mtmc {
 
         int EbpfCtxStateChange(EBPF_STATE state);
 
+        // Add or remove tid in the target_threads map. Requires filter_mux_
+        int UpdateThreadFilter(pid_t tid, bool add);
+
+        // Block until the state is RUNNING. Returns false if it is EXITING
+        bool WaitRunning();
+
+        // Collector thread of the ring buffer transport
+        void RingBufCollect(EbpfCtxScConfig ebpf_cfg);
+
+        // Ring buffer sample callback. Appends the record to the storage of its core
+        static int OnRingBufSample(void* ctx, void* data, size_t size);
+
+        // Span ring buffer sample callback
+        static int OnSpanSample(void* ctx, void* data, size_t size);
+
+        // Wakeup ring buffer sample callback
+        static int OnWakeupSample(void* ctx, void* data, size_t size);
+
+        // Slot for the next record of this cpu according to the overflow policy. nullptr if dropped
+        StoreData* ReserveRecord(EbpfCpuStorage& storage);
+
+        // Append [begin, end) of the percpu array values read with bpf_lookup_batch
+        void CopyRecords(EbpfCpuStorage& storage, const char* values, uint64_t record_bytes, int max_cpu, int cpu_id,
+                         uint64_t begin, uint64_t end, uint64_t curr_idx, uint64_t warp_around);
+
+        // Expand a kernel record of record_bytes into PmcData. Counters it does not carry are 0
+        static void DecodeRecord(const void* record, uint64_t record_bytes, PmcData* dst);
+
+        // Name of the perf array of an event. Empty if the program does not read it
+        std::string PmcArrayName(int group, int event) const;
+
+        // pmc_data struct, perf arrays and read_pmcs() of the program for layout
+        static std::string GeneratePmcSource(const EbpfPmcLayout& layout);
+
         static EbpfSampler* ebpf_instance_;
 
         // Class private common variables
         std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> cpu_fd_pairs_;
         ebpf::BPF bpf_;
+        EbpfPmcLayout layout_;
+        uint64_t record_bytes_{};
+        std::mutex group_mux_;
 
         // Init variables
         std::mutex init_mux_;
@@ -84,8 +212,35 @@ namespace mtmc {
         std::atomic<int> running_state_{0};
         std::shared_ptr<std::thread> ebpf_collector_;
 
-        // Data Storage
-        std::shared_ptr<std::map<int, std::vector<StoreData>>> ebpf_data_map_;
+        // Data Storage. Indexed by cpu id, preallocated at init
+        std::vector<EbpfCpuStorage> cpu_storage_;
+        int overflow_policy_{};
+        std::atomic<uint64_t> stored_records_{0};
+        std::atomic<uint64_t> lost_records_{0};
+
+        // Spans from the USDT probes. Only the collector thread writes them
+        bool span_usdt_{};
+        std::mutex span_mux_;
+        std::vector<EbpfSpanData> span_data_;
+        uint64_t max_spans_{};
+        std::atomic<uint64_t> lost_spans_{0};
+
+        // Wakeup to run latencies from the sched tracepoints. Only the collector thread writes them
+        bool wakeup_latency_{};
+        std::mutex wakeup_mux_;
+        std::vector<EbpfWakeupData> wakeup_data_;
+        uint64_t max_wakeups_{};
+        std::atomic<uint64_t> lost_wakeups_{0};
+
+        // Off cpu stacks stay in the kernel maps until exported
+        bool offcpu_stacks_{};
+
+        // In kernel filters. Threads are kept here so that the ones registered before init are not missed
+        std::mutex filter_mux_;
+        std::set<pid_t> target_threads_;
+        bool filter_tgid_{};
+        bool filter_threads_{};
+        bool filter_ready_{};
     };
 }
 
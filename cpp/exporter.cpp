@@ -14,30 +14,69 @@
 
 #include "exporter.h"
 
+#include <map>
+
 mtmc::ShmExporter::ShmExporter() {}
 
 mtmc::ShmExporter::~ShmExporter() {
 }
 
-__attribute__((optimize("O3"))) int mtmc::ShmExporter::Export(std::list<util::IndexVector<SingleProfile>>& profile_storage,
+int mtmc::ShmExporter::Export(std::list<util::IndexVector<SingleProfile>>& profile_storage,
                               ProfilerSetting mtmc_setting) {
+    auto handle = ExportAsync(profile_storage, mtmc_setting);
+    if (handle->Wait(mtmc_setting.export_timeout_ms) != 1) {
+        return -1;
+    }
+    Dprintf(FGRN("OTLE Exporter has received the payload.\n"));
+    return 0;
+}
+
+std::shared_ptr<mtmc::ExportHandle> mtmc::ShmExporter::ExportAsync(std::list<util::IndexVector<SingleProfile>>& profile_storage,
+                                                                   ProfilerSetting mtmc_setting,
+                                                                   const SpanQualityCounts* quality) {
+    // Zero copy path. Only valid if every storage lives in the arena
+    if (arena_ && arena_->Valid()) {
+        bool all_in_arena = true;
+        for (auto& vec : profile_storage) {
+            if (vec.GetChunkProvider() != arena_.get()) {
+                all_in_arena = false;
+                break;
+            }
+        }
+        if (all_in_arena) {
+            return ExportArena(profile_storage, mtmc_setting, quality);
+        }
+        Dprintf(FYEL("Part of the storage is not allocated from the shm arena. Fall back to copy export\n"));
+    }
+    return ExportCopy(profile_storage, mtmc_setting, quality);
+}
+
+__attribute__((optimize("O3"))) std::shared_ptr<mtmc::ExportHandle> mtmc::ShmExporter::ExportCopy(
+        std::list<util::IndexVector<SingleProfile>>& profile_storage, ProfilerSetting& mtmc_setting,
+        const SpanQualityCounts* quality) {
+
+    auto handle = std::make_shared<ExportHandle>();
+    handle->status_ = -1;
 
     ipc::channel chnl = ipc::channel(DEFAULT_CHANNEL_NAME, ipc::sender);
 
     if (!chnl.valid()) {
         Dprintf("Export failed due to channel is not valid\n");
-        return -1;
+        return handle;
     }
 
     std::vector<SingleProfile*> to_export;
+    std::map<int, std::vector<std::pair<size_t, size_t>>> node_ranges;  // Ranges of to_export stored on each node
     size_t data_size_bytes = 0;
 
     // Calculate SHM size as well as select data to be exported
     for (auto& vec : profile_storage) {
+        auto provider = vec.GetChunkProvider();
+        node_ranges[provider ? provider->Node() : -1].emplace_back(to_export.size(), 0);
         for (int prof_i = 0; prof_i < vec.Size(); ++prof_i) {
             auto& profile = vec[prof_i];
-            /* Here are some invalid data conditions */
-            if (profile.rd_ret_start.num_event != profile.rd_ret_end.num_event) {
+            /* Here are some invalid data conditions, same as WriteSpans. Migrated spans go out with pmc_valid unset */
+            if (profile.flag_bits.group_switched || profile.rd_ret_start.num_event != profile.rd_ret_end.num_event) {
                 continue;
             }
             if (mtmc_setting.perf_collect_topdown && (profile.rd_ret_start.num_event - 2 < 0)) {
@@ -47,6 +86,7 @@ __attribute__((optimize("O3"))) int mtmc::ShmExporter::Export(std::list<util::In
             to_export.push_back(&profile);
             data_size_bytes += sizeof(profile);
         }
+        node_ranges[provider ? provider->Node() : -1].back().second = to_export.size();
     }
 
     data_size_bytes += sizeof(ShmIpcStatus);
@@ -63,7 +103,7 @@ __attribute__((optimize("O3"))) int mtmc::ShmExporter::Export(std::list<util::In
                                  data_size_bytes, ipc::shm::create);
     if (!shm_hdlr.valid()) {
         Dprintf(FRED("Export failed due to shm handler is not valid\n"));
-        return -1;
+        return handle;
     }
     memset(shm_hdlr.get(), 0, shm_hdlr.size());
     Dprintf(FCYN("Data size to export is %.2f MB. SHM size: %lu, SHM name: %s\n"),
@@ -72,9 +112,18 @@ __attribute__((optimize("O3"))) int mtmc::ShmExporter::Export(std::list<util::In
     // Copy data to the SHM
     auto shm_status = (ShmIpcStatus*)(shm_hdlr.get());
     auto head = (SingleProfile*)((char*)shm_hdlr.get() + sizeof(ShmIpcStatus));
-    for (int i = 0; i < to_export.size(); ++i) {
-        memcpy(head + i, to_export.data()[i], sizeof(SingleProfile));
+    // Copied by a worker on the node of each storage, so that the spans are read node locally
+    std::vector<int> nodes;
+    for (auto& elem : node_ranges) {
+        nodes.push_back(elem.first);
     }
+    util::RunOnNodes(nodes, [&](int node) {
+        for (auto& range : node_ranges.find(node)->second) {
+            for (size_t i = range.first; i < range.second; ++i) {
+                memcpy(head + i, to_export.data()[i], sizeof(SingleProfile));
+            }
+        }
+    });
 
     // Create Load
     auto load = ShmIpcLoad{};
@@ -83,50 +132,262 @@ __attribute__((optimize("O3"))) int mtmc::ShmExporter::Export(std::list<util::In
     snprintf(load.msg, 32, "%s", std::to_string(shm_hdlr.size()).c_str());
     load.shm_size = shm_hdlr.size();
     load.num_data = to_export.size();
-    load.trace_hash = mtmc_setting.trace_hash;
-    load.configs_id = mtmc_setting.configs_id;
-    load.cnsts_length = mtmc_setting.cnst_var.size();
+    FillLoad(&load, mtmc_setting, quality);
+
+    // Created before sending so that the post from the daemon can not be missed
+    handle->done_sem_ = std::make_shared<ipc::sync::semaphore>(ShmDoneSemName(shm_hdlr.name()).c_str(), 0);
+
+    // Channel send requests
+    auto msg = BuildMessage(load, {}, mtmc_setting);
+    bool status = chnl.send(msg.data(), msg.size());
+    Dprintf(FYEL("Send data %d. Waiting for response\n"), status);
+
+    if (!status) {
+        Dprintf(FRED("Send data to otle exporter failed. Make sure you have started mtmc otle exporter\n"));
+        return handle;
+    }
+
+    handle->status_ = 0;
+    handle->shm_status_ = shm_status;
+    handle->shm_hdlr_ = std::move(shm_hdlr);
+    return handle;
+}
+
+std::shared_ptr<mtmc::ShmSpanArena> mtmc::ShmExporter::CreateArena(size_t arena_bytes) {
+    if (arena_ && arena_->Valid()) {
+        return arena_;
+    }
+    arena_ = std::make_shared<ShmSpanArena>();
+    if (arena_->Create(arena_bytes) != 1) {
+        arena_.reset();
+        return nullptr;
+    }
+    return arena_;
+}
+
+std::shared_ptr<mtmc::ExportHandle> mtmc::ShmExporter::ExportArena(std::list<util::IndexVector<SingleProfile>>& profile_storage,
+                                                                   ProfilerSetting& mtmc_setting,
+                                                                   const SpanQualityCounts* quality) {
+
+    auto handle = std::make_shared<ExportHandle>();
+    handle->status_ = -1;
+
+    ipc::channel chnl = ipc::channel(DEFAULT_CHANNEL_NAME, ipc::sender);
+
+    if (!chnl.valid()) {
+        Dprintf("Export failed due to channel is not valid\n");
+        return handle;
+    }
+
+    // Describe filled part of every chunk. Invalid spans are filtered by the daemon, since data is not touched here
+    std::vector<ShmChunkDesc> descs;
+    size_t num_data = 0;
+    for (auto& vec : profile_storage) {
+        size_t remain = vec.Size();
+        for (size_t c = 0; c < vec.NumChunks() && remain > 0; ++c) {
+            size_t filled = remain < vec.ChunkLength() ? remain : vec.ChunkLength();
+            descs.push_back(ShmChunkDesc{.offset = arena_->OffsetOf(vec.GetChunk(c)), .num_data = filled});
+            remain -= filled;
+            num_data += filled;
+        }
+    }
+
+    auto load = ShmIpcLoad{};
+    load.data_offset = 0;
+    snprintf(load.shm_name, 32, "%s", arena_->Name());
+    snprintf(load.msg, 32, "%s", "ARENA");
+    load.shm_size = arena_->Size();
+    load.num_data = num_data;
+    FillLoad(&load, mtmc_setting, quality);
+    auto msg = BuildMessage(load, descs, mtmc_setting);
+
+    Dprintf(FCYN("Publish %lu chunks, %lu spans from arena %s\n"), descs.size(), num_data, arena_->Name());
+
+    auto shm_status = arena_->Status();
+    shm_status->done = 0;
+    cpl_barrier();
+    handle->done_sem_ = std::make_shared<ipc::sync::semaphore>(ShmDoneSemName(arena_->Name()).c_str(), 0);
+
+    bool status = chnl.send(msg.data(), msg.size());
+    if (!status) {
+        Dprintf(FRED("Send data to otle exporter failed. Make sure you have started mtmc otle exporter\n"));
+        return handle;
+    }
+
+    // Data is read in place, so the daemon reports done after it has converted all the spans
+    handle->status_ = 0;
+    handle->shm_status_ = shm_status;
+    return handle;
+}
+
+void mtmc::ShmExporter::FillLoad(ShmIpcLoad* load, ProfilerSetting& mtmc_setting, const SpanQualityCounts* quality) {
+    if (quality) {
+        load->num_spans = quality->num_spans;
+        load->num_migrated = quality->num_migrated;
+        load->num_mismatched = quality->num_mismatched;
+        load->num_dropped = quality->num_dropped;
+    }
+    load->trace_hash = mtmc_setting.trace_hash;
+    load->configs_id = mtmc_setting.configs_id;
+    load->cnsts_length = mtmc_setting.cnst_var.size();
     int cntr = 0;
     for (auto& cnst : mtmc_setting.cnst_var) {
         if (cnst == "SYSTEM_TSC_FREQ") {
-            load.cnsts[cntr] = mtmc::Env::GetTSCFrequencyHz();
+            load->cnsts[cntr] = mtmc::Env::GetTSCFrequencyHz();
         }
         else if (cnst == "DURATIONTIMEINMILLISECONDS") {
-            load.cnsts[cntr] = -2;
+            load->cnsts[cntr] = -2;
         }
         else {
             printf(FRED("Error. MTMC profiler encountered an unknown constant. The post-processing may fail."
                         "Unknown Constant: %s\n"), cnst.c_str());
-            load.cnsts[cntr] = -1;
+            load->cnsts[cntr] = -1;
         }
         ++cntr;
     }
+}
 
-    // Channel send requests
-    bool status = chnl.send(&load, sizeof(load));
-    Dprintf(FYEL("Send data %d. Waiting for response\n"), status);
+std::vector<char> mtmc::ShmExporter::BuildMessage(ShmIpcLoad& load, const std::vector<ShmChunkDesc>& descs,
+                                                  ProfilerSetting& mtmc_setting) {
+    std::vector<ShmEventName> names;
+    for (int group = 0; group < mtmc_setting.event_names.size(); ++group) {
+        for (auto& evt_name : mtmc_setting.event_names[group]) {
+            names.emplace_back();
+            names.back().group = group;
+            snprintf(names.back().name, SHM_EVENT_NAME_LEN, "%s", evt_name.c_str());
+        }
+    }
+    // Same order as the values in load.cnsts
+    for (auto& cnst : mtmc_setting.cnst_var) {
+        names.emplace_back();
+        names.back().group = -1;
+        snprintf(names.back().name, SHM_EVENT_NAME_LEN, "%s", cnst.c_str());
+    }
 
-    if (!status) {
-        Dprintf(FRED("Send data to otle exporter failed. Make sure you have started mtmc otle exporter\n"));
-        return -1;
+    std::vector<ShmMetricFormula> metrics;
+    for (int group = 0; group < mtmc_setting.metric_formulas.size(); ++group) {
+        for (auto& metric : mtmc_setting.metric_formulas[group]) {
+            if (metric.first.size() >= SHM_EVENT_NAME_LEN || metric.second.size() >= SHM_FORMULA_LEN) {
+                Dprintf(FRED("Metric %s is too long to send. The daemon will not emit it\n"), metric.first.c_str());
+                continue;
+            }
+            metrics.emplace_back();
+            metrics.back().group = group;
+            snprintf(metrics.back().name, SHM_EVENT_NAME_LEN, "%s", metric.first.c_str());
+            snprintf(metrics.back().formula, SHM_FORMULA_LEN, "%s", metric.second.c_str());
+        }
     }
 
-    // Wait for request done;
-    for (int i = 0; i < 1000; ++i) {
-        if (!shm_status->done) {
-            usleep(100 * 1e3);
+    load.num_chunks = descs.size();
+    load.num_names = names.size();
+    load.num_metrics = metrics.size();
+
+    size_t desc_bytes = descs.size() * sizeof(ShmChunkDesc);
+    size_t name_bytes = names.size() * sizeof(ShmEventName);
+    size_t metric_bytes = metrics.size() * sizeof(ShmMetricFormula);
+    std::vector<char> msg(sizeof(ShmIpcLoad) + desc_bytes + name_bytes + metric_bytes);
+    memcpy(msg.data(), &load, sizeof(ShmIpcLoad));
+    memcpy(msg.data() + sizeof(ShmIpcLoad), descs.data(), desc_bytes);
+    memcpy(msg.data() + sizeof(ShmIpcLoad) + desc_bytes, names.data(), name_bytes);
+    memcpy(msg.data() + sizeof(ShmIpcLoad) + desc_bytes + name_bytes, metrics.data(), metric_bytes);
+    return msg;
+}
+
+// ------------------------------- ExportHandle -------------------------------------
+
+bool mtmc::ExportHandle::Done() {
+    if (status_ == 0 && shm_status_ && shm_status_->done) {
+        status_ = 1;
+        if (shm_hdlr_.valid()) {
+            shm_hdlr_.release();
         }
-        else {
-            break;
+    }
+    return status_ == 1;
+}
+
+int mtmc::ExportHandle::Wait(uint64_t timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!Done()) {
+        if (status_ == -1) {
+            return -1;
         }
-        if (i == 1000 - 1) {
-            Dprintf(FRED("Timeout and does not receive done signale from mtmc otle exporter\n"));
+        auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remain.count() <= 0) {
+            Dprintf(FRED("Timeout and does not receive done signal from mtmc otle exporter\n"));
+            status_ = -1;
             return -1;
         }
+        // A stale post from a previously timed out export only causes one more round of the loop
+        done_sem_->wait(remain.count());
     }
-    Dprintf(FGRN("OTLE Exporter has received the payload.\n"));
-    shm_hdlr.release();
+    return 1;
+}
 
-    return 0;
+// ------------------------------- ShmSpanArena -------------------------------------
+
+int mtmc::ShmSpanArena::Create(size_t arena_bytes) {
+    chunk_bytes_ = sizeof(SingleProfile) << SHM_ARENA_CHUNK_SHIFT;
+    if (arena_bytes < chunk_bytes_) {
+        Dprintf(FRED("Shm arena size %lu is smaller than a single chunk %lu\n"), arena_bytes, chunk_bytes_);
+        return -1;
+    }
+    num_chunks_ = arena_bytes / chunk_bytes_;
+    next_chunk_ = 0;
+
+    std::string name = "mtmc_arena_" + std::to_string(getpid()) + "_" + std::to_string(Env::rdtsc() % 100000000);
+    // Fresh shm pages are zero filled by the kernel, so no memset is needed
+    shm_hdlr_ = ipc::shm::handle(name.c_str(), getpagesize() + num_chunks_ * chunk_bytes_, ipc::shm::create);
+    if (!shm_hdlr_.valid()) {
+        Dprintf(FRED("Create shm arena %s failed\n"), name.c_str());
+        return -1;
+    }
+    Dprintf(FCYN("Shm arena %s created. %lu chunks, %.2f MB\n"), shm_hdlr_.name(), num_chunks_, float(shm_hdlr_.size())/1e6);
+    return 1;
+}
+
+bool mtmc::ShmSpanArena::Valid() const {
+    return shm_hdlr_.valid();
+}
+
+mtmc::SingleProfile* mtmc::ShmSpanArena::AcquireChunk() {
+    std::lock_guard<std::mutex> lock(mux_);
+    if (!free_chunks_.empty()) {
+        auto chunk = free_chunks_.back();
+        free_chunks_.pop_back();
+        return chunk;
+    }
+    if (!shm_hdlr_.valid() || next_chunk_ >= num_chunks_) {
+        Dprintf(FRED("Shm arena is exhausted. %lu chunks in use\n"), next_chunk_);
+        return nullptr;
+    }
+    auto chunk = (SingleProfile*)((char*)shm_hdlr_.get() + getpagesize() + next_chunk_ * chunk_bytes_);
+    ++next_chunk_;
+    return chunk;
+}
+
+void mtmc::ShmSpanArena::ReleaseChunk(SingleProfile* chunk) {
+    std::lock_guard<std::mutex> lock(mux_);
+    free_chunks_.push_back(chunk);
+}
+
+mtmc::ShmIpcStatus* mtmc::ShmSpanArena::Status() const {
+    return (ShmIpcStatus*)shm_hdlr_.get();
+}
+
+uint64_t mtmc::ShmSpanArena::OffsetOf(const SingleProfile* chunk) const {
+    return (const char*)chunk - (const char*)shm_hdlr_.get();
 }
 
+const char* mtmc::ShmSpanArena::Name() const {
+    return shm_hdlr_.name();
+}
+
+size_t mtmc::ShmSpanArena::Size() const {
+    return shm_hdlr_.size();
+}
+
+mtmc::ShmSpanArena::~ShmSpanArena() {
+    if (shm_hdlr_.valid()) {
+        shm_hdlr_.release();
+    }
+}
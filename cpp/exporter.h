@@ -15,14 +15,23 @@
 #define MTMC_EXPORTER_H
 
 #include "libipc/ipc.h"
+#include "libipc/semaphore.h"
 #include "mtmc_profiler.h"
 #include <iostream>
 #include <cstring>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
 
 namespace mtmc {
 
 #define DEFAULT_CHANNEL_NAME "mtmc_ipc_shm_channel_0"
 
+// Number of SingleProfile in one shm arena chunk is (1 << SHM_ARENA_CHUNK_SHIFT)
+#define SHM_ARENA_CHUNK_SHIFT 10
+
     struct ShmIpcLoad {
         char msg[32];      // Message of this operation
         char shm_name[32]; // Name of the shared memory
@@ -33,6 +42,13 @@ namespace mtmc {
         uint64_t cnsts[16];
         uint64_t trace_hash;
         int configs_id;
+        int num_chunks;    // > 0 means data stays in the arena and num_chunks ShmChunkDesc follow this load
+        int num_names;     // Number of ShmEventName following the chunk descriptors
+        int num_metrics;   // Number of ShmMetricFormula following the event names
+        uint64_t num_spans;      // Data quality counters of the producer, see SpanQuality
+        uint64_t num_migrated;
+        uint64_t num_mismatched;
+        uint64_t num_dropped;
     };
 
     struct ShmIpcStatus {
@@ -40,6 +56,105 @@ namespace mtmc {
         char placeholder[60];
     };
 
+    // Name of the semaphore the daemon posts once the payload in shm_name is done
+    inline std::string ShmDoneSemName(const char* shm_name) {
+        return std::string(shm_name) + "_done";
+    }
+
+#define SHM_EVENT_NAME_LEN 64
+
+    // Name of an event or a constant, so that the daemon can emit typed attributes named after it
+    struct ShmEventName {
+        int group;         // Config group of the event. -1 for a constant, in the order of ShmIpcLoad::cnsts
+        char name[SHM_EVENT_NAME_LEN];
+    };
+
+#define SHM_FORMULA_LEN 512
+
+    // Formula of a metric over the event and constant names, so that the daemon can emit the metric of every span
+    struct ShmMetricFormula {
+        int group;         // Config group whose events the formula uses
+        char name[SHM_EVENT_NAME_LEN];
+        char formula[SHM_FORMULA_LEN];
+    };
+
+    // Location of a chunk of SingleProfile inside the shm arena
+    struct ShmChunkDesc {
+        uint64_t offset;   // Offset to the start of the arena
+        uint64_t num_data; // Number of SingleProfile filled in this chunk
+    };
+
+    /**
+     * Named shared memory that per thread storage is allocated from. The daemon maps the same memory, so exporting only
+     * needs to publish the chunk descriptors.
+     */
+    class ShmSpanArena : public util::ChunkProvider<SingleProfile> {
+    public:
+        ShmSpanArena() = default;
+        ~ShmSpanArena() override;
+
+        /**
+         * Create the named shm segment
+         * @param arena_bytes: Total size of the arena. Rounded down to a multiple of the chunk size
+         * @return 1 for success, -1 for failed
+         */
+        int Create(size_t arena_bytes);
+
+        bool Valid() const;
+
+        SingleProfile* AcquireChunk() override;
+
+        void ReleaseChunk(SingleProfile* chunk) override;
+
+        size_t ChunkShift() const override {
+            return SHM_ARENA_CHUNK_SHIFT;
+        }
+
+        ShmIpcStatus* Status() const;
+
+        uint64_t OffsetOf(const SingleProfile* chunk) const;
+
+        const char* Name() const;
+
+        size_t Size() const;
+
+    private:
+        ipc::shm::handle shm_hdlr_;
+        size_t chunk_bytes_ = 0;
+        size_t num_chunks_ = 0;
+        size_t next_chunk_ = 0;
+        std::vector<SingleProfile*> free_chunks_;
+        std::mutex mux_;
+    };
+
+    /**
+     * Completion handle of an asynchronous export. In copy mode it keeps the exported shm alive until the daemon has
+     * opened it.
+     */
+    class ExportHandle {
+    public:
+        /**
+         * Block until the daemon reports done or timeout. Wakes up as soon as the daemon posts the done semaphore
+         * @param timeout_ms: Max time to wait in milliseconds
+         * @return 1 for done, -1 for failed or timeout
+         */
+        int Wait(uint64_t timeout_ms);
+
+        /**
+         * Non-blocking check of the completion
+         * @return true if the daemon has reported done
+         */
+        bool Done();
+
+    private:
+        friend class ShmExporter;
+
+        int status_ = 0;  // 0 pending, 1 done, -1 failed
+        ShmIpcStatus* shm_status_ = nullptr;
+        ipc::shm::handle shm_hdlr_;  // Only valid in copy mode. The arena outlives the handle
+        std::shared_ptr<ipc::sync::semaphore> done_sem_;
+    };
+
 class ShmExporter : public Exporter {
 public:
     ShmExporter();
@@ -48,6 +163,22 @@ public:
     int Export(std::list<util::IndexVector<SingleProfile>>& profile_storage,
                ProfilerSetting mtmc_setting) override;
 
+    /**
+     * Send the payload to the daemon without waiting for it to be done
+     * @param quality: Data quality counters reported in the load. Zero if nullptr
+     * @return Completion handle. Never nullptr, failed export gives a handle whose Wait() returns -1
+     */
+    std::shared_ptr<ExportHandle> ExportAsync(std::list<util::IndexVector<SingleProfile>>& profile_storage,
+                                              ProfilerSetting mtmc_setting,
+                                              const SpanQualityCounts* quality = nullptr);
+
+    /**
+     * Create the shm arena that per thread storage should be allocated from
+     * @param arena_bytes: Size of the arena in bytes
+     * @return The arena or nullptr if failed. Storage allocated from it must hold this until the storage is freed
+     */
+    std::shared_ptr<ShmSpanArena> CreateArena(size_t arena_bytes);
+
     ShmExporter(const ShmExporter&) = delete;
     ShmExporter& operator=(const ShmExporter&) = delete;
 
@@ -57,7 +188,22 @@ public:
     }
 
 private:
+    std::shared_ptr<ExportHandle> ExportCopy(std::list<util::IndexVector<SingleProfile>>& profile_storage,
+                                             ProfilerSetting& mtmc_setting, const SpanQualityCounts* quality);
+
+    std::shared_ptr<ExportHandle> ExportArena(std::list<util::IndexVector<SingleProfile>>& profile_storage,
+                                              ProfilerSetting& mtmc_setting, const SpanQualityCounts* quality);
+
+    void FillLoad(ShmIpcLoad* load, ProfilerSetting& mtmc_setting, const SpanQualityCounts* quality);
+
+    /**
+     * Build the channel message: the load, then chunk descriptors, then event and constant names
+     */
+    std::vector<char> BuildMessage(ShmIpcLoad& load, const std::vector<ShmChunkDesc>& descs,
+                                   ProfilerSetting& mtmc_setting);
+
     std::string shm_name_;
+    std::shared_ptr<ShmSpanArena> arena_;
 
 };
 
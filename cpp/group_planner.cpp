@@ -0,0 +1,353 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "group_planner.h"
+#include "perfmon_config.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cpuid.h>
+
+using json = nlohmann::json;
+
+namespace mtmc {
+
+    namespace {
+        // Raw configs of the fixed counters, in counter order
+        const uint64_t FIXED_CONFIGS[] = {
+                0x00c0,   // INST_RETIRED.ANY
+                0x003c,   // CPU_CLK_UNHALTED.THREAD
+                0x0300,   // CPU_CLK_UNHALTED.REF_TSC, fixed counter only
+                0x0400,   // TOPDOWN.SLOTS, fixed counter only
+        };
+#define NUM_FIXED_COUNTERS (sizeof(FIXED_CONFIGS) / sizeof(uint64_t))
+#define SLOTS_CONFIG 0x0400
+#define PERF_METRICS_CONFIG 0x8000
+
+        int FixedCounter(uint64_t config) {
+            for (size_t i = 0; i < NUM_FIXED_COUNTERS; ++i) {
+                if (FIXED_CONFIGS[i] == config) return i;
+            }
+            return -1;
+        }
+
+        bool FixedOnly(uint64_t config) {
+            return config == 0x0300 || config == SLOTS_CONFIG;
+        }
+
+        // Kuhn's augmenting path, try to move the event on counter c elsewhere
+        bool Augment(const std::vector<uint32_t>& masks, int e, std::vector<int>* owner, std::vector<bool>* seen) {
+            for (int c = 0; c < (int)owner->size(); ++c) {
+                if (!(masks[e] & (1u << c)) || (*seen)[c]) continue;
+                (*seen)[c] = true;
+                if ((*owner)[c] < 0 || Augment(masks, (*owner)[c], owner, seen)) {
+                    (*owner)[c] = e;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool IsEventChar(char c) {
+            return isalnum((unsigned char)c) || c == '_' || c == '.' || c == ':';
+        }
+    }
+
+    GroupPlanner::GroupPlanner(int num_gp_counters) {
+        if (num_gp_counters <= 0) num_gp_counters = DetectGpCounters();
+        num_gp_counters_ = std::min(std::max(num_gp_counters, 1), 32);
+    }
+
+    int GroupPlanner::AddEvent(const std::string& name, const std::string& encoding, uint32_t counter_mask) {
+        auto hw_evt_cfg = util::HexToVec(encoding);
+        if (hw_evt_cfg.size() != 5) {
+            Dprintf(FRED("Event %s do not have proper counter info: %s\n"), name.c_str(), encoding.c_str());
+            return -1;
+        }
+        if (event_idx_.count(name)) return 1;
+        uint64_t config = X86Config(hw_evt_cfg[0], hw_evt_cfg[1], hw_evt_cfg[2], hw_evt_cfg[3], hw_evt_cfg[4]);
+        event_idx_[name] = events_.size();
+        events_.push_back(Event{name, encoding, config, counter_mask});
+        return 1;
+    }
+
+    int GroupPlanner::AddMetric(const std::string& name, const std::vector<std::string>& events) {
+        Unit unit;
+        unit.metrics.push_back(name);
+        for (auto& evt : events) {
+            auto itr = event_idx_.find(evt);
+            if (itr == event_idx_.end()) {
+                Dprintf(FRED("Metric %s uses event %s that is not in the event list\n"), name.c_str(), evt.c_str());
+                return -1;
+            }
+            if (std::find(unit.events.begin(), unit.events.end(), itr->second) == unit.events.end()) {
+                unit.events.push_back(itr->second);
+            }
+        }
+        metric_units_.push_back(unit);
+        return 1;
+    }
+
+    int GroupPlanner::AddMetricFormula(const std::string& name, const std::string& formula) {
+        std::vector<std::string> events;
+        for (size_t i = 0; i < formula.size();) {
+            if (!IsEventChar(formula[i])) {
+                ++i;
+                continue;
+            }
+            size_t j = i;
+            while (j < formula.size() && IsEventChar(formula[j])) ++j;
+            auto token = formula.substr(i, j - i);
+            if (event_idx_.count(token)) events.push_back(token);
+            i = j;
+        }
+        if (events.empty()) {
+            Dprintf(FRED("Metric %s uses none of the events in the event list\n"), name.c_str());
+            return -1;
+        }
+        return AddMetric(name, events);
+    }
+
+    int GroupPlanner::Plan(std::vector<PlannedGroup>* groups, bool* minimal) const {
+        int slots = SlotsEvent();
+        std::vector<Unit> units = metric_units_;
+        std::vector<bool> used(events_.size(), false);
+        for (auto& unit : units) {
+            for (int e : unit.events) used[e] = true;
+        }
+        for (int e = 0; e < (int)events_.size(); ++e) {
+            if (!used[e]) units.push_back(Unit{{e}, {}});
+        }
+
+        // PERF_METRICS is read relative to the slots leader
+        for (auto& unit : units) {
+            bool metrics = false, has_slots = false;
+            for (int e : unit.events) {
+                metrics |= events_[e].config == PERF_METRICS_CONFIG;
+                has_slots |= e == slots;
+            }
+            if (!metrics || has_slots) continue;
+            if (slots < 0) {
+                Dprintf(FRED("PERF_METRICS is used without a TOPDOWN.SLOTS event\n"));
+                return -1;
+            }
+            unit.events.push_back(slots);
+        }
+
+        for (auto& unit : units) {
+            if (!Fits(unit.events)) {
+                Dprintf(FRED("%s does not fit into %d general purpose counters\n"),
+                        unit.metrics.empty() ? events_[unit.events[0]].name.c_str() : unit.metrics[0].c_str(),
+                        num_gp_counters_);
+                return -1;
+            }
+        }
+
+        // Largest first. Equal sizes keep the order they are given in
+        std::stable_sort(units.begin(), units.end(), [](const Unit& a, const Unit& b) {
+            return a.events.size() > b.events.size();
+        });
+
+        std::vector<Unit> planned;
+        for (auto& unit : units) {
+            int best = -1;
+            size_t best_shared = 0;
+            for (int g = 0; g < (int)planned.size(); ++g) {
+                auto merged = planned[g].events;
+                size_t shared = 0;
+                for (int e : unit.events) {
+                    if (std::find(merged.begin(), merged.end(), e) != merged.end()) ++shared;
+                    else merged.push_back(e);
+                }
+                if ((best < 0 || shared > best_shared) && Fits(merged)) {
+                    best = g;
+                    best_shared = shared;
+                }
+            }
+            if (best < 0) {
+                planned.push_back(Unit{});
+                best = planned.size() - 1;
+            }
+            auto& group = planned[best];
+            for (int e : unit.events) {
+                if (std::find(group.events.begin(), group.events.end(), e) == group.events.end()) {
+                    group.events.push_back(e);
+                }
+            }
+            group.metrics.insert(group.metrics.end(), unit.metrics.begin(), unit.metrics.end());
+        }
+
+        // First fit decreasing is not always the fewest groups. Search below its count until the budget runs out
+        std::vector<Unit> current;
+        int budget = PLANNER_SEARCH_NODES;
+        Search(units, 0, &current, &planned, &budget);
+        if (minimal) *minimal = budget > 0;
+
+        groups->clear();
+        for (auto& group : planned) {
+            // Slots leads, PERF_METRICS follows, then the events in the order they are added
+            std::sort(group.events.begin(), group.events.end(), [this, slots](int a, int b) {
+                int rank_a = a == slots ? 0 : events_[a].config == PERF_METRICS_CONFIG ? 1 : 2;
+                int rank_b = b == slots ? 0 : events_[b].config == PERF_METRICS_CONFIG ? 1 : 2;
+                return rank_a != rank_b ? rank_a < rank_b : a < b;
+            });
+            groups->emplace_back();
+            for (int e : group.events) {
+                groups->back().events.push_back(events_[e].name);
+            }
+            groups->back().metrics = group.metrics;
+        }
+        return groups->size();
+    }
+
+    int GroupPlanner::PlanConfigJson(const json& plan, json* config) {
+        if (config == nullptr) return -1;
+        try {
+            if (!plan.contains("Events") || !plan.contains("Metrics"))
+                throw std::runtime_error("A plan config needs \"Events\" and \"Metrics\"");
+
+            GroupPlanner planner(plan.contains("GpCounters") ? plan["GpCounters"].get<int>() : 0);
+            for (auto& evt : plan["Events"].items()) {
+                uint32_t mask = 0;
+                if (plan.contains("CounterMasks") && plan["CounterMasks"].contains(evt.key())) {
+                    mask = std::stoul(plan["CounterMasks"][evt.key()].get<std::string>(), nullptr, 16);
+                }
+                if (planner.AddEvent(evt.key(), evt.value().get<std::string>(), mask) != 1)
+                    throw std::runtime_error("Invalid event " + evt.key());
+            }
+            for (auto& metric : plan["Metrics"].items()) {
+                int stat = metric.value().is_string() ?
+                           planner.AddMetricFormula(metric.key(), metric.value().get<std::string>()) :
+                           planner.AddMetric(metric.key(), metric.value().get<std::vector<std::string>>());
+                if (stat != 1) throw std::runtime_error("Invalid metric " + metric.key());
+            }
+
+            std::vector<PlannedGroup> groups;
+            bool minimal = false;
+            if (planner.Plan(&groups, &minimal) < 0) throw std::runtime_error("Can not plan the event groups");
+
+            *config = json::object();
+            for (auto& elem : plan.items()) {
+                if (elem.key() == "Events" || elem.key() == "Metrics" || elem.key() == "CounterMasks" ||
+                    elem.key() == "GpCounters") continue;
+                (*config)[elem.key()] = elem.value();
+            }
+            json configs = json::array();
+            for (auto& group : groups) {
+                json cfg;
+                cfg["Events"] = json::object();
+                for (auto& evt : group.events) {
+                    cfg["Events"][evt] = plan["Events"][evt];
+                }
+                cfg["EventList"] = group.events;
+                cfg["Metrics"] = group.metrics;
+                // Formulas go on to the exporter daemon, which emits every metric per span
+                for (auto& metric : group.metrics) {
+                    if (plan["Metrics"][metric].is_string()) cfg["MetricFormulas"][metric] = plan["Metrics"][metric];
+                }
+                cfg["Constants"] = json::array();
+                configs.push_back(cfg);
+            }
+            (*config)["Configs"] = configs;
+            Dprintf(FGRN("Planned %lu events into %lu groups%s\n"), plan["Events"].size(), groups.size(),
+                    minimal ? "" : ". Search budget ran out, fewer groups may exist");
+        }
+        catch (const std::exception& e) {
+            printf(FRED("%s\n"), e.what());
+            return -1;
+        }
+        return 1;
+    }
+
+    int GroupPlanner::DetectGpCounters() {
+        unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+        // EAX[7:0] is the architectural perfmon version, 0 if there is none
+        if (!__get_cpuid(0x0a, &eax, &ebx, &ecx, &edx) || (eax & 0xff) == 0 || ((eax >> 8) & 0xff) == 0) {
+            Dprintf(FRED("CPUID does not enumerate the PMU. Assume %d general purpose counters\n"),
+                    PLANNER_FALLBACK_GP_COUNTERS);
+            return PLANNER_FALLBACK_GP_COUNTERS;
+        }
+        return (eax >> 8) & 0xff;
+    }
+
+    // ----------------------------------- Private ----------------------------------------
+
+    bool GroupPlanner::Fits(const std::vector<int>& events) const {
+        if (events.size() > GP_COUNTER) return false;
+
+        bool fixed_used[NUM_FIXED_COUNTERS] = {};
+        std::vector<uint32_t> masks;
+        uint32_t all = num_gp_counters_ == 32 ? UINT32_MAX : (1u << num_gp_counters_) - 1;
+        for (int e : events) {
+            auto& evt = events_[e];
+            if (evt.config == PERF_METRICS_CONFIG) continue;
+            int fixed = FixedCounter(evt.config);
+            if (fixed >= 0 && !fixed_used[fixed]) {
+                fixed_used[fixed] = true;
+                continue;
+            }
+            if (FixedOnly(evt.config)) return false;
+            masks.push_back(evt.counter_mask ? evt.counter_mask & all : all);
+        }
+        if ((int)masks.size() > num_gp_counters_) return false;
+
+        std::vector<int> owner(num_gp_counters_, -1);
+        for (int e = 0; e < (int)masks.size(); ++e) {
+            std::vector<bool> seen(num_gp_counters_, false);
+            if (!Augment(masks, e, &owner, &seen)) return false;
+        }
+        return true;
+    }
+
+    // Depth first over the group of every unit. Only plans with fewer groups than the best one are followed
+    void GroupPlanner::Search(const std::vector<Unit>& units, size_t next, std::vector<Unit>* current,
+                              std::vector<Unit>* best, int* budget) const {
+        if (*budget <= 0 || current->size() >= best->size()) return;
+        --*budget;
+        if (next == units.size()) {
+            *best = *current;
+            return;
+        }
+
+        auto& unit = units[next];
+        for (size_t g = 0; g < current->size(); ++g) {
+            auto& group = (*current)[g];
+            size_t num_events = group.events.size(), num_metrics = group.metrics.size();
+            for (int e : unit.events) {
+                if (std::find(group.events.begin(), group.events.begin() + num_events, e) ==
+                    group.events.begin() + num_events) group.events.push_back(e);
+            }
+            if (Fits(group.events)) {
+                group.metrics.insert(group.metrics.end(), unit.metrics.begin(), unit.metrics.end());
+                Search(units, next + 1, current, best, budget);
+            }
+            // Search only appends, so the group is restored by cutting back
+            (*current)[g].events.resize(num_events);
+            (*current)[g].metrics.resize(num_metrics);
+        }
+        // A new group for the unit. Opening one at a time avoids trying the same plan with its groups reordered
+        if (current->size() + 1 < best->size()) {
+            current->push_back(unit);
+            Search(units, next + 1, current, best, budget);
+            current->pop_back();
+        }
+    }
+
+    int GroupPlanner::SlotsEvent() const {
+        for (int e = 0; e < (int)events_.size(); ++e) {
+            if (events_[e].config == SLOTS_CONFIG) return e;
+        }
+        return -1;
+    }
+}
@@ -0,0 +1,126 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_GROUP_PLANNER_H
+#define MTMC_GROUP_PLANNER_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+namespace mtmc {
+
+// General purpose counters assumed if CPUID does not enumerate the architectural PMU, eg. in a guest without a vPMU
+#define PLANNER_FALLBACK_GP_COUNTERS 4
+// Nodes the search for fewer groups than first fit decreasing may visit before it keeps the best plan found so far
+#define PLANNER_SEARCH_NODES 200000
+
+    struct PlannedGroup {
+        std::vector<std::string> events;   // Leader first. TOPDOWN.SLOTS and PERF_METRICS lead a topdown group
+        std::vector<std::string> metrics;  // Metrics whose events are all in this group
+    };
+
+    /**
+     * Packs events into few multiplex groups, so that every group can be scheduled on the core at once.
+     * The events of a metric are kept in one group, so the metric is computed from deltas of the same time slice.
+     *
+     * A group fits if every event gets a counter: INST_RETIRED.ANY, CPU_CLK_UNHALTED.THREAD, REF_TSC and TOPDOWN.SLOTS
+     * take their fixed counter (a second INST_RETIRED.ANY or CPU_CLK_UNHALTED.THREAD falls back to a general purpose
+     * one), PERF_METRICS needs TOPDOWN.SLOTS as the leader and takes no counter, and the rest are matched to the general
+     * purpose counters allowed by their counter mask. Packing starts first fit decreasing, preferring the group that
+     * already counts most of a metric's events, then a search bounded by PLANNER_SEARCH_NODES looks for a plan with
+     * fewer groups. The result is the fewest groups possible only if the search completes.
+     */
+    class GroupPlanner {
+    public:
+        /**
+         * @param num_gp_counters: General purpose counters per logical core. 0 to detect them, see DetectGpCounters
+         */
+        explicit GroupPlanner(int num_gp_counters = 0);
+
+        /**
+         * @param encoding: "event,umask,inv,cmask,edge" in hex, the format of the "Events" of a config
+         * @param counter_mask: Bit i set if the event can count on general purpose counter i. 0 for any counter
+         * @return 1 for success, -1 for a malformed encoding
+         */
+        int AddEvent(const std::string& name, const std::string& encoding, uint32_t counter_mask = 0);
+
+        /**
+         * @param events: Names of added events the metric is computed from
+         * @return 1 for success, -1 if an event was not added
+         */
+        int AddMetric(const std::string& name, const std::vector<std::string>& events);
+
+        /**
+         * Same as above, the events are the added event names found in the formula
+         */
+        int AddMetricFormula(const std::string& name, const std::string& formula);
+
+        /**
+         * Events not used by any metric are planned as well
+         * @param minimal: Set to whether the search completed, so no plan has fewer groups. Optional
+         * @return number of groups; -1 if a metric does not fit into a group on its own
+         */
+        int Plan(std::vector<PlannedGroup>* groups, bool* minimal = nullptr) const;
+
+        /**
+         * Expand a plan config into an MTMC config with "Configs"
+         *  {
+         *      "Events": {"INST_RETIRED.ANY": "c0,00,0,0,0", ...},
+         *      "Metrics": {"CPI": ["CPU_CLK_UNHALTED.THREAD", "INST_RETIRED.ANY"], "IPC": "INST_RETIRED.ANY / ...", ...},
+         *      "CounterMasks": {"MEMORY_ACTIVITY.STALLS_L1D_MISS": "0f", ...} (Optional),
+         *      "GpCounters": 8 (Optional, overrides the detected number),
+         *      ... general settings, copied as they are
+         *  }
+         * @return 1 for success, -1 for failed
+         */
+        static int PlanConfigJson(const nlohmann::json& plan, nlohmann::json* config);
+
+        /**
+         * General purpose counters per logical core from CPUID.0AH:EAX[15:8]. Already halved by HT where the sibling
+         * threads share them, eg. 4 instead of 8 before Icelake
+         * @return number of counters; PLANNER_FALLBACK_GP_COUNTERS if the leaf is not enumerated
+         */
+        static int DetectGpCounters();
+
+    private:
+        struct Event {
+            std::string name;
+            std::string encoding;
+            uint64_t config;
+            uint32_t counter_mask;
+        };
+
+        // Events a group needs to count a metric, or a single event not used by any metric
+        struct Unit {
+            std::vector<int> events;
+            std::vector<std::string> metrics;
+        };
+
+        bool Fits(const std::vector<int>& events) const;
+        void Search(const std::vector<Unit>& units, size_t next, std::vector<Unit>* current, std::vector<Unit>* best,
+                    int* budget) const;
+        int SlotsEvent() const;
+
+        int num_gp_counters_;
+        std::vector<Event> events_;
+        std::map<std::string, int> event_idx_;
+        std::vector<Unit> metric_units_;
+    };
+}
+
+#endif //MTMC_GROUP_PLANNER_H
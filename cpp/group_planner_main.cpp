@@ -0,0 +1,49 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include <cstdio>
+#include <fstream>
+
+#include "group_planner.h"
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        printf("Usage: %s plan.json config.json\n"
+               "  Pack the \"Events\" and \"Metrics\" of a plan config into the \"Configs\" groups of an MTMC config\n",
+               argv[0]);
+        return 1;
+    }
+
+    nlohmann::json plan, config;
+    std::ifstream in(argv[1]);
+    try {
+        in >> plan;
+    }
+    catch (const std::exception& e) {
+        printf("Can not read %s: %s\n", argv[1], e.what());
+        return 1;
+    }
+    if (mtmc::GroupPlanner::PlanConfigJson(plan, &config) != 1) return 1;
+
+    std::ofstream out(argv[2]);
+    out << config.dump(4) << std::endl;
+    if (!out.good()) {
+        printf("Can not write %s\n", argv[2]);
+        return 1;
+    }
+    for (auto& cfg : config["Configs"]) {
+        printf("%s\n", cfg["EventList"].dump().c_str());
+    }
+    return 0;
+}
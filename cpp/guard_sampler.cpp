@@ -14,38 +14,76 @@
 
 #include "guard_sampler.h"
 
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 namespace mtmc {
 
-    GuardSampler::GuardSampler() {
-        sampler_pid = -1;
-    }
+    GuardSampler::GuardSampler() = default;
 
     void GuardSampler::Read(const std::string& data_path) {
-        if (sampler_pid != -1) {
+        if (running_.load()) {
             Dprintf(FRED("Sampler already running!\n"));
             return;
         }
 
-        pid_t pid = fork();
-
-        if (pid < 0) {
-            Dprintf(FRED("Error forking a new process for perf reading\n"));
+        int tp_id = -1;
+        if (ReadSwitchFormat(&tp_id, &format_) == -1) {
+            Dprintf(FRED("Can not read the sched:sched_switch tracepoint. Is tracefs mounted?\n"));
             return;
         }
+        records_.clear();
+        lost_ = 0;
+        data_path_ = data_path;
 
-        if (pid == 0) {
-            Dprintf(FGRN("Child process\n"));
-            const char* const argv[]  = {"perf", "record", "-e", "sched:sched_switch", "-k" ,"1", "-T", "-o" ,data_path.c_str(), NULL};
-            const char* const arge[] = {NULL};
-
-            execve("/bin/perf", const_cast<char*const*>(argv), const_cast<char*const*>(arge));
+        streams_.clear();
+        size_t page = getpagesize();
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.config = tp_id;
+        attr.sample_period = 1;
+        attr.sample_type = PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_RAW;
+        attr.disabled = 1;
+        // Same clock as the spans, so no conversion is needed afterwards
+        attr.use_clockid = 1;
+        attr.clockid = CLOCK_REALTIME;
+        attr.watermark = 1;
+        attr.wakeup_watermark = GUARD_RING_PAGES * page / 4;
+        for (int cpu : util::GetCurrAvailableCPUList()) {
+            int fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+            if (fd < 0) {
+                Dprintf(FRED("Open sched_switch on cpu %d failed: %s\n"), cpu, strerror(errno));
+                CloseStreams();
+                return;
+            }
+            size_t mmap_bytes = (GUARD_RING_PAGES + 1) * page;
+            void* base = mmap(nullptr, mmap_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (base == MAP_FAILED) {
+                Dprintf(FRED("Map sched_switch ring buffer of cpu %d failed: %s\n"), cpu, strerror(errno));
+                close(fd);
+                CloseStreams();
+                return;
+            }
+            streams_.push_back(CpuStream{cpu, fd, base, mmap_bytes});
         }
-        else {
-            clock_gettime(CLOCK_MONOTONIC, &timeinfo.time_mo[0]);
-            clock_gettime(CLOCK_REALTIME, &timeinfo.time_rl[0]);
-            sampler_pid = pid;
-            Dprintf(FGRN("Subprocess {%d} start collecting context switch information\n"), (int)pid);
+        if (pipe2(wake_fd_, O_CLOEXEC) != 0) {
+            CloseStreams();
+            return;
         }
+
+        clock_gettime(CLOCK_MONOTONIC, &timeinfo.time_mo[0]);
+        clock_gettime(CLOCK_REALTIME, &timeinfo.time_rl[0]);
+        for (auto& stream : streams_) {
+            ioctl(stream.fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        running_.store(true);
+        collector_ = std::thread(&GuardSampler::Collect, this);
+        Dprintf(FGRN("Start collecting context switch information on %lu cpus\n"), streams_.size());
     }
 
     void GuardSampler::TimeExport(const std::string &data_path) {
@@ -61,16 +99,177 @@ namespace mtmc {
         out.close();
     }
 
+    const std::map<int, std::vector<SchedSwitchRecord>>& GuardSampler::Records() const {
+        return records_;
+    }
+
+    uint64_t GuardSampler::Lost() const {
+        return lost_;
+    }
+
     GuardSampler::~GuardSampler() {
         Stop();
     }
 
     void GuardSampler::Stop() {
-        if (sampler_pid > 0 ) {
-            clock_gettime(CLOCK_MONOTONIC, &timeinfo.time_mo[1]);
-            clock_gettime(CLOCK_REALTIME, &timeinfo.time_rl[1]);
-            kill(sampler_pid, SIGINT);
+        if (!running_.exchange(false)) return;
+        clock_gettime(CLOCK_MONOTONIC, &timeinfo.time_mo[1]);
+        clock_gettime(CLOCK_REALTIME, &timeinfo.time_rl[1]);
+        for (auto& stream : streams_) {
+            ioctl(stream.fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+        char c = 0;
+        if (write(wake_fd_[1], &c, 1) < 0) {
+            Dprintf(FRED("Guard sampler wake up failed\n"));
+        }
+        if (collector_.joinable()) collector_.join();
+
+        // Records written between the last poll and the disable
+        for (auto& stream : streams_) {
+            Drain(stream);
+        }
+        CloseStreams();
+
+        if (lost_ > 0) {
+            Dprintf(FRED("%lu context switch records lost. The ring buffers were full\n"), lost_);
+        }
+        if (!data_path_.empty()) {
+            WriteSchedSwitchBinary(data_path_, records_, 0);
+        }
+    }
+
+    // ----------------------------------- Private ----------------------------------------
+
+    int GuardSampler::ReadSwitchFormat(int* tp_id, SwitchFormat* format) {
+        const char* const dirs[] = {"/sys/kernel/tracing/events/sched/sched_switch/",
+                                    "/sys/kernel/debug/tracing/events/sched/sched_switch/"};
+        for (auto dir : dirs) {
+            std::ifstream id_fs(std::string(dir) + "id");
+            std::ifstream format_fs(std::string(dir) + "format");
+            if (!(id_fs >> *tp_id) || !format_fs.good()) continue;
+
+            // eg. "	field:pid_t prev_pid;	offset:24;	size:4;	signed:1;"
+            *format = SwitchFormat{-1, -1, -1, 0, -1, -1};
+            std::string line;
+            while (std::getline(format_fs, line)) {
+                auto field = line.find("field:");
+                auto semi = line.find(';');
+                auto offset = line.find("offset:");
+                auto size = line.find("size:");
+                if (field == std::string::npos || semi == std::string::npos || offset == std::string::npos ||
+                    size == std::string::npos) continue;
+                std::string decl = line.substr(field + 6, semi - field - 6);
+                std::string name = decl.substr(decl.find_last_of(" *") + 1);
+                name = name.substr(0, name.find('['));
+                int field_offset = atoi(line.c_str() + offset + 7);
+                int field_size = atoi(line.c_str() + size + 5);
+                if (name == "prev_comm") format->prev_comm = field_offset;
+                else if (name == "prev_pid") format->prev_pid = field_offset;
+                else if (name == "next_comm") format->next_comm = field_offset;
+                else if (name == "next_pid") format->next_pid = field_offset;
+                else if (name == "prev_state") {
+                    format->prev_state = field_offset;
+                    format->prev_state_size = field_size;
+                }
+            }
+            if (format->prev_pid < 0 || format->next_pid < 0 || format->prev_state < 0 || format->prev_comm < 0 ||
+                format->next_comm < 0) return -1;
+            return 1;
+        }
+        return -1;
+    }
+
+    void GuardSampler::CloseStreams() {
+        for (auto& stream : streams_) {
+            munmap(stream.base, stream.mmap_bytes);
+            close(stream.fd);
+        }
+        streams_.clear();
+        for (auto& fd : wake_fd_) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+    }
+
+    void GuardSampler::Collect() {
+        std::vector<pollfd> fds;
+        for (auto& stream : streams_) {
+            fds.push_back(pollfd{stream.fd, POLLIN, 0});
+        }
+        fds.push_back(pollfd{wake_fd_[0], POLLIN, 0});
+        while (running_.load()) {
+            int ret = poll(fds.data(), fds.size(), GUARD_POLL_MS);
+            if (ret < 0 && errno != EINTR) break;
+            if (fds.back().revents) break;
+            for (auto& stream : streams_) {
+                Drain(stream);
+            }
+        }
+    }
+
+    void GuardSampler::Drain(CpuStream& stream) {
+        auto meta = (perf_event_mmap_page*)stream.base;
+        const char* data = (const char*)stream.base + meta->data_offset;
+        uint64_t data_size = meta->data_size;
+        uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+        uint64_t tail = meta->data_tail;
+
+        while (tail < head) {
+            // Records can wrap around the end of the buffer. Copy them out in that case
+            perf_event_header hdr{};
+            uint64_t pos = tail % data_size;
+            for (size_t i = 0; i < sizeof(hdr); ++i) {
+                ((char*)&hdr)[i] = data[(pos + i) % data_size];
+            }
+            if (hdr.size == 0) break;
+            const char* rec = data + pos;
+            if (pos + hdr.size > data_size) {
+                scratch_.resize(hdr.size);
+                uint64_t first = data_size - pos;
+                memcpy(scratch_.data(), data + pos, first);
+                memcpy(scratch_.data() + first, data, hdr.size - first);
+                rec = scratch_.data();
+            }
+
+            if (hdr.type == PERF_RECORD_SAMPLE) {
+                ParseSample(rec + sizeof(hdr), hdr.size - sizeof(hdr));
+            }
+            else if (hdr.type == PERF_RECORD_LOST) {
+                // struct { header; u64 id; u64 lost; }
+                uint64_t lost = 0;
+                memcpy(&lost, rec + sizeof(hdr) + sizeof(uint64_t), sizeof(lost));
+                lost_ += lost;
+            }
+            tail += hdr.size;
+        }
+        __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    void GuardSampler::ParseSample(const char* sample, size_t size) {
+        // PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_RAW: u64 time; u32 cpu, res; u32 raw_size; raw data
+        if (size < 2 * sizeof(uint64_t) + sizeof(uint32_t)) return;
+        SchedSwitchRecord record{};
+        uint32_t raw_size = 0;
+        memcpy(&record.ts, sample, sizeof(uint64_t));
+        memcpy(&record.cpu, sample + sizeof(uint64_t), sizeof(int32_t));
+        memcpy(&raw_size, sample + 2 * sizeof(uint64_t), sizeof(uint32_t));
+        const char* raw = sample + 2 * sizeof(uint64_t) + sizeof(uint32_t);
+        if (raw_size > size - 2 * sizeof(uint64_t) - sizeof(uint32_t) ||
+            raw_size < (uint32_t)format_.next_pid + sizeof(int32_t)) return;
+
+        memcpy(&record.prev_tid, raw + format_.prev_pid, sizeof(int32_t));
+        memcpy(&record.next_tid, raw + format_.next_pid, sizeof(int32_t));
+        memcpy(&record.prev_comm, raw + format_.prev_comm, sizeof(record.prev_comm));
+        memcpy(&record.next_comm, raw + format_.next_comm, sizeof(record.next_comm));
+        if (format_.prev_state_size == sizeof(int64_t)) {
+            memcpy(&record.prev_state, raw + format_.prev_state, sizeof(int64_t));
+        }
+        else {
+            int32_t state = 0;
+            memcpy(&state, raw + format_.prev_state, sizeof(int32_t));
+            record.prev_state = state;
         }
+        records_[record.cpu].push_back(record);
     }
 
-}
\ No newline at end of file
+}
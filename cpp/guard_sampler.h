@@ -22,12 +22,21 @@
 #include <pthread.h>
 #include <signal.h>
 #include <fstream>
+#include <atomic>
+#include <map>
+#include <vector>
 
 #include "env.h"
 #include "util.h"
+#include "binary_trace.h"
 
 namespace mtmc {
 
+// Data pages of the per cpu perf ring buffer. Must be a power of 2
+#define GUARD_RING_PAGES 256
+// Max wait of the collector before it drains the ring buffers
+#define GUARD_POLL_MS 100
+
     struct TimeInfo {
         timespec time_mo[2];
         timespec time_rl[2];
@@ -37,14 +46,16 @@ namespace mtmc {
     public:
         /**
          * @description Guard sampler should call Read before workloads begin and call Stop after workload finish.
-         * It is the wrapper of Linux perf record context switch. Be careful that long running time will generated
-         * a huge perf data that may occupy large space on disk.
+         * It records the sched:sched_switch tracepoint of every online cpu in process with perf_event_open. Records
+         * are timestamped with CLOCK_REALTIME, the clock of the spans, and kept in memory as SchedSwitchRecord.
+         * Requires CAP_PERFMON (or CAP_SYS_ADMIN) or kernel.perf_event_paranoid <= 0.
          */
         GuardSampler();
 
         /**
          * @name Read
-         * @param data_path: Path to store perf recorded data
+         * @param data_path: Path of the binary trace written at Stop, see binary_trace.h. Empty to only keep the
+         * records in memory
          * @description: Start record context switch events
          */
         void Read(const std::string& data_path);
@@ -52,7 +63,7 @@ namespace mtmc {
 
         /**
          * @name Stop
-         * @description: Stop the perf recording
+         * @description: Stop the recording, drain the ring buffers and write the trace
          */
         void Stop();
 
@@ -63,10 +74,52 @@ namespace mtmc {
          */
         void TimeExport(const std::string& data_path);
 
+        // Records of the last run by cpu, oldest first. Valid after Stop
+        const std::map<int, std::vector<SchedSwitchRecord>>& Records() const;
+
+        // Records the kernel could not write, because a ring buffer was full
+        uint64_t Lost() const;
+
         ~GuardSampler();
 
     private:
-        pid_t sampler_pid;
+        struct CpuStream {
+            int cpu;
+            int fd;
+            void* base;
+            size_t mmap_bytes;
+        };
+
+        // Offsets of the fields in the raw tracepoint data. Read from the format file, the layout changed over kernels
+        struct SwitchFormat {
+            int prev_comm;
+            int prev_pid;
+            int prev_state;
+            int prev_state_size;
+            int next_comm;
+            int next_pid;
+        };
+
+        static int ReadSwitchFormat(int* tp_id, SwitchFormat* format);
+
+        void CloseStreams();
+
+        void Collect();
+
+        // Consume everything in the ring buffer of one cpu
+        void Drain(CpuStream& stream);
+
+        void ParseSample(const char* sample, size_t size);
+
+        std::vector<CpuStream> streams_;
+        SwitchFormat format_{};
+        std::map<int, std::vector<SchedSwitchRecord>> records_;
+        std::vector<char> scratch_;
+        std::atomic<bool> running_{false};
+        std::thread collector_;
+        int wake_fd_[2] = {-1, -1};
+        uint64_t lost_ = 0;
+        std::string data_path_;
         TimeInfo timeinfo{};
     };
 
@@ -0,0 +1,184 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "imbalance_detector.h"
+
+#include <algorithm>
+#include <fstream>
+
+using json = nlohmann::json;
+
+namespace mtmc {
+
+    namespace {
+        bool IdleGreater(const SiblingGroup& a, const SiblingGroup& b) {
+            return a.IdleBarrier() > b.IdleBarrier();
+        }
+    }
+
+    ImbalanceDetector::ImbalanceDetector(uint64_t window_ms) {
+        window_ns_ = window_ms * 1000 * 1000;
+    }
+
+    int ImbalanceDetector::Record(const SingleProfile& prof) {
+        const ParamsInfo& parent = prof.parent_info;
+        if (parent.task_sched_time == 0 || parent.parent_tid == 0) return 0;
+
+        SiblingKey key{parent.parent_tid, parent.parent_ctx_hash_id, parent.task_sched_time};
+        uint64_t dur = prof.end_ts > prof.start_ts ? prof.end_ts - prof.start_ts : 0;
+        Shard& shard = shards_[SiblingKeyHash()(key) % IMB_NUM_SHARDS];
+
+        std::lock_guard<std::mutex> lock(shard.mux);
+        auto itr = shard.groups.find(key);
+        if (itr == shard.groups.end()) {
+            SiblingGroup group{};
+            group.name = prof.prefix;
+            group.fork_ts = parent.task_sched_time;
+            group.first_start = prof.start_ts;
+            group.min_dur = dur;
+            shard.groups.insert({key, group});
+            itr = shard.groups.find(key);
+        }
+        SiblingGroup& group = itr->second;
+        group.first_start = std::min(group.first_start, prof.start_ts);
+        group.last_end = std::max(group.last_end, prof.end_ts);
+        group.min_dur = std::min(group.min_dur, dur);
+        group.max_dur = std::max(group.max_dur, dur);
+        group.sum_dur += dur;
+        group.sum_end += prof.end_ts;
+        ++group.num_chunks;
+
+        // Joined groups are folded lazily by whoever touches the shard after a quarter window
+        if (prof.end_ts > shard.last_sweep + window_ns_ / 4) {
+            SweepShard(shard, prof.end_ts);
+        }
+        return 1;
+    }
+
+    void ImbalanceDetector::Sweep(uint64_t now_ns) {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mux);
+            SweepShard(shard, now_ns);
+        }
+    }
+
+    std::unordered_map<std::string, ImbalanceSummary> ImbalanceDetector::Summaries() {
+        std::lock_guard<std::mutex> lock(summary_mux_);
+        return summaries_;
+    }
+
+    std::vector<SiblingGroup> ImbalanceDetector::Stragglers() {
+        std::vector<SiblingGroup> ret;
+        {
+            std::lock_guard<std::mutex> lock(summary_mux_);
+            ret = stragglers_;
+        }
+        std::sort(ret.begin(), ret.end(), IdleGreater);
+        return ret;
+    }
+
+    int ImbalanceDetector::Export(const std::string& file) {
+        Sweep(UINT64_MAX);
+
+        json ops = json::array();
+        for (auto& elem : Summaries()) {
+            auto& s = elem.second;
+            json j_op;
+            j_op["Name"] = elem.first;
+            j_op["Groups"] = s.num_groups;
+            j_op["MeanChunks"] = double(s.num_chunks) / s.num_groups;
+            j_op["MeanForkToFirstStartNs"] = double(s.sum_fork_to_first_start) / s.num_groups;
+            j_op["MaxForkToFirstStartNs"] = s.max_fork_to_first_start;
+            j_op["MeanSpreadNs"] = double(s.sum_spread) / s.num_groups;
+            j_op["MeanImbalanceRatio"] = s.sum_imbalance_ratio / s.num_groups;
+            j_op["MaxImbalanceRatio"] = s.max_imbalance_ratio;
+            j_op["MeanIdleBarrierNs"] = double(s.sum_idle_barrier) / s.num_groups;
+            j_op["IdleBarrierShare"] = s.sum_thread_time ? double(s.sum_idle_barrier) / s.sum_thread_time : 0;
+            ops.push_back(j_op);
+        }
+
+        json stragglers = json::array();
+        for (auto& group : Stragglers()) {
+            json j_group;
+            j_group["Name"] = group.name;
+            j_group["ForkTs"] = group.fork_ts;
+            j_group["Chunks"] = group.num_chunks;
+            j_group["ForkToFirstStartNs"] = group.ForkToFirstStart();
+            j_group["MinChunkNs"] = group.min_dur;
+            j_group["MaxChunkNs"] = group.max_dur;
+            j_group["IdleBarrierNs"] = group.IdleBarrier();
+            stragglers.push_back(j_group);
+        }
+
+        json j;
+        j["Ops"] = ops;
+        j["Stragglers"] = stragglers;
+
+        std::ofstream resultfs(file, std::ios::out);
+        if (!resultfs.good()) {
+            Dprintf(FRED("Open file failed: %s\n"), file.c_str());
+            return -1;
+        }
+        resultfs << j.dump(2) << std::endl;
+        return 1;
+    }
+
+    // ----------------------------------- Private ----------------------------------------
+
+    void ImbalanceDetector::SweepShard(Shard& shard, uint64_t now_ns) {
+        if (now_ns != UINT64_MAX) shard.last_sweep = now_ns;
+        for (auto itr = shard.groups.begin(); itr != shard.groups.end();) {
+            if (now_ns > itr->second.last_end + window_ns_) {
+                Fold(itr->second);
+                itr = shard.groups.erase(itr);
+            }
+            else {
+                ++itr;
+            }
+        }
+    }
+
+    void ImbalanceDetector::Fold(const SiblingGroup& group) {
+        // A single forked task is not a parallel region
+        if (group.num_chunks < 2) return;
+
+        double mean_dur = double(group.sum_dur) / group.num_chunks;
+        double ratio = mean_dur > 0 ? group.max_dur / mean_dur : 1;
+        uint64_t idle = group.IdleBarrier();
+
+        std::lock_guard<std::mutex> lock(summary_mux_);
+        auto& s = summaries_[group.name];
+        ++s.num_groups;
+        s.num_chunks += group.num_chunks;
+        s.sum_fork_to_first_start += group.ForkToFirstStart();
+        s.max_fork_to_first_start = std::max(s.max_fork_to_first_start, group.ForkToFirstStart());
+        s.sum_spread += group.max_dur - group.min_dur;
+        s.sum_imbalance_ratio += ratio;
+        s.max_imbalance_ratio = std::max(s.max_imbalance_ratio, ratio);
+        s.sum_idle_barrier += idle;
+        s.sum_thread_time += group.num_chunks * (group.last_end > group.fork_ts ? group.last_end - group.fork_ts : 0);
+
+        if (stragglers_.size() < IMB_TOP_K) {
+            stragglers_.push_back(group);
+            std::push_heap(stragglers_.begin(), stragglers_.end(), IdleGreater);
+        }
+        else if (idle > stragglers_.front().IdleBarrier()) {
+            std::pop_heap(stragglers_.begin(), stragglers_.end(), IdleGreater);
+            stragglers_.back() = group;
+            std::push_heap(stragglers_.begin(), stragglers_.end(), IdleGreater);
+            DDprintf(FYEL("Straggler in %s: %u chunks, %lu ns idle at the barrier\n"), group.name.c_str(),
+                     group.num_chunks, idle);
+        }
+    }
+}
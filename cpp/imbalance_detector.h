@@ -0,0 +1,142 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_IMBALANCE_DETECTOR_H
+#define MTMC_IMBALANCE_DETECTOR_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mtmc_profiler.h"
+
+namespace mtmc {
+
+#define IMB_NUM_SHARDS 64
+// Number of worst groups (by barrier idle time) kept as stragglers
+#define IMB_TOP_K 16
+
+    // Sibling chunks are the spans forked by the same parent at the same task_sched_time
+    struct SiblingKey {
+        int64_t parent_tid;
+        uint64_t parent_ctx_hash_id;
+        uint64_t task_sched_time;
+
+        bool operator==(const SiblingKey& other) const {
+            return task_sched_time == other.task_sched_time && parent_tid == other.parent_tid &&
+                   parent_ctx_hash_id == other.parent_ctx_hash_id;
+        }
+    };
+
+    struct SiblingKeyHash {
+        size_t operator()(const SiblingKey& key) const {
+            uint64_t h = key.task_sched_time * 0x9E3779B97F4A7C15ull;
+            h ^= (uint64_t)key.parent_tid + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+            h ^= key.parent_ctx_hash_id + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+            return h;
+        }
+    };
+
+    // Chunks of one parallel region seen so far
+    struct SiblingGroup {
+        std::string name;       // Prefix of the first chunk
+        uint64_t fork_ts;
+        uint64_t first_start;
+        uint64_t last_end;
+        uint64_t min_dur;
+        uint64_t max_dur;
+        uint64_t sum_dur;
+        uint64_t sum_end;
+        uint32_t num_chunks;
+
+        uint64_t ForkToFirstStart() const {
+            return first_start > fork_ts ? first_start - fork_ts : 0;
+        }
+
+        // Time the other threads wait at the join for the last chunk
+        uint64_t IdleBarrier() const {
+            return last_end * num_chunks - sum_end;
+        }
+    };
+
+    // Imbalance statistics of one op over all of its parallel regions
+    struct ImbalanceSummary {
+        uint64_t num_groups;
+        uint64_t num_chunks;
+        uint64_t sum_fork_to_first_start;
+        uint64_t max_fork_to_first_start;
+        uint64_t sum_spread;             // Sum of max - min chunk duration
+        double sum_imbalance_ratio;      // Sum of max / mean chunk duration
+        double max_imbalance_ratio;
+        uint64_t sum_idle_barrier;
+        uint64_t sum_thread_time;        // Sum of num_chunks * (last_end - fork_ts). Denominator of the idle share
+    };
+
+    /**
+     * Online detector of load imbalance among intra-op chunks. LogEnd records each forked span into the group of its
+     * siblings. A group is considered joined once no chunk of it ended for window_ms, then it is folded into the
+     * summary of its op.
+     */
+    class ImbalanceDetector {
+    public:
+        explicit ImbalanceDetector(uint64_t window_ms);
+
+        ImbalanceDetector(const ImbalanceDetector&) = delete;
+        ImbalanceDetector& operator=(const ImbalanceDetector&) = delete;
+
+        /**
+         * Add a finished span to its sibling group. Spans not forked by GetParamsInfo() are ignored
+         * @return 1 if recorded, 0 if ignored
+         */
+        int Record(const SingleProfile& prof);
+
+        /**
+         * Fold the groups that have been quiet for the window into the summaries
+         * @param now_ns: Current time. Every group is folded if it is UINT64_MAX
+         */
+        void Sweep(uint64_t now_ns);
+
+        std::unordered_map<std::string, ImbalanceSummary> Summaries();
+
+        std::vector<SiblingGroup> Stragglers();
+
+        /**
+         * Fold all open groups and write the summaries and stragglers as json
+         * @return 1 for success, -1 for failed
+         */
+        int Export(const std::string& file);
+
+    private:
+        struct Shard {
+            std::mutex mux;
+            std::unordered_map<SiblingKey, SiblingGroup, SiblingKeyHash> groups;
+            uint64_t last_sweep = 0;
+        };
+
+        void SweepShard(Shard& shard, uint64_t now_ns);
+
+        void Fold(const SiblingGroup& group);
+
+        uint64_t window_ns_;
+        Shard shards_[IMB_NUM_SHARDS];
+
+        std::mutex summary_mux_;
+        std::unordered_map<std::string, ImbalanceSummary> summaries_;
+        std::vector<SiblingGroup> stragglers_;  // Min heap on IdleBarrier()
+    };
+}
+
+#endif //MTMC_IMBALANCE_DETECTOR_H
@@ -0,0 +1,53 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_PROBES_H
+#define MTMC_PROBES_H
+
+/*
+ * USDT probes of provider "mtmc". Built with MTMC_USDT (CMake option USDT_PROBES) and <sys/sdt.h> from
+ * systemtap-sdt-dev, each probe is a single nop plus an ELF note. A tracer attaching to it (bpftrace, bcc, perf probe,
+ * or EbpfSampler with EbpfCtxScConfig::SpanUsdtBinary) turns the nop into a breakpoint. Otherwise probes compile to
+ * nothing and their arguments are not evaluated.
+ *
+ *   span_start      tid, depth, hash_id, parent_tid, parent_ctx_hash_id, int_prefix, prefix (char*)
+ *   span_end        tid, depth
+ *   set_int_prefix  int_prefix
+ *   ctx_update      level, ctx_hash_id, tracing_hash_id, name (char*)
+ *   ctx_push        level, ctx_hash_id, tracing_hash_id, name (char*)
+ *   ctx_pop         remaining stack size
+ *
+ * depth is the number of open spans of the thread before the span started, so (tid, depth) pairs a span_end with its
+ * span_start. Both fire before the profiler reads its own counters, and also for spans the profiler could not store.
+ */
+#if defined(MTMC_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MTMC_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef MTMC_PROBES_ENABLED
+#define MTMC_PROBE1(name, a1) DTRACE_PROBE1(mtmc, name, a1)
+#define MTMC_PROBE2(name, a1, a2) DTRACE_PROBE2(mtmc, name, a1, a2)
+#define MTMC_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(mtmc, name, a1, a2, a3, a4)
+#define MTMC_PROBE7(name, a1, a2, a3, a4, a5, a6, a7) DTRACE_PROBE7(mtmc, name, a1, a2, a3, a4, a5, a6, a7)
+#else
+#define MTMC_PROBE1(name, a1) do {} while (0)
+#define MTMC_PROBE2(name, a1, a2) do {} while (0)
+#define MTMC_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#define MTMC_PROBE7(name, a1, a2, a3, a4, a5, a6, a7) do {} while (0)
+#endif
+
+#endif //MTMC_PROBES_H
@@ -15,11 +15,26 @@
 #include "mtmc_profiler.h"
 #include "mtmc_temp_profiler.h"
 #include "exporter.h"
+#include "op_aggregator.h"
+#include "imbalance_detector.h"
+#include "query_server.h"
+#include "stripe_coordinator.h"
+#include "ctx_switch_join.h"
+#include "mtmc_probes.h"
+#ifdef EBPF_CTX_SC
+#include "ebpf_sampler.h"
+#endif
+
+#include <algorithm>
+#include <map>
+#include <thread>
+
+using json = nlohmann::json;
 
 namespace mtmc {
 
     ThreadInfo& GetPerThreadInfo() {
-        thread_local ThreadInfo info{.tid = -1, .pthread_id = -1, .storage_ptr=nullptr, .data_tracer={}};
+        thread_local ThreadInfo info{.tid = -1, .pthread_id = -1, .storage_ptr=nullptr, .data_tracer={}, .quality_ptr=nullptr};
         return info;
     }
 
@@ -100,6 +115,30 @@ namespace mtmc {
                 PerfmonConfig::PerfMetricConfig(&cfg, 1);
             }
 
+            mtmc_setting_.event_names.clear();
+            for (auto& group : cfg) {
+                mtmc_setting_.event_names.emplace_back(group.names, group.names + group.event_num);
+            }
+            // Txt configs have no formulas
+            mtmc_setting_.metric_formulas.resize(cfg.size());
+
+            // Count only the claimed group. Event names keep every group, so multiplex_idx is the claimed group's index
+            // and the results of all instances merge as if one process had multiplexed them
+            mtmc_setting_.stripe_group = -1;
+            if (!mtmc_setting_.stripe_key.empty() && cfg.size() > 1) {
+                stripe_ = std::make_shared<StripeCoordinator>();
+                int group = stripe_->Claim(mtmc_setting_.stripe_key, cfg.size());
+                if (group < 0) {
+                    stripe_.reset();
+                    Dprintf(FRED("Stripe claim failed. This instance multiplexes all the groups\n"));
+                }
+                else {
+                    mtmc_setting_.stripe_group = group;
+                    cfg = {cfg[group]};
+                    cfg[0].multiplex_intv = 0;
+                }
+            }
+
             if (!perfmon_collector_) {
                 perfmon_collector_ = std::make_shared<PerfmonCollector>();
             }
@@ -110,6 +149,54 @@ namespace mtmc {
                 return -1;
             }
 
+#ifdef EBPF_CTX_SC
+            // The context switch probe has to follow the group switches of the per core agents
+            if (perfmon_collector_->IsMultiplexed()) {
+                auto& ebpf_sampler = EbpfSampler::GetInstance();
+                perfmon_collector_->SetGroupSwitchHook([&ebpf_sampler](int cpu, int group, const EventCtx& ctx) {
+                    ebpf_sampler.EbpfCtxScSwitchGroup(cpu, group, std::vector<int>(ctx.fd, ctx.fd + ctx.event_num));
+                });
+            }
+#endif
+
+            // Allocate per thread storage from the shm arena, so that the shm exporter does not need to copy
+            if ((mtmc_setting_.export_mode == 2 || mtmc_setting_.export_mode == 3) && mtmc_setting_.shm_arena_bytes > 0) {
+                shm_arena_ = ShmExporter::GetExporter().CreateArena(mtmc_setting_.shm_arena_bytes);
+                chunk_provider_ = shm_arena_.get();
+                if (!chunk_provider_) {
+                    Dprintf(FRED("Create shm arena failed. Fall back to heap storage and copy export\n"));
+                }
+            }
+
+            // Otherwise keep every thread's storage on the node it runs on if asked. Remote stores would add memory
+            // traffic to the workload being measured
+            if (mtmc_setting_.numa_storage && !chunk_provider_ && numa_available() >= 0 && numa_max_node() > 0) {
+                for (int node = 0; node <= numa_max_node(); ++node) {
+                    numa_providers_.emplace_back(new util::NumaChunkProvider<SingleProfile>(node, NUMA_CHUNK_SHIFT));
+                }
+                Dprintf(FCYN("Per thread storage is allocated on %d NUMA nodes\n"), numa_max_node() + 1);
+            }
+
+            if (mtmc_setting_.aggregate_mode != AGG_OFF) {
+                aggregator_ = std::make_shared<OpAggregator>(mtmc_setting_.aggregate_mode);
+                Dprintf(FCYN("Aggregate mode %d. Spans are folded into per op statistics\n"), mtmc_setting_.aggregate_mode);
+            }
+
+            if (mtmc_setting_.imbalance_window_ms > 0) {
+                imbalance_detector_ = std::make_shared<ImbalanceDetector>(mtmc_setting_.imbalance_window_ms);
+            }
+
+            // Live queries from an operator, eg. `echo status | nc -U $MTMC_QUERY_SOCKET`
+            auto query_socket = getenv("MTMC_QUERY_SOCKET");
+            if (query_socket) {
+                query_server_ = std::make_shared<QueryServer>();
+                if (query_server_->Start(query_socket, [this](const std::string& cmd, const std::string& arg) {
+                        return HandleQuery(cmd, arg);
+                    }) != 1) {
+                    query_server_.reset();
+                }
+            }
+
             // Set global variables after reading config
             SetGlobalIntPrefix(0);
 
@@ -125,6 +212,64 @@ namespace mtmc {
         return 1;
     }
 
+    int MTMCProfiler::Reconfigure(const std::string& config_addr) {
+        std::lock_guard<std::mutex> lock(InitMux);
+        if (!valid_ || !perfmon_collector_) {
+            Dprintf(FRED("Reconfigure failed. MTMC Profiler is not initialized\n"));
+            return -1;
+        }
+#ifdef EBPF_CTX_SC
+        // The context switch program reads the fds of the agents that a reopen would close
+        if (EbpfSampler::GetInstance().EbpfCtxScInited()) {
+            Dprintf(FRED("Reconfigure failed. Close the eBPF context switch sampler first\n"));
+            return -1;
+        }
+#endif
+
+        // Export, storage and the other settings stay as they were at Init
+        std::vector<InputConfig> cfg;
+        ProfilerSetting new_setting = mtmc_setting_;
+        int stat;
+        if (util::CheckConfigType(config_addr) == util::CFG_FILE_TYPE::JSON) {
+            stat = PerfmonConfig::ReadConfigJson(config_addr, &cfg, &new_setting);
+        }
+        else {
+            stat = PerfmonConfig::ReadConfig(config_addr, &cfg, &new_setting);
+        }
+        if (stat != 1 || cfg.empty()) {
+            Dprintf(FRED("Reconfigure failed. Can not read config file from %s\n"), config_addr.c_str());
+            return -1;
+        }
+        if (new_setting.cfg_type == util::TXT && new_setting.perf_collect_topdown) {
+            PerfmonConfig::PerfMetricConfig(&cfg, 1);
+        }
+
+        // A striped instance keeps counting its claimed group, now taken from the new config
+        int group_base = mtmc_setting_.event_names.size();
+        std::vector<InputConfig> counted = cfg;
+        if (stripe_) {
+            if ((int)cfg.size() != stripe_->NumGroups()) {
+                Dprintf(FRED("Reconfigure failed. The stripe counts %d groups, the new config has %lu\n"),
+                        stripe_->NumGroups(), cfg.size());
+                return -1;
+            }
+            counted = {cfg[stripe_->Group()]};
+            counted[0].multiplex_intv = 0;
+            group_base += stripe_->Group();
+        }
+
+        int epoch = perfmon_collector_->Reconfigure(counted, group_base);
+        if (epoch < 0) return -1;
+        mtmc_setting_.metric_formulas.resize(mtmc_setting_.event_names.size());
+        new_setting.metric_formulas.resize(cfg.size());
+        mtmc_setting_.metric_formulas.insert(mtmc_setting_.metric_formulas.end(), new_setting.metric_formulas.begin(),
+                                             new_setting.metric_formulas.end());
+        for (auto& group : cfg) {
+            mtmc_setting_.event_names.emplace_back(group.names, group.names + group.event_num);
+        }
+        return epoch;
+    }
+
     ParamsInfo MTMCProfiler::GetParamsInfo() {
         if (!valid_) return ParamsInfo{};
         ParamsInfo ret{};
@@ -156,8 +301,16 @@ namespace mtmc {
             th_info.pthread_id = Env::GetPthreadid();
             RegisterPerThreadStorage(&th_info, true);
         }
+        MTMC_PROBE7(span_start, th_info.tid, th_info.data_tracer.size(), hash_id, params_info.parent_tid,
+                    params_info.parent_ctx_hash_id, global_int_prefix_.load(std::memory_order_relaxed), prefix.c_str());
         DDprintf("LogStart {%lld,%p}, size: %llu\n", th_info.tid, th_info.storage_ptr, th_info.storage_ptr->Size());
-        th_info.storage_ptr->PushBack(SingleProfile());
+        if (!th_info.storage_ptr->PushBack(SingleProfile())) {
+            DDprintf(FRED("LogStart failed. Profile storage is exhausted\n"));
+            th_info.data_tracer.push(DROPPED_SPAN_IDX);
+            th_info.quality_ptr->num_dropped.store(th_info.quality_ptr->num_dropped.load(std::memory_order_relaxed) + 1,
+                                                   std::memory_order_relaxed);
+            return -1;
+        }
         SingleProfile* log_info = &th_info.storage_ptr->Back();
 
 
@@ -193,8 +346,16 @@ namespace mtmc {
             th_info.pthread_id = Env::GetPthreadid();
             RegisterPerThreadStorage(&th_info, true);
         }
+        MTMC_PROBE7(span_start, th_info.tid, th_info.data_tracer.size(), trace_info.current_id, trace_info.parent_tid,
+                    trace_info.parent_id, global_int_prefix_.load(std::memory_order_relaxed), trace_info.name.c_str());
         DDprintf("LogStart {%lld,%p}, size: %llu\n", th_info.tid, th_info.storage_ptr, th_info.storage_ptr->Size());
-        th_info.storage_ptr->PushBack(SingleProfile());
+        if (!th_info.storage_ptr->PushBack(SingleProfile())) {
+            DDprintf(FRED("LogStart failed. Profile storage is exhausted\n"));
+            th_info.data_tracer.push(DROPPED_SPAN_IDX);
+            th_info.quality_ptr->num_dropped.store(th_info.quality_ptr->num_dropped.load(std::memory_order_relaxed) + 1,
+                                                   std::memory_order_relaxed);
+            return -1;
+        }
         SingleProfile* log_info = &th_info.storage_ptr->Back();
         // Compatible for post process
         // Todo: refine this part after sync_up with post process
@@ -258,6 +419,12 @@ namespace mtmc {
         if (th_info.storage_ptr == nullptr) {
             RegisterPerThreadStorage(&th_info, false);
         }
+        MTMC_PROBE2(span_end, th_info.tid, (int64_t)th_info.data_tracer.size() - 1);
+        // Matching LogStart was dropped
+        if (!th_info.data_tracer.empty() && th_info.data_tracer.top() == DROPPED_SPAN_IDX) {
+            th_info.data_tracer.pop();
+            return -1;
+        }
         // Sanity checks
         if (th_info.storage_ptr == nullptr || th_info.storage_ptr->Empty() || th_info.data_tracer.empty()) {
             Dprintf(FRED("LogEnd detect an empty storage space, it could means that LogEnd is called before LogStart\n"));
@@ -280,7 +447,8 @@ namespace mtmc {
         }
 
         log_info->end_ts = Env::GetClockTimeNs();
-        auto status = perfmon_collector_->PerCoreRead(false, log_info->ret_end, &log_info->rd_ret_end);
+        int end_multiplex_idx = log_info->multiplex_idx;
+        auto status = perfmon_collector_->PerCoreRead(false, log_info->ret_end, &log_info->rd_ret_end, &end_multiplex_idx);
         if (status == -1) {
             DDprintf(FRED("Failed perfmon_collector per core read\n"));
         }
@@ -288,6 +456,40 @@ namespace mtmc {
         // Set end bit to 1 to prevent conflicts with another LogEnd
         log_info->flag_bits.has_end_info = 1;
 
+        // Counter deltas are only meaningful within the same event group, and on the same core in per core mode
+        log_info->flag_bits.migrated = log_info->rd_ret_start.core_id != log_info->rd_ret_end.core_id;
+        log_info->flag_bits.group_switched = GroupSwitched(log_info->rd_ret_start, log_info->multiplex_idx,
+                                                           log_info->rd_ret_end, end_multiplex_idx);
+#ifdef USE_PER_THREADS_PERF
+        log_info->flag_bits.pmc_invalid = log_info->flag_bits.group_switched;
+#else
+        log_info->flag_bits.pmc_invalid = log_info->flag_bits.group_switched || log_info->flag_bits.migrated;
+#endif
+        SpanQuality* quality = th_info.quality_ptr;
+        if (quality) {
+            quality->num_spans.store(quality->num_spans.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (log_info->flag_bits.migrated) {
+                quality->num_migrated.store(quality->num_migrated.load(std::memory_order_relaxed) + 1,
+                                            std::memory_order_relaxed);
+            }
+            if (log_info->flag_bits.group_switched) {
+                quality->num_mismatched.store(quality->num_mismatched.load(std::memory_order_relaxed) + 1,
+                                              std::memory_order_relaxed);
+            }
+        }
+
+        if (imbalance_detector_) {
+            imbalance_detector_->Record(*log_info);
+        }
+
+        if (aggregator_) {
+            aggregator_->Record(*log_info);
+            // Nothing is open on this thread, so the storage can be reused from the beginning
+            if (th_info.data_tracer.empty()) {
+                th_info.storage_ptr->Clear();
+            }
+        }
+
         return 1;
     }
 
@@ -320,78 +522,66 @@ namespace mtmc {
             output_file = std::string(env_path);
         }
 
+        return ExportLog(output_file, clear_when_done);
+    }
+
+    int MTMCProfiler::ExportLog(const std::string& output_file, bool clear_when_done) {
         std::ofstream resultfs;
         resultfs.open(output_file, std::ios::out);
         if (!resultfs.good()) {
             Dprintf("Open file failed: %s\n", output_file.c_str());
             return -1;
         }
-        for (auto & vec : profile_storage_) {
-            for (int prof_i = 0; prof_i < vec.Size(); ++prof_i) {
-                auto& profile = vec[prof_i];
-                /* Here are some invalid data conditions */
-                if (profile.rd_ret_start.num_event != profile.rd_ret_end.num_event) {
-//                    Dprintf(FRED("Event number mismatch\n"));
-                    continue;
-                }
-                if (mtmc_setting_.perf_collect_topdown && (profile.rd_ret_start.num_event - 2 < 0)) {
-                    Dprintf(FRED("Topdown metric and event number mismatch\n"));
-                    continue;
-                }
-                resultfs << profile.tid << ",";
-                resultfs << (uint32_t)(profile.pthread_id) << ",";
-                resultfs << profile.start_ts << ",";
-                resultfs << profile.end_ts << ",";
-                resultfs << profile.parent_info.parent_tid << ",";
-                resultfs << (uint32_t)(profile.parent_info.parent_pthread_id) << ",";
-                resultfs << profile.parent_info.task_sched_time << ",";
-
-                // Export topdown metrics separately
-                auto num_event = profile.rd_ret_start.num_event;
-                    resultfs << 0 <<  "_" << 0 << "_" << 0 << "_"
-                             << 0 << "_" << 0 << "_" << 0;
-                resultfs << ",";
-
-                // Export events
-                resultfs << profile.rd_ret_start.num_event << "_" << profile.rd_ret_start.core_id << "_" << profile.rd_ret_start.prefix << ",";
-                for (int i = 0; i < num_event; ++i) {
-                    resultfs << profile.ret_start[i];
-                    if (i != num_event - 1) resultfs << "_";
-                    else resultfs << ",";
-                }
-                resultfs << profile.rd_ret_end.num_event << "_" << profile.rd_ret_end.core_id << "_" << profile.rd_ret_end.prefix << ",";
-                for (int i = 0; i < num_event; ++i) {
-                    resultfs << profile.ret_end[i];
-                    if (i != num_event - 1) resultfs << "_";
-                    else resultfs << ",";
-                }
-
-                resultfs << profile.int_prefix << ",";
-                resultfs << profile.prefix << ",";
-                resultfs << profile.multiplex_idx << ",";
+        // Single field header line. Post-processing skips it as a short line
+        auto quality = GetSpanQuality();
+        resultfs << "#spans=" << quality.num_spans << ";migrated=" << quality.num_migrated
+                 << ";mismatched=" << quality.num_mismatched << ";dropped=" << quality.num_dropped;
+        if (stripe_) {
+            resultfs << ";stripe_group=" << stripe_->Group() << ";stripe_instance=" << stripe_->Instance();
+        }
+        resultfs << "\n";
+
+        // Storage of threads registering meanwhile is not visited
+        std::vector<util::IndexVector<SingleProfile>*> storage;
+        {
+            std::lock_guard<std::mutex> lock(mux_);
+            for (auto& vec : profile_storage_) {
+                storage.push_back(&vec);
+            }
+        }
 
-                int i = 0;
-                for (auto& cnst : mtmc_setting_.cnst_var) {
-                    if (cnst == "SYSTEM_TSC_FREQ") {
-                        resultfs << mtmc::Env::GetTSCFrequencyHz();
-                    }
-                    else if (cnst == "DURATIONTIMEINMILLISECONDS") {
-                        resultfs << (profile.end_ts - profile.start_ts)/1e6;
-                    }
-                    else {
-                        printf(FRED("Error. MTMC profiler encountered an unknown constant. The post-processing may fail."
-                               "Unknown Constant: %s\n"), cnst.c_str());
-                        resultfs << -1;
-                    }
-                    if (i != mtmc_setting_.cnst_var.size()-1)
-                        resultfs << "_";
-                    ++i;
+        // Storage on NUMA nodes is formatted by a worker on each node, so that the spans are read node locally
+        std::map<int, std::vector<util::IndexVector<SingleProfile>*>> node_storage;
+        for (auto vec : storage) {
+            auto provider = vec->GetChunkProvider();
+            node_storage[provider ? provider->Node() : -1].push_back(vec);
+        }
+        if (node_storage.size() == 1 && node_storage.begin()->first < 0) {
+            for (auto vec : node_storage.begin()->second) {
+                WriteSpans(*vec, resultfs);
+            }
+        }
+        else {
+            std::vector<int> nodes;
+            std::map<int, std::ostringstream> node_output;
+            for (auto& elem : node_storage) {
+                nodes.push_back(elem.first);
+                node_output[elem.first];
+            }
+            util::RunOnNodes(nodes, [&](int node) {
+                auto& os = node_output.find(node)->second;
+                for (auto vec : node_storage.find(node)->second) {
+                    WriteSpans(*vec, os);
                 }
-
-                resultfs << std::endl;
+            });
+            for (auto& elem : node_output) {
+                resultfs << elem.second.str();
             }
-            if (clear_when_done) {
-                vec.AsyncClear();
+        }
+
+        if (clear_when_done) {
+            for (auto vec : storage) {
+                vec->AsyncClear();
             }
         }
         resultfs.close();
@@ -399,14 +589,106 @@ namespace mtmc {
         return 1;
     }
 
+    void MTMCProfiler::WriteSpans(util::IndexVector<SingleProfile>& vec, std::ostream& os) {
+        // The owner thread may still be pushing, so only the spans published so far are read
+        std::vector<const SingleProfile*> spans;
+        vec.ForEachPublished([&spans](const SingleProfile& profile) {
+            spans.push_back(&profile);
+        });
+        for (auto span : spans) {
+            auto& profile = *span;
+            /* Here are some invalid data conditions. Migrated spans are kept, their begin and end core ids differ */
+            if (profile.flag_bits.group_switched ||
+                profile.rd_ret_start.num_event != profile.rd_ret_end.num_event) {
+//                    Dprintf(FRED("Event number mismatch\n"));
+                continue;
+            }
+            if (mtmc_setting_.perf_collect_topdown && (profile.rd_ret_start.num_event - 2 < 0)) {
+                Dprintf(FRED("Topdown metric and event number mismatch\n"));
+                continue;
+            }
+            os << profile.tid << ",";
+            os << (uint32_t)(profile.pthread_id) << ",";
+            os << profile.start_ts << ",";
+            os << profile.end_ts << ",";
+            os << profile.parent_info.parent_tid << ",";
+            os << (uint32_t)(profile.parent_info.parent_pthread_id) << ",";
+            os << profile.parent_info.task_sched_time << ",";
+
+            // Export topdown metrics separately
+            auto num_event = profile.rd_ret_start.num_event;
+                os << 0 <<  "_" << 0 << "_" << 0 << "_"
+                         << 0 << "_" << 0 << "_" << 0;
+            os << ",";
+
+            // Export events
+            os << profile.rd_ret_start.num_event << "_" << profile.rd_ret_start.core_id << "_" << profile.rd_ret_start.prefix << ",";
+            for (int i = 0; i < num_event; ++i) {
+                os << profile.ret_start[i];
+                if (i != num_event - 1) os << "_";
+                else os << ",";
+            }
+            os << profile.rd_ret_end.num_event << "_" << profile.rd_ret_end.core_id << "_" << profile.rd_ret_end.prefix << ",";
+            for (int i = 0; i < num_event; ++i) {
+                os << profile.ret_end[i];
+                if (i != num_event - 1) os << "_";
+                else os << ",";
+            }
+
+            os << profile.int_prefix << ",";
+            os << profile.prefix << ",";
+            os << profile.multiplex_idx << ",";
+
+            int i = 0;
+            for (auto& cnst : mtmc_setting_.cnst_var) {
+                if (cnst == "SYSTEM_TSC_FREQ") {
+                    os << mtmc::Env::GetTSCFrequencyHz();
+                }
+                else if (cnst == "DURATIONTIMEINMILLISECONDS") {
+                    os << (profile.end_ts - profile.start_ts)/1e6;
+                }
+                else {
+                    printf(FRED("Error. MTMC profiler encountered an unknown constant. The post-processing may fail."
+                           "Unknown Constant: %s\n"), cnst.c_str());
+                    os << -1;
+                }
+                if (i != mtmc_setting_.cnst_var.size()-1)
+                    os << "_";
+                ++i;
+            }
+
+            os << std::endl;
+        }
+    }
+
     int MTMCProfiler::Close() {
         if (this->valid_) {
             Dprintf(FGRN("Close MTMC Profiler. Exist %d profiler uses live perfmon_collector\n"), Inited.load()-1);
             std::lock_guard<std::mutex> lock(InitMux);
             if (Inited.fetch_sub(1) <= 1) {
+                if (query_server_) {
+                    query_server_->Stop();
+                    query_server_.reset();
+                }
                 Dprintf("MTMC_SETTING: %d\n", mtmc_setting_.export_mode);
+                if (imbalance_detector_ && getenv("MTMC_LOG_EXPORT_PATH")) {
+                    ExportImbalance(std::string(getenv("MTMC_LOG_EXPORT_PATH")) + ".imbalance.json");
+                }
                 /* Check Export Mode to export */
-                if (mtmc_setting_.export_mode > 0) {
+                if (aggregator_ && mtmc_setting_.export_mode > 0) {
+                    // Spans are not kept in aggregate mode. Export the statistics to the file export path instead
+                    auto* env_path = getenv("MTMC_LOG_EXPORT_PATH");
+                    if (env_path) {
+                        ExportAggregate(std::string(env_path));
+                    }
+                    else {
+                        Dprintf(FRED("Aggregate export failed due to no MTMC_LOG_EXPORT_PATH\n"));
+                    }
+                }
+                else if (mtmc_setting_.export_mode > 0) {
+                    auto quality = GetSpanQuality();
+                    Dprintf("Spans: %lu, migrated: %lu, mismatched: %lu, dropped: %lu\n", quality.num_spans,
+                            quality.num_migrated, quality.num_mismatched, quality.num_dropped);
                     switch(mtmc_setting_.export_mode) {
                         case 1:
                             Dprintf("ExportMode: %d\n", 1);
@@ -414,11 +696,12 @@ namespace mtmc {
                             break;
                         case 2:
                             Dprintf("ExportMode: %d\n", 2);
-                            Finish(mtmc::ShmExporter::GetExporter()); // TODO: Here hardcode to SHM exporter. Change later if more export in exporter.h
+                            // TODO: Here hardcode to SHM exporter. Change later if more export in exporter.h
+                            pending_export_ = mtmc::ShmExporter::GetExporter().ExportAsync(profile_storage_, mtmc_setting_, &quality);
                             break;
                         case 3:
                             Dprintf("ExportMode: %d\n", 3);
-                            Finish(mtmc::ShmExporter::GetExporter());
+                            pending_export_ = mtmc::ShmExporter::GetExporter().ExportAsync(profile_storage_, mtmc_setting_, &quality);
                             break;
                         default:
                             Dprintf(FRED("Unsupported ExportMode in the config json: %d\n"), mtmc_setting_.export_mode);
@@ -435,6 +718,116 @@ namespace mtmc {
         return 1;
     }
 
+    int MTMCProfiler::ExportAggregate(const std::string& file) {
+        if (!aggregator_) {
+            Dprintf(FRED("Aggregate mode is off. Nothing to export\n"));
+            return -1;
+        }
+        return aggregator_->Export(file, mtmc_setting_.event_names);
+    }
+
+    int MTMCProfiler::ExportImbalance(const std::string& file) {
+        if (!imbalance_detector_) {
+            Dprintf(FRED("Imbalance detector is off. Nothing to export\n"));
+            return -1;
+        }
+        return imbalance_detector_->Export(file);
+    }
+
+    int MTMCProfiler::ExportCtxSwitchJoin(const std::map<int, std::vector<StoreData>>& ctx_data,
+                                          const std::string& file, const std::vector<EbpfWakeupData>* wakeups) {
+        // Per thread counters never count other tasks, only the per core ones need the correction
+#ifdef USE_PER_THREADS_PERF
+        CtxSwitchJoin join(CtxSwitchJoin::MonoToRealOffsetNs(), false);
+#else
+        CtxSwitchJoin join(CtxSwitchJoin::MonoToRealOffsetNs(), true, std::max(mtmc_setting_.stripe_group, 0));
+#endif
+        join.AddSwitches(ctx_data);
+        if (wakeups) join.AddWakeups(*wakeups);
+        std::lock_guard<std::mutex> lock(mux_);
+        return join.Export(profile_storage_, file);
+    }
+
+    std::string MTMCProfiler::HandleQuery(const std::string& cmd, const std::string& arg) {
+        json reply;
+        if (cmd == "status") {
+            std::lock_guard<std::mutex> lock(mux_);
+            size_t num_spans = 0;
+            for (auto& vec : profile_storage_) {
+                num_spans += vec.ApproxSize();
+            }
+            reply["Enabled"] = collect_flag_.load(std::memory_order_relaxed);
+            reply["StorageBytes"] = num_spans * sizeof(SingleProfile);
+            reply["Threads"] = profile_storage_.size();
+            reply["ExportMode"] = mtmc_setting_.export_mode;
+            reply["AggregateMode"] = mtmc_setting_.aggregate_mode;
+            reply["ImbalanceDetector"] = imbalance_detector_ != nullptr;
+            reply["ConfigEpoch"] = perfmon_collector_ ? perfmon_collector_->GetConfigEpoch() : 0;
+            reply["StripeGroup"] = stripe_ ? stripe_->Group() : -1;
+        }
+        else if (cmd == "quality") {
+            auto quality = GetSpanQuality();
+            reply["Spans"] = quality.num_spans;
+            reply["Migrated"] = quality.num_migrated;
+            reply["Mismatched"] = quality.num_mismatched;
+            reply["Dropped"] = quality.num_dropped;
+        }
+        else if (cmd == "threads") {
+            std::lock_guard<std::mutex> lock(mux_);
+            json threads = json::array();
+            for (auto& elem : thread_storage_mapper) {
+                threads.push_back({{"Tid", elem.first}, {"Spans", elem.second->ApproxSize()}});
+            }
+            reply["Threads"] = threads;
+        }
+        else if (cmd == "ops") {
+            if (!aggregator_) {
+                reply["Error"] = "Aggregate mode is off";
+                return reply.dump();
+            }
+            // Busiest ops first, at most arg of them
+            auto merged = aggregator_->Merge();
+            std::sort(merged.begin(), merged.end(), [](const OpAggregator::MergedOp& a, const OpAggregator::MergedOp& b) {
+                return a.count > b.count;
+            });
+            size_t limit = arg.empty() ? 20 : strtoul(arg.c_str(), nullptr, 10);
+            json ops = json::array();
+            for (size_t i = 0; i < merged.size() && i < limit; ++i) {
+                auto& op = merged[i];
+                ops.push_back({{"Name", op.name}, {"IntPrefix", op.int_prefix}, {"Group", op.group}, {"Count", op.count},
+                               {"MeanNs", double(op.sum_ns) / op.count},
+                               {"P50Ns", LogLinearBucket::Percentile(op.hist.data(), op.count, 50)},
+                               {"P99Ns", LogLinearBucket::Percentile(op.hist.data(), op.count, 99)}});
+            }
+            reply["Ops"] = ops;
+        }
+        else if (cmd == "enable") {
+            reply["Previous"] = GlobalProfilerEnable();
+        }
+        else if (cmd == "disable") {
+            reply["Previous"] = GlobalProfilerDisable();
+        }
+        else if (cmd == "checkpoint") {
+            if (arg.empty()) {
+                reply["Error"] = "Usage: checkpoint <file>";
+                return reply.dump();
+            }
+            // Heap storage may be reallocated by its thread under the reader, chunks stay in place
+            if (!aggregator_ && IsEnabled() && !chunk_provider_ && numa_providers_.empty()) {
+                reply["Error"] = "Checkpoint of heap storage needs the collection disabled first";
+                return reply.dump();
+            }
+            // Spans are kept, so the final export at Close still sees everything
+            int ret = aggregator_ ? ExportAggregate(arg) : ExportLog(arg, false);
+            if (imbalance_detector_) ExportImbalance(arg + ".imbalance.json");
+            reply["Result"] = ret;
+        }
+        else {
+            reply["Error"] = "Unknown command. Supported: status, threads, ops [n], enable, disable, checkpoint <file>";
+        }
+        return reply.dump();
+    }
+
     inline int MTMCProfiler::GlobalProfilerDisable() {
         bool old = collect_flag_.load();
         collect_flag_.store(false, std::memory_order_release);
@@ -452,11 +845,13 @@ namespace mtmc {
     }
 
     inline int MTMCProfiler::SetGlobalIntPrefix(int64_t int_prefix) {
+        MTMC_PROBE1(set_int_prefix, int_prefix);
         global_int_prefix_.store(int_prefix, std::memory_order_release);
         return 1;
     }
 
     inline int MTMCProfiler::UpdateCurrentCtx(const Context &ctx) {
+        MTMC_PROBE4(ctx_update, ctx.level, ctx.ctx_hash_id, ctx.tracing_hash_id, ctx.name.c_str());
         *ctx_saver.GetThreadLocalData() = ctx;
         return 1;
     }
@@ -466,11 +861,13 @@ namespace mtmc {
     }
 
     inline void  MTMCProfiler::PushCurrentCtx(const Context& ctx) {
+        MTMC_PROBE4(ctx_push, ctx.level, ctx.ctx_hash_id, ctx.tracing_hash_id, ctx.name.c_str());
         ctx_info.GetThreadLocalStack()->push_back(ctx);
     }
 
     inline void  MTMCProfiler::PopCurrentCtx() {
         ctx_info.GetThreadLocalStack()->pop_back();
+        MTMC_PROBE1(ctx_pop, ctx_info.GetThreadLocalStack()->size());
     }
 
     inline Context*  MTMCProfiler::CurrentCtx() {
@@ -481,6 +878,18 @@ namespace mtmc {
         return ctx_info.GetThreadLocalStack()->size();
     }
 
+    SpanQualityCounts MTMCProfiler::GetSpanQuality() {
+        std::lock_guard<std::mutex> lock(mux_);
+        SpanQualityCounts counts{};
+        for (auto& quality : span_quality_storage_) {
+            counts.num_spans += quality.num_spans.load(std::memory_order_relaxed);
+            counts.num_migrated += quality.num_migrated.load(std::memory_order_relaxed);
+            counts.num_mismatched += quality.num_mismatched.load(std::memory_order_relaxed);
+            counts.num_dropped += quality.num_dropped.load(std::memory_order_relaxed);
+        }
+        return counts;
+    }
+
     size_t MTMCProfiler::StorageSize() {
         size_t ret = 0;
         for (auto& vec : profile_storage_) {
@@ -607,8 +1016,24 @@ namespace mtmc {
         return mtmc_setting_;
     }
 
+    int MTMCProfiler::WaitExport(uint64_t timeout_ms) {
+        if (!pending_export_) return 1;
+        int ret = pending_export_->Wait(timeout_ms);
+        pending_export_.reset();
+        return ret;
+    }
+
     MTMCProfiler::~MTMCProfiler() {
         MTMCProfiler::Close();
+        // Copy mode shm is released with the handle. A detached waiter keeps it for the daemon, so that the destructor
+        // does not block for up to the export timeout
+        if (pending_export_ && !pending_export_->Done()) {
+            auto handle = pending_export_;
+            uint64_t timeout_ms = mtmc_setting_.export_timeout_ms;
+            std::thread([handle, timeout_ms]() {
+                handle->Wait(timeout_ms);
+            }).detach();
+        }
     }
 
     // ----------------------------------- Private ----------------------------------------
@@ -619,19 +1044,38 @@ namespace mtmc {
         if (storage_ptr_itr == thread_storage_mapper.end()) {
             if (create_at_absence) {
                 // Init this thread's storage vector. Push back an empty vector<SingleProfile>
-                profile_storage_.emplace_back(1024);  // TODO: Reserve is not a good idea. When thread# >1000, system will crash
+                if (chunk_provider_) {
+                    profile_storage_.emplace_back(chunk_provider_);
+                }
+                else if (!numa_providers_.empty()) {
+                    int node = util::GetCurrentNumaNode();
+                    if (node < 0 || node >= (int)numa_providers_.size()) node = 0;
+                    profile_storage_.emplace_back(numa_providers_[node].get());
+                }
+                else {
+                    profile_storage_.emplace_back(1024);  // TODO: Reserve is not a good idea. When thread# >1000, system will crash
+                }
                 th_info->storage_ptr = &(profile_storage_.back());
                 // th_info->storage_ptr->reserve(1024*1024*100); // TODO: Use list or Vector+reserve?
                 // Add the thread info to the map
                 thread_storage_mapper.insert({th_info->tid, th_info->storage_ptr});
+                span_quality_storage_.emplace_back();
+                th_info->quality_ptr = &(span_quality_storage_.back());
+                thread_quality_mapper.insert({th_info->tid, th_info->quality_ptr});
+#ifdef EBPF_CTX_SC
+                // Let the context switch probe keep the switches of this thread
+                EbpfSampler::GetInstance().EbpfCtxScAddThread((pid_t)th_info->tid);
+#endif
             }
             else {
                 th_info->storage_ptr = nullptr;
+                th_info->quality_ptr = nullptr;
             }
 
         }
         else {
             th_info->storage_ptr = storage_ptr_itr->second;
+            th_info->quality_ptr = thread_quality_mapper[th_info->tid];
         }
     }
 
@@ -683,6 +1127,10 @@ namespace mtmc {
         return profiler_impl->Close();
     }
 
+    int MTMCTemprolProfiler::WaitExport(uint64_t timeout_ms) {
+        return profiler_impl->WaitExport(timeout_ms);
+    }
+
     int MTMCTemprolProfiler::GlobalProfilerDisable() {
         return profiler_impl->GlobalProfilerDisable();
     }
@@ -21,6 +21,7 @@
 #include <mutex>
 #include <unordered_map>
 #include <list>
+#include <map>
 #include <memory>
 #include<deque>
 #include <stack>
@@ -57,17 +58,42 @@ namespace mtmc {
               char has_start_info : 1,
               has_end_info : 1,
               has_topdown_info: 1,
-              reserved : 5;
+              migrated : 1,        // Start and end PMC read on different cores
+              group_switched : 1,  // Event group multiplexed between start and end
+              pmc_invalid : 1,     // Counter deltas can not be used. Group switched, or migrated with per core counters
+              reserved : 2;
           } flag_bits;
           char flags;
         };
     };
 
+    // Pushed to the data tracer when LogStart could not store the span, so that the matching LogEnd is skipped
+#define DROPPED_SPAN_IDX SIZE_MAX
+
+// Number of SingleProfile in one NUMA local storage chunk is (1 << NUMA_CHUNK_SHIFT)
+#define NUMA_CHUNK_SHIFT 10
+
+    // Per thread data quality counters. Only the owner thread writes them
+    struct SpanQuality {
+        std::atomic<uint64_t> num_spans{};       // Spans finished by LogEnd
+        std::atomic<uint64_t> num_migrated{};    // Start and end PMC read on different cores
+        std::atomic<uint64_t> num_mismatched{};  // Start and end PMC read from different event groups
+        std::atomic<uint64_t> num_dropped{};     // Spans lost because the storage was exhausted
+    };
+
+    struct SpanQualityCounts {
+        uint64_t num_spans;
+        uint64_t num_migrated;
+        uint64_t num_mismatched;
+        uint64_t num_dropped;
+    };
+
     struct ThreadInfo {
         int64_t tid;
         int32_t pthread_id;
         util::IndexVector<SingleProfile>* storage_ptr;
         std::stack<size_t> data_tracer;
+        SpanQuality* quality_ptr;
     };
 
     ThreadInfo& GetPerThreadInfo();
@@ -94,6 +120,15 @@ namespace mtmc {
         }
     };
 
+    class ExportHandle;
+    class OpAggregator;
+    class ImbalanceDetector;
+    class QueryServer;
+    class StripeCoordinator;
+    class ShmSpanArena;
+    struct StoreData;
+    struct EbpfWakeupData;
+
     class Exporter {
     public:
         Exporter() = default;
@@ -123,6 +158,18 @@ namespace mtmc {
          */
         int Init();
 
+        /**
+         * @name Reconfigure
+         * @param config_addr -- input, path of a config in the format of MTMC_CONFIG. Only its event groups are used
+         * @description Swap the event groups of every per core and per thread agent without re-Init. Agents switch at
+         * their next LogStart with no span open on the thread, spans in flight keep their groups. The new groups are
+         * appended to the profiler's group list, so multiplex_idx of a span stays valid across epochs and
+         * rd_ret_start.config_epoch tells the epoch. A striped instance counts its claimed group of the new config, which
+         * must have as many groups as the stripe. Fails while the eBPF context switch sampler is inited
+         * @return the new config epoch; < 0 for failure
+         */
+        int Reconfigure(const std::string& config_addr);
+
         /**
          * @name ExportThreadPoolInfo. Export thread pool information to the disk.
          * @param tids -- input,the list of tid
@@ -195,6 +242,39 @@ namespace mtmc {
          */
         int Close();
 
+        /**
+         * Wait for the export issued by Close() to be done by the exporter daemon. Close() does not block on it, and
+         * the destructor leaves a pending export to a detached waiter
+         * @param timeout_ms: Max time to wait in milliseconds
+         * @return 1 for done or nothing to wait. -1 for failed or timeout
+         */
+        int WaitExport(uint64_t timeout_ms);
+
+        /**
+         * Export the per op statistics collected in aggregate mode as json
+         * @param file: Path of the output file
+         * @return 1 for success. -1 for failed or aggregate mode is off
+         */
+        int ExportAggregate(const std::string& file);
+
+        /**
+         * Export the intra-op load imbalance summaries and the worst stragglers as json
+         * @param file: Path of the output file
+         * @return 1 for success. -1 for failed or the detector is off
+         */
+        int ExportImbalance(const std::string& file);
+
+        /**
+         * Join the eBPF context switch records to the collected spans and write the true on cpu time, the off cpu
+         * time, the number of preemptions and the corrected counter deltas of every span as csv
+         * @param ctx_data: Per cpu records of the EbpfSampler, collected over the same period
+         * @param file: Path of the output file
+         * @param wakeups: Optional wakeup to run latencies of the EbpfSampler, to split the runqueue wait out
+         * @return 1 for success, -1 for failed
+         */
+        int ExportCtxSwitchJoin(const std::map<int, std::vector<StoreData>>& ctx_data, const std::string& file,
+                                const std::vector<EbpfWakeupData>* wakeups = nullptr);
+
         /**
          * Disable the profiler globally. If the profiler is disabled, it will not capture any data with LogEnd or LogStart.
          * @return 1 and 0 for previous states (Enabled or disabled). -1 for failed
@@ -213,6 +293,11 @@ namespace mtmc {
          */
         inline int IsEnabled();
 
+        /**
+         * Sum of the data quality counters of all threads
+         */
+        SpanQualityCounts GetSpanQuality();
+
         /**
          * Approximate number of byte used to store log data
          * @return size in byte
@@ -261,7 +346,10 @@ namespace mtmc {
     private:
         std::string config_addr_;
         std::shared_ptr<PerfmonCollector> perfmon_collector_;
-        ProfilerSetting mtmc_setting_{.perf_collect_topdown = false};
+        ProfilerSetting mtmc_setting_{.perf_collect_topdown = false, .export_timeout_ms = DEFAULT_EXPORT_TIMEOUT_MS};
+
+        // Export issued by Close() that the exporter daemon has not reported done yet
+        std::shared_ptr<ExportHandle> pending_export_;
 
         // Init flag
         bool valid_{};
@@ -274,8 +362,27 @@ namespace mtmc {
 
         // Collected data storage
         std::mutex mux_{};
+        // One chunk provider per NUMA node. Declared before the storage that borrows its chunks
+        std::vector<std::unique_ptr<util::NumaChunkProvider<SingleProfile>>> numa_providers_{};
+        // Shared with the exporter, whose static may be destroyed first. Also declared before the storage
+        std::shared_ptr<ShmSpanArena> shm_arena_{};
         std::list<util::IndexVector<SingleProfile>> profile_storage_{};
         std::unordered_map<int64_t, util::IndexVector<SingleProfile>*> thread_storage_mapper{};
+        std::list<SpanQuality> span_quality_storage_{};
+        std::unordered_map<int64_t, SpanQuality*> thread_quality_mapper{};
+        util::ChunkProvider<SingleProfile>* chunk_provider_{};  // Not owned. shm_arena_ or unset
+
+        // Per op statistics. Only set in aggregate mode, where finished spans are folded here instead of being kept
+        std::shared_ptr<OpAggregator> aggregator_;
+
+        // Groups sibling intra-op chunks at LogEnd. Only set if ImbalanceWindowMs > 0
+        std::shared_ptr<ImbalanceDetector> imbalance_detector_;
+
+        // Unix domain socket server for live queries. Only set if MTMC_QUERY_SOCKET is given
+        std::shared_ptr<QueryServer> query_server_;
+
+        // Claims the config group counted by this process. Only set if StripeKey is given and the claim succeeded
+        std::shared_ptr<StripeCoordinator> stripe_;
 
         // Context propagation
         ThreadLocalSaver<Context> ctx_saver{};
@@ -283,6 +390,15 @@ namespace mtmc {
         ThreadLocalStack<Context> ctx_info;
 
         void RegisterPerThreadStorage(ThreadInfo* th_info, bool create_at_absence);
+
+        // Write the collected spans to output_file in the text log format
+        int ExportLog(const std::string& output_file, bool clear_when_done);
+
+        // Write the valid spans of one thread's storage as text log lines
+        void WriteSpans(util::IndexVector<SingleProfile>& vec, std::ostream& os);
+
+        // Answer a query from the query server. Returns a json line
+        std::string HandleQuery(const std::string& cmd, const std::string& arg);
     };
 }
 
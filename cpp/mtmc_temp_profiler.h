@@ -153,6 +153,13 @@ namespace mtmc {
          */
         int Close();
 
+        /**
+         * @name WaitExport
+         * @description Wait for the export issued by Close() to be done by the exporter daemon.
+         * @return 1 for done or nothing to wait; -1 for failed or timeout.
+         */
+        int WaitExport(uint64_t timeout_ms);
+
         /**
          * Disable the profiler globally. If the profiler is disabled, it will not capture any data with LogEnd or LogStart.
          * @return 1 and 0 for previous states (Enabled or disabled). -1 for failed
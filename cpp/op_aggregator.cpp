@@ -0,0 +1,250 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "op_aggregator.h"
+
+#include <fstream>
+#include <limits>
+#include <map>
+#include <tuple>
+
+using json = nlohmann::json;
+
+namespace mtmc {
+
+    namespace {
+        std::atomic<uint64_t> aggregator_instance_cnt{0};
+
+        // Single writer update, so no read-modify-write instruction is needed
+        inline void Bump(std::atomic<uint64_t>& counter, uint64_t delta) {
+            counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        }
+    }
+
+    // -------------------------------------- LogLinearBucket ----------------------------------------
+
+    uint64_t LogLinearBucket::Percentile(const uint64_t* hist, uint64_t total, double percentile) {
+        if (total == 0) return 0;
+        uint64_t rank = uint64_t(percentile / 100.0 * total);
+        if (rank >= total) rank = total - 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < AGG_HIST_NUM_BUCKETS; ++i) {
+            seen += hist[i];
+            if (seen > rank) return LowerBound(i);
+        }
+        return LowerBound(AGG_HIST_NUM_BUCKETS - 1);
+    }
+
+    // -------------------------------------- ThreadOpTable ----------------------------------------
+
+    ThreadOpTable::~ThreadOpTable() {
+        for (auto& page : pages_) {
+            delete[] page.load();
+        }
+    }
+
+    OpStats* ThreadOpTable::Find(const char* name, size_t name_hash, int64_t int_prefix, int group) {
+        auto itr = index_.find(Key{name, name_hash, int_prefix, group});
+        return itr == index_.end() ? nullptr : itr->second;
+    }
+
+    OpStats* ThreadOpTable::Append(const char* name, size_t name_hash, uint32_t name_id, int64_t int_prefix,
+                                   int group) {
+        size_t slot = num_slots_.load(std::memory_order_relaxed);
+        if (slot >= size_t(AGG_PAGE_SIZE) * AGG_MAX_PAGES) {
+            return nullptr;
+        }
+        if (slot % AGG_PAGE_SIZE == 0) {
+            pages_[slot / AGG_PAGE_SIZE].store(new OpStats[AGG_PAGE_SIZE](), std::memory_order_release);
+        }
+        OpStats* stats = &pages_[slot / AGG_PAGE_SIZE].load(std::memory_order_relaxed)[slot % AGG_PAGE_SIZE];
+        stats->name_id = name_id;
+        stats->int_prefix = int_prefix;
+        stats->group = group;
+        stats->min_ns.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+        name_store_.emplace_back(name);
+        index_.insert({Key{name_store_.back().c_str(), name_hash, int_prefix, group}, stats});
+        // Publish the slot after its key is written
+        num_slots_.store(slot + 1, std::memory_order_release);
+        return stats;
+    }
+
+    size_t ThreadOpTable::NameHash(const char* name) {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+        for (; *name; ++name) {
+            hash = (hash ^ (unsigned char)(*name)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // -------------------------------------- OpAggregator ----------------------------------------
+
+    OpAggregator::OpAggregator(int mode) {
+        mode_ = mode;
+        instance_id_ = aggregator_instance_cnt.fetch_add(1) + 1;
+    }
+
+    int OpAggregator::Record(const SingleProfile& prof) {
+        ThreadOpTable* table = GetThreadTable();
+        int64_t int_prefix = mode_ == AGG_BY_NAME_INT_PREFIX ? prof.int_prefix : 0;
+        size_t name_hash = ThreadOpTable::NameHash(prof.prefix);
+
+        // The name is only copied the first time the thread sees the op
+        OpStats* stats = table->Find(prof.prefix, name_hash, int_prefix, prof.multiplex_idx);
+        if (stats == nullptr) {
+            stats = table->Append(prof.prefix, name_hash, Intern(prof.prefix), int_prefix, prof.multiplex_idx);
+            if (stats == nullptr) {
+                DDprintf(FRED("Op table is full, span %s is dropped from the aggregation\n"), prof.prefix);
+                return -1;
+            }
+        }
+
+        uint64_t dur = prof.end_ts > prof.start_ts ? prof.end_ts - prof.start_ts : 0;
+        Bump(stats->count, 1);
+        Bump(stats->sum_ns, dur);
+        if (dur < stats->min_ns.load(std::memory_order_relaxed)) stats->min_ns.store(dur, std::memory_order_relaxed);
+        if (dur > stats->max_ns.load(std::memory_order_relaxed)) stats->max_ns.store(dur, std::memory_order_relaxed);
+        Bump(stats->hist[LogLinearBucket::Index(dur)], 1);
+
+        // A migration in per core mode, a group switch or a config epoch change between start and end makes the deltas
+        // meaningless
+        int num_event = prof.rd_ret_start.num_event;
+        if (num_event > 0 && num_event == prof.rd_ret_end.num_event && !prof.flag_bits.pmc_invalid) {
+            if (num_event > AGG_MAX_EVENTS) num_event = AGG_MAX_EVENTS;
+            Bump(stats->pmc_count, 1);
+            for (int i = 0; i < num_event; ++i) {
+                if (prof.ret_end[i] >= prof.ret_start[i]) {
+                    Bump(stats->pmc_delta_sum[i], prof.ret_end[i] - prof.ret_start[i]);
+                }
+            }
+        }
+        return 1;
+    }
+
+    std::vector<OpAggregator::MergedOp> OpAggregator::Merge() {
+        std::lock_guard<std::mutex> lock(mux_);
+        std::vector<MergedOp> merged;
+        std::map<std::tuple<uint32_t, int64_t, int>, size_t> merged_idx;
+
+        for (auto& table : tables_) {
+            size_t num_slots = table->Size();
+            for (size_t slot = 0; slot < num_slots; ++slot) {
+                const OpStats* stats = table->Get(slot);
+                uint64_t count = stats->count.load(std::memory_order_relaxed);
+                if (count == 0) continue;
+
+                auto key = std::make_tuple(stats->name_id, stats->int_prefix, stats->group);
+                auto itr = merged_idx.find(key);
+                if (itr == merged_idx.end()) {
+                    MergedOp op{};
+                    op.name = names_[stats->name_id];
+                    op.int_prefix = stats->int_prefix;
+                    op.group = stats->group;
+                    op.min_ns = std::numeric_limits<uint64_t>::max();
+                    op.pmc_delta_sum.assign(AGG_MAX_EVENTS, 0);
+                    op.hist.assign(AGG_HIST_NUM_BUCKETS, 0);
+                    itr = merged_idx.insert({key, merged.size()}).first;
+                    merged.push_back(std::move(op));
+                }
+
+                MergedOp& op = merged[itr->second];
+                op.count += count;
+                op.sum_ns += stats->sum_ns.load(std::memory_order_relaxed);
+                op.min_ns = std::min(op.min_ns, stats->min_ns.load(std::memory_order_relaxed));
+                op.max_ns = std::max(op.max_ns, stats->max_ns.load(std::memory_order_relaxed));
+                op.pmc_count += stats->pmc_count.load(std::memory_order_relaxed);
+                for (int i = 0; i < AGG_MAX_EVENTS; ++i) {
+                    op.pmc_delta_sum[i] += stats->pmc_delta_sum[i].load(std::memory_order_relaxed);
+                }
+                for (size_t i = 0; i < AGG_HIST_NUM_BUCKETS; ++i) {
+                    op.hist[i] += stats->hist[i].load(std::memory_order_relaxed);
+                }
+            }
+        }
+        return merged;
+    }
+
+    int OpAggregator::Export(const std::string& file, const std::vector<std::vector<std::string>>& event_names) {
+        auto merged = Merge();
+
+        json ops = json::array();
+        for (auto& op : merged) {
+            json j_op;
+            j_op["Name"] = op.name;
+            j_op["IntPrefix"] = op.int_prefix;
+            j_op["Group"] = op.group;
+            j_op["Count"] = op.count;
+            j_op["MeanNs"] = double(op.sum_ns) / op.count;
+            j_op["MinNs"] = op.min_ns;
+            j_op["MaxNs"] = op.max_ns;
+            j_op["P50Ns"] = LogLinearBucket::Percentile(op.hist.data(), op.count, 50);
+            j_op["P90Ns"] = LogLinearBucket::Percentile(op.hist.data(), op.count, 90);
+            j_op["P99Ns"] = LogLinearBucket::Percentile(op.hist.data(), op.count, 99);
+            j_op["P999Ns"] = LogLinearBucket::Percentile(op.hist.data(), op.count, 99.9);
+
+            json pmc = json::object();
+            if (op.pmc_count > 0 && op.group >= 0 && op.group < (int)event_names.size()) {
+                auto& names = event_names[op.group];
+                for (size_t i = 0; i < names.size() && i < AGG_MAX_EVENTS; ++i) {
+                    pmc[names[i]] = double(op.pmc_delta_sum[i]) / op.pmc_count;
+                }
+            }
+            j_op["MeanPmcDelta"] = pmc;
+            ops.push_back(j_op);
+        }
+
+        json j;
+        j["AggregateMode"] = mode_;
+        j["Ops"] = ops;
+
+        std::ofstream resultfs(file, std::ios::out);
+        if (!resultfs.good()) {
+            Dprintf(FRED("Open file failed: %s\n"), file.c_str());
+            return -1;
+        }
+        resultfs << j.dump(2) << std::endl;
+        Dprintf("Aggregated %lu ops exported to %s\n", merged.size(), file.c_str());
+        return 1;
+    }
+
+    // ----------------------------------- Private ----------------------------------------
+
+    uint32_t OpAggregator::Intern(const std::string& name) {
+        // Only called the first time a thread sees an op, so the lock is off the hot path
+        std::lock_guard<std::mutex> lock(mux_);
+        auto itr = name_ids_.find(name);
+        if (itr != name_ids_.end()) return itr->second;
+        uint32_t id = names_.size();
+        names_.push_back(name);
+        name_ids_.insert({name, id});
+        return id;
+    }
+
+    ThreadOpTable* OpAggregator::GetThreadTable() {
+        // Instance id instead of the address, so a new aggregator at a reused address does not pick up a stale table
+        thread_local struct {
+            uint64_t instance_id;
+            ThreadOpTable* table;
+        } cache{0, nullptr};
+
+        if (cache.instance_id != instance_id_) {
+            std::lock_guard<std::mutex> lock(mux_);
+            tables_.emplace_back(new ThreadOpTable());
+            cache.instance_id = instance_id_;
+            cache.table = tables_.back().get();
+        }
+        return cache.table;
+    }
+}
@@ -0,0 +1,209 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_OP_AGGREGATOR_H
+#define MTMC_OP_AGGREGATOR_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mtmc_profiler.h"
+
+namespace mtmc {
+
+// Values below (1 << AGG_HIST_SUB_BITS) get exact buckets, larger values keep AGG_HIST_SUB_BITS bits of precision
+#define AGG_HIST_SUB_BITS 3
+#define AGG_HIST_NUM_BUCKETS ((64 - AGG_HIST_SUB_BITS + 1) << AGG_HIST_SUB_BITS)
+// Per thread op table grows by pages of AGG_PAGE_SIZE ops, up to AGG_MAX_PAGES pages
+#define AGG_PAGE_SIZE 16
+#define AGG_MAX_PAGES 4096
+#define AGG_MAX_EVENTS 16
+
+    enum AggregateMode {
+        AGG_OFF = 0,
+        AGG_BY_NAME = 1,            // One entry per span name (prefix) and config group
+        AGG_BY_NAME_INT_PREFIX = 2, // Additionally split by int_prefix
+    };
+
+    /**
+     * Log-linear (HDR style) histogram bucketing. Relative error of a bucket is below 2^-AGG_HIST_SUB_BITS
+     */
+    struct LogLinearBucket {
+        static inline size_t Index(uint64_t value) {
+            if (value < (uint64_t(1) << AGG_HIST_SUB_BITS)) return value;
+            int exp = 63 - __builtin_clzll(value);
+            size_t sub = (value >> (exp - AGG_HIST_SUB_BITS)) & ((uint64_t(1) << AGG_HIST_SUB_BITS) - 1);
+            return (size_t(exp - AGG_HIST_SUB_BITS + 1) << AGG_HIST_SUB_BITS) + sub;
+        }
+
+        static inline uint64_t LowerBound(size_t idx) {
+            if (idx < (size_t(1) << AGG_HIST_SUB_BITS)) return idx;
+            int exp = int(idx >> AGG_HIST_SUB_BITS) + AGG_HIST_SUB_BITS - 1;
+            uint64_t sub = idx & ((size_t(1) << AGG_HIST_SUB_BITS) - 1);
+            return (uint64_t(1) << exp) | (sub << (exp - AGG_HIST_SUB_BITS));
+        }
+
+        /**
+         * Value at the given percentile of a bucket count array
+         * @param hist: AGG_HIST_NUM_BUCKETS counts
+         * @param total: Sum of the counts
+         * @param percentile: 0 to 100
+         * @return Lower bound of the bucket the percentile falls in. 0 if total is 0
+         */
+        static uint64_t Percentile(const uint64_t* hist, uint64_t total, double percentile);
+    };
+
+    /**
+     * Statistics of one op. Only the owner thread writes, so updates are plain relaxed load + store. Other threads read
+     * them at merge time and may see a slightly stale but never torn value.
+     */
+    struct OpStats {
+        uint32_t name_id;
+        int64_t int_prefix;
+        int group;
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum_ns;
+        std::atomic<uint64_t> min_ns;
+        std::atomic<uint64_t> max_ns;
+        std::atomic<uint64_t> pmc_count;   // Number of spans whose start and end PMC read are from the same group
+        std::atomic<uint64_t> pmc_delta_sum[AGG_MAX_EVENTS];
+        std::atomic<uint64_t> hist[AGG_HIST_NUM_BUCKETS];
+    };
+
+    /**
+     * Op table of one thread. The owner thread looks up and appends ops without locking, other threads only read the
+     * slots published by Size().
+     */
+    class ThreadOpTable {
+    public:
+        ThreadOpTable() = default;
+        ~ThreadOpTable();
+
+        ThreadOpTable(const ThreadOpTable&) = delete;
+        ThreadOpTable& operator=(const ThreadOpTable&) = delete;
+
+        // Owner thread only. nullptr if the key is new
+        OpStats* Find(const char* name, size_t name_hash, int64_t int_prefix, int group);
+
+        // Owner thread only. nullptr if the table is full
+        OpStats* Append(const char* name, size_t name_hash, uint32_t name_id, int64_t int_prefix, int group);
+
+        // Hash of a span name for Find and Append, computed without copying the name
+        static size_t NameHash(const char* name);
+
+        size_t Size() const {
+            return num_slots_.load(std::memory_order_acquire);
+        }
+
+        const OpStats* Get(size_t slot) const {
+            return &pages_[slot / AGG_PAGE_SIZE].load(std::memory_order_acquire)[slot % AGG_PAGE_SIZE];
+        }
+
+    private:
+        // The name of a stored key points into name_store_. A lookup key points to the span's prefix
+        struct Key {
+            const char* name;
+            size_t name_hash;
+            int64_t int_prefix;
+            int group;
+            bool operator==(const Key& other) const {
+                return name_hash == other.name_hash && int_prefix == other.int_prefix && group == other.group &&
+                       strcmp(name, other.name) == 0;
+            }
+        };
+
+        struct KeyHash {
+            size_t operator()(const Key& key) const {
+                return key.name_hash ^ (std::hash<int64_t>()(key.int_prefix) * 31 + key.group);
+            }
+        };
+
+        std::unordered_map<Key, OpStats*, KeyHash> index_;
+        std::deque<std::string> name_store_;  // Elements never move, so the keys can point to them
+        std::atomic<OpStats*> pages_[AGG_MAX_PAGES]{};
+        std::atomic<size_t> num_slots_{0};
+    };
+
+    /**
+     * Streaming per op aggregation. Completed spans are folded into per thread tables at LogEnd, so memory is
+     * proportional to the number of distinct ops instead of the number of spans.
+     */
+    class OpAggregator {
+    public:
+        explicit OpAggregator(int mode);
+        ~OpAggregator() = default;
+
+        OpAggregator(const OpAggregator&) = delete;
+        OpAggregator& operator=(const OpAggregator&) = delete;
+
+        // Merged statistics of one op over all threads
+        struct MergedOp {
+            std::string name;
+            int64_t int_prefix;
+            int group;
+            uint64_t count;
+            uint64_t sum_ns;
+            uint64_t min_ns;
+            uint64_t max_ns;
+            uint64_t pmc_count;
+            std::vector<uint64_t> pmc_delta_sum;
+            std::vector<uint64_t> hist;
+        };
+
+        /**
+         * Fold a completed span into the calling thread's table. Must be called by the thread that owns the span
+         * @return 1 for success, -1 if the table is full
+         */
+        int Record(const SingleProfile& prof);
+
+        /**
+         * Merge the tables of all threads. Can be called while other threads are still recording
+         */
+        std::vector<MergedOp> Merge();
+
+        /**
+         * Merge and write the statistics as json
+         * @param file: Output path
+         * @param event_names: Event names of every config group, used to name the counter deltas
+         * @return 1 for success, -1 for failed
+         */
+        int Export(const std::string& file, const std::vector<std::vector<std::string>>& event_names);
+
+        int Mode() const {
+            return mode_;
+        }
+
+    private:
+        uint32_t Intern(const std::string& name);
+
+        ThreadOpTable* GetThreadTable();
+
+        int mode_;
+        uint64_t instance_id_;
+
+        std::mutex mux_;  // Guards the name table and the thread table list
+        std::unordered_map<std::string, uint32_t> name_ids_;
+        std::vector<std::string> names_;
+        std::vector<std::unique_ptr<ThreadOpTable>> tables_;
+    };
+}
+
+#endif //MTMC_OP_AGGREGATOR_H
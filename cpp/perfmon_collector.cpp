@@ -14,6 +14,9 @@
 
 #include "perfmon_collector.h"
 
+#include <algorithm>
+#include <thread>
+
 namespace mtmc {
 
     uint64_t ReadMmapPMC(void *addr, const ReadSetting& rd_setting) {
@@ -66,15 +69,23 @@ namespace mtmc {
     // ------------------------------- PerfmonAgent -------------------------------------
 
     int PerfmonAgent::AddAttr(const InputConfig &configs) {
-//        if (configs.event_num + num_events_here_ > GP_COUNTER) {
-//            Dprintf("Number of events exceeds limitation when adding\n");
-//            return 0;
-//        }
+        // Multiplexed groups are registered one at a time, otherwise every group is read together
+        int num_events = configs.multiplex_intv > 0 ? configs.event_num : configs.event_num + num_events_here_;
+        if (num_events > GP_COUNTER) {
+            Dprintf(FRED("Number of events exceeds limitation when adding\n"));
+            return -1;
+        }
         cfg_vec_.push_back(configs);
         num_events_here_ += configs.event_num;
         return 1;
     }
 
+    void PerfmonAgent::ClearAttr() {
+        cfg_vec_.clear();
+        num_events_here_ = 0;
+        curr_cfg_idx = 0;
+    }
+
     int PerfmonAgent::RegisterEvents(std::vector<InputConfig> sub_cfg_vec) {
         // TODO: Register failed should have corresponding clear up actions
         /* Check and iterate through cfg_vec. Each iteration register one group of events */
@@ -333,7 +344,9 @@ namespace mtmc {
                 config.pid_arr[j] = 0;
                 config.cpu_arr[j] = -1;
             }
-            this->AddAttr(config);
+            if (this->AddAttr(config) != 1) {
+                goto Failed;
+            }
         }
 
         if (this->RegisterEvents({(*cfg_from_collector)[0]}) != 1) {
@@ -421,38 +434,53 @@ Failed:
 
         Dprintf(FCYN("Perfmon collector will bind to THREADS\n"));
 
-        this->init_config = input_config;
-
-        for (auto& config : init_config) {
-            for (int j = 0; j < config.event_num; ++j) {
-                config.pid_arr[j] = 0;
-                config.cpu_arr[j] = -1;
-            }
-        }
-
-        init_cntr.fetch_add(1);
+        // Threads open their agents with it on their next read
+        init_epoch_ = PublishConfig(input_config, std::max(mtmc_setting.stripe_group, 0));
 
 #else
         int max_num_core = util::GetMaxNumOfCpus();
 
-        if (max_num_core > perfmon_agent_vec_.size()) {
-            perfmon_agent_vec_.resize(max_num_core);
-            Dprintf(FBLU("Reset perfmon_agent_vec_ to %d\n"), max_num_core);
+        if (max_num_core > num_core_agents_) {
+            core_agents_.reset(new CoreAgent[max_num_core]);
+            num_core_agents_ = max_num_core;
+            Dprintf(FBLU("Reset core agents to %d\n"), max_num_core);
+        }
+        init_epoch_ = PublishConfig(input_config, std::max(mtmc_setting.stripe_group, 0));
+        agent_state_.reset(new std::atomic<int>[num_core_agents_]);
+        for (size_t i = 0; i < num_core_agents_; ++i) {
+            agent_state_[i].store(AGENT_OFF);
         }
 
-        /* Create and register per core perfmon agent */
+        std::vector<int> cores;
         for (auto& cpu_id : num_core) {
             if (cpu_id >= max_num_core || cpu_id < 0) {
                 Dprintf(FRED("Invalid core number %d. Ignore this config\n"), cpu_id);
                 continue;
             }
-            for (auto& config : input_config) {
-                for (auto& cpu : config.cpu_arr) cpu = cpu_id;
-                perfmon_agent_vec_[cpu_id].AddAttr(config);
+            agent_state_[cpu_id].store(AGENT_CLOSED);
+            cores.push_back(cpu_id);
+        }
+
+        /* Create and register per core perfmon agent. Agents are independent, so they are opened in parallel */
+        if (!mtmc_setting.lazy_agent_init) {
+            int num_workers = mtmc_setting.init_threads;
+            if (num_workers <= 0) num_workers = std::max(1u, std::thread::hardware_concurrency());
+            num_workers = std::min(num_workers, (int)cores.size());
+            std::atomic<size_t> next{0};
+            std::atomic<bool> failed{false};
+            std::vector<std::thread> workers;
+            for (int w = 0; w < num_workers; ++w) {
+                workers.emplace_back([&]() {
+                    size_t i;
+                    while ((i = next.fetch_add(1)) < cores.size() && !failed.load()) {
+                        if (OpenAgent(cores[i]) != 1) failed.store(true);
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
             }
-            if (perfmon_agent_vec_[cpu_id].RegisterEvents() != 1) return -1;
-            if (perfmon_agent_vec_[cpu_id].ResetEvents() != 1) return -1;
-            if (perfmon_agent_vec_[cpu_id].EnableEvents() != 1) return -1;
+            if (failed.load()) return -1;
         }
 
 #endif
@@ -472,20 +500,57 @@ Failed:
         return 1;
     }
 
+    int PerfmonCollector::Reconfigure(const std::vector<InputConfig>& input_config, int group_base) {
+        if (!ready_.load()) {
+            Dprintf(FRED("Reconfigure failed. PerfmonCollector is not inited\n"));
+            return -1;
+        }
+        uint32_t epoch = PublishConfig(input_config, group_base);
+        Dprintf(FGRN("Perfmon collector config epoch %u: %lu groups from group %d\n"), epoch, input_config.size(),
+                group_base);
+        return epoch;
+    }
+
+    uint32_t PerfmonCollector::GetConfigEpoch() const {
+        return config_epoch_.load(std::memory_order_acquire);
+    }
+
+    void PerfmonCollector::SetGroupSwitchHook(GroupSwitchHook hook) {
+        group_switch_hook_ = std::move(hook);
+    }
+
+    std::vector<int> PerfmonCollector::GetGroupEventNums() const {
+        auto config = std::atomic_load(&agent_config_);
+        return config ? config->group_event_nums : std::vector<int>();
+    }
+
+    bool PerfmonCollector::IsMultiplexed() const {
+        auto config = std::atomic_load(&agent_config_);
+        return config && config->multiplexed;
+    }
+
     std::vector<PerfmonAgent> PerfmonCollector::DebugAcquirePerfmonAgent() {
-        return perfmon_agent_vec_;
+        std::vector<PerfmonAgent> agents(num_core_agents_);
+        for (size_t i = 0; i < num_core_agents_; ++i) {
+            auto agent = core_agents_[i].agent.load();
+            if (agent) agents[i] = *agent;
+        }
+        return agents;
     };
 
 #ifdef USE_PER_THREADS_PERF
 
-    PerfmonAgent& PerfmonCollector::GetPerThreadAgent() {
+    PerfmonAgent& PerfmonCollector::GetPerThreadAgent(bool quiescent) {
         thread_local PerfmonAgent per_thread_agent;
-        thread_local int this_init_cnt = 0;
 
-        if (per_thread_agent.init_status == 0 || init_cntr.load(std::memory_order_relaxed) > this_init_cnt) {
+        if (per_thread_agent.init_status == 0 ||
+            (quiescent && per_thread_agent.config_epoch != config_epoch_.load(std::memory_order_acquire))) {
             Dprintf(FCYN("Init perfmon agent on tid %ld\n"), Env::GetKtid());
-            per_thread_agent.TryInitPerThreadAgent(&this->init_config);
-            this_init_cnt = init_cntr.load(std::memory_order_relaxed);
+            auto config = std::atomic_load(&agent_config_);
+            auto groups = config->groups;
+            per_thread_agent.TryInitPerThreadAgent(&groups);
+            per_thread_agent.config_epoch = config->epoch;
+            per_thread_agent.group_base = config->group_base;
         }
 
         return per_thread_agent;
@@ -505,32 +570,70 @@ Failed:
             rd_ret->num_event = 0;
             return -1;
         }
-        PerfmonAgent& perfmon_agent_ref = GetPerThreadAgent();
+        // New event groups are only taken at a start read with no span open on this thread
+        return ReadAgent(GetPerThreadAgent(reset_flag), reset_flag, ret, rd_ret, multiplex_group_idx);
 
 #else
-        // Return if perfmon_agent_vec does not exist or have no events
-        if (!ready_.load() || rd_ret->core_id >= perfmon_agent_vec_.size() || perfmon_agent_vec_[rd_ret->core_id].GetEventCtxNum() == 0) {
+        if (rd_ret->core_id >= num_core_agents_) {
             rd_ret->num_event = 0;
             return -1;
         }
 
-        // Get per core perfmon agent
-        PerfmonAgent& perfmon_agent_ref = perfmon_agent_vec_[rd_ret->core_id];
+        // Held until the read is done and taken before ready_ is checked. CloseContext clears ready_ then waits for the
+        // readers, so it can not free the agent under this thread, and ReclaimAgent does not free a replaced one
+        auto& core_agent = core_agents_[rd_ret->core_id];
+        core_agent.readers.fetch_add(1);
+        PerfmonAgent* agent = nullptr;
+        if (ready_.load() && (agent_state_[rd_ret->core_id].load(std::memory_order_acquire) == AGENT_OPEN ||
+                              OpenLazyAgent(rd_ret->core_id))) {
+            agent = core_agent.agent.load();
+        }
 
+        // New event groups are only taken at a start read with no span open on this thread. Spans of other threads on
+        // the core see the epoch change and are marked
+        if (agent && reset_flag && agent->config_epoch != config_epoch_.load(std::memory_order_acquire) &&
+            ReopenAgent(rd_ret->core_id) == 1) {
+            agent = core_agent.agent.load();
+        }
+
+        // No agent if the collector is closed or the core's agent failed to open
+        int status = -1;
+        if (agent && agent->GetEventCtxNum() > 0) {
+            status = ReadAgent(*agent, reset_flag, ret, rd_ret, multiplex_group_idx);
+        }
+        else {
+            rd_ret->num_event = 0;
+        }
+        core_agent.readers.fetch_sub(1);
+        if (core_agent.retired.load(std::memory_order_relaxed)) ReclaimAgent(rd_ret->core_id);
+        return status;
 #endif
+    }
 
+    int PerfmonCollector::ReadAgent(PerfmonAgent& perfmon_agent_ref, bool reset_flag, uint64_t* ret, ReadResult* rd_ret,
+                                    int* multiplex_group_idx) {
         auto num_event_ctx = perfmon_agent_ref.GetEventCtxNum();
 
         // For start, check if pmc need reset, and if it needs to multiplex
         if (reset_flag) {
+#ifdef USE_PER_THREADS_PERF
             perfmon_agent_ref.MultiplexStep();
+#else
+            // The context switch probe only knows the groups of Init
+            if (perfmon_agent_ref.MultiplexStep() == 1 && group_switch_hook_ &&
+                perfmon_agent_ref.config_epoch == init_epoch_) {
+                group_switch_hook_(rd_ret->core_id, perfmon_agent_ref.GetMultiplexIdx(),
+                                   *perfmon_agent_ref.GetEventContext(0));
+            }
+#endif
             perfmon_agent_ref.CheckAndResetEventCtx();
             cpl_barrier();
         }
 
         if (multiplex_group_idx) {
-            (*multiplex_group_idx) = perfmon_agent_ref.GetMultiplexIdx();
+            (*multiplex_group_idx) = perfmon_agent_ref.group_base + perfmon_agent_ref.GetMultiplexIdx();
         }
+        rd_ret->config_epoch = perfmon_agent_ref.config_epoch;
 
         // Read those pmc and store to the ret ptr
         int ret_idx = 0;
@@ -554,10 +657,19 @@ Failed:
 //#ifndef USE_PER_THREADS_PERF
         bool expected = true;
         if (ready_.compare_exchange_strong(expected, false)) {
-            for (auto& agent : perfmon_agent_vec_) {
-                if (agent.GetEventCtxNum() > 0) {
-                    agent.DisableEvents();
-                    agent.UnregisterEvents();
+            for (size_t i = 0; i < num_core_agents_; ++i) {
+                auto& core_agent = core_agents_[i];
+                // Readers count themselves before they check ready_, so none can reach the agents once this is zero
+                while (core_agent.readers.load() > 0) {
+                    std::this_thread::yield();
+                }
+                for (auto agent : {core_agent.agent.exchange(nullptr), core_agent.retired.exchange(nullptr)}) {
+                    if (!agent) continue;
+                    if (agent->GetEventCtxNum() > 0) {
+                        agent->DisableEvents();
+                        agent->UnregisterEvents();
+                    }
+                    delete agent;
                 }
             }
         }
@@ -577,15 +689,23 @@ Failed:
     std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> PerfmonCollector::DebugAcquireEbpfCpuFdPairs() {
         std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> output;
 
-        auto& perfmon_agent_vec = perfmon_agent_vec_;
         auto cpu_onlines = util::GetCurrAvailableCPUList();
+        for (auto& online_id : cpu_onlines) {
+            if (!(online_id >= 0 && online_id < num_core_agents_) || !agent_state_) continue;
+            // The sampler needs the fds of every core, even the ones not read yet
+            OpenLazyAgent(online_id);
+            while (agent_state_[online_id].load(std::memory_order_acquire) == AGENT_OPENING) {
+                std::this_thread::yield();
+            }
+        }
 
         // Register attach bpf to every perfmon collectors' opend event
         for (auto& online_id : cpu_onlines) {
-            if (!(online_id >= 0 && online_id < perfmon_agent_vec.size())) {
+            if (!(online_id >= 0 && online_id < num_core_agents_) || !core_agents_[online_id].agent.load()) {
                 Dprintf(FRED("CPU number %d is invalid to init Ebpf perf event.\n"), online_id);
+                continue;
             }
-            auto& percore_agent = perfmon_agent_vec[online_id];
+            auto& percore_agent = *core_agents_[online_id].agent.load();
             for (int ctx = 0; ctx < percore_agent.GetEventCtxNum(); ++ctx) {
                 auto this_ctx = percore_agent.GetEventContext(ctx);
                 for (int evt_id = 0; evt_id < this_ctx->event_num; ++evt_id) {
@@ -603,4 +723,103 @@ Failed:
         return output;
     }
 
+    // ----------------------------------- Private ----------------------------------------
+
+    uint32_t PerfmonCollector::PublishConfig(const std::vector<InputConfig>& input_config, int group_base) {
+        std::lock_guard<std::mutex> lck(config_mux_);
+        auto config = std::make_shared<AgentConfig>();
+        config->epoch = config_epoch_.load() + 1;
+        config->group_base = group_base;
+        config->groups = input_config;
+        for (auto& group : input_config) {
+            config->group_event_nums.push_back(group.event_num);
+        }
+        config->multiplexed = input_config.size() > 1 && input_config[0].multiplex_intv > 0;
+#ifdef USE_PER_THREADS_PERF
+        for (auto& group : config->groups) {
+            for (int j = 0; j < group.event_num; ++j) {
+                group.pid_arr[j] = 0;
+                group.cpu_arr[j] = -1;
+            }
+        }
+#endif
+        std::atomic_store(&agent_config_, std::shared_ptr<const AgentConfig>(config));
+        // The epoch is bumped after the config is visible, so an agent seeing it finds the config
+        config_epoch_.store(config->epoch, std::memory_order_release);
+        return config->epoch;
+    }
+
+    PerfmonAgent* PerfmonCollector::NewAgent(int cpu_id, const AgentConfig& config) {
+        std::unique_ptr<PerfmonAgent> agent(new PerfmonAgent());
+        for (auto group : config.groups) {
+            for (auto& cpu : group.cpu_arr) cpu = cpu_id;
+            if (agent->AddAttr(group) != 1) return nullptr;
+        }
+        if (agent->RegisterEvents() != 1 || agent->ResetEvents() != 1 || agent->EnableEvents() != 1) {
+            agent->UnregisterEvents();
+            return nullptr;
+        }
+        agent->config_epoch = config.epoch;
+        agent->group_base = config.group_base;
+        return agent.release();
+    }
+
+    int PerfmonCollector::OpenAgent(int cpu_id) {
+        auto agent = NewAgent(cpu_id, *std::atomic_load(&agent_config_));
+        if (!agent) {
+            agent_state_[cpu_id].store(AGENT_OFF, std::memory_order_release);
+            return -1;
+        }
+        core_agents_[cpu_id].agent.store(agent);
+        agent_state_[cpu_id].store(AGENT_OPEN, std::memory_order_release);
+        return 1;
+    }
+
+    int PerfmonCollector::ReopenAgent(int cpu_id) {
+        auto& core_agent = core_agents_[cpu_id];
+        bool expected = false;
+        if (!core_agent.reopening.compare_exchange_strong(expected, true)) return -1;
+        // The agent replaced last time is still held by a reader. Try again at a later start read
+        if (core_agent.retired.load()) {
+            core_agent.reopening.store(false);
+            return -1;
+        }
+
+        // Readers still holding the old agent read stopped counters until they leave, it is not unmapped under them
+        auto old_agent = core_agent.agent.load();
+        old_agent->DisableEvents();
+        auto agent = NewAgent(cpu_id, *std::atomic_load(&agent_config_));
+        if (!agent) {
+            old_agent->EnableEvents();
+            core_agent.reopening.store(false);
+            Dprintf(FRED("Reopen perfmon agent of core %d failed. Keep the groups of epoch %u\n"), cpu_id,
+                    old_agent->config_epoch);
+            return -1;
+        }
+        core_agent.agent.store(agent);
+        core_agent.retired.store(old_agent);
+        core_agent.reopening.store(false);
+        DDprintf(FCYN("Reopen perfmon agent of core %d with config epoch %u\n"), cpu_id, agent->config_epoch);
+        return 1;
+    }
+
+    void PerfmonCollector::ReclaimAgent(int cpu_id) {
+        auto& core_agent = core_agents_[cpu_id];
+        // Readers take the count before they load the agent, so none of them can still reach the replaced one
+        if (core_agent.readers.load() != 0) return;
+        auto old_agent = core_agent.retired.exchange(nullptr);
+        if (!old_agent) return;
+        old_agent->UnregisterEvents();
+        delete old_agent;
+    }
+
+    bool PerfmonCollector::OpenLazyAgent(int cpu_id) {
+        int expected = AGENT_CLOSED;
+        if (!agent_state_[cpu_id].compare_exchange_strong(expected, AGENT_OPENING)) {
+            return expected == AGENT_OPEN;
+        }
+        DDprintf(FCYN("Open perfmon agent of core %d on first use\n"), cpu_id);
+        return OpenAgent(cpu_id) == 1;
+    }
+
 }
@@ -22,6 +22,9 @@
 #include <atomic>
 #include <array>
 #include <map>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 #include "env.h"
 #include "util.h"
@@ -37,9 +40,9 @@ namespace mtmc {
 
         /**
          * Add a tester config to the tester.
-         * Throw an exception when total number of event after adding is greater than GP_COUNTER
+         * Fails when the events read together after adding are more than GP_COUNTER
          * @param configs. InputConfig struct that contains a group of events
-         * @return
+         * @return 1 for success, -1 for too many events
          */
         int AddAttr(const InputConfig& configs);
 
@@ -125,6 +128,13 @@ namespace mtmc {
 
         int GetMultiplexIdx() const;
 
+        // Drop the added configs. Call after UnregisterEvents
+        void ClearAttr();
+
+        // Epoch of the collector config the agent was opened with, and the profiler index of its first group
+        uint32_t config_epoch = 0;
+        int group_base = 0;
+
 #ifdef USE_PER_THREADS_PERF
         int TryInitPerThreadAgent(std::vector<InputConfig>* cfg_from_collector);
 
@@ -158,8 +168,14 @@ namespace mtmc {
         int num_event;
         uint32_t core_id;
         uint32_t prefix;
+        uint32_t config_epoch;  // Epoch of the event groups the counters were read with, see Reconfigure
     };
 
+    // Counter deltas are only meaningful between two reads of the same group in the same config epoch
+    inline bool GroupSwitched(const ReadResult& start, int start_group, const ReadResult& end, int end_group) {
+        return start_group != end_group || start.num_event != end.num_event || start.config_epoch != end.config_epoch;
+    }
+
     /**
      *  PerfmonCollector class will set up corresponding registers and provide apis to read PMC
      */
@@ -175,6 +191,8 @@ namespace mtmc {
          * @param input_config: vector of configs from PerfmonConfig. Each config is a group of pmcs
          * @param num_core: List of cores that will be monitored.
          * a range of cores
+         * @param mtmc_setting: init_threads agents are opened in parallel. With lazy_agent_init, a core's agent is only
+         * opened by the first read on it
          * @return 1 for success
          */
         int InitContext(std::vector<InputConfig> &input_config, const std::vector<int>& num_core, const ProfilerSetting& mtmc_setting);
@@ -187,16 +205,26 @@ namespace mtmc {
          * @param reset_flag: is_start is true means the PerCoreRead will do some reset and init function to make sure the
          * @param rd_ret: ReadResult. Stores the information like core id and event number for this reading.
          * correctness ot the final result.
+         * @param multiplex_group_idx: Group the counters were read from, counted over every Reconfigure
          * @return 1 for success
          */
         int PerCoreRead(bool reset_flag, uint64_t* ret, ReadResult* rd_ret, int* multiplex_group_idx = nullptr);
 
-#ifdef USE_PER_THREADS_PERF
+        /**
+         * Swap the event groups of every per core and per thread agent. An agent takes the new groups at its next
+         * start read with no span open on the reading thread, so spans in flight keep the groups they started with
+         * @param input_config: New groups, as for InitContext
+         * @param group_base: Index the first new group gets in multiplex_group_idx
+         * @return The new config epoch. -1 if the collector is not inited
+         */
+        int Reconfigure(const std::vector<InputConfig>& input_config, int group_base);
 
-        PerfmonAgent& GetPerThreadAgent();
+        uint32_t GetConfigEpoch() const;
 
-        std::vector<InputConfig> init_config;
-        std::atomic<int> init_cntr{0};
+#ifdef USE_PER_THREADS_PERF
+
+        // Agent of the calling thread. It takes a new config epoch only if quiescent
+        PerfmonAgent& GetPerThreadAgent(bool quiescent);
 
 #endif
 
@@ -204,14 +232,86 @@ namespace mtmc {
 
         std::vector<PerfmonAgent> DebugAcquirePerfmonAgent();
 
+        /**
+         * {group, event} -> {cpu, fd} of every online core. Lazy agents not opened yet are opened here
+         */
         std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> DebugAcquireEbpfCpuFdPairs();
 
+        // Called on a core whose agent switched to another event group. ctx is the new context of that group
+        typedef std::function<void(int cpu, int group, const EventCtx& ctx)> GroupSwitchHook;
+
+        /**
+         * Set before the profiling starts. Per core agents only. Only called for the groups of InitContext, agents
+         * reopened by Reconfigure do not call it
+         */
+        void SetGroupSwitchHook(GroupSwitchHook hook);
+
+        // Number of events of every group of the current config
+        std::vector<int> GetGroupEventNums() const;
+
+        // Groups of the current config are switched every multiplex interval, instead of being counted together
+        bool IsMultiplexed() const;
+
     private:
 
+        enum AGENT_STATE : int {
+            AGENT_OFF = -1,      // Core not monitored or its agent failed to open
+            AGENT_CLOSED = 0,    // Lazy agent not opened yet
+            AGENT_OPENING = 1,
+            AGENT_OPEN = 2,
+        };
+
+        // Event groups of one config epoch. Published as a whole and never modified, agents copy them when they open
+        struct AgentConfig {
+            uint32_t epoch;
+            int group_base;
+            std::vector<InputConfig> groups;
+            std::vector<int> group_event_nums;
+            bool multiplexed;
+        };
+
+        /* Agent of a core. Readers hold readers while they use agent. A reconfigured agent is opened aside and swapped
+         * in, the replaced one is kept in retired and closed once no reader holds the core */
+        struct CoreAgent {
+            std::atomic<PerfmonAgent*> agent{nullptr};
+            std::atomic<PerfmonAgent*> retired{nullptr};
+            std::atomic<int> readers{0};
+            std::atomic<bool> reopening{false};
+        };
+
+        // Publish a new config for the agents. Returns its epoch
+        uint32_t PublishConfig(const std::vector<InputConfig>& input_config, int group_base);
+
+        // Open an agent of cpu_id with every group of config. nullptr if it failed
+        PerfmonAgent* NewAgent(int cpu_id, const AgentConfig& config);
+
+        // Open the agent of cpu_id with the current config
+        int OpenAgent(int cpu_id);
+
+        // Open an agent with the current config and swap it in. -1 if another thread is on it or it failed to open
+        int ReopenAgent(int cpu_id);
+
+        // Close the replaced agent of cpu_id if no reader holds the core any more
+        void ReclaimAgent(int cpu_id);
+
+        // Start or end read of the counters of agent, see PerCoreRead
+        int ReadAgent(PerfmonAgent& agent, bool reset_flag, uint64_t* ret, ReadResult* rd_ret, int* multiplex_group_idx);
+
+        // Open a lazy agent on the first read of its core. Only one caller opens it, the others return false until then
+        bool OpenLazyAgent(int cpu_id);
+
         std::vector<std::vector<void*>> perf_mmap_pages_vec_;
-        std::vector<PerfmonAgent> perfmon_agent_vec_;
+        std::unique_ptr<CoreAgent[]> core_agents_;
+        size_t num_core_agents_ = 0;
+        std::unique_ptr<std::atomic<int>[]> agent_state_;  // AGENT_STATE of every agent
+        std::shared_ptr<const AgentConfig> agent_config_;  // Only accessed with std::atomic_load / atomic_store
+        std::atomic<uint32_t> config_epoch_{0};            // Epoch of agent_config_. Bumped by every Init and Reconfigure
+        uint32_t init_epoch_ = 0;                          // Epoch of the groups given to InitContext
+        std::mutex config_mux_;
         std::atomic<bool> ready_;
 
+        GroupSwitchHook group_switch_hook_;
+
     };
 
 }
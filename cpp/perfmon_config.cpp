@@ -13,6 +13,7 @@
 //        limitations under the License.
 
 #include "perfmon_config.h"
+#include "group_planner.h"
 
 using json = nlohmann::json;
 
@@ -289,6 +290,13 @@ namespace mtmc {
         json j;
         in >> j;
 
+        // A plan config lists the events and metrics only, the groups are planned here
+        if (!j.contains("Configs") && j.contains("Events")) {
+            json planned;
+            if (GroupPlanner::PlanConfigJson(j, &planned) != 1) return -1;
+            j = planned;
+        }
+
         /*
          *  {
          *      "Configs": [
@@ -297,15 +305,27 @@ namespace mtmc {
          *                  "CPU_CLOCK_THREADS": "00,01,02,03,04", (event,umask,cmask,inv,edge)
          *                  ...
          *              },
-         *              "Metrics": [str0, str1, str2...]
+         *              "Metrics": [str0, str1, str2...],
+         *              "MetricFormulas": {"IPC": "INST_RETIRED.ANY / CPU_CLK_UNHALTED.THREAD", ...} (Optional)
          *          },
          *          {
          *              ...
          *          },
          *      ],
          *      "SwitchIntvl": "30s"/"20ms"/"10ns",
-         *      "ExportMode": 0/1/2/3
+         *      "ExportMode": 0/1/2/3,
+         *      "ShmArenaMB": 0/256/... (Optional, zero copy shm export. 0 disables it),
+         *      "ExportTimeoutMs": 100000 (Optional, max time to wait for the exporter daemon),
+         *      "AggregateMode": 0/1/2 (Optional, per op statistics instead of spans. 1 by name, 2 by name + int prefix),
+         *      "ImbalanceWindowMs": 0/100/... (Optional, online intra-op load imbalance detector. 0 disables it)
+         *      "InitThreads": 0/8/... (Optional, threads opening the per core agents at init. 0 for one per hardware thread)
+         *      "LazyAgentInit": false/true (Optional, open a core's agent on the first read there instead of at init)
+         *      "NumaStorage": false/true (Optional, span storage on the node of the thread. Ignored with ShmArenaMB)
+         *      "StripeKey": "run0" (Optional, concurrent processes with the same key each count a different config)
          *  }
+         *
+         *  The file is only read. Event names are taken in the order of "EventList"
+         *  Without "Configs", the file is a plan config and the groups are planned by GroupPlanner::PlanConfigJson
          */
 
         try {
@@ -352,6 +372,51 @@ namespace mtmc {
                 mtmc_setting->configs_id = -1;
             }
 
+            // Shm arena size:
+            if (j.contains("ShmArenaMB")) {
+                mtmc_setting->shm_arena_bytes = j["ShmArenaMB"].get<size_t>() << 20;
+            }
+            else {
+                mtmc_setting->shm_arena_bytes = 0;
+            }
+
+            // Export timeout:
+            if (j.contains("ExportTimeoutMs")) {
+                mtmc_setting->export_timeout_ms = j["ExportTimeoutMs"];
+            }
+            else {
+                mtmc_setting->export_timeout_ms = DEFAULT_EXPORT_TIMEOUT_MS;
+            }
+
+            // Aggregate mode:
+            if (j.contains("AggregateMode")) {
+                mtmc_setting->aggregate_mode = j["AggregateMode"];
+                if (!(mtmc_setting->aggregate_mode >= 0 && mtmc_setting->aggregate_mode <= 2)) {
+                    throw std::runtime_error("Invalid aggregate mode. Aggregate mode should be 0,1 or 2");
+                }
+            }
+            else {
+                mtmc_setting->aggregate_mode = 0;
+            }
+
+            // Imbalance detector:
+            if (j.contains("ImbalanceWindowMs")) {
+                mtmc_setting->imbalance_window_ms = j["ImbalanceWindowMs"];
+            }
+            else {
+                mtmc_setting->imbalance_window_ms = 0;
+            }
+
+            // Agent init:
+            mtmc_setting->init_threads = j.contains("InitThreads") ? j["InitThreads"].get<int>() : 0;
+            mtmc_setting->lazy_agent_init = j.contains("LazyAgentInit") ? j["LazyAgentInit"].get<bool>() : false;
+
+            // Storage:
+            mtmc_setting->numa_storage = j.contains("NumaStorage") ? j["NumaStorage"].get<bool>() : false;
+
+            // Striping:
+            mtmc_setting->stripe_key = j.contains("StripeKey") ? j["StripeKey"].get<std::string>() : "";
+
             // OverallCnsts:
             if (j.contains("OverallCnsts")) {
                 for (auto& elem : j["OverallCnsts"].items()) {
@@ -362,6 +427,7 @@ namespace mtmc {
 
             /* ------------- Perfmon Event Settings ---------------- */
             int cntr = 0;
+            mtmc_setting->metric_formulas.clear();
             for (auto& elem : j["Configs"]) {
                 printf("== Config %d ==\n", cntr);
                 all_configs.emplace_back();
@@ -389,9 +455,21 @@ namespace mtmc {
                     ++i;
                 };
 
-                elem["EventList"].clear();
-                for (int ev_num = 0; ev_num < temp_cfg.event_num; ++ev_num) {
-                    elem["EventList"].push_back(temp_cfg.names[ev_num]);
+                // Formulas over the events of this config and the constants, emitted per span by the exporter daemon
+                mtmc_setting->metric_formulas.emplace_back();
+                if (elem.contains("MetricFormulas")) {
+                    std::vector<std::string> names(temp_cfg.names, temp_cfg.names + temp_cfg.event_num);
+                    names.insert(names.end(), mtmc_setting->cnst_var.begin(), mtmc_setting->cnst_var.end());
+                    for (auto& metric : elem["MetricFormulas"].items()) {
+                        const auto& formula = metric.value().get<std::string>();
+                        util::MetricFormula compiled;
+                        if (compiled.Compile(formula, names) != 1) {
+                            printf(FYEL("Metric %s is left to the post-processing. Can not evaluate %s\n"),
+                                   metric.key().c_str(), formula.c_str());
+                            continue;
+                        }
+                        mtmc_setting->metric_formulas.back().emplace_back(metric.key(), formula);
+                    }
                 }
 
                 config_vec->push_back(temp_cfg);
@@ -405,9 +483,6 @@ namespace mtmc {
 
         in.close();
 
-        std::ofstream out(file_path, std::ofstream::out);
-        out << j.dump(4);
-
         return 1;
     }
 
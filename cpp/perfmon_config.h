@@ -55,6 +55,8 @@ union x86_pmu_config {
 
 #define X86_CONFIG(args...) ((union x86_pmu_config){.bits = {args}}).value
 
+#define DEFAULT_EXPORT_TIMEOUT_MS 100000
+
 }
 
 namespace mtmc {
@@ -100,6 +102,12 @@ namespace mtmc {
         /* Constant variables required by the config */
         std::set<std::string> cnst_var;
 
+        /* Event names of every config group, in the order they are read */
+        std::vector<std::vector<std::string>> event_names;
+
+        /* Metric name and formula of every config group, evaluated per span by the exporter daemon */
+        std::vector<std::vector<std::pair<std::string, std::string>>> metric_formulas;
+
         /* ExportMode */
         int export_mode;
 
@@ -108,6 +116,33 @@ namespace mtmc {
 
         /* Configuration file id. Used for per process event mux */
         int configs_id;
+
+        /* Size of the shm arena that per thread storage is allocated from. 0 disables the zero copy export */
+        size_t shm_arena_bytes;
+
+        /* Max time to wait for the exporter daemon to report done */
+        uint64_t export_timeout_ms;
+
+        /* Per op aggregation instead of storing every span. 0 off, 1 by name, 2 by name and int prefix */
+        int aggregate_mode;
+
+        /* Quiet time after which a group of sibling intra-op chunks is considered joined. 0 disables the detector */
+        uint64_t imbalance_window_ms;
+
+        /* Threads opening the per core perfmon agents at init. 0 for one per hardware thread */
+        int init_threads;
+
+        /* Open the perfmon agent of a core on the first read there instead of at init */
+        bool lazy_agent_init;
+
+        /* Keep every thread's span storage on the NUMA node it runs on. Only takes effect on multi node machines */
+        bool numa_storage;
+
+        /* Concurrent instances with the same key count different config groups. Empty disables the striping */
+        std::string stripe_key;
+
+        /* Index of the only config group this process counts, claimed by key. -1 if not striped */
+        int stripe_group;
     };
 
     class PerfmonConfig {
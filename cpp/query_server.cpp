@@ -0,0 +1,144 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "query_server.h"
+#include "util.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mtmc {
+
+    QueryServer::~QueryServer() {
+        Stop();
+    }
+
+    int QueryServer::Start(const std::string& path, Handler handler) {
+        if (running_.load()) return -1;
+
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            Dprintf(FRED("Invalid query socket path: %s\n"), path.c_str());
+            return -1;
+        }
+        memcpy(addr.sun_path, path.data(), path.size());
+        socklen_t addr_len = offsetof(sockaddr_un, sun_path) + path.size();
+        if (path[0] == '@') {
+            addr.sun_path[0] = '\0';
+        }
+        else {
+            unlink(path.c_str());
+            addr_len += 1;
+        }
+
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr*)&addr, addr_len) != 0 || listen(listen_fd_, 4) != 0) {
+            Dprintf(FRED("Query server failed to listen on %s: %s\n"), path.c_str(), strerror(errno));
+            if (listen_fd_ >= 0) close(listen_fd_);
+            listen_fd_ = -1;
+            return -1;
+        }
+        if (pipe2(wake_fd_, O_CLOEXEC) != 0) {
+            close(listen_fd_);
+            listen_fd_ = -1;
+            return -1;
+        }
+
+        path_ = path;
+        handler_ = std::move(handler);
+        running_.store(true);
+        thread_ = std::thread(&QueryServer::ServeLoop, this);
+        Dprintf(FGRN("Query server listening on %s\n"), path.c_str());
+        return 1;
+    }
+
+    void QueryServer::Stop() {
+        if (!running_.exchange(false)) return;
+        char c = 0;
+        if (write(wake_fd_[1], &c, 1) < 0) {
+            Dprintf(FRED("Query server wake up failed\n"));
+        }
+        if (thread_.joinable()) thread_.join();
+        close(listen_fd_);
+        close(wake_fd_[0]);
+        close(wake_fd_[1]);
+        listen_fd_ = wake_fd_[0] = wake_fd_[1] = -1;
+        if (path_[0] != '@') unlink(path_.c_str());
+    }
+
+    // ----------------------------------- Private ----------------------------------------
+
+    void QueryServer::ServeLoop() {
+        pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_fd_[0], POLLIN, 0}};
+        while (running_.load()) {
+            int ret = poll(fds, 2, -1);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (fds[1].revents) break;
+            if (fds[0].revents & POLLIN) {
+                int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd < 0) continue;
+                ServeClient(fd);
+                close(fd);
+            }
+        }
+    }
+
+    void QueryServer::ServeClient(int fd) {
+        std::string buf;
+        char chunk[512];
+        pollfd fds[2] = {{fd, POLLIN, 0}, {wake_fd_[0], POLLIN, 0}};
+        while (running_.load()) {
+            int ret = poll(fds, 2, QUERY_CLIENT_TIMEOUT_MS);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret <= 0 || fds[1].revents) return;
+
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n <= 0) return;
+            buf.append(chunk, n);
+
+            size_t nl;
+            while ((nl = buf.find('\n')) != std::string::npos) {
+                std::string line = buf.substr(0, nl);
+                buf.erase(0, nl + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.empty()) continue;
+
+                size_t sp = line.find(' ');
+                std::string cmd = line.substr(0, sp);
+                std::string arg = sp == std::string::npos ? "" : line.substr(sp + 1);
+                std::string reply = handler_(cmd, arg) + "\n";
+
+                const char* p = reply.data();
+                size_t left = reply.size();
+                while (left > 0) {
+                    ssize_t w = send(fd, p, left, MSG_NOSIGNAL);
+                    if (w <= 0) return;
+                    p += w;
+                    left -= w;
+                }
+            }
+            if (buf.size() > QUERY_MAX_LINE) return;
+        }
+    }
+}
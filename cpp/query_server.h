@@ -0,0 +1,73 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_QUERY_SERVER_H
+#define MTMC_QUERY_SERVER_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace mtmc {
+
+// Max length of a query line
+#define QUERY_MAX_LINE 4096
+// Idle clients are dropped after this time
+#define QUERY_CLIENT_TIMEOUT_MS 5000
+
+    /**
+     * Unix domain socket server answering line based queries on its own thread. Each line is "<command> [argument]"
+     * and is answered with one line produced by the handler. Clients are served one at a time and instrumented threads
+     * never touch the socket.
+     *
+     * A path starting with '@' is bound in the abstract namespace.
+     */
+    class QueryServer {
+    public:
+        using Handler = std::function<std::string(const std::string& cmd, const std::string& arg)>;
+
+        QueryServer() = default;
+        ~QueryServer();
+
+        QueryServer(const QueryServer&) = delete;
+        QueryServer& operator=(const QueryServer&) = delete;
+
+        /**
+         * Bind the socket and launch the server thread
+         * @return 1 for success, -1 for failed
+         */
+        int Start(const std::string& path, Handler handler);
+
+        void Stop();
+
+        bool Running() const {
+            return running_.load();
+        }
+
+    private:
+        void ServeLoop();
+
+        void ServeClient(int fd);
+
+        std::string path_;
+        Handler handler_;
+        int listen_fd_ = -1;
+        int wake_fd_[2] = {-1, -1};  // Self pipe to interrupt poll() on Stop()
+        std::thread thread_;
+        std::atomic<bool> running_{false};
+    };
+}
+
+#endif //MTMC_QUERY_SERVER_H
@@ -0,0 +1,174 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#include "stripe_coordinator.h"
+#include "util.h"
+
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace mtmc {
+
+    namespace {
+#define STRIPE_MAGIC 0x4d544d4353545250ull  // "MTMCSTRP"
+
+        bool Alive(pid_t pid) {
+            return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+        }
+
+        std::atomic<uint64_t>* Magic(StripeShm* shm) {
+            return reinterpret_cast<std::atomic<uint64_t>*>(&shm->magic);
+        }
+    }
+
+    StripeCoordinator::~StripeCoordinator() {
+        Release();
+        if (shm_) munmap(shm_, sizeof(StripeShm));
+    }
+
+    int StripeCoordinator::Claim(const std::string& key, int num_groups) {
+        if (slot_ >= 0) return group_;
+        if (num_groups <= 0) return -1;
+
+        std::string name = "/mtmc_stripe_";
+        for (char c : key) {
+            name.push_back(isalnum((unsigned char)c) || c == '-' ? c : '_');
+        }
+
+        if (!shm_) {
+            bool creator = true;
+            int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+            if (fd < 0 && errno == EEXIST) {
+                creator = false;
+                fd = shm_open(name.c_str(), O_RDWR, 0666);
+            }
+            if (fd < 0 || (creator && ftruncate(fd, sizeof(StripeShm)) != 0)) {
+                Dprintf(FRED("Open stripe segment %s failed: %s\n"), name.c_str(), strerror(errno));
+                if (fd >= 0) close(fd);
+                return -1;
+            }
+            // The creator may not have sized the segment yet
+            for (int waited = 0; !creator; ++waited) {
+                struct stat st{};
+                if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(StripeShm)) break;
+                if (waited >= STRIPE_INIT_TIMEOUT_MS) {
+                    Dprintf(FRED("Stripe segment %s is not initialized\n"), name.c_str());
+                    close(fd);
+                    return -1;
+                }
+                usleep(1000);
+            }
+            void* addr = mmap(nullptr, sizeof(StripeShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED) {
+                Dprintf(FRED("Map stripe segment %s failed\n"), name.c_str());
+                return -1;
+            }
+            shm_ = (StripeShm*)addr;
+
+            if (creator) {
+                pthread_mutexattr_t attr;
+                pthread_mutexattr_init(&attr);
+                pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+                pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+                pthread_mutex_init(&shm_->mux, &attr);
+                pthread_mutexattr_destroy(&attr);
+                shm_->num_groups = num_groups;
+                Magic(shm_)->store(STRIPE_MAGIC, std::memory_order_release);
+            }
+            for (int waited = 0; Magic(shm_)->load(std::memory_order_acquire) != STRIPE_MAGIC; ++waited) {
+                if (waited >= STRIPE_INIT_TIMEOUT_MS) {
+                    Dprintf(FRED("Stripe segment %s is not initialized\n"), name.c_str());
+                    munmap(shm_, sizeof(StripeShm));
+                    shm_ = nullptr;
+                    return -1;
+                }
+                usleep(1000);
+            }
+        }
+
+        if (Lock() != 1) return -1;
+        std::vector<int> load(num_groups, 0);
+        int num_live = 0;
+        int free_slot = -1;
+        for (int i = 0; i < STRIPE_MAX_INSTANCES; ++i) {
+            auto& slot = shm_->slots[i];
+            if (slot.pid != 0 && !Alive(slot.pid)) slot.pid = 0;
+            if (slot.pid == 0) {
+                if (free_slot < 0) free_slot = i;
+                continue;
+            }
+            ++num_live;
+            if (slot.group >= 0 && slot.group < num_groups) ++load[slot.group];
+        }
+        // A run with a different config may reuse the key once the previous one has exited
+        if (num_live == 0) shm_->num_groups = num_groups;
+        if (shm_->num_groups != num_groups || free_slot < 0) {
+            Dprintf(FRED("Stripe %s claim failed. %d live instances count %d groups, this one has %d\n"),
+                    key.c_str(), num_live, shm_->num_groups, num_groups);
+            pthread_mutex_unlock(&shm_->mux);
+            return -1;
+        }
+
+        int group = 0;
+        for (int g = 1; g < num_groups; ++g) {
+            if (load[g] < load[group]) group = g;
+        }
+        auto& slot = shm_->slots[free_slot];
+        slot.pid = getpid();
+        slot.group = group;
+        slot.instance = shm_->next_instance++;
+        instance_ = slot.instance;
+        pthread_mutex_unlock(&shm_->mux);
+
+        slot_ = free_slot;
+        group_ = group;
+        num_groups_ = num_groups;
+        Dprintf(FGRN("Stripe %s: instance %u counts group %d of %d\n"), key.c_str(), instance_, group_, num_groups);
+        return group_;
+    }
+
+    void StripeCoordinator::Release() {
+        if (!shm_ || slot_ < 0) return;
+        if (Lock() == 1) {
+            if (shm_->slots[slot_].pid == getpid()) shm_->slots[slot_].pid = 0;
+            pthread_mutex_unlock(&shm_->mux);
+        }
+        slot_ = -1;
+    }
+
+    // ----------------------------------- Private ----------------------------------------
+
+    int StripeCoordinator::Lock() {
+        int ret = pthread_mutex_lock(&shm_->mux);
+        // The previous holder died. The slots are only written under the lock as a whole, so they are consistent
+        if (ret == EOWNERDEAD) {
+            pthread_mutex_consistent(&shm_->mux);
+            ret = 0;
+        }
+        if (ret != 0) {
+            Dprintf(FRED("Lock stripe segment failed: %s\n"), strerror(ret));
+            return -1;
+        }
+        return 1;
+    }
+}
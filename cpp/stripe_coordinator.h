@@ -0,0 +1,93 @@
+//Copyright 2022 Intel Corporation
+//
+//Licensed under the Apache License, Version 2.0 (the "License");
+//you may not use this file except in compliance with the License.
+//You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//Unless required by applicable law or agreed to in writing, software
+//distributed under the License is distributed on an "AS IS" BASIS,
+//WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//See the License for the specific language governing permissions and
+//        limitations under the License.
+
+#ifndef MTMC_STRIPE_COORDINATOR_H
+#define MTMC_STRIPE_COORDINATOR_H
+
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+#include <sys/types.h>
+
+namespace mtmc {
+
+// Max number of instances sharing a stripe key at the same time
+#define STRIPE_MAX_INSTANCES 256
+// Max time to wait for the creator of the segment to initialize it
+#define STRIPE_INIT_TIMEOUT_MS 1000
+
+    struct StripeSlot {
+        pid_t pid;          // 0 if free
+        int32_t group;
+        uint32_t instance;
+    };
+
+    struct StripeShm {
+        uint64_t magic;     // Set last by the creator
+        pthread_mutex_t mux;    // Robust and process shared, a crashed holder does not block the others
+        int32_t num_groups;
+        uint32_t next_instance;
+        StripeSlot slots[STRIPE_MAX_INSTANCES];
+    };
+
+    /**
+     * Assigns the config groups to the processes sharing a key through a shm segment /dev/shm/mtmc_stripe_<key>, so that
+     * concurrent instances of a workload count different groups and together cover all of them in one run.
+     *
+     * A process claims the group the fewest live instances count. The slot of an exited process is reclaimed by the
+     * next claim, so the segment is left in place and reused by later runs with the same key.
+     */
+    class StripeCoordinator {
+    public:
+        StripeCoordinator() = default;
+        ~StripeCoordinator();
+
+        StripeCoordinator(const StripeCoordinator&) = delete;
+        StripeCoordinator& operator=(const StripeCoordinator&) = delete;
+
+        /**
+         * @param key: Shared by the instances of a run. Characters other than [A-Za-z0-9_-] are replaced with '_'
+         * @param num_groups: Number of config groups. Must match the live instances of the key
+         * @return the claimed group; -1 for failed
+         */
+        int Claim(const std::string& key, int num_groups);
+
+        // Free the slot. Also done by the destructor
+        void Release();
+
+        int Group() const {
+            return group_;
+        }
+
+        int NumGroups() const {
+            return num_groups_;
+        }
+
+        // Order of the claim among all claims of the key, to tag the results of this instance
+        uint32_t Instance() const {
+            return instance_;
+        }
+
+    private:
+        int Lock();
+
+        StripeShm* shm_ = nullptr;
+        int slot_ = -1;
+        int group_ = -1;
+        int num_groups_ = 0;
+        uint32_t instance_ = 0;
+    };
+}
+
+#endif //MTMC_STRIPE_COORDINATOR_H
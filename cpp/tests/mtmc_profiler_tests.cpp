@@ -12,7 +12,10 @@
 //See the License for the specific language governing permissions and
 //        limitations under the License.
 
+#include <algorithm>
+#include <cmath>
 #include <cassert>
+#include <fstream>
 #include <memory>
 #include <vector>
 #include <thread>
@@ -23,9 +26,23 @@
 #include "test_util.h"
 
 #include "exporter.h"
+#include "op_aggregator.h"
+#include "imbalance_detector.h"
+#include "query_server.h"
+#include "ctx_switch_join.h"
+#include "binary_trace.h"
+#include "group_planner.h"
+#include "stripe_coordinator.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #ifdef OTL_EXPORTER
 #endif
 
+#ifdef TRACE_ANALYZER
+#include "critical_path.h"
+#endif
+
 #ifdef EBPF_CTX_SC
 #include "ebpf_sampler.h"
 #include "ebpf_common.h"
@@ -361,6 +378,484 @@ namespace tests {
         return;
     }
 
+    // Heap backed chunk provider with a fixed budget of chunks
+    class TestChunkProvider : public mtmc::util::ChunkProvider<int> {
+    public:
+        explicit TestChunkProvider(int max_chunks) : max_chunks_(max_chunks) {}
+        ~TestChunkProvider() override {
+            for (auto chunk : all_chunks_) delete[] chunk;
+        }
+        int* AcquireChunk() override {
+            if (!free_chunks_.empty()) {
+                auto chunk = free_chunks_.back();
+                free_chunks_.pop_back();
+                return chunk;
+            }
+            if (all_chunks_.size() >= max_chunks_) return nullptr;
+            all_chunks_.push_back(new int[1 << ChunkShift()]);
+            return all_chunks_.back();
+        }
+        void ReleaseChunk(int* chunk) override {
+            free_chunks_.push_back(chunk);
+        }
+        size_t ChunkShift() const override {
+            return 2;
+        }
+        std::vector<int*> all_chunks_;
+        std::vector<int*> free_chunks_;
+        int max_chunks_;
+    };
+
+    __attribute__ ((optimize("O0"))) void TestMTMCChunkedIndexVec() {
+        TestChunkProvider provider(3);
+        {
+            mtmc::util::IndexVector<int> a(&provider);
+            bool ok = true;
+            for (int i = 0; i < 12; ++i) {
+                ok &= a.PushBack(i);
+            }
+            Assert(ok && a.Size() == 12 && a.NumChunks() == 3 && a[5] == 5 && a.Back() == 11,
+                   "[IndexVector] Chunked push back");
+            Assert(!a.PushBack(12) && a.Size() == 12, "[IndexVector] Chunk provider exhausted");
+            Assert(a.GetChunk(1)[1] == 5, "[IndexVector] Chunk address is stable");
+            int sum = 0;
+            Assert(a.ForEachPublished([&sum](int v) { sum += v; }) == 12 && sum == 66,
+                   "[IndexVector] Published elements read");
+
+            a.AsyncClearAndReleaseMemory();
+            Assert(a.ForEachPublished([](int) {}) == 0 && a.NumChunks() == 3,
+                   "[IndexVector] Reader does not apply a pending clear");
+            Assert(a.Empty() && a.NumChunks() == 0 && provider.free_chunks_.size() == 3,
+                   "[IndexVector] Chunks released to provider");
+            a.PushBack(1);
+            Assert(a.NumChunks() == 1 && provider.free_chunks_.size() == 2, "[IndexVector] Chunk reused");
+        }
+        Assert(provider.free_chunks_.size() == 3, "[IndexVector] Chunks released at destruction");
+    }
+
+    void TestNumaChunkProvider() {
+        if (numa_available() < 0) return;
+        mtmc::util::NumaChunkProvider<int> provider(0, 2);
+        mtmc::util::IndexVector<int> a(&provider);
+        for (int i = 0; i < 10; ++i) {
+            a.PushBack(i);
+        }
+        Assert(a.Size() == 10 && a.NumChunks() == 3 && a[9] == 9 && provider.Node() == 0, "[NumaChunkProvider] Push back");
+        int node = mtmc::util::GetCurrentNumaNode();
+        Assert(node >= 0 && node <= numa_max_node(), "[NumaChunkProvider] Current node");
+
+        std::atomic<int> sum{};
+        mtmc::util::RunOnNodes({0}, [&](int n) {
+            for (int i = 0; i < a.Size(); ++i) sum += a[i];
+        });
+        Assert(sum.load() == 45, "[NumaChunkProvider] Node local worker");
+    }
+
+    void TestMetricFormula() {
+        mtmc::util::MetricFormula formula;
+        std::vector<std::string> names = {"EXE_ACTIVITY.BOUND_ON_LOADS", "MEMORY_ACTIVITY.STALLS_L1D_MISS",
+                                          "CPU_CLK_UNHALTED.THREAD", "TOPDOWN.SLOTS:perf_metrics"};
+        double values[] = {30, 10, 100, 400};
+        Assert(formula.Compile("100*(MAX(((EXE_ACTIVITY.BOUND_ON_LOADS-MEMORY_ACTIVITY.STALLS_L1D_MISS)/"
+                               "(CPU_CLK_UNHALTED.THREAD)),(0)))", names) == 1 && formula.Eval(values) == 20,
+               "[MetricFormula] Max of a difference");
+        Assert(formula.Compile("-TOPDOWN.SLOTS:perf_metrics / 4 + MIN(2, 0.5) * 2 - 1", names) == 1 &&
+               formula.Eval(values) == -100, "[MetricFormula] Precedence and unary minus");
+        Assert(formula.Compile("1 / (CPU_CLK_UNHALTED.THREAD - 100)", names) == 1 && !std::isfinite(formula.Eval(values)),
+               "[MetricFormula] Division by zero");
+        Assert(formula.Compile("UNKNOWN / 2", names) == -1 && formula.Compile("(1 + 2", names) == -1 &&
+               formula.Compile("1 2", names) == -1, "[MetricFormula] Invalid formula");
+    }
+
+    void TestOpAggregator() {
+        using mtmc::LogLinearBucket;
+        bool exact = true, bounded = true;
+        for (uint64_t v = 0; v < 8; ++v) {
+            exact &= LogLinearBucket::LowerBound(LogLinearBucket::Index(v)) == v;
+        }
+        for (uint64_t v = 8; v < (1ull << 20); v = v * 3 / 2 + 1) {
+            uint64_t lb = LogLinearBucket::LowerBound(LogLinearBucket::Index(v));
+            bounded &= lb <= v && v - lb <= v / (1 << AGG_HIST_SUB_BITS);
+        }
+        bounded &= LogLinearBucket::Index(UINT64_MAX) == AGG_HIST_NUM_BUCKETS - 1;
+        Assert(exact, "[OpAggregator] Small values have exact buckets");
+        Assert(bounded, "[OpAggregator] Bucket relative error");
+
+        mtmc::OpAggregator agg(mtmc::AGG_BY_NAME);
+        auto record = [&agg](const char* name, int n) {
+            std::unique_ptr<mtmc::SingleProfile> prof(new mtmc::SingleProfile());
+            strcpy(prof->prefix, name);
+            prof->rd_ret_start.num_event = prof->rd_ret_end.num_event = 1;
+            for (int i = 1; i <= n; ++i) {
+                prof->start_ts = 1000;
+                prof->end_ts = 1000 + i;
+                prof->ret_start[0] = 10;
+                prof->ret_end[0] = 10 + 2 * i;
+                agg.Record(*prof);
+            }
+        };
+        std::thread t0(record, "op_a", 100);
+        std::thread t1(record, "op_a", 100);
+        std::thread t2(record, "op_b", 10);
+        t0.join(); t1.join(); t2.join();
+
+        // Names longer than the small string buffer, and one differing only in its last character
+        std::string long_a(100, 'x'), long_b(100, 'x');
+        long_a.back() = 'a';
+        long_b.back() = 'b';
+        std::thread t3(record, long_a.c_str(), 3);
+        t3.join();
+        record(long_a.c_str(), 2);
+        record(long_b.c_str(), 1);
+
+        auto merged = agg.Merge();
+        Assert(merged.size() == 4, "[OpAggregator] Merge by name");
+        for (auto& op : merged) {
+            if (op.name != "op_a") continue;
+            uint64_t p50 = LogLinearBucket::Percentile(op.hist.data(), op.count, 50);
+            Assert(op.count == 200 && op.sum_ns == 2 * 5050 && op.min_ns == 1 && op.max_ns == 100,
+                   "[OpAggregator] Merged count and duration");
+            Assert(p50 >= 44 && p50 <= 50, "[OpAggregator] Percentile");
+            Assert(op.pmc_count == 200 && op.pmc_delta_sum[0] == 2 * 2 * 5050, "[OpAggregator] PMC delta");
+        }
+        for (auto& op : merged) {
+            if (op.name == long_a) Assert(op.count == 5, "[OpAggregator] Long names looked up in place");
+        }
+
+        // Counted, but the counter deltas of a migrated or group switched span are left out
+        std::unique_ptr<mtmc::SingleProfile> invalid(new mtmc::SingleProfile());
+        strcpy(invalid->prefix, "op_c");
+        invalid->rd_ret_start.num_event = invalid->rd_ret_end.num_event = 1;
+        invalid->ret_end[0] = 100;
+        invalid->flag_bits.pmc_invalid = 1;
+        agg.Record(*invalid);
+        for (auto& op : agg.Merge()) {
+            if (op.name == "op_c") Assert(op.count == 1 && op.pmc_count == 0, "[OpAggregator] Invalid PMC skipped");
+        }
+    }
+
+    void TestImbalanceDetector() {
+        mtmc::ImbalanceDetector detector(1);
+        std::unique_ptr<mtmc::SingleProfile> prof(new mtmc::SingleProfile());
+        strcpy(prof->prefix, "matmul");
+        prof->parent_info = mtmc::ParamsInfo{.parent_tid = 1, .parent_pthread_id = 1, .task_sched_time = 1000,
+                                             .parent_ctx_hash_id = 7};
+        // 3 chunks forked at 1000: [1010, 1110], [1020, 1070], [1050, 1400]
+        uint64_t chunks[3][2] = {{1010, 1110}, {1020, 1070}, {1050, 1400}};
+        for (auto& chunk : chunks) {
+            prof->start_ts = chunk[0];
+            prof->end_ts = chunk[1];
+            detector.Record(*prof);
+        }
+        prof->parent_info.task_sched_time = 0;
+        Assert(detector.Record(*prof) == 0, "[Imbalance] Not forked span ignored");
+
+        detector.Sweep(1400 + 500 * 1000);
+        Assert(detector.Summaries().empty(), "[Imbalance] Group open within the window");
+        detector.Sweep(1400 + 2000 * 1000);
+        auto summaries = detector.Summaries();
+        auto stragglers = detector.Stragglers();
+        Assert(summaries.size() == 1 && summaries["matmul"].num_groups == 1 && summaries["matmul"].num_chunks == 3,
+               "[Imbalance] Group folded after the window");
+        Assert(stragglers.size() == 1 && stragglers[0].ForkToFirstStart() == 10 && stragglers[0].min_dur == 50 &&
+               stragglers[0].max_dur == 350 && stragglers[0].IdleBarrier() == 290 + 330, "[Imbalance] Group statistics");
+    }
+
+    void TestQueryServer() {
+        mtmc::QueryServer server;
+        std::string path = "@mtmc_query_test_" + std::to_string(getpid());
+        int ret = server.Start(path, [](const std::string& cmd, const std::string& arg) {
+            return cmd + ":" + arg;
+        });
+        Assert(ret == 1 && server.Running(), "[QueryServer] Start");
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path + 1, path.data() + 1, path.size() - 1);
+        bool connected = connect(fd, (sockaddr*)&addr, offsetof(sockaddr_un, sun_path) + path.size()) == 0;
+        std::string query = "status\nops 5\n";
+        std::string reply;
+        if (connected && write(fd, query.data(), query.size()) == (ssize_t)query.size()) {
+            char buf[64];
+            ssize_t n;
+            while (reply.size() < 15 && (n = read(fd, buf, sizeof(buf))) > 0) reply.append(buf, n);
+        }
+        close(fd);
+        Assert(reply == "status:\nops:5\n", "[QueryServer] Line protocol");
+        server.Stop();
+        Assert(!server.Running(), "[QueryServer] Stop");
+    }
+
+    void TestCtxSwitchJoin() {
+        auto record = [](uint64_t ts, pid_t prev, pid_t curr, uint64_t state, uint64_t pmc) {
+            mtmc::StoreData data{};
+            data.pmc_data.time_stamp = ts;
+            data.pmc_data.prev_pid = prev;
+            data.pmc_data.curr_pid = curr;
+            data.pmc_data.prev_task_state = state;
+            data.pmc_data.pmc_reading[0] = pmc;
+            return data;
+        };
+        // Thread 100 is preempted by 200 on cpu 2 and comes back there, then blocks and never comes back
+        std::map<int, std::vector<mtmc::StoreData>> ctx_data;
+        ctx_data[2] = {record(1200, 100, 200, 0, 300), record(1500, 200, 100, 0, 450), record(1800, 100, 0, 1, 600)};
+
+        std::unique_ptr<mtmc::SingleProfile> span(new mtmc::SingleProfile());
+        span->tid = 100;
+        span->start_ts = 1000;
+        span->end_ts = 1700;
+        span->rd_ret_start.num_event = span->rd_ret_end.num_event = 1;
+        span->ret_start[0] = 0;
+        span->ret_end[0] = 500;
+
+        mtmc::CtxSwitchJoin per_core(0, true);
+        per_core.AddSwitches(ctx_data);
+        auto intervals = per_core.Intervals(100);
+        Assert(intervals && intervals->size() == 2 && (*intervals)[0].in_ts == 1500 && (*intervals)[1].in_ts == UINT64_MAX,
+               "[CtxSwitchJoin] Off cpu intervals");
+        auto info = per_core.Join(*span);
+        Assert(info.off_cpu_ns == 300 && info.num_preempted == 1 && info.num_blocked == 0 && info.pmc_delta[0] == 350 &&
+               info.pmc_exclusive, "[CtxSwitchJoin] Per core correction");
+
+        // Striped to group 2, the records still count their own group 0
+        mtmc::CtxSwitchJoin striped(0, true, 2);
+        striped.AddSwitches(ctx_data);
+        span->multiplex_idx = 2;
+        Assert(striped.Join(*span).pmc_exclusive, "[CtxSwitchJoin] Records group offset by the group base");
+        span->multiplex_idx = 0;
+        Assert(!striped.Join(*span).pmc_exclusive, "[CtxSwitchJoin] Records of another group");
+
+        span->end_ts = 2000;
+        info = per_core.Join(*span);
+        Assert(info.off_cpu_ns == 500 && info.num_blocked == 1 && !info.pmc_exclusive, "[CtxSwitchJoin] Open interval");
+
+        mtmc::CtxSwitchJoin per_thread(0, false);
+        per_thread.AddSwitches(ctx_data);
+        info = per_thread.Join(*span);
+        Assert(info.pmc_delta[0] == 500 && info.pmc_exclusive, "[CtxSwitchJoin] Per thread counters are kept");
+
+        // Forked at 600, woken up at 700 and ran at 900. Within the span, waited from 1450 to 1500 after a wakeup
+        std::vector<mtmc::EbpfWakeupData> wakeups(3);
+        wakeups[0] = mtmc::EbpfWakeupData{700, 750, 900, 100, 1, 2, 2};
+        wakeups[1] = mtmc::EbpfWakeupData{1450, 1460, 1500, 100, 200, 2, 2};
+        wakeups[2] = mtmc::EbpfWakeupData{1450, 1460, 1500, 300, 200, 2, 2};
+        span->parent_info.task_sched_time = 600;
+        per_thread.AddWakeups(wakeups);
+        info = per_thread.Join(*span);
+        Assert(per_thread.Wakeups(100) && per_thread.Wakeups(100)->size() == 2 && info.runqueue_ns == 50 &&
+               info.num_wakeups == 1 && info.sched_delay_ns == 400 && info.sched_runqueue_ns == 200,
+               "[CtxSwitchJoin] Runqueue wait");
+    }
+
+    void TestCtxSwitchBinary() {
+        // Cpu 0 rotated: 5 records written into 3 slots, cpu 1 empty, cpu 3 not rotated
+        std::vector<mtmc::EbpfCpuStorage> cpu_storage(4);
+        auto fill = [](mtmc::EbpfCpuStorage& storage, uint64_t capacity, uint64_t num_written, int cpu) {
+            storage.data.reset(new mtmc::StoreData[capacity]());
+            storage.capacity = capacity;
+            for (uint64_t i = 0; i < num_written; ++i) {
+                auto& data = storage.data[i % capacity].pmc_data;
+                data.time_stamp = 1000 * cpu + i;
+                data.core_id = cpu;
+                data.pmc_reading[EBPF_NUM_PMC - 1] = i;
+            }
+            storage.num_written = num_written;
+        };
+        fill(cpu_storage[0], 3, 5, 0);
+        fill(cpu_storage[1], 3, 0, 1);
+        fill(cpu_storage[3], 8, 2, 3);
+
+        std::string path = "/tmp/mtmc_test_ctx_switch.bin";
+        std::vector<std::string> names = {"cycles", "instructions", "LLC-misses"};
+        Assert(mtmc::WriteCtxSwitchBinary(path, cpu_storage, names, -42, 2) == 1, "[CtxSwitchBinary] Write");
+
+        std::map<int, std::vector<mtmc::PmcData>> per_cpu;
+        std::vector<std::string> read_names;
+        int64_t offset = 0;
+        Assert(mtmc::ReadCtxSwitchBinary(path, &per_cpu, &read_names, &offset) == 1, "[CtxSwitchBinary] Read");
+        Assert(read_names == names && offset == -42, "[CtxSwitchBinary] Header");
+
+        bool ok = per_cpu.size() == 2 && per_cpu[0].size() == 3 && per_cpu[3].size() == 2;
+        for (uint64_t i = 0; ok && i < 3; ++i) {
+            ok = per_cpu[0][i].time_stamp == 2 + i && per_cpu[0][i].pmc_reading[EBPF_NUM_PMC - 1] == 2 + i;
+        }
+        ok = ok && per_cpu[3][1].time_stamp == 3001 && per_cpu[3][1].core_id == 3;
+        Assert(ok, "[CtxSwitchBinary] Records oldest first");
+        remove(path.c_str());
+
+        std::map<int, std::vector<mtmc::SchedSwitchRecord>> switches;
+        mtmc::SchedSwitchRecord sw{};
+        sw.ts = 77;
+        sw.cpu = 5;
+        sw.prev_tid = 10;
+        sw.next_tid = 11;
+        snprintf(sw.next_comm, sizeof(sw.next_comm), "worker");
+        switches[5] = {sw, sw};
+        switches[5][1].ts = 78;
+        std::map<int, std::vector<mtmc::SchedSwitchRecord>> read_switches;
+        ok = mtmc::WriteSchedSwitchBinary(path, switches, 0) == 1 &&
+             mtmc::ReadSchedSwitchBinary(path, &read_switches, &offset) == 1 && offset == 0 &&
+             read_switches[5].size() == 2 && read_switches[5][1].ts == 78 && read_switches[5][0].next_tid == 11 &&
+             std::string(read_switches[5][0].next_comm) == "worker";
+        Assert(ok, "[CtxSwitchBinary] Sched switch records");
+        Assert(mtmc::ReadCtxSwitchBinary(path, &per_cpu, &read_names, &offset) == -1, "[CtxSwitchBinary] Record type");
+        remove(path.c_str());
+    }
+
+    void TestGroupPlanner() {
+        // 4 general purpose counters. The MEMORY_ACTIVITY events only count on counter 0 and 1
+        mtmc::GroupPlanner planner(4);
+        planner.AddEvent("SLOTS", "0,04,0,0,0");
+        planner.AddEvent("PERF_METRICS", "0,80,0,0,0");
+        planner.AddEvent("CLK", "3c,00,0,0,0");
+        planner.AddEvent("INST", "c0,00,0,0,0");
+        for (auto name : {"A", "B", "C", "D"}) planner.AddEvent(name, "a6,21,0,5,0");
+        planner.AddEvent("L1", "47,03,0,3,0", 0x3);
+        planner.AddEvent("L2", "47,05,0,5,0", 0x3);
+        planner.AddEvent("L3", "47,09,0,9,0", 0x3);
+        Assert(planner.AddEvent("BAD", "47,09") == -1, "[GroupPlanner] Malformed encoding");
+
+        planner.AddMetric("Topdown", {"PERF_METRICS"});
+        planner.AddMetric("L2_Bound", {"L1", "L2", "CLK"});
+        planner.AddMetric("L3_Bound", {"L2", "L3", "CLK"});
+        planner.AddMetric("Wide", {"A", "B", "C", "D"});
+        Assert(planner.AddMetricFormula("CPI", "CLK / (INST + 0.5)") == 1, "[GroupPlanner] Metric formula");
+        Assert(planner.AddMetric("Unknown", {"E"}) == -1, "[GroupPlanner] Unknown event");
+
+        // L1, L2 and L3 can not share the two counters, the fixed counter and topdown events fill the other groups
+        std::vector<mtmc::PlannedGroup> groups;
+        Assert(planner.Plan(&groups) == 3, "[GroupPlanner] Number of groups");
+        Assert(groups[0].events.size() == 6 && groups[0].events[0] == "SLOTS" && groups[0].events[1] == "PERF_METRICS",
+               "[GroupPlanner] Slots leads the topdown group");
+        std::map<std::string, std::vector<std::string>> metric_events = {
+                {"Topdown", {"SLOTS", "PERF_METRICS"}}, {"L2_Bound", {"L1", "L2", "CLK"}},
+                {"L3_Bound", {"L2", "L3", "CLK"}}, {"Wide", {"A", "B", "C", "D"}}, {"CPI", {"CLK", "INST"}}};
+        size_t num_metrics = 0;
+        bool together = true;
+        for (auto& group : groups) {
+            for (auto& metric : group.metrics) {
+                ++num_metrics;
+                for (auto& evt : metric_events[metric]) {
+                    together &= std::find(group.events.begin(), group.events.end(), evt) != group.events.end();
+                }
+            }
+        }
+        Assert(num_metrics == metric_events.size() && together, "[GroupPlanner] Metric events in one group");
+
+        mtmc::GroupPlanner small(4);
+        for (auto name : {"A", "B", "C", "D", "E"}) small.AddEvent(name, "a6,21,0,5,0");
+        small.AddMetric("Wide", {"A", "B", "C", "D", "E"});
+        Assert(small.Plan(&groups) == -1, "[GroupPlanner] Oversubscribed metric");
+        // First fit decreasing puts the two triples together, three pairs in the next group and the last pair alone
+        mtmc::GroupPlanner packing(7);
+        for (int e = 0; e < 14; ++e) {
+            char enc[32];
+            snprintf(enc, sizeof(enc), "d0,%02x,0,0,0", e + 1);
+            packing.AddEvent("E" + std::to_string(e), enc);
+        }
+        packing.AddMetric("T0", {"E0", "E1", "E2"});
+        packing.AddMetric("T1", {"E3", "E4", "E5"});
+        packing.AddMetric("P0", {"E6", "E7"});
+        packing.AddMetric("P1", {"E8", "E9"});
+        packing.AddMetric("P2", {"E10", "E11"});
+        packing.AddMetric("P3", {"E12", "E13"});
+        bool minimal = false;
+        Assert(packing.Plan(&groups, &minimal) == 2 && minimal, "[GroupPlanner] Search finds fewer groups");
+        Assert(mtmc::GroupPlanner::DetectGpCounters() > 0, "[GroupPlanner] Detected counters");
+    }
+
+    void TestStripeCoordinator() {
+        std::string key = "test_" + std::to_string(getpid());
+        mtmc::StripeCoordinator a, b, c, d;
+        Assert(a.Claim(key, 3) == 0 && b.Claim(key, 3) == 1 && c.Claim(key, 3) == 2 && d.Claim(key, 3) == 0,
+               "[Stripe] Least loaded group");
+        Assert(a.Instance() == 0 && d.Instance() == 3, "[Stripe] Instance order");
+        Assert(a.NumGroups() == 3, "[Stripe] Group count kept");
+        mtmc::StripeCoordinator other;
+        Assert(other.Claim(key, 2) == -1, "[Stripe] Group count mismatch");
+        b.Release();
+        mtmc::StripeCoordinator e;
+        Assert(e.Claim(key, 3) == 1, "[Stripe] Released group reclaimed");
+        shm_unlink(("/mtmc_stripe_" + key).c_str());
+    }
+
+    void TestReconfigure() {
+        std::vector<std::string> paths;
+        for (auto& evt : {"c0,00,0,0,0", "3c,00,0,0,0"}) {
+            paths.push_back("/tmp/mtmc_test_reconfigure_" + std::to_string(paths.size()) + ".json");
+            std::ofstream out(paths.back());
+            out << R"({"Configs": [{"Events": {"E": ")" << evt << R"("}, "EventList": ["E"], "Metrics": []}]})";
+        }
+        std::vector<mtmc::InputConfig> cfg_a, cfg_b;
+        mtmc::ProfilerSetting setting{};
+        mtmc::PerfmonConfig::ReadConfigJson(paths[0], &cfg_a, &setting);
+        mtmc::PerfmonConfig::ReadConfigJson(paths[1], &cfg_b, &setting);
+
+        // Agents are thread local in per thread mode, so the reads run on a thread of their own
+        mtmc::PerfmonCollector collector;
+        Assert(collector.Reconfigure(cfg_b, 1) == -1, "[Reconfigure] Not inited");
+        collector.InitContext(cfg_a, mtmc::util::GetCurrAvailableCPUList(), setting);
+        std::thread([&collector, &cfg_b]() {
+            uint64_t ret[16];
+            mtmc::ReadResult start{}, end{}, next{};
+            int start_group = -1, end_group = -1, next_group = -1;
+            collector.PerCoreRead(true, ret, &start, &start_group);
+            auto epoch = collector.GetConfigEpoch();
+            Assert(collector.Reconfigure(cfg_b, 1) == (int)epoch + 1, "[Reconfigure] Epoch bumped");
+            collector.PerCoreRead(false, ret, &end, &end_group);
+            Assert(start.config_epoch == epoch && end.config_epoch == epoch && end_group == 0,
+                   "[Reconfigure] In flight span keeps its groups");
+            collector.PerCoreRead(true, ret, &next, &next_group);
+            Assert(next.config_epoch == epoch + 1 && next_group == 1, "[Reconfigure] Group offset by group base");
+            Assert(!mtmc::GroupSwitched(start, start_group, end, end_group) &&
+                   mtmc::GroupSwitched(start, start_group, next, start_group), "[Reconfigure] Epoch change switches");
+        }).join();
+        collector.CloseContext();
+
+        // The groups of every epoch stay in the profiler's group list
+        mtmc::MTMCProfiler prof(paths[0]);
+        std::thread([&prof, &paths]() {
+            prof.LogStart(mtmc::ParamsInfo{}, "Span");
+            Assert(prof.Reconfigure(paths[1]) > 0, "[Reconfigure] Profiler reconfigured");
+            prof.LogEnd();
+            prof.LogStart(mtmc::ParamsInfo{}, "Span");
+            prof.LogEnd();
+        }).join();
+        auto quality = prof.GetSpanQuality();
+        Assert(quality.num_spans == 2 && quality.num_mismatched == 0, "[Reconfigure] Spans across epochs");
+        for (auto& path : paths) remove(path.c_str());
+    }
+
+#ifdef TRACE_ANALYZER
+    void TestCriticalPath() {
+        using namespace mtmc::analyzer;
+        TraceSpan span{};
+        const char* name;
+        size_t name_len;
+        std::string line = "200,7,15,60,100,5,10,0_0_0_0_0_0,1_3_0,5,1_3_0,9,1,INTRAOP~a,b~MatMul,0,";
+        bool ok = TraceReader::ParseLine(line.data(), line.data() + line.size(), &span, &name, &name_len);
+        Assert(ok && span.tid == 200 && span.parent_tid == 100 && span.task_sched_time == 10 && span.int_prefix == 1 &&
+               std::string(name, name_len) == "INTRAOP~a,b~MatMul", "[TraceAnalyzer] Parse log line");
+
+        // Thread 100 forks a and b at 10 and joins them. b ends last, so the path is step -> b -> step
+        Trace trace;
+        trace.names = {"step", "a", "b"};
+        trace.spans = {
+                TraceSpan{15, 60, 10, 1, 200, 100, 1},
+                TraceSpan{0, 100, 0, 1, 100, 0, 0},
+                TraceSpan{12, 90, 10, 1, 300, 100, 2},
+        };
+        CriticalPathAnalyzer analyzer(2);
+        auto result = analyzer.Analyze(&trace);
+        Assert(result.iterations.size() == 1 && result.iterations[0].makespan_ns == 100 &&
+               result.iterations[0].cp_num_spans == 2 && result.num_orphans == 0, "[TraceAnalyzer] Iteration");
+        Assert(result.ops[0].cp_self_ns == 20 && result.ops[2].cp_self_ns == 78 && result.ops[2].cp_sched_delay_ns == 2 &&
+               result.ops[1].cp_count == 0, "[TraceAnalyzer] Critical path");
+        Assert(result.ops[1].sched_count == 1 && result.ops[1].sched_delay_ns == 5, "[TraceAnalyzer] Scheduling delay");
+    }
+#endif
+
 }
 
 int main(int argc, char* argv[]) {
@@ -373,5 +868,30 @@ int main(int argc, char* argv[]) {
 
     tests::TestMTMCIndexVec();
 
+    tests::TestMTMCChunkedIndexVec();
+
+    tests::TestNumaChunkProvider();
+
+    tests::TestMetricFormula();
+
+    tests::TestOpAggregator();
+
+    tests::TestImbalanceDetector();
+
+    tests::TestQueryServer();
+
+    tests::TestCtxSwitchJoin();
+    tests::TestCtxSwitchBinary();
+
+    tests::TestGroupPlanner();
+
+    tests::TestStripeCoordinator();
+
+    tests::TestReconfigure();
+
+#ifdef TRACE_ANALYZER
+    tests::TestCriticalPath();
+#endif
+
 //    tests::FunctionalTest();
 }
\ No newline at end of file
@@ -14,6 +14,11 @@
 
 #include "util.h"
 
+#include <thread>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
 namespace mtmc {
 namespace util {
 
@@ -155,6 +160,34 @@ namespace util {
         return fields;
     };
 
+    int GetCurrentNumaNode() {
+        if (numa_available() < 0) return -1;
+        uint32_t core_id, prefix;
+        Env::GetCoreId(&core_id, &prefix);
+        // Linux keeps the node of the cpu in the upper bits of TSC_AUX
+        if ((int)prefix <= numa_max_node()) return (int)prefix;
+        return numa_node_of_cpu((int)core_id);
+    }
+
+    void RunOnNodes(const std::vector<int>& nodes, const std::function<void(int)>& fn) {
+        if (nodes.size() == 1 && nodes[0] < 0) {
+            fn(-1);
+            return;
+        }
+        std::vector<std::thread> workers;
+        for (int node : nodes) {
+            workers.emplace_back([node, &fn]() {
+                if (node >= 0 && numa_run_on_node(node) != 0) {
+                    Dprintf(FYEL("Failed to bind worker to NUMA node %d\n"), node);
+                }
+                fn(node);
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
     std::vector<uint64_t> HexToVec(const std::string& hex_string) {
 
         std::vector<uint64_t> nums;
@@ -226,6 +259,147 @@ namespace util {
         return hash_arr;
     };
 
+    // ------------------------------- MetricFormula -------------------------------------
+
+    int MetricFormula::Compile(const std::string& formula, const std::vector<std::string>& names) {
+        ops_.clear();
+        formula_ = &formula;
+        names_ = &names;
+        pos_ = 0;
+        depth_ = 0;
+        max_depth_ = 0;
+        int stat = ParseSum();
+        if (stat == 1 && !NextToken().empty()) {
+            stat = -1;
+        }
+        if (stat == 1 && max_depth_ > FORMULA_MAX_DEPTH) {
+            Dprintf(FRED("Formula %s needs more than %d stack values\n"), formula.c_str(), FORMULA_MAX_DEPTH);
+            stat = -1;
+        }
+        formula_ = nullptr;
+        names_ = nullptr;
+        if (stat != 1) {
+            ops_.clear();
+        }
+        return stat;
+    }
+
+    double MetricFormula::Eval(const double* values) const {
+        double stack[FORMULA_MAX_DEPTH];
+        int top = -1;
+        for (auto& op : ops_) {
+            switch (op.type) {
+                case OP_NUM: stack[++top] = op.num; break;
+                case OP_VALUE: stack[++top] = values[op.idx]; break;
+                case OP_NEG: stack[top] = -stack[top]; break;
+                case OP_ADD: stack[top - 1] += stack[top]; --top; break;
+                case OP_SUB: stack[top - 1] -= stack[top]; --top; break;
+                case OP_MUL: stack[top - 1] *= stack[top]; --top; break;
+                case OP_DIV: stack[top - 1] /= stack[top]; --top; break;
+                case OP_MAX: stack[top - 1] = std::max(stack[top - 1], stack[top]); --top; break;
+                case OP_MIN: stack[top - 1] = std::min(stack[top - 1], stack[top]); --top; break;
+            }
+        }
+        return top == 0 ? stack[0] : 0.;
+    }
+
+    // A name or number, a single operator character, or empty at the end
+    std::string MetricFormula::NextToken() {
+        auto& f = *formula_;
+        while (pos_ < f.size() && isspace((unsigned char)f[pos_])) ++pos_;
+        if (pos_ >= f.size()) return "";
+        size_t begin = pos_;
+        while (pos_ < f.size() && (isalnum((unsigned char)f[pos_]) || f[pos_] == '_' || f[pos_] == '.' || f[pos_] == ':')) {
+            ++pos_;
+        }
+        if (pos_ == begin) ++pos_;
+        return f.substr(begin, pos_ - begin);
+    }
+
+    int MetricFormula::ParseSum() {
+        if (ParseProduct() != 1) return -1;
+        while (true) {
+            size_t pos = pos_;
+            auto token = NextToken();
+            if (token != "+" && token != "-") {
+                pos_ = pos;
+                return 1;
+            }
+            if (ParseProduct() != 1) return -1;
+            Emit(token == "+" ? OP_ADD : OP_SUB, 2);
+        }
+    }
+
+    int MetricFormula::ParseProduct() {
+        if (ParseUnary() != 1) return -1;
+        while (true) {
+            size_t pos = pos_;
+            auto token = NextToken();
+            if (token != "*" && token != "/") {
+                pos_ = pos;
+                return 1;
+            }
+            if (ParseUnary() != 1) return -1;
+            Emit(token == "*" ? OP_MUL : OP_DIV, 2);
+        }
+    }
+
+    int MetricFormula::ParseUnary() {
+        size_t pos = pos_;
+        auto token = NextToken();
+        if (token == "-") {
+            if (ParseUnary() != 1) return -1;
+            Emit(OP_NEG, 1);
+            return 1;
+        }
+        if (token != "+") pos_ = pos;
+        return ParsePrimary();
+    }
+
+    int MetricFormula::ParsePrimary() {
+        auto token = NextToken();
+        if (token.empty()) {
+            Dprintf(FRED("Formula %s ends early\n"), formula_->c_str());
+            return -1;
+        }
+        if (token == "(") {
+            if (ParseSum() != 1) return -1;
+            return NextToken() == ")" ? 1 : -1;
+        }
+        if (token == "MAX" || token == "MIN" || token == "max" || token == "min") {
+            if (NextToken() != "(" || ParseSum() != 1 || NextToken() != "," || ParseSum() != 1 || NextToken() != ")") {
+                return -1;
+            }
+            Emit(toupper(token[1]) == 'A' ? OP_MAX : OP_MIN, 2);
+            return 1;
+        }
+        if (isdigit((unsigned char)token[0]) || token[0] == '.') {
+            char* end = nullptr;
+            double num = strtod(token.c_str(), &end);
+            if (*end != '\0') {
+                Dprintf(FRED("Formula %s has an invalid number %s\n"), formula_->c_str(), token.c_str());
+                return -1;
+            }
+            Emit(OP_NUM, 0, num);
+            return 1;
+        }
+        for (size_t i = 0; i < names_->size(); ++i) {
+            if ((*names_)[i] == token) {
+                Emit(OP_VALUE, 0, 0, i);
+                return 1;
+            }
+        }
+        Dprintf(FRED("Formula %s uses %s that is not a known name\n"), formula_->c_str(), token.c_str());
+        return -1;
+    }
+
+    // Also tracks how deep the value stack of Eval gets
+    void MetricFormula::Emit(OpType type, int pop, double num, int idx) {
+        ops_.push_back(Op{type, num, idx});
+        depth_ += 1 - pop;
+        max_depth_ = std::max(max_depth_, depth_);
+    }
+
     // Path to a file. Need to check if the path before the file exists
     // CAN NOT HANDLE RACE CONDITION
     /*int CheckPath(const std::string& path, CheckType type) {
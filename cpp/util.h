@@ -26,6 +26,9 @@
 #include <fcntl.h>
 #include <atomic>
 #include <sstream>
+#include <functional>
+#include <mutex>
+#include <vector>
 
 #include "env.h"
 
@@ -103,6 +106,101 @@ namespace util {
 
     int CheckLink(const std::string& path);*/
 
+    // Source of fixed size memory chunks for IndexVector. Chunks are owned by the provider, the vector only borrows them.
+    template <typename T>
+    class ChunkProvider {
+    public:
+        virtual ~ChunkProvider() = default;
+
+        /**
+         * Acquire a chunk that can hold (1 << ChunkShift()) elements
+         * @return pointer to the chunk. nullptr if the provider is exhausted
+         */
+        virtual T* AcquireChunk() = 0;
+
+        /**
+         * Give a chunk back to the provider so that it can be handed out again
+         */
+        virtual void ReleaseChunk(T* chunk) = 0;
+
+        /**
+         * log2 of the number of elements in a chunk
+         */
+        virtual size_t ChunkShift() const = 0;
+
+        /**
+         * NUMA node the chunks are allocated on. -1 if unknown
+         */
+        virtual int Node() const {
+            return -1;
+        }
+    };
+
+    // Chunks allocated on a single NUMA node. Released chunks are kept for reuse and only freed with the provider
+    template <typename T>
+    class NumaChunkProvider : public ChunkProvider<T> {
+    public:
+        NumaChunkProvider(int node, size_t chunk_shift) : node_(node), chunk_shift_(chunk_shift) {}
+
+        ~NumaChunkProvider() override {
+            for (auto chunk : all_chunks_) {
+                numa_free(chunk, ChunkBytes());
+            }
+        }
+
+        NumaChunkProvider(const NumaChunkProvider&) = delete;
+        NumaChunkProvider& operator=(const NumaChunkProvider&) = delete;
+
+        T* AcquireChunk() override {
+            std::lock_guard<std::mutex> lock(mux_);
+            if (!free_chunks_.empty()) {
+                T* chunk = free_chunks_.back();
+                free_chunks_.pop_back();
+                return chunk;
+            }
+            void* mem = numa_alloc_onnode(ChunkBytes(), node_);
+            if (mem == nullptr) return nullptr;
+            all_chunks_.push_back(static_cast<T*>(mem));
+            return all_chunks_.back();
+        }
+
+        void ReleaseChunk(T* chunk) override {
+            std::lock_guard<std::mutex> lock(mux_);
+            free_chunks_.push_back(chunk);
+        }
+
+        size_t ChunkShift() const override {
+            return chunk_shift_;
+        }
+
+        int Node() const override {
+            return node_;
+        }
+
+    private:
+        size_t ChunkBytes() const {
+            return sizeof(T) << chunk_shift_;
+        }
+
+        int node_;
+        size_t chunk_shift_;
+        std::mutex mux_;
+        std::vector<T*> all_chunks_;
+        std::vector<T*> free_chunks_;
+    };
+
+    /**
+     * NUMA node of the calling thread's current cpu, from the socket id GetCoreId() decodes
+     * @return node id, or -1 if NUMA is not available
+     */
+    int GetCurrentNumaNode();
+
+    /**
+     * Run fn(node) for every node on its own thread bound to that node, and wait for all of them.
+     * Node -1 runs unbound
+     */
+    void RunOnNodes(const std::vector<int>& nodes, const std::function<void(int)>& fn);
+
     // Vector with index tracer.
     template <typename T>
     class IndexVector {
@@ -122,9 +220,32 @@ namespace util {
             release_memory_flag_.store(false, std::memory_order_release);
         }
 
-        void PushBack(const T& value) {
+        /**
+         * Elements are stored in chunks borrowed from the provider instead of a std::vector. Chunks are never moved,
+         * so a reader holding the chunk address (eg. another process mapping the same shm) sees the data in place.
+         */
+        explicit IndexVector(ChunkProvider<T>* provider) {
+            curr_idx_ = 0;
+            init_reserve_size_ = 0;
+            chunk_provider_ = provider;
+            chunk_shift_ = provider->ChunkShift();
+            chunk_mask_ = (size_t(1) << chunk_shift_) - 1;
+            reset_flag_.store(false, std::memory_order_release);
+            release_memory_flag_.store(false, std::memory_order_release);
+        }
+
+        ~IndexVector() {
+            ReleaseChunks();
+        }
+
+        bool PushBack(const T& value) {
             ActualClear();
-            if (data_.size() == curr_idx_) {
+            if (chunk_provider_) {
+                if (!ReserveChunkSlot()) return false;
+                ChunkAt(curr_idx_) = value;
+                ++curr_idx_;
+            }
+            else if (data_.size() == curr_idx_) {
                 data_.push_back(value);
                 ++curr_idx_;
             }
@@ -134,12 +255,20 @@ namespace util {
             }
             else {
                 printf("Error\n");
+                return false;
             }
+            published_idx_.store(curr_idx_, std::memory_order_release);
+            return true;
         }
 
-        void PushBack(T&& value) {
+        bool PushBack(T&& value) {
             ActualClear();
-            if (data_.size() == curr_idx_) {
+            if (chunk_provider_) {
+                if (!ReserveChunkSlot()) return false;
+                ChunkAt(curr_idx_) = std::move(value);
+                ++curr_idx_;
+            }
+            else if (data_.size() == curr_idx_) {
                 data_.push_back(value);
                 ++curr_idx_;
             }
@@ -149,16 +278,21 @@ namespace util {
             }
             else {
                 printf("Error\n");
+                return false;
             }
+            published_idx_.store(curr_idx_, std::memory_order_release);
+            return true;
         }
 
         void Clear() {
             curr_idx_ = 0;
+            published_idx_.store(0, std::memory_order_release);
         }
 
         void ClearAndReleaseMemory() {
             Clear();
             data_.clear();
+            ReleaseChunks();
         }
 
         bool Empty() {
@@ -181,7 +315,7 @@ namespace util {
                 throw std::runtime_error("Calling back() to an empty IndexVector");
             }
             else {
-                return data_[curr_idx_-1];
+                return chunk_provider_ ? ChunkAt(curr_idx_-1) : data_[curr_idx_-1];
             }
         }
 
@@ -190,12 +324,78 @@ namespace util {
             return curr_idx_;
         }
 
+        // For readers on other threads. Does not apply a pending clear and may be stale
+        size_t ApproxSize() const {
+            return reset_flag_.load(std::memory_order_relaxed) ? 0 : curr_idx_;
+        }
+
         T& operator[](size_t n) {
             ActualClear();
-            return data_[n];
+            return chunk_provider_ ? ChunkAt(n) : data_[n];
+        }
+
+        /**
+         * Visit the elements pushed so far from another thread, without applying a pending clear. Chunked storage can
+         * be read while the owner keeps pushing. A std::vector may be reallocated under the reader, so with heap storage
+         * the owner must not push meanwhile
+         * @return number of elements visited
+         */
+        template <typename F>
+        size_t ForEachPublished(F func) {
+            if (reset_flag_.load(std::memory_order_acquire)) return 0;
+            size_t size = published_idx_.load(std::memory_order_acquire);
+            if (!chunk_provider_) {
+                for (size_t i = 0; i < size; ++i) func(data_[i]);
+                return size;
+            }
+            std::vector<T*> chunks;
+            {
+                std::lock_guard<std::mutex> lock(chunks_mux_);
+                chunks = chunks_;
+            }
+            for (size_t i = 0; i < size; ++i) func(chunks[i >> chunk_shift_][i & chunk_mask_]);
+            return size;
+        }
+
+        ChunkProvider<T>* GetChunkProvider() const {
+            return chunk_provider_;
+        }
+
+        size_t NumChunks() const {
+            return chunks_.size();
+        }
+
+        T* GetChunk(size_t n) const {
+            return chunks_[n];
+        }
+
+        size_t ChunkLength() const {
+            return chunk_mask_ + 1;
         }
 
     private:
+        inline T& ChunkAt(size_t n) {
+            return chunks_[n >> chunk_shift_][n & chunk_mask_];
+        }
+
+        inline bool ReserveChunkSlot() {
+            if ((curr_idx_ >> chunk_shift_) < chunks_.size()) return true;
+            T* chunk = chunk_provider_->AcquireChunk();
+            if (chunk == nullptr) return false;
+            std::lock_guard<std::mutex> lock(chunks_mux_);
+            chunks_.push_back(chunk);
+            return true;
+        }
+
+        void ReleaseChunks() {
+            if (!chunk_provider_) return;
+            std::lock_guard<std::mutex> lock(chunks_mux_);
+            for (auto chunk : chunks_) {
+                chunk_provider_->ReleaseChunk(chunk);
+            }
+            chunks_.clear();
+        }
+
         inline void ActualClear() {
             if (reset_flag_.load(std::memory_order_relaxed)) {
                 if (release_memory_flag_.load(std::memory_order_relaxed)) {
@@ -214,6 +414,15 @@ namespace util {
         std::vector<T> data_;
         size_t init_reserve_size_;
 
+        // Chunked storage. Only used when constructed with a ChunkProvider
+        ChunkProvider<T>* chunk_provider_ = nullptr;
+        std::vector<T*> chunks_;
+        std::mutex chunks_mux_;     // Guards chunks_ against ForEachPublished. Only taken when a chunk is added
+        size_t chunk_shift_ = 0;
+        size_t chunk_mask_ = 0;
+
+        std::atomic<size_t> published_idx_{0};  // curr_idx_ for ForEachPublished, stored after the element is written
+
         std::atomic<bool> reset_flag_{};
         std::atomic<bool> release_memory_flag_{};
 
@@ -240,6 +449,62 @@ namespace util {
 
     std::vector<uint8_t> GenerateUniqueSpanId(uint64_t hash_int = 0);
 
+// Deepest value stack a metric formula may need
+#define FORMULA_MAX_DEPTH 64
+
+    /**
+     * Formula of a metric over named values, eg. "100 * MAX(A - B, 0) / C". Supports + - * /, unary minus, parentheses,
+     * numbers and MAX/MIN of two arguments. Compiled once, then evaluated for every span
+     */
+    class MetricFormula {
+    public:
+        /**
+         * @param names: Names the formula may use. A name's index is the index of its value in Eval
+         * @return 1 for success, -1 for a syntax error or a name not in the list
+         */
+        int Compile(const std::string& formula, const std::vector<std::string>& names);
+
+        /**
+         * @return value of the formula; not finite if it divides by zero
+         */
+        double Eval(const double* values) const;
+
+    private:
+        enum OpType {
+            OP_NUM,
+            OP_VALUE,
+            OP_ADD,
+            OP_SUB,
+            OP_MUL,
+            OP_DIV,
+            OP_NEG,
+            OP_MAX,
+            OP_MIN
+        };
+
+        struct Op {
+            OpType type;
+            double num;
+            int idx;
+        };
+
+        std::string NextToken();
+        int ParseSum();
+        int ParseProduct();
+        int ParseUnary();
+        int ParsePrimary();
+        void Emit(OpType type, int pop, double num = 0, int idx = -1);
+
+        std::vector<Op> ops_;
+
+        // Only set while compiling
+        const std::string* formula_ = nullptr;
+        const std::vector<std::string>* names_ = nullptr;
+        size_t pos_ = 0;
+        int depth_ = 0;
+        int max_depth_ = 0;
+    };
+
 }
 }
 
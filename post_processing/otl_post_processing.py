@@ -24,6 +24,66 @@ def parse_json(path):
     with open(path, 'r') as f:
         return json.load(f)
 
+def ParseLogFields(fields):
+    """
+    Read the PeriodInfo fields of a span. Typed attributes (evt.*, cnst.*, PERF_METRICS.*, metric.*) are collected into
+    dicts.
+    String encoded attributes from older exporters are split into lists.
+    """
+    info = {'tid': None, 'pthread_id': None, 'int_prefix': None, 'parent_tid': None, 'parent_pthread_id': None,
+            'sched_time': None, 'cfg_id': -1, 'mux_id': 0, 'b_events': None, 'e_events': None, 'cnsts': [],
+            'evt_deltas': {}, 'perf_metrics': {}, 'cnsts_typed': {}, 'metrics': {}}
+    for log_field in fields:
+        key = log_field['key']
+        value = log_field['value']
+        if key == 'tid':
+            info['tid'] = value
+        elif key == 'pthreadid':
+            info['pthread_id'] = int(value) & 0xffffffff
+        elif key == 'int_prefix':
+            info['int_prefix'] = value
+        elif key == 'parent_tid':
+            info['parent_tid'] = value
+        elif key == 'parent_pthreadid':
+            info['parent_pthread_id'] = int(value) & 0xffffffff
+        elif key == 'parent_sched_time':
+            info['sched_time'] = value
+        elif key == 'cfg_id':
+            info['cfg_id'] = value
+        elif key == 'mux_id':
+            info['mux_id'] = value
+        elif key.startswith('evt.'):
+            info['evt_deltas'][key[len('evt.'):]] = value
+        elif key.startswith('PERF_METRICS.'):
+            info['perf_metrics'][key] = value
+        elif key.startswith('cnst.'):
+            info['cnsts_typed'][key[len('cnst.'):]] = value
+        elif key.startswith('metric.'):
+            info['metrics'][key[len('metric.'):]] = value
+        # String encoded attributes
+        elif key == 'parent_tid_pthreadid_sched_time':
+            parent_tid, parent_pthread_id, sched_time = value.split("-*-")
+            info['parent_tid'] = parent_tid
+            info['parent_pthread_id'] = int(parent_pthread_id) & 0xffffffff
+            info['sched_time'] = sched_time
+        elif key == 'b_events':
+            info['b_events'] = [int(i) for i in value.split("-")]
+        elif key == 'e_events':
+            info['e_events'] = [int(i) for i in value.split("-")]
+        elif key == 'cnsts':
+            info['cnsts'] = [int(i) for i in value.split("-*-") if i != '']
+    return info
+
+def CalSpanPmu(perfmon_parser, info, args_dict, cfg_idx, dur_ms):
+    if info['b_events'] is not None and info['e_events'] is not None:
+        perfmon_parser.CalPmu(info['b_events'], info['e_events'], args_dict, cfg_idx=cfg_idx, cnsts=info['cnsts'], dur_ms=dur_ms)
+    else:
+        perfmon_parser.CalPmuTyped(info['evt_deltas'], info['perf_metrics'], args_dict, cfg_idx=cfg_idx,
+                                   cnsts=info['cnsts_typed'], dur_ms=dur_ms)
+    # Metrics the exporter already evaluated from the config formulas
+    for name, value in info['metrics'].items():
+        args_dict["Met-." + name] = round(value, 2)
+
 def ParseSpanToTimelineTF(file, cfg_file, output_file):
     perfmon_parser = PerfmonParser(tc.SprTmaCal(), cfg_file)
 
@@ -51,33 +111,15 @@ def ParseSpanToTimelineTF(file, cfg_file, output_file):
             op_step_id = span_name_list[5] if span_name_list[5] != '' else -1
             start_time = span['startTime']
             duration = span['duration']
-            for log_field in span['logs'][0]['fields']:
-                if log_field['key'] == 'tid':
-                    tid = log_field['value']
-                elif log_field['key'] == 'pthreadid':
-                    pthread_id = int(log_field['value']) & 0xffffffff
-                elif log_field['key'] == 'int_prefix':
-                    int_prefix = log_field['value']
-                elif log_field['key'] == 'parent_tid_pthreadid_sched_time':
-                    parent_info_col = log_field['value']
-                    parent_tid, parent_pthread_id, sched_time = parent_info_col.split("-*-")
-                    parent_pthread_id = int(parent_pthread_id) & 0xffffffff
-                elif log_field['key'] == 's_coreid_prefix_num_event':
-                    b_event_col = log_field['value']
-                    b_core, b_prefix, b_events_num = b_event_col.split("-")
-                elif log_field['key'] == 'e_coreid_prefix_num_event':
-                    e_event_col = log_field['value']
-                    e_core, e_prefix, e_events_num = e_event_col.split("-")
-                elif log_field['key'] == 'b_events':
-                    b_events = [int(i) for i in log_field['value'].split("-")]
-                elif log_field['key'] == 'e_events':
-                    e_events = [int(i) for i in log_field['value'].split("-")]
-                elif log_field['key'] == 'cfg_id':
-                    cfg_id = log_field['value']
-                elif log_field['key'] == 'mux_id':
-                    mux_id = log_field['value']
-                elif log_field['key'] == 'cnsts':
-                    cnsts = [int(i) for i in log_field['value'].split("-*-") if i != '']
+            info = ParseLogFields(span['logs'][0]['fields'])
+            tid = info['tid']
+            pthread_id = info['pthread_id']
+            int_prefix = info['int_prefix']
+            parent_tid = info['parent_tid']
+            parent_pthread_id = info['parent_pthread_id']
+            sched_time = info['sched_time']
+            cfg_id = info['cfg_id']
+            mux_id = info['mux_id']
 
             if cfg_id == -1:
                 parser_cfg_id = mux_id
@@ -108,7 +150,7 @@ def ParseSpanToTimelineTF(file, cfg_file, output_file):
                 "args": args_dict
             }
 
-            perfmon_parser.CalPmu(b_events, e_events, temp_dict["args"], cfg_idx=parser_cfg_id, cnsts=cnsts, dur_ms=float(duration)/1000)
+            CalSpanPmu(perfmon_parser, info, temp_dict["args"], cfg_idx=parser_cfg_id, dur_ms=float(duration)/1000)
 
             dump_dict.append(temp_dict)
 
@@ -164,33 +206,15 @@ def ParseSpanToTimelinePT(file, cfg_file, output_file):
             op_step_id = span_name_list[5] if span_name_list[5] != '' else -1
             start_time = span['startTime']
             duration = span['duration']
-            for log_field in span['logs'][0]['fields']:
-                if log_field['key'] == 'tid':
-                    tid = log_field['value']
-                elif log_field['key'] == 'pthreadid':
-                    pthread_id = int(log_field['value']) & 0xffffffff
-                elif log_field['key'] == 'int_prefix':
-                    int_prefix = log_field['value']
-                elif log_field['key'] == 'parent_tid_pthreadid_sched_time':
-                    parent_info_col = log_field['value']
-                    parent_tid, parent_pthread_id, sched_time = parent_info_col.split("-*-")
-                    parent_pthread_id = int(parent_pthread_id) & 0xffffffff
-                elif log_field['key'] == 's_coreid_prefix_num_event':
-                    b_event_col = log_field['value']
-                    b_core, b_prefix, b_events_num = b_event_col.split("-")
-                elif log_field['key'] == 'e_coreid_prefix_num_event':
-                    e_event_col = log_field['value']
-                    e_core, e_prefix, e_events_num = e_event_col.split("-")
-                elif log_field['key'] == 'b_events':
-                    b_events = [int(i) for i in log_field['value'].split("-")]
-                elif log_field['key'] == 'e_events':
-                    e_events = [int(i) for i in log_field['value'].split("-")]
-                elif log_field['key'] == 'cfg_id':
-                    cfg_id = log_field['value']
-                elif log_field['key'] == 'mux_id':
-                    mux_id = log_field['value']
-                elif log_field['key'] == 'cnsts':
-                    cnsts = [int(i) for i in log_field['value'].split("-*-") if i != '']
+            info = ParseLogFields(span['logs'][0]['fields'])
+            tid = info['tid']
+            pthread_id = info['pthread_id']
+            int_prefix = info['int_prefix']
+            parent_tid = info['parent_tid']
+            parent_pthread_id = info['parent_pthread_id']
+            sched_time = info['sched_time']
+            cfg_id = info['cfg_id']
+            mux_id = info['mux_id']
 
             if cfg_id == -1:
                 parser_cfg_id = mux_id
@@ -221,7 +245,7 @@ def ParseSpanToTimelinePT(file, cfg_file, output_file):
                 "args": args_dict
             }
 
-            perfmon_parser.CalPmu(b_events, e_events, temp_dict["args"], cfg_idx=parser_cfg_id, cnsts=cnsts, dur_ms=float(duration)/1000)
+            CalSpanPmu(perfmon_parser, info, temp_dict["args"], cfg_idx=parser_cfg_id, dur_ms=float(duration)/1000)
 
             dump_dict.append(temp_dict)
 
@@ -283,33 +307,15 @@ def ParseSpanToTimeline(file, cfg_file, output_file):
             span_id = span['spanID']
             start_time = span['startTime']
             duration = span['duration']
-            for log_field in span['logs'][0]['fields']:
-                if log_field['key'] == 'tid':
-                    tid = log_field['value']
-                elif log_field['key'] == 'pthreadid':
-                    pthread_id = int(log_field['value']) & 0xffffffff
-                elif log_field['key'] == 'int_prefix':
-                    int_prefix = log_field['value']
-                elif log_field['key'] == 'parent_tid_pthreadid_sched_time':
-                    parent_info_col = log_field['value']
-                    parent_tid, parent_pthread_id, sched_time = parent_info_col.split("-*-")
-                    parent_pthread_id = int(parent_pthread_id) & 0xffffffff
-                elif log_field['key'] == 's_coreid_prefix_num_event':
-                    b_event_col = log_field['value']
-                    b_core, b_prefix, b_events_num = b_event_col.split("-")
-                elif log_field['key'] == 'e_coreid_prefix_num_event':
-                    e_event_col = log_field['value']
-                    e_core, e_prefix, e_events_num = e_event_col.split("-")
-                elif log_field['key'] == 'b_events':
-                    b_events = [int(i) for i in log_field['value'].split("-")]
-                elif log_field['key'] == 'e_events':
-                    e_events = [int(i) for i in log_field['value'].split("-")]
-                elif log_field['key'] == 'cfg_id':
-                    cfg_id = log_field['value']
-                elif log_field['key'] == 'mux_id':
-                    mux_id = log_field['value']
-                elif log_field['key'] == 'cnsts':
-                    cnsts = [int(i) for i in log_field['value'].split("-*-") if i != '']
+            info = ParseLogFields(span['logs'][0]['fields'])
+            tid = info['tid']
+            pthread_id = info['pthread_id']
+            int_prefix = info['int_prefix']
+            parent_tid = info['parent_tid']
+            parent_pthread_id = info['parent_pthread_id']
+            sched_time = info['sched_time']
+            cfg_id = info['cfg_id']
+            mux_id = info['mux_id']
 
             if cfg_id == -1:
                 parser_cfg_id = mux_id
@@ -335,7 +341,7 @@ def ParseSpanToTimeline(file, cfg_file, output_file):
                 "args": args_dict
             }
 
-            perfmon_parser.CalPmu(b_events, e_events, temp_dict["args"], cfg_idx=parser_cfg_id, cnsts=cnsts, dur_ms=float(duration)/1000)
+            CalSpanPmu(perfmon_parser, info, temp_dict["args"], cfg_idx=parser_cfg_id, dur_ms=float(duration)/1000)
 
             # # TODO: Need to check if CalTopDown flag is set
             # tmam_names, output_tmam =  perfmon_parser.CalTopDown(int(b_events[-3]), int(b_events[-2]), int(b_events[-1]),
@@ -27,10 +27,12 @@ class PerfmonParser:
         assert(len(self.event_names) == len(self.metrics))
 
         self.equs, self.perf_equs, self.cmp_equs, self.cmp_perf_equs, self.sorted_cnsts_alias, self.sorted_cnsts_idx = [], [], [], [], [], []
+        self.perf_names = []
         for i in range(len(self.metrics)):
-            equs, perf_equs, cnsts = tma_cal.EquLookup(self.metrics[i], self.event_names[i])
+            equs, perf_equs, cnsts, perf_names = tma_cal.EquLookup(self.metrics[i], self.event_names[i])
             self.equs.append(equs)
             self.perf_equs.append(perf_equs)
+            self.perf_names.append(perf_names)
             self.cmp_equs.append([ps.expr(i).compile() for i in equs])
             self.cmp_perf_equs.append([ps.expr(i).compile() for i in perf_equs])
 
@@ -125,7 +127,6 @@ class PerfmonParser:
         pmu_end_n = np.array(pmu_end).astype(np.double)
         pmu_delta_n = pmu_end_n - pmu_begin_n
 
-        a = pmu_delta_n
         B = pmu_begin
         C = pmu_end
         D = []
@@ -133,6 +134,28 @@ class PerfmonParser:
         for perf_equ in self.cmp_perf_equs[cfg_idx]:
             D.append(eval(perf_equ))
 
+        return self.EvalMetrics(pmu_delta_n, D, output_dict, cfg_idx, cnsts, dur_ms)
+
+    def CalPmuTyped(self, evt_deltas, perf_metrics, dict_to_append=None, cfg_idx=0, cnsts={}, dur_ms=None):
+        """
+        Same as CalPmu, but takes the typed span attributes from the OTLE exporter
+        :param evt_deltas: {event name: counter delta}
+        :param perf_metrics: {"PERF_METRICS.xxx": value} already calculated by the exporter
+        :param cnsts: {constant name: value}
+        """
+        output_dict = {}
+        if dict_to_append is not None:
+            output_dict = dict_to_append
+
+        pmu_delta_n = np.array([evt_deltas.get(name, 0) for name in self.event_names[cfg_idx]]).astype(np.double)
+        D = [perf_metrics.get(name, 0) for name in self.perf_names[cfg_idx]]
+        cnsts_list = [cnsts.get(name, 0) for name in self.overall_cnsts]
+
+        return self.EvalMetrics(pmu_delta_n, D, output_dict, cfg_idx, cnsts_list, dur_ms)
+
+    def EvalMetrics(self, pmu_delta_n, D, output_dict, cfg_idx, cnsts, dur_ms):
+        a = pmu_delta_n
+
         if self.equ_valid:
             for idx, key in enumerate(self.metrics[cfg_idx]):
                 for i, cnst_alisa in enumerate(self.sorted_cnsts_alias[cfg_idx][idx]):
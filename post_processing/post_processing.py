@@ -13,6 +13,7 @@
 #limitations under the License.
 
 import copy
+import struct
 import time
 
 import numpy as np
@@ -585,12 +586,45 @@ class PerfMapper:
 
         return ret
 
+    def ReadSchedSwitchBinary(self, data_path, time_boundary=None):
+        # Written by GuardSampler, see cpp/binary_trace.h for the layout. Timestamps are CLOCK_REALTIME already
+        output_core = {}
+        output_thread = {}
+        with open(data_path, 'rb') as f:
+            buf = f.read()
+        magic, version, record_type, record_size, num_events, offset, num_blocks, names_bytes = \
+            struct.unpack_from('<8sIIIIqQQ', buf, 0)
+        if record_type != 2 or record_size != struct.calcsize('<QiiiiQ16s16s'):
+            raise Exception("Not a sched_switch binary trace!")
+        pos = struct.calcsize('<8sIIIIqQQ') + names_bytes
+        for _ in range(num_blocks):
+            cpu, _, num_records = struct.unpack_from('<iIQ', buf, pos)
+            pos += struct.calcsize('<iIQ')
+            for ts, core, prev_pid, next_pid, _, prev_state, prev_comm, next_comm in \
+                    struct.iter_unpack('<QiiiiQ16s16s', buf[pos:pos + num_records * record_size]):
+                ts += offset
+                if time_boundary is not None and (ts < time_boundary[0] or ts > time_boundary[1]):
+                    continue
+                # 0 - core, 1 - time, 2 - prev tid , 3 - prev name, 4 - next tid, 5 - next name
+                data = [core, ts, prev_pid, prev_comm.split(b'\0')[0].decode(errors='replace'), next_pid,
+                        next_comm.split(b'\0')[0].decode(errors='replace')]
+                output_core.setdefault(core, []).append(data)
+                output_thread.setdefault(prev_pid, []).append(['e', data])
+                output_thread.setdefault(next_pid, []).append(['b', data])
+            pos += num_records * record_size
+        return output_core, output_thread
+
     def PerfDataToTimeline(self, data_path, time_boundary=None, output_path=None):
         if not os.path.exists(data_path):
             raise Exception("Perf record data file does is not exist!")
         if not PathCheck([data_path]):
             raise Exception("Perf record data does is not valid!")
 
+        with open(data_path, 'rb') as f:
+            if f.read(8) == b'MTMCBIN\0':
+                output_core, output_thread = self.ReadSchedSwitchBinary(data_path, time_boundary)
+                return self.GenPerfTimeline(output_core, output_thread, output_path, 0)
+
         time_opt = ""
         if time_boundary is not None:
             time_begin, time_end = time_boundary
@@ -647,41 +681,72 @@ class EbpfMapper(PerfMapper):
             0x7f:"TASK_REPORT",
         }
 
+    def ReadEbpfBinary(self, path_to_ebpf_data):
+        # Written by EbpfSampler::EbpfCtxScExport, see cpp/binary_trace.h for the layout
+        hdr_dtype = np.dtype([('magic', 'S8'), ('version', '<u4'), ('record_type', '<u4'), ('record_size', '<u4'),
+                              ('num_events', '<u4'), ('realtime_offset_ns', '<i8'), ('num_blocks', '<u8'),
+                              ('names_bytes', '<u8')])
+        blk_dtype = np.dtype([('cpu', '<i4'), ('reserved', '<u4'), ('num_records', '<u8')])
+        rec_dtype = np.dtype([('ts', '<u8'), ('prev_pid', '<i4'), ('curr_pid', '<i4'), ('core_id', '<i4'),
+                              ('group_id', '<i4'), ('prev_task_state', '<u8'), ('pmc', '<u8', (13,))])
+        buf = np.fromfile(path_to_ebpf_data, dtype=np.uint8)
+        hdr = np.frombuffer(buf, hdr_dtype, 1)[0]
+        assert hdr['record_type'] == 1 and hdr['record_size'] == rec_dtype.itemsize
+        self.clk_diff = int(hdr['realtime_offset_ns'])
+
+        lines = []
+        pos = hdr_dtype.itemsize + int(hdr['names_bytes'])
+        for _ in range(int(hdr['num_blocks'])):
+            blk = np.frombuffer(buf, blk_dtype, 1, pos)[0]
+            pos += blk_dtype.itemsize
+            recs = np.frombuffer(buf, rec_dtype, int(blk['num_records']), pos)
+            pos += rec_dtype.itemsize * int(blk['num_records'])
+            for idx, rec in enumerate(recs):
+                lines.append([str(blk['cpu']), str(int(rec['ts']) + self.clk_diff), '0', str(idx),
+                              str(rec['prev_task_state']), str(rec['prev_pid']), str(rec['curr_pid']),
+                              '-'.join(str(v) for v in rec['pmc'])])
+        return lines
+
     def ParseEbpfData(self, path_to_ebpf_data, time_boundary=None):
         output_core = {}
         output_thread = {}
 
-        with open(path_to_ebpf_data, 'r') as f:
-            lines = f.readlines()
+        with open(path_to_ebpf_data, 'rb') as f:
+            is_binary = f.read(8) == b'MTMCBIN\0'
 
+        if is_binary:
+            lines = self.ReadEbpfBinary(path_to_ebpf_data)
+        else:
+            with open(path_to_ebpf_data, 'r') as f:
+                lines = f.readlines()
             clk_source = [int(i) for i in lines.pop(0).split(',')]
             self.clk_diff = clk_source[1] - clk_source[0]
+            lines = [line.split('\n')[0].split(',') for line in lines]
+
+        for segments in lines:
+            # print(segments)
+            # 0 - core, 1 - time, 2 - wp ar, 3 - idx, 4 - prv_state, 5 - prv_pid, 6 - next_pid, 7 - PMC reading
+            data = segments
+            data[1] = int(data[1])
+            if time_boundary is not None:
+                if data[1] < time_boundary[0] or data[1] > time_boundary[1]:
+                    continue
+            data[4] = f"{hex(int(data[4]))}-{self.task_state[int(data[4])] if self.task_state.get(int(data[4])) is not None else 'Unknown'}"
 
-            for line in lines:
-                segments = line.split('\n')[0].split(',')
-                # print(segments)
-                # 0 - core, 1 - time, 2 - wp ar, 3 - idx, 4 - prv_state, 5 - prv_pid, 6 - next_pid, 7 - PMC reading
-                data = segments
-                data[1] = int(data[1])
-                if time_boundary is not None:
-                    if data[1] < time_boundary[0] or data[1] > time_boundary[1]:
-                        continue
-                data[4] = f"{hex(int(data[4]))}-{self.task_state[int(data[4])] if self.task_state.get(int(data[4])) is not None else 'Unknown'}"
-
-                if data[0] in output_core.keys():
-                    output_core[data[0]].append(data)
-                else:
-                    output_core[data[0]] = [data]
+            if data[0] in output_core.keys():
+                output_core[data[0]].append(data)
+            else:
+                output_core[data[0]] = [data]
 
-                if data[5] in output_thread.keys():
-                    output_thread[data[5]].append(['e', data])
-                else:
-                    output_thread[data[5]] = [['e', data]]
+            if data[5] in output_thread.keys():
+                output_thread[data[5]].append(['e', data])
+            else:
+                output_thread[data[5]] = [['e', data]]
 
-                if data[6] in output_thread.keys():
-                    output_thread[data[6]].append(['b', data])
-                else:
-                    output_thread[data[6]] = [['b', data]]
+            if data[6] in output_thread.keys():
+                output_thread[data[6]].append(['b', data])
+            else:
+                output_thread[data[6]] = [['b', data]]
         return output_core, output_thread
 
     def CoreThreadDataToTimeline(self, path_to_ebpf_data, dump_path=None, time_boundary=None):
@@ -830,6 +895,10 @@ class PostProcessor:
                 with open(os.path.join(self.log_folder, name), 'r') as f:
                     logs = f.readlines()
                     for line in logs:
+                        if line.startswith('#'):
+                            # Header with the data quality counters of the profiler
+                            print(f"Log header: {line.strip()[1:]}")
+                            continue
                         sig_prof = line.split(',')
                         if len(sig_prof) < kSingleLogLen:
                             print("Skip sig_prof: ", sig_prof)
@@ -136,6 +136,7 @@ class SprTmaCal(TmaCal):
         ret = []
         perf_met_dict = {}
         ret_perf = []
+        ret_perf_names = []
         ret_cnst = []
         init = 'a'
         alphabet = [chr(ord(init) + i) for i in range(0, 26)]
@@ -158,6 +159,7 @@ class SprTmaCal(TmaCal):
                         else:
                             perf_met_dict[evt] = len(ret_perf)
                             ret_perf.append(f"self.tma_cal.PerfMetricEquLookup('{evt}', B[{perf_mat_idx}], C[{perf_mat_idx}], B[{perf_slots_idx}], C[{perf_slots_idx}])")
+                            ret_perf_names.append(evt)
                             to_replace.append((find_strict_occ(equ_alphabet[idx], equ), f"D[{perf_met_dict[evt]}]"))
 
                     elif evt in event_names:
@@ -179,7 +181,7 @@ class SprTmaCal(TmaCal):
             else:
                 ret.append("0")
 
-        return ret, ret_perf, ret_cnst
+        return ret, ret_perf, ret_cnst, ret_perf_names
 
     def GenTopdownEqus(self, perf_metrics_rep: str, sub_perf_metrics: str):
         topdown_equ = lambda rep, i : f"(int({rep}) >> int({i} * 8) & 0xff)"
@@ -17,6 +17,13 @@ def single_run(sig_cfg, command, store_path):
                                                "MTMC_LOG_EXPORT_PATH": store_path})
     popen.wait()
 
+def stripe_run(sig_cfg, command, store_paths):
+    # Instances run concurrently. Each claims its config group from the profiler's stripe coordinator at init
+    popens = [sp.Popen(command, shell=True, env={"MTMC_CONFIG": sig_cfg, "MTMC_LOG_EXPORT_PATH": path})
+              for path in store_paths]
+    for popen in popens:
+        popen.wait()
+
 def get_trace_hash(export_mode):
     if export_mode == 3:
         # All iterations share the same hash id
@@ -37,6 +44,18 @@ def main():
                         type=int,
                         default=0)
     parser.add_argument("--mux", help="Turn on events multiplexing. Default is true", default=False, action="store_true")
+    parser.add_argument("--shm-arena", help="Size in MB of the shared memory arena used by export mode 2/3 to avoid "
+                                            "copying spans on export. 0 disables it. Only applied with --mux.",
+                        type=int,
+                        default=0)
+    parser.add_argument("--aggregate", help="Keep per op statistics instead of every span and export them as json to "
+                                            "the log path. 1: by name, 2: by name and int prefix. Only applied with --mux.",
+                        type=int,
+                        default=0)
+    parser.add_argument("--stripe", help="Run this many instances of the workload at once. Each counts a different "
+                                         "config group, so one run covers all of them. 0 disables it.",
+                        type=int,
+                        default=0)
     args = parser.parse_args()
 
     # Variables from arguments
@@ -46,6 +65,9 @@ def main():
     command = args.r
     export_mode = int(args.mode)
     event_mux = args.mux
+    shm_arena_mb = int(args.shm_arena)
+    aggregate_mode = int(args.aggregate)
+    num_stripes = int(args.stripe)
 
     # Some sanity checks
     if not os.path.isfile(cfg_path):
@@ -69,12 +91,35 @@ def main():
     trace_hash = get_trace_hash(export_mode)
 
     # Mux settings
-    if event_mux:
+    if num_stripes > 0:
+        num_cfgs = len(cfg_json['Configs'])
+        print("Will run %d instances striped over %d configs." % (num_stripes, num_cfgs))
+        if num_stripes < num_cfgs:
+            print("Warning. Fewer instances than configs, %d configs will not be counted." % (num_cfgs - num_stripes,))
+
+        full_cfg = dict(cfg_json)
+        full_cfg['ExportMode'] = export_mode
+        full_cfg['TraceHash'] = trace_hash
+        full_cfg['StripeKey'] = "run_%d_%d" % (os.getpid(), time.time_ns())
+        full_cfg['ConfigsId'] = -1
+        if shm_arena_mb > 0:
+            full_cfg['ShmArenaMB'] = shm_arena_mb
+        if aggregate_mode > 0:
+            full_cfg['AggregateMode'] = aggregate_mode
+
+        itr_cfg = os.path.join(abs_script_dir, 'temp_cfg_stripe.json')
+        with open(itr_cfg, 'w') as f:
+            json.dump(full_cfg, f, indent=4)
+        # The claimed group of an instance is in the header line of its log and in the group column of every span
+        stripe_run(itr_cfg, command, [os.path.join(log_path, f"mtmc_stripe_{i}.txt") for i in range(num_stripes)])
+        stripe_shm = "/dev/shm/mtmc_stripe_" + full_cfg['StripeKey']
+        if os.path.exists(stripe_shm):
+            os.remove(stripe_shm)
+    elif event_mux:
         configs = cfg_json['Configs']
         num_cfgs = len(configs)
         print("Will do event multiplexing outside over %d configs." % (num_cfgs,))
 
-        modified_configs = []
         for idx, cfg in enumerate(configs):
             full_cfg = {
                 'Configs': [cfg],
@@ -84,16 +129,17 @@ def main():
                 # ConfigsId is used only for event mux. Put -1 or leave it alone if not using multiplexing
                 'SwitchIntvl': "0ms"
             }
+            if shm_arena_mb > 0:
+                full_cfg['ShmArenaMB'] = shm_arena_mb
+            if aggregate_mode > 0:
+                full_cfg['AggregateMode'] = aggregate_mode
 
             itr_cfg = os.path.join(abs_script_dir, 'temp_cfg.json')
             with open(itr_cfg, 'w') as f:
                 json.dump(full_cfg, f, indent=4)
                 print("Dump config %d to %s" % (idx, itr_cfg))
+            # The profiler only reads the config, the file is not rewritten by the run
             single_run(itr_cfg, command, os.path.join(log_path, f"mtmc_temp_{idx}.txt"))
-
-            # mtmc_profiler cpp will modify and rearrange configs if necessary. So store a new configs
-            new_itr_cfg = read_config(itr_cfg)
-            modified_configs += new_itr_cfg['Configs']
     else:
         print("Will not do event multiplexing outside.")
         single_run(cfg_path, command, os.path.join(log_path, f"mtmc_temp_0.txt"))